@@ -38,6 +38,12 @@ static const char* const help =
 "\tn num           Number of timers to use\n"
 "\tfast            Do not benchmark POSIX and thread timers\n"
 "\n"
+"tcp\n"
+"   Methods\n"
+"\ttcp-idle-bench  Measure the memory taken by idle connections\n"
+"   Options\n"
+"\tn num           Number of connections to open\n"
+"\n"
 "You cannot use the \"=\" notation to provide arguments. Instead, provide any\n"
 "arguments right after the option that requires them, with a space in between.\n"
 "Example usage: %s time-bench n 1000 fast\n"
@@ -51,7 +57,8 @@ enum cli_option_type {
   cli_option_fast,
   cli_option_force,
 
-  cli_option_time_bench
+  cli_option_time_bench,
+  cli_option_tcp_idle_bench
 };
 
 struct cli_option {
@@ -73,14 +80,16 @@ static struct cli_option cli_options[] = {
   { "f", cli_option_force },
   { "force", cli_option_force },
 
-  { "time-bench", cli_option_time_bench }
+  { "time-bench", cli_option_time_bench },
+  { "tcp-idle-bench", cli_option_tcp_idle_bench }
 };
 
 #define cli_options_len (sizeof(cli_options) / sizeof(cli_options[0]))
 
 enum cli_method {
   cli_method_invalid,
-  cli_method_time_bench
+  cli_method_time_bench,
+  cli_method_tcp_idle_bench
 };
 
 struct options options = {0};
@@ -148,6 +157,10 @@ int main(int argc, char** argv) {
         method = cli_method_time_bench;
         break;
       }
+      case cli_option_tcp_idle_bench: {
+        method = cli_method_tcp_idle_bench;
+        break;
+      }
       case cli_option_num: {
         ARGS(1, "number");
         options.num = atoi(argv[++i]);
@@ -173,6 +186,10 @@ int main(int argc, char** argv) {
       time_benchmark();
       break;
     }
+    case cli_method_tcp_idle_bench: {
+      tcp_idle_benchmark();
+      break;
+    }
   }
 
   out:;
@@ -28,4 +28,6 @@ extern void print_time(const uint64_t);
 
 extern void time_benchmark(void);
 
+extern void tcp_idle_benchmark(void);
+
 #endif // _shnet_cli_consts_h_
@@ -0,0 +1,138 @@
+#include "consts.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+
+#include <shnet/tcp.h>
+#include <shnet/time.h>
+
+static _Atomic uint32_t accepted;
+static _Atomic uint32_t closed;
+static _Atomic uint32_t server_freed;
+
+static void idle_socket_onevent(struct tcp_socket* socket, enum tcp_event event) {
+  if(event == tcp_close) {
+    atomic_fetch_add_explicit(&closed, 1, memory_order_relaxed);
+    tcp_socket_free(socket);
+  }
+}
+
+static struct tcp_socket* idle_server_onevent(struct tcp_server* server, struct tcp_socket* socket, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      socket->on_event = idle_socket_onevent;
+      atomic_fetch_add_explicit(&accepted, 1, memory_order_relaxed);
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(server);
+      break;
+    }
+    case tcp_free: {
+      atomic_store_explicit(&server_freed, 1, memory_order_relaxed);
+      break;
+    }
+    default: break;
+  }
+  return socket;
+}
+
+static uint64_t get_rss(void) {
+  FILE* const file = fopen("/proc/self/statm", "r");
+  assert(file);
+  uint64_t size;
+  uint64_t resident;
+  assert(fscanf(file, "%" SCNu64 " %" SCNu64, &size, &resident) == 2);
+  (void) fclose(file);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void wait_for(_Atomic uint32_t* const count, const uint32_t num) {
+  while(atomic_load_explicit(count, memory_order_relaxed) != num) {
+    (void) usleep(1000);
+  }
+}
+
+void tcp_idle_benchmark() {
+  const int default_num = 10000;
+  if(options.num <= 0) {
+    options.num = default_num;
+  }
+  struct rlimit limit;
+  assert(!getrlimit(RLIMIT_NOFILE, &limit));
+  limit.rlim_cur = limit.rlim_max;
+  (void) setrlimit(RLIMIT_NOFILE, &limit);
+  assert(!getrlimit(RLIMIT_NOFILE, &limit));
+  printf(
+    "tcp-idle-bench parameters:\n"
+    "num : %" PRId32 "%s\n"
+    "Every connection takes 2 file descriptors, out of %" PRIu64 " available.\n"
+    "\n",
+    options.num,
+    options.num == default_num ? " (the default)" : "",
+    (uint64_t) limit.rlim_cur
+  );
+  DROP_IF_RIDICULOUS(options.num, "num", 0, (int)((limit.rlim_cur - 64) / 2 > 10000000 ? 10000000 : (limit.rlim_cur - 64) / 2));
+
+  struct tcp_server server = {0};
+  server.on_event = idle_server_onevent;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .backlog = options.num
+  })));
+  const struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    .sin_port = htons(tcp_server_get_port(&server))
+  };
+  int* const clients = malloc(sizeof(*clients) * options.num);
+  assert(clients);
+
+  /* Peers are plain sockets, so that only the accepting side counts */
+  const uint64_t rss_before = get_rss();
+  printf("Opening %" PRId32 " idle connections", options.num);
+  fflush(stdout);
+  const uint64_t start = time_get_time();
+  for(int32_t i = 0; i < options.num; ++i) {
+    clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+    if(clients[i] == -1 || connect(clients[i], (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+      printf("\nConnecting %" PRId32 " failed with errno: %d\nConsider setting the \"num\" option to something below %d.\n", i, errno, options.num);
+      assert(0);
+    }
+  }
+  wait_for(&accepted, options.num);
+  printf(" took ");
+  print_time(time_get_time() - start);
+  puts("");
+  const uint64_t rss_after = get_rss();
+  const uint64_t rss = rss_after > rss_before ? rss_after - rss_before : 0;
+  printf(
+    "RSS before      : %" PRIu64 " KiB\n"
+    "RSS after       : %" PRIu64 " KiB\n"
+    "RSS per socket  : %" PRIu64 " bytes\n"
+    "sizeof(socket)  : %zu bytes\n",
+    rss_before >> 10,
+    rss_after >> 10,
+    rss / options.num,
+    sizeof(struct tcp_socket)
+  );
+
+  printf("Closing the connections");
+  fflush(stdout);
+  for(int32_t i = 0; i < options.num; ++i) {
+    (void) close(clients[i]);
+  }
+  wait_for(&closed, options.num);
+  puts(" done");
+  free(clients);
+  tcp_server_close(&server);
+  wait_for(&server_freed, 1);
+}
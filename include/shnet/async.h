@@ -20,19 +20,42 @@ struct async_event {
   int fd;
   uint8_t socket:1;
   uint8_t server:1;
+  uint8_t callback:1;
 };
 
+struct async_loop;
+
+struct async_callback {
+  struct async_event core;
+  void (*on_event)(struct async_loop*, uint32_t, struct async_callback*);
+};
+
+struct async_wheel;
+
 struct async_loop {
   struct epoll_event* events;
   void (*on_event)(struct async_loop*, uint32_t, struct async_event*);
   
   pthread_t thread;
   struct async_event evt;
+  struct async_wheel* wheel;
   
   int events_len;
   int fd;
 };
 
+struct async_timer {
+  struct async_timer* next;
+  struct async_timer** pprev;
+  void (*on_timeout)(struct async_loop*, struct async_timer*);
+  uint64_t expires;
+};
+
+struct async_task {
+  struct async_task* next;
+  void (*on_run)(struct async_loop*, struct async_task*);
+};
+
 extern void* async_loop_thread(void*);
 
 extern int   async_loop(struct async_loop* const);
@@ -51,6 +74,20 @@ extern int   async_loop_mod(const struct async_loop* const, struct async_event*
 
 extern int   async_loop_remove(const struct async_loop* const, struct async_event* const);
 
+extern int   async_loop_pin(const struct async_loop* const, const int);
+
+extern void  async_loop_post(struct async_loop* const, struct async_task* const);
+
+enum async_timer_const {
+  async_timer_tick = 10
+};
+
+extern void  async_timer_set(struct async_loop* const, struct async_timer* const, const uint64_t);
+
+extern void  async_timer_cancel(struct async_loop* const, struct async_timer* const);
+
+extern int   async_timer_armed(const struct async_timer* const);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,66 @@
+#ifndef _shnet_dns_h_
+#define _shnet_dns_h_ 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <shnet/net.h>
+#include <shnet/async.h>
+
+#include <netinet/in.h>
+
+enum dns_const {
+  dns_max_servers = 3
+};
+
+struct dns_host;
+struct dns_query;
+struct dns_question;
+
+struct dns_resolver {
+  struct async_callback core;
+  pthread_mutex_t lock;
+
+  struct async_loop* loop;
+
+  struct dns_question** questions;
+  uint32_t questions_used;
+  uint32_t questions_size;
+
+  struct dns_query* done;
+
+  struct dns_host* hosts;
+  uint32_t hosts_len;
+
+  struct sockaddr_in6 servers[dns_max_servers];
+  uint32_t servers_len;
+
+  uint32_t timeout;
+  uint32_t attempts;
+
+  int timer;
+  int wake;
+
+  uint8_t alloc_loop:1;
+};
+
+struct dns_resolver_options {
+  const char* resolv_conf;
+  const char* hosts;
+  uint16_t port;
+  uint32_t timeout;
+  uint32_t attempts;
+};
+
+extern int  dns_resolver(struct dns_resolver* const, const struct dns_resolver_options* const);
+
+extern void dns_resolver_free(struct dns_resolver* const);
+
+extern int  dns_resolve(struct dns_resolver* const, struct net_async_address* const);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _shnet_dns_h_
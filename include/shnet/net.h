@@ -7,14 +7,17 @@ extern "C" {
 
 #include <netdb.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 
 enum net_consts {
   /* FAMILIES */
   net_family_any = AF_UNSPEC,
   net_family_ipv4 = AF_INET,
   net_family_ipv6 = AF_INET6,
+  net_family_unix = AF_UNIX,
   
   /* SOCKTYPES */
   net_sock_any = 0,
@@ -57,12 +60,57 @@ struct net_async_address {
   struct addrinfo* hints;
   void* data;
   void (*callback)(struct net_async_address*, struct addrinfo*);
+  uint32_t ttl;
 };
 
 extern int   net_get_address_async(struct net_async_address* const);
 
 extern void  net_free_address(struct addrinfo* const);
 
+extern struct addrinfo* net_copy_address(const struct addrinfo* const);
+
+extern struct addrinfo* net_get_unix_address(const char* const, const int);
+
+
+struct dns_resolver;
+
+struct net_dns_cache_entry;
+
+struct net_dns_cache {
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+
+  struct net_dns_cache_entry** entries;
+  uint32_t used;
+  uint32_t size;
+  uint32_t pending;
+
+  uint32_t default_ttl;
+  uint32_t stale_ttl;
+  struct dns_resolver* resolver;
+
+  uint64_t hits;
+  uint64_t stale_hits;
+  uint64_t misses;
+  uint64_t lookups;
+};
+
+struct net_dns_cache_stats {
+  uint64_t hits;
+  uint64_t stale_hits;
+  uint64_t misses;
+  uint64_t lookups;
+  uint32_t entries;
+};
+
+extern int  net_dns_cache(struct net_dns_cache* const);
+
+extern void net_dns_cache_free(struct net_dns_cache* const);
+
+extern int  net_dns_cache_get_async(struct net_dns_cache* const, struct net_async_address* const);
+
+extern void net_dns_cache_get_stats(struct net_dns_cache* const, struct net_dns_cache_stats* const);
+
 
 extern void  net_address_to_string(const void* const, char* const);
 
@@ -105,6 +153,10 @@ extern void net_socket_dont_block(const int);
 
 extern void net_socket_default_options(const int);
 
+extern int  net_socket_get_incoming_cpu(const int);
+
+extern int  net_socket_steer_by_cpu(const int, const uint32_t);
+
 #ifdef __cplusplus
 }
 #endif
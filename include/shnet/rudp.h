@@ -0,0 +1,95 @@
+#ifndef _shnet_rudp_h_
+#define _shnet_rudp_h_ 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <shnet/udp.h>
+
+enum rudp_event {
+  rudp_open,
+  rudp_close,
+  rudp_free
+};
+
+enum rudp_channel {
+  rudp_unreliable,
+  rudp_sequenced,
+  rudp_reliable
+};
+
+struct rudp_peer;
+
+struct rudp_state;
+
+struct rudp_host {
+  struct udp_socket udp;
+  struct async_timer tick;
+  
+  void (*on_event)(struct rudp_host*, struct rudp_peer*, enum rudp_event);
+  void (*on_message)(struct rudp_host*, struct rudp_peer*, uint8_t, const char*, uint32_t);
+  struct rudp_state* state;
+  uint8_t* channels;
+  
+  uint32_t channels_len;
+  uint32_t max_peers;
+  uint32_t mtu;
+  uint32_t tick_interval;
+  uint32_t timeout;
+  uint32_t ping_interval;
+  uint32_t loss;
+  uint32_t rng;
+};
+
+struct rudp_host_options {
+  struct addrinfo* info;
+  const char* hostname;
+  const char* port;
+  int family;
+  int flags;
+  const enum rudp_channel* channels;
+  uint32_t channels_len;
+  uint32_t max_peers;
+  uint32_t mtu;
+  uint32_t tick;
+  uint32_t timeout;
+  uint32_t ping_interval;
+  uint32_t loss;
+};
+
+extern int  rudp_host(struct rudp_host* const, const struct rudp_host_options* const);
+
+extern void rudp_host_close(struct rudp_host* const);
+
+extern void rudp_host_flush(struct rudp_host* const);
+
+extern struct rudp_peer* rudp_connect(struct rudp_host* const, const void* const);
+
+extern int  rudp_send(struct rudp_peer* const, const uint8_t, const void* const, const uint32_t);
+
+extern void rudp_disconnect(struct rudp_peer* const);
+
+extern void rudp_peer_set_data(struct rudp_peer* const, void* const);
+
+extern void* rudp_peer_get_data(const struct rudp_peer* const);
+
+extern void rudp_peer_get_address(const struct rudp_peer* const, void* const);
+
+struct rudp_peer_stats {
+  uint64_t packets_sent;
+  uint64_t packets_received;
+  uint64_t retransmits;
+  uint32_t unacked;
+  uint32_t rtt;
+  uint32_t rtt_var;
+  uint32_t rto;
+};
+
+extern void rudp_peer_get_stats(const struct rudp_peer* const, struct rudp_peer_stats* const);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _shnet_rudp_h_
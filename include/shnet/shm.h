@@ -0,0 +1,80 @@
+#ifndef _shnet_shm_h_
+#define _shnet_shm_h_ 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+
+#include <shnet/async.h>
+#include <shnet/storage.h>
+
+enum shm_event {
+  shm_data,
+  shm_can_send,
+  shm_close,
+  shm_free
+};
+
+enum shm_const {
+  shm_fds = 3
+};
+
+struct shm_header;
+
+struct shm_ring;
+
+struct shm_channel {
+  struct async_callback core;
+  pthread_mutex_t lock;
+  
+  void (*on_event)(struct shm_channel*, enum shm_event);
+  struct async_loop* loop;
+  struct data_storage queue;
+  
+  struct shm_header* header;
+  struct shm_ring* in;
+  struct shm_ring* out;
+  char* in_data;
+  char* out_data;
+  uint64_t size;
+  uint64_t map_size;
+  uint64_t seen;
+  uint32_t busy_poll;
+  int memfd;
+  int peer_fd;
+  
+  uint8_t side:1;
+  uint8_t alloc_loop:1;
+  uint8_t blocked:1;
+};
+
+struct shm_channel_options {
+  uint64_t size;
+  uint32_t busy_poll;
+};
+
+extern int  shm_channel(struct shm_channel* const, const struct shm_channel_options* const);
+
+extern void shm_channel_get_fds(const struct shm_channel* const, int* const);
+
+extern int  shm_channel_attach(struct shm_channel* const, const int* const, const struct shm_channel_options* const);
+
+extern int  shm_send(struct shm_channel* const, const struct data_frame* const);
+
+extern uint64_t shm_read(struct shm_channel* const, void*, uint64_t);
+
+extern uint64_t shm_peek(const struct shm_channel* const, const char** const);
+
+extern void shm_consume(struct shm_channel* const, const uint64_t);
+
+extern void shm_channel_close(struct shm_channel* const);
+
+extern void shm_channel_free(struct shm_channel* const);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _shnet_shm_h_
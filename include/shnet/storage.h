@@ -7,19 +7,29 @@ extern "C" {
 
 #include <stdint.h>
 
+struct data_generator;
+
 struct data_frame {
   union {
     char* data;
     int fd;
+    struct data_generator* gen;
   };
   uint64_t len:61;
   uint64_t read_only:1;
   uint64_t dont_free:1;
   uint64_t free_onerr:1;
-  uint64_t offset:61;
+  uint64_t offset:60;
   uint64_t mmaped:1;
   uint64_t file:1;
-  uint64_t _unused:1;
+  uint64_t generator:1;
+  uint64_t pooled:1;
+};
+
+struct data_generator {
+  int (*produce)(struct data_generator*, struct data_frame*);
+  void (*free)(struct data_generator*);
+  uint64_t threshold;
 };
 
 struct data_storage {
@@ -28,6 +38,38 @@ struct data_storage {
   uint32_t size;
 };
 
+struct data_pool_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t arenas;
+  uint64_t arena_bytes;
+};
+
+extern void* data_pool_malloc(const uint64_t);
+
+extern void* data_pool_realloc(void* const, const uint64_t);
+
+extern void  data_pool_free(void* const);
+
+extern void  data_pool_hugepages(const int);
+
+extern void  data_pool_get_stats(struct data_pool_stats* const);
+
+
+struct data_budget_stats {
+  uint64_t used;
+  uint64_t peak;
+  uint64_t limit;
+  uint64_t queues;
+};
+
+extern void  data_budget_set_limit(const uint64_t);
+
+extern int   data_budget_exceeded(void);
+
+extern void  data_budget_get_stats(struct data_budget_stats* const);
+
+
 extern void data_storage_free_frame(const struct data_frame* const);
 
 extern void data_storage_free_frame_err(const struct data_frame* const);
@@ -42,6 +84,8 @@ extern void data_storage_drain(struct data_storage* const, const uint64_t);
 
 extern void data_storage_finish(const struct data_storage* const);
 
+extern int  data_storage_generate(struct data_storage* const);
+
 extern int  data_storage_is_empty(const struct data_storage* const);
 
 extern uint64_t data_storage_size(const struct data_storage* const);
@@ -19,14 +19,55 @@ enum tcp_event {
   tcp_free
 };
 
+struct tcp_splice;
+
+struct tcp_race;
+
+struct tcp_connect;
+
+struct tcp_worker;
+
+struct tcp_server_counters;
+
+struct tcp_tune;
+
+struct tcp_stage;
+
+struct tcp_fds;
+
+struct tcp_budget;
+
+struct tcp_deadline;
+
+struct dns_resolver;
+
 struct tcp_socket {
   struct async_event core;
-  pthread_mutex_t lock;
+  uint32_t lock;
+  uint32_t connect_timeout;
   
   void (*on_event)(struct tcp_socket*, enum tcp_event);
   struct async_loop* loop;
+  struct tcp_splice* splice;
+  struct tcp_worker* worker;
+  struct tcp_server_counters* counters;
   
   struct data_storage queue;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t handle;
+  
+  struct tcp_deadline* deadline;
+  struct tcp_race* race;
+  struct tcp_connect* connect;
+  struct tcp_tune* tune;
+  struct tcp_stage* stage;
+  struct tcp_fds* fds;
+  struct tcp_budget* budget;
+  uint32_t idle_timeout;
+  uint32_t read_timeout;
+  uint32_t write_timeout;
+  
   uint8_t alloc_loop:1;
   uint8_t opened:1;
   uint8_t confirmed_free:1;
@@ -37,12 +78,19 @@ struct tcp_socket {
   uint8_t dont_send_buffered:1;
   uint8_t dont_close_onreadclose:1;
   uint8_t dont_autoclean:1;
+  uint8_t read_paused:1;
+  uint8_t fastopen:1;
+  uint8_t timed_out:1;
+  uint8_t autotune:1;
+  uint8_t migrating:1;
+  uint8_t stage_sends:1;
   /* TLS Extensions */
   uint8_t alloc_ctx:1;
   uint8_t alloc_ssl:1;
   uint8_t tls_close_guard:1;
   uint8_t init_fin:1;
   uint8_t shutdown_once:1;
+  uint8_t ktls:1;
 };
 
 extern void tcp_lock(struct tcp_socket* const);
@@ -63,6 +111,49 @@ extern void tcp_socket_keepalive_on(const struct tcp_socket* const);
 
 extern void tcp_socket_keepalive_off(const struct tcp_socket* const);
 
+extern void tcp_socket_pause_read(struct tcp_socket* const);
+
+extern void tcp_socket_resume_read(struct tcp_socket* const);
+
+extern int  tcp_socket_fastopen_used(const struct tcp_socket* const);
+
+extern int  tcp_socket_get_incoming_cpu(const struct tcp_socket* const);
+
+struct tcp_socket_stats {
+  /* Userspace */
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t queued;
+  /* Kernel, from TCP_INFO */
+  uint64_t bytes_acked;
+  uint64_t bytes_received;
+  uint64_t delivery_rate;
+  uint32_t rtt;
+  uint32_t rtt_var;
+  uint32_t min_rtt;
+  uint32_t cwnd;
+  uint32_t ssthresh;
+  uint32_t mss;
+  uint32_t unacked;
+  uint32_t lost;
+  uint32_t retransmits;
+  uint32_t send_queue;
+  uint32_t recv_queue;
+  uint32_t sndbuf;
+  uint32_t rcvbuf;
+  uint8_t state;
+};
+
+extern int  tcp_socket_stats(struct tcp_socket* const, struct tcp_socket_stats* const);
+
+extern uint64_t tcp_socket_handle(struct tcp_socket* const);
+
+extern struct tcp_socket* tcp_handle_acquire(const uint64_t);
+
+extern void tcp_handle_release(const uint64_t);
+
+extern int  tcp_handle_send(const uint64_t, const struct data_frame* const);
+
 extern void tcp_socket_free_(struct tcp_socket* const);
 
 extern void tcp_socket_free(struct tcp_socket* const);
@@ -77,6 +168,15 @@ struct tcp_socket_options {
   const char* port;
   int family;
   int flags;
+  int fastopen;
+  struct dns_resolver* resolver;
+  struct net_dns_cache* dns_cache;
+  uint32_t connect_timeout;
+  uint32_t idle_timeout;
+  uint32_t read_timeout;
+  uint32_t write_timeout;
+  int autotune;
+  int stage_sends;
 };
 
 extern int  tcp_socket(struct tcp_socket* const, const struct tcp_socket_options* const);
@@ -87,14 +187,62 @@ extern int  tcp_send(struct tcp_socket* const, const struct data_frame* const);
 
 extern uint64_t tcp_read(struct tcp_socket* const, void*, uint64_t);
 
+extern int  tcp_send_fds(struct tcp_socket* const, const int* const, const uint32_t, const struct data_frame* const);
+
+extern uint64_t tcp_read_fds(struct tcp_socket* const, void*, uint64_t, int* const, uint32_t* const);
+
+extern int  tcp_splice(struct tcp_socket* const, struct tcp_socket* const);
+
+extern int  tcp_socket_migrate(struct tcp_socket* const, struct async_loop* const);
+
+struct tcp_autotune_options {
+  uint32_t min;
+  uint32_t max;
+  uint32_t interval;
+};
+
+extern void tcp_autotune(const struct tcp_autotune_options* const);
+
+
+enum tcp_budget_flags {
+  tcp_budget_refuse = 1,
+  tcp_budget_close = 2,
+  tcp_budget_stop_accepting = 4
+};
+
+extern void tcp_budget_policy(const uint32_t);
+
+extern int  tcp_budget_check(struct tcp_socket* const, struct data_storage* const);
+
+
+enum tcp_balance {
+  tcp_balance_round_robin,
+  tcp_balance_least_connections,
+  tcp_balance_least_lag
+};
+
+struct tcp_workers;
+
+struct tcp_admit;
 
 struct tcp_server {
   struct async_event core;
   
   struct tcp_socket* (*on_event)(struct tcp_server*, struct tcp_socket*, enum tcp_event);
   struct async_loop* loop;
+  struct tcp_workers* workers;
+  struct tcp_server_counters* counters;
+  struct async_timer accept_retry;
+  struct tcp_admit* admit;
+  int reserve_fd;
+  
+  uint32_t idle_timeout;
+  uint32_t read_timeout;
+  uint32_t write_timeout;
   
   uint8_t alloc_loop:1;
+  uint8_t autotune:1;
+  uint8_t stage_sends:1;
   /* TLS Extensions */
   uint8_t alloc_ctx:1;
 };
@@ -105,6 +253,34 @@ extern void tcp_server_free(struct tcp_server* const);
 
 extern void tcp_server_close(struct tcp_server* const);
 
+struct tcp_worker_stats {
+  struct async_loop* loop;
+  uint32_t connections;
+  uint32_t lag;
+  uint32_t migrated;
+};
+
+struct tcp_server_stats {
+  uint64_t accepted;
+  uint64_t closed;
+  uint64_t open;
+  /* Of closed connections */
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t retransmits;
+  /* Of the listener */
+  uint32_t listen_queue;
+  uint32_t listen_backlog;
+  uint32_t listen_drops;
+  /* Of admission control */
+  uint64_t shed;
+  uint32_t lag;
+};
+
+extern int  tcp_server_stats(const struct tcp_server* const, struct tcp_server_stats* const);
+
+extern int  tcp_server_get_worker_stats(const struct tcp_server* const, const uint32_t, struct tcp_worker_stats* const);
+
 struct tcp_server_options {
   struct addrinfo* info;
   const char* hostname;
@@ -112,11 +288,96 @@ struct tcp_server_options {
   int family;
   int flags;
   int backlog;
+  int fastopen;
+  uint32_t idle_timeout;
+  uint32_t read_timeout;
+  uint32_t write_timeout;
+  struct async_loop** workers;
+  uint32_t workers_len;
+  enum tcp_balance balance;
+  uint32_t cpu_steering;
+  int autotune;
+  uint32_t max_lag;
+  uint32_t accept_rate;
+  uint32_t accept_burst;
+  uint32_t rebalance_interval;
+  uint32_t rebalance_lag;
+  int stage_sends;
 };
 
 extern int  tcp_server(struct tcp_server* const, const struct tcp_server_options* const);
 
 
+struct tcp_pool;
+
+struct tcp_pool_key;
+
+struct tcp_pool_conn {
+  struct tcp_socket tcp;
+  
+  void (*on_event)(struct tcp_socket*, enum tcp_event);
+  void* data;
+  
+  struct tcp_pool_key* key;
+  struct tcp_pool_conn* prev;
+  struct tcp_pool_conn* next;
+  uint64_t idle_since;
+  int err;
+  
+  uint8_t busy:1;
+  uint8_t idle:1;
+  uint8_t creating:1;
+  uint8_t dead:1;
+};
+
+struct tcp_pool_key {
+  struct tcp_pool* pool;
+  struct tcp_socket_options opt;
+  
+  struct tcp_pool_conn* idle_head;
+  struct tcp_pool_conn* idle_tail;
+  
+  uint32_t idle;
+  uint32_t total;
+  uint32_t min;
+  uint32_t max;
+};
+
+struct tcp_pool {
+  struct async_callback core;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  
+  struct async_loop* loop;
+  
+  struct tcp_pool_key** keys;
+  uint32_t keys_used;
+  uint32_t keys_size;
+  
+  uint32_t idle_timeout;
+  uint32_t conns;
+  
+  uint8_t alloc_loop:1;
+  uint8_t closing:1;
+};
+
+extern int  tcp_pool(struct tcp_pool* const);
+
+extern void tcp_pool_free(struct tcp_pool* const);
+
+struct tcp_pool_key_options {
+  struct tcp_socket_options tcp;
+  uint32_t min;
+  uint32_t max;
+};
+
+extern struct tcp_pool_key* tcp_pool_key(struct tcp_pool* const, const struct tcp_pool_key_options* const);
+
+extern struct tcp_socket* tcp_pool_get(struct tcp_pool_key* const, void (*)(struct tcp_socket*, enum tcp_event));
+
+extern void tcp_pool_put(struct tcp_socket* const);
+
+
 extern void tcp_onevent(struct async_loop*, uint32_t, struct async_event*);
 
 extern int  tcp_async_loop(struct async_loop* const);
@@ -44,6 +44,16 @@ extern void test_mutex_wake(void);
 
 extern void test_sleep(const uint64_t);
 
+/* Polls every 10 milliseconds for up to 10 seconds, then asserts */
+#define test_wait_for(cond) \
+do { \
+  int _i = 0; \
+  for(; _i < 1000 && !(cond); ++_i) { \
+    test_sleep(10); \
+  } \
+  assert(cond); \
+} while(0)
+
 
 extern void test_expect_segfault(const void* const);
 
@@ -0,0 +1,99 @@
+#ifndef _shnet_tls_h_
+#define _shnet_tls_h_ 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <shnet/tcp.h>
+
+#include <openssl/ssl.h>
+
+struct tls_session_entry;
+
+struct tls_session_cache {
+  pthread_mutex_t lock;
+  struct tls_session_entry* entries;
+  uint32_t used;
+  uint32_t size;
+};
+
+extern int  tls_session_cache(struct tls_session_cache* const);
+
+extern void tls_session_cache_free(struct tls_session_cache* const);
+
+
+extern SSL_CTX* tls_client_ctx(void);
+
+extern SSL_CTX* tls_server_ctx(void);
+
+extern int  tls_ctx_self_signed(SSL_CTX* const, const char* const);
+
+extern void tls_ctx_session_cache(SSL_CTX* const);
+
+
+struct tls_socket {
+  struct tcp_socket tcp;
+
+  void (*on_event)(struct tls_socket*, enum tcp_event);
+  SSL_CTX* ctx;
+  SSL* ssl;
+  struct tls_session_cache* cache;
+  char* session_key;
+
+  struct data_storage queue;
+  struct data_generator close_notify;
+  uint8_t dont_close_onreadclose:1;
+};
+
+extern int  tls_socket_resumed(struct tls_socket* const);
+
+extern int  tls_socket_ktls(struct tls_socket* const);
+
+extern void tls_socket_free(struct tls_socket* const);
+
+extern void tls_socket_close(struct tls_socket* const);
+
+extern void tls_socket_force_close(struct tls_socket* const);
+
+struct tls_socket_options {
+  struct tcp_socket_options tcp;
+  SSL_CTX* ctx;
+  const char* servername;
+  struct tls_session_cache* cache;
+};
+
+extern int  tls_socket(struct tls_socket* const, const struct tls_socket_options* const);
+
+extern int  tls_send(struct tls_socket* const, const struct data_frame* const);
+
+extern int  tls_handle_send(const uint64_t, const struct data_frame* const);
+
+extern uint64_t tls_read(struct tls_socket* const, void*, uint64_t);
+
+
+struct tls_server {
+  struct tcp_server tcp;
+
+  struct tls_socket* (*on_event)(struct tls_server*, struct tls_socket*, enum tcp_event);
+  SSL_CTX* ctx;
+};
+
+extern void tls_server_free(struct tls_server* const);
+
+extern void tls_server_close(struct tls_server* const);
+
+struct tls_server_options {
+  struct tcp_server_options tcp;
+  SSL_CTX* ctx;
+  const char* cert_path;
+  const char* key_path;
+};
+
+extern int  tls_server(struct tls_server* const, const struct tls_server_options* const);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _shnet_tls_h_
@@ -0,0 +1,72 @@
+#ifndef _shnet_udp_h_
+#define _shnet_udp_h_ 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <shnet/net.h>
+#include <shnet/async.h>
+#include <shnet/storage.h>
+
+enum udp_event {
+  udp_data,
+  udp_can_send,
+  udp_close,
+  udp_free
+};
+
+struct udp_datagram {
+  char* data;
+  uint32_t len;
+  uint16_t segment;
+  uint8_t truncated;
+  union {
+    struct sockaddr addr;
+    struct sockaddr_in addr4;
+    struct sockaddr_in6 addr6;
+  };
+};
+
+struct udp_recv;
+
+struct udp_socket {
+  struct async_callback core;
+  
+  void (*on_event)(struct udp_socket*, enum udp_event);
+  struct async_loop* loop;
+  struct udp_recv* recv;
+  uint32_t recv_size;
+  
+  uint8_t alloc_loop:1;
+  uint8_t gro:1;
+};
+
+struct udp_socket_options {
+  struct addrinfo* info;
+  const char* hostname;
+  const char* port;
+  int family;
+  int flags;
+  int bind;
+  int gro;
+  uint32_t recv_size;
+};
+
+extern int  udp_socket(struct udp_socket* const, const struct udp_socket_options* const);
+
+extern uint16_t udp_socket_get_port(const struct udp_socket* const);
+
+extern uint32_t udp_read(struct udp_socket* const, struct udp_datagram* const, const uint32_t);
+
+extern uint32_t udp_send(struct udp_socket* const, const struct udp_datagram* const, const uint32_t);
+
+extern void udp_socket_close(struct udp_socket* const);
+
+extern void udp_socket_free(struct udp_socket* const);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _shnet_udp_h_
@@ -0,0 +1,10 @@
+#ifndef _shnet_version_h_
+#define _shnet_version_h_ 1
+
+#define SHNET_VERSION 1
+#define SHNET_PATCH 3
+
+#define SHNET_CLI_VERSION 1
+#define SHNET_CLI_PATCH 0
+
+#endif // _shnet_version_h_
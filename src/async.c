@@ -1,8 +1,14 @@
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <sched.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdatomic.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include <shnet/async.h>
 #include <shnet/error.h>
@@ -30,6 +36,8 @@ void* async_loop_thread(void* async_loop_thread_data) {
           free(loop);
         }
         return NULL;
+      } else if(event->callback) {
+        ((struct async_callback*) event)->on_event(loop, mask, (struct async_callback*) event);
       } else {
         loop->on_event(loop, mask, event);
       }
@@ -42,6 +50,240 @@ void* async_loop_thread(void* async_loop_thread_data) {
 #undef event
 #undef loop
 
+/*
+ * Every loop has a hierarchical timing wheel, as described by Varghese and
+ * Lauck, and a queue of tasks posted to it from other threads. Timers are only
+ * ever touched by the loop's thread, so arming, re-arming and cancelling them
+ * are just a few pointer writes - no locks, no heap.
+ *
+ * The first level has a slot for each of the next 64 ticks. Every next level
+ * has slots 64 times as wide. Whenever the first level wraps around, a slot of
+ * the second level is emptied into the first one, and so on.
+ */
+
+enum async_wheel_const {
+  async_wheel_bits = 6,
+  async_wheel_slots = 1 << async_wheel_bits,
+  async_wheel_mask = async_wheel_slots - 1,
+  async_wheel_levels = 4
+};
+
+struct async_wheel {
+  struct async_callback timer;
+  struct async_callback post;
+  
+  _Atomic(struct async_task*) tasks;
+  
+  uint64_t base;
+  uint64_t now;
+  uint32_t count;
+  uint8_t ticking;
+  
+  struct async_timer* slots[async_wheel_levels][async_wheel_slots];
+};
+
+static uint64_t async_wheel_time(const struct async_wheel* const wheel) {
+  struct timespec tp;
+  (void) clock_gettime(CLOCK_MONOTONIC, &tp);
+  return ((uint64_t) tp.tv_sec * 1000 + tp.tv_nsec / 1000000 - wheel->base) / async_timer_tick;
+}
+
+static void async_wheel_tick_on(struct async_wheel* const wheel, const int on) {
+  const struct timespec spec = (struct timespec) {
+    .tv_sec = on ? async_timer_tick / 1000 : 0,
+    .tv_nsec = on ? (async_timer_tick % 1000) * 1000000 : 0
+  };
+  (void) timerfd_settime(wheel->timer.core.fd, 0, &((struct itimerspec) {
+    .it_interval = spec,
+    .it_value = spec
+  }), NULL);
+  wheel->ticking = on;
+}
+
+static void async_wheel_link(struct async_wheel* const wheel, struct async_timer* const timer) {
+  if(timer->expires < wheel->now) {
+    timer->expires = wheel->now;
+  }
+  uint64_t delta = timer->expires - wheel->now;
+  if(delta >> (async_wheel_bits * async_wheel_levels)) {
+    delta = ((uint64_t) 1 << (async_wheel_bits * async_wheel_levels)) - 1;
+    timer->expires = wheel->now + delta;
+  }
+  uint32_t level = 0;
+  while((delta >> (async_wheel_bits * (level + 1))) != 0) {
+    ++level;
+  }
+  struct async_timer** const slot = &wheel->slots[level][(timer->expires >> (async_wheel_bits * level)) & async_wheel_mask];
+  timer->next = *slot;
+  if(timer->next != NULL) {
+    timer->next->pprev = &timer->next;
+  }
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+static void async_wheel_unlink(struct async_timer* const timer) {
+  *timer->pprev = timer->next;
+  if(timer->next != NULL) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+static void async_wheel_advance(struct async_loop* const loop, struct async_wheel* const wheel) {
+  const uint32_t idx = wheel->now & async_wheel_mask;
+  if(idx == 0) {
+    for(uint32_t level = 1; level < async_wheel_levels; ++level) {
+      const uint32_t i = (wheel->now >> (async_wheel_bits * level)) & async_wheel_mask;
+      struct async_timer* timer = wheel->slots[level][i];
+      wheel->slots[level][i] = NULL;
+      while(timer != NULL) {
+        struct async_timer* const next = timer->next;
+        async_wheel_link(wheel, timer);
+        timer = next;
+      }
+      if(i != 0) {
+        break;
+      }
+    }
+  }
+  struct async_timer* list = wheel->slots[0][idx];
+  wheel->slots[0][idx] = NULL;
+  if(list != NULL) {
+    list->pprev = &list;
+  }
+  /* Timers armed by the callbacks below can't end up in the list anymore */
+  ++wheel->now;
+  while(list != NULL) {
+    struct async_timer* const timer = list;
+    async_wheel_unlink(timer);
+    --wheel->count;
+    timer->on_timeout(loop, timer);
+  }
+}
+
+static void async_wheel_ontimer(struct async_loop* loop, uint32_t events, struct async_callback* callback) {
+  (void) events;
+  struct async_wheel* const wheel = (struct async_wheel*) callback;
+  uint64_t expired;
+  (void) read(wheel->timer.core.fd, &expired, sizeof(expired));
+  const uint64_t now = async_wheel_time(wheel);
+  while(wheel->count != 0 && wheel->now <= now) {
+    async_wheel_advance(loop, wheel);
+  }
+  if(wheel->count == 0 && wheel->ticking) {
+    async_wheel_tick_on(wheel, 0);
+  }
+}
+
+void async_timer_set(struct async_loop* const loop, struct async_timer* const timer, const uint64_t ms) {
+  struct async_wheel* const wheel = loop->wheel;
+  if(timer->pprev != NULL) {
+    async_wheel_unlink(timer);
+    --wheel->count;
+  }
+  const uint64_t now = async_wheel_time(wheel);
+  if(wheel->count == 0) {
+    /* Nothing to catch up on, skip straight to the present */
+    wheel->now = now;
+    if(!wheel->ticking) {
+      async_wheel_tick_on(wheel, 1);
+    }
+  }
+  timer->expires = now + (ms + async_timer_tick - 1) / async_timer_tick;
+  async_wheel_link(wheel, timer);
+  ++wheel->count;
+}
+
+void async_timer_cancel(struct async_loop* const loop, struct async_timer* const timer) {
+  if(timer->pprev != NULL) {
+    async_wheel_unlink(timer);
+    --loop->wheel->count;
+  }
+}
+
+int async_timer_armed(const struct async_timer* const timer) {
+  return timer->pprev != NULL;
+}
+
+void async_loop_post(struct async_loop* const loop, struct async_task* const task) {
+  struct async_wheel* const wheel = loop->wheel;
+  task->next = atomic_load_explicit(&wheel->tasks, memory_order_relaxed);
+  while(!atomic_compare_exchange_weak_explicit(&wheel->tasks, &task->next, task, memory_order_release, memory_order_relaxed));
+  /* Only the first task needs to wake the loop up, it takes all of them */
+  if(task->next == NULL) {
+    assert(!eventfd_write(wheel->post.core.fd, 1));
+  }
+}
+
+static void async_wheel_onpost(struct async_loop* loop, uint32_t events, struct async_callback* callback) {
+  (void) events;
+  (void) callback;
+  struct async_wheel* const wheel = loop->wheel;
+  eventfd_t count;
+  (void) eventfd_read(wheel->post.core.fd, &count);
+  struct async_task* task = atomic_exchange_explicit(&wheel->tasks, NULL, memory_order_acquire);
+  /* The tasks were pushed in reverse order */
+  struct async_task* list = NULL;
+  while(task != NULL) {
+    struct async_task* const next = task->next;
+    task->next = list;
+    list = task;
+    task = next;
+  }
+  while(list != NULL) {
+    struct async_task* const next = list->next;
+    list->on_run(loop, list);
+    list = next;
+  }
+}
+
+static int async_wheel(struct async_loop* const loop) {
+  struct async_wheel* const wheel = shnet_calloc(1, sizeof(*wheel));
+  if(wheel == NULL) {
+    return -1;
+  }
+  struct timespec tp;
+  (void) clock_gettime(CLOCK_MONOTONIC, &tp);
+  wheel->base = (uint64_t) tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+  safe_execute(wheel->timer.core.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), wheel->timer.core.fd == -1, errno);
+  if(wheel->timer.core.fd == -1) {
+    goto err_wheel;
+  }
+  safe_execute(wheel->post.core.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), wheel->post.core.fd == -1, errno);
+  if(wheel->post.core.fd == -1) {
+    goto err_timer;
+  }
+  wheel->timer.core.callback = 1;
+  wheel->timer.on_event = async_wheel_ontimer;
+  wheel->post.core.callback = 1;
+  wheel->post.on_event = async_wheel_onpost;
+  if(async_loop_add(loop, &wheel->timer.core, EPOLLIN) == -1) {
+    goto err_post;
+  }
+  if(async_loop_add(loop, &wheel->post.core, EPOLLIN) == -1) {
+    goto err_post;
+  }
+  loop->wheel = wheel;
+  return 0;
+  
+  err_post:
+  (void) close(wheel->post.core.fd);
+  err_timer:
+  (void) close(wheel->timer.core.fd);
+  err_wheel:
+  free(wheel);
+  return -1;
+}
+
+static void async_wheel_free(struct async_loop* const loop) {
+  (void) close(loop->wheel->timer.core.fd);
+  (void) close(loop->wheel->post.core.fd);
+  free(loop->wheel);
+  loop->wheel = NULL;
+}
+
 int async_loop(struct async_loop* const loop) {
   if(loop->events_len == 0) {
     loop->events_len = 64;
@@ -58,7 +300,7 @@ int async_loop(struct async_loop* const loop) {
   if(loop->evt.fd == -1) {
     goto err_fd;
   }
-  if(async_loop_add(loop, &loop->evt, EPOLLIN) == -1) {
+  if(async_loop_add(loop, &loop->evt, EPOLLIN) == -1 || async_wheel(loop) == -1) {
     goto err_efd;
   }
   return 0;
@@ -76,12 +318,25 @@ int async_loop_start(struct async_loop* const loop) {
   return pthread_start(&loop->thread, async_loop_thread, loop);
 }
 
+int async_loop_pin(const struct async_loop* const loop, const int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  const int err = pthread_setaffinity_np(loop->thread, sizeof(set), &set);
+  if(err != 0) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
 void async_loop_stop(const struct async_loop* const loop) {
   async_loop_shutdown(loop, async_joinable);
   (void) pthread_join(loop->thread, NULL);
 }
 
 void async_loop_free(struct async_loop* const loop) {
+  async_wheel_free(loop);
   (void) close(loop->fd);
   (void) close(loop->evt.fd);
   free(loop->events);
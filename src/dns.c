@@ -0,0 +1,989 @@
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <shnet/dns.h>
+#include <shnet/error.h>
+
+/*
+ * A stub resolver. Names are first looked up in the hosts file, then queried
+ * over UDP at the nameservers from resolv.conf, switching to TCP for truncated
+ * responses. Every question is sent to one server at a time, moving on to the
+ * next server on timeout or failure, for the given number of attempts.
+ *
+ * The UDP sockets, the timer, an eventfd and any TCP connections live in
+ * a separate epoll instance, which is added to the resolver's loop as a single
+ * callback event, the same way connection races do it in the TCP module.
+ */
+
+enum dns_consts {
+  dns_type_a = 1,
+  dns_type_cname = 5,
+  dns_type_aaaa = 28,
+  dns_type_opt = 41,
+  dns_class_in = 1,
+
+  dns_flag_qr = 0x8000,
+  dns_flag_tc = 0x0200,
+  dns_flag_rd = 0x0100,
+
+  dns_rcode_ok = 0,
+  dns_rcode_nxdomain = 3,
+
+  dns_header_size = 12,
+  dns_max_name = 255,
+  dns_max_query = dns_header_size + dns_max_name + 1 + 4 + 11,
+  dns_udp_size = 1232,
+  dns_max_jumps = 16,
+
+  dns_default_timeout = 5000,
+  dns_default_attempts = 2,
+  dns_max_attempts = 5,
+  dns_batch = 16
+};
+
+struct dns_host {
+  char* name;
+  struct sockaddr_in6 addr;
+};
+
+struct dns_query {
+  struct dns_query* next;
+  struct net_async_address* addr;
+  /* IPv6 results first, IPv4 second */
+  struct addrinfo* heads[2];
+  struct addrinfo* tails[2];
+  uint32_t ttl;
+  int code;
+  int socktype;
+  int protocol;
+  uint16_t port;
+  uint8_t pending;
+  char name[dns_max_name + 1];
+};
+
+struct dns_question {
+  struct dns_query* query;
+  uint64_t deadline;
+  uint32_t tries;
+  uint16_t id;
+  uint16_t type;
+  int udp;
+  int tcp;
+  uint8_t* buf;
+  uint32_t buf_len;
+  uint32_t sent;
+  uint16_t len;
+  /* Length prefix for TCP, followed by the message */
+  uint8_t msg[2 + dns_max_query];
+};
+
+static uint64_t dns_now(void) {
+  struct timespec tp;
+  (void) clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t) tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+static uint16_t dns_read_u16(const uint8_t* const ptr) {
+  return ((uint16_t) ptr[0] << 8) | ptr[1];
+}
+
+static uint32_t dns_read_u32(const uint8_t* const ptr) {
+  return ((uint32_t) dns_read_u16(ptr) << 16) | dns_read_u16(ptr + 2);
+}
+
+static void dns_write_u16(uint8_t* const ptr, const uint16_t value) {
+  ptr[0] = value >> 8;
+  ptr[1] = value;
+}
+
+static void dns_lowercase(char* str) {
+  for(; *str; ++str) {
+    if(*str >= 'A' && *str <= 'Z') {
+      *str += 'a' - 'A';
+    }
+  }
+}
+
+/*
+ * Names are kept lowercase and without the trailing dot, so that they can be
+ * compared with strcmp().
+ */
+
+static int dns_read_name(const uint8_t* const msg, const uint32_t len, uint32_t off, char* const out, uint32_t* const next) {
+  uint32_t out_len = 0;
+  uint32_t jumps = 0;
+  *next = 0;
+  while(1) {
+    if(off >= len) {
+      return -1;
+    }
+    const uint8_t label = msg[off];
+    if((label & 0xc0) == 0xc0) {
+      if(off + 1 >= len || ++jumps > dns_max_jumps) {
+        return -1;
+      }
+      if(*next == 0) {
+        *next = off + 2;
+      }
+      off = ((label & 0x3f) << 8) | msg[off + 1];
+      continue;
+    }
+    if(label & 0xc0) {
+      return -1;
+    }
+    if(label == 0) {
+      if(*next == 0) {
+        *next = off + 1;
+      }
+      break;
+    }
+    if(off + 1 + label > len || out_len + label + 1 > dns_max_name) {
+      return -1;
+    }
+    if(out_len != 0) {
+      out[out_len++] = '.';
+    }
+    (void) memcpy(out + out_len, msg + off + 1, label);
+    out_len += label;
+    off += 1 + label;
+  }
+  out[out_len] = 0;
+  dns_lowercase(out);
+  return 0;
+}
+
+static int dns_build_query(struct dns_question* const q) {
+  uint8_t* const msg = q->msg + 2;
+  (void) memset(msg, 0, dns_header_size);
+  dns_write_u16(msg, q->id);
+  dns_write_u16(msg + 2, dns_flag_rd);
+  dns_write_u16(msg + 4, 1);
+  dns_write_u16(msg + 10, 1);
+  uint32_t off = dns_header_size;
+  const char* label = q->query->name;
+  while(*label) {
+    const char* const dot = strchr(label, '.');
+    const size_t label_len = dot == NULL ? strlen(label) : (size_t)(dot - label);
+    if(label_len == 0 || label_len > 63) {
+      return -1;
+    }
+    msg[off++] = label_len;
+    (void) memcpy(msg + off, label, label_len);
+    off += label_len;
+    if(dot == NULL) {
+      break;
+    }
+    label = dot + 1;
+  }
+  msg[off++] = 0;
+  dns_write_u16(msg + off, q->type);
+  dns_write_u16(msg + off + 2, dns_class_in);
+  off += 4;
+  /* EDNS(0), to receive bigger responses over UDP */
+  msg[off++] = 0;
+  dns_write_u16(msg + off, dns_type_opt);
+  dns_write_u16(msg + off + 2, dns_udp_size);
+  (void) memset(msg + off + 4, 0, 6);
+  off += 10;
+  q->len = off;
+  dns_write_u16(q->msg, off);
+  return 0;
+}
+
+/*
+ * The results are compatible with glibc's freeaddrinfo(), which frees every
+ * node and its canonical name, so they can be freed with net_free_address().
+ */
+
+static int dns_query_add(struct dns_query* const query, const int family, const void* const ip) {
+  struct addrinfo* const info = shnet_calloc(1, sizeof(struct addrinfo) + sizeof(struct sockaddr_in6));
+  if(info == NULL) {
+    return -1;
+  }
+  info->ai_family = family;
+  info->ai_socktype = query->socktype;
+  info->ai_protocol = query->protocol;
+  info->ai_addr = (struct sockaddr*)(info + 1);
+  if(family == net_family_ipv4) {
+    struct sockaddr_in* const addr = (struct sockaddr_in*) info->ai_addr;
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(query->port);
+    (void) memcpy(&addr->sin_addr, ip, 4);
+    info->ai_addrlen = sizeof(struct sockaddr_in);
+  } else {
+    struct sockaddr_in6* const addr = (struct sockaddr_in6*) info->ai_addr;
+    addr->sin6_family = AF_INET6;
+    addr->sin6_port = htons(query->port);
+    (void) memcpy(&addr->sin6_addr, ip, 16);
+    info->ai_addrlen = sizeof(struct sockaddr_in6);
+  }
+  const int idx = family == net_family_ipv4;
+  if(query->heads[idx] == NULL) {
+    query->heads[idx] = info;
+  } else {
+    query->tails[idx]->ai_next = info;
+  }
+  query->tails[idx] = info;
+  return 0;
+}
+
+static void dns_query_push(struct dns_resolver* const resolver, struct dns_query* const query) {
+  query->next = resolver->done;
+  resolver->done = query;
+  (void) eventfd_write(resolver->wake, 1);
+}
+
+static void dns_query_complete(struct dns_query* const query) {
+  struct addrinfo* info = query->heads[0];
+  if(info == NULL) {
+    info = query->heads[1];
+  } else {
+    query->tails[0]->ai_next = query->heads[1];
+  }
+  struct net_async_address* const addr = query->addr;
+  addr->ttl = info == NULL ? 0 : query->ttl;
+  errno = info == NULL ? (query->code == 0 ? EAI_NONAME : query->code) : 0;
+  free(query);
+  addr->callback(addr, info);
+}
+
+static void dns_question_close(struct dns_resolver* const resolver, struct dns_question* const q) {
+  if(q->udp != -1) {
+    (void) epoll_ctl(resolver->core.core.fd, EPOLL_CTL_DEL, q->udp, NULL);
+    (void) close(q->udp);
+    q->udp = -1;
+  }
+  if(q->tcp != -1) {
+    (void) epoll_ctl(resolver->core.core.fd, EPOLL_CTL_DEL, q->tcp, NULL);
+    (void) close(q->tcp);
+    q->tcp = -1;
+  }
+  if(q->buf != NULL) {
+    free(q->buf);
+    q->buf = NULL;
+  }
+  q->buf_len = 0;
+  q->sent = 0;
+}
+
+static void dns_question_finish(struct dns_resolver* const resolver, struct dns_question* const q, const int code) {
+  for(uint32_t i = 0; i < resolver->questions_used; ++i) {
+    if(resolver->questions[i] == q) {
+      resolver->questions[i] = resolver->questions[--resolver->questions_used];
+      break;
+    }
+  }
+  dns_question_close(resolver, q);
+  struct dns_query* const query = q->query;
+  free(q);
+  if(code != 0 && query->code != EAI_NONAME) {
+    query->code = code;
+  }
+  if(--query->pending == 0) {
+    dns_query_push(resolver, query);
+  }
+}
+
+static const struct sockaddr_in6* dns_question_server(const struct dns_resolver* const resolver, const struct dns_question* const q) {
+  return resolver->servers + q->tries % resolver->servers_len;
+}
+
+/*
+ * Every attempt gets a socket of its own, like glibc does. Connecting it binds
+ * it to a random ephemeral port, so that the ID isn't all a forged answer has
+ * to guess, and makes the kernel drop whatever doesn't come from the server.
+ * If anything fails, the question just times out and is tried again.
+ */
+
+static void dns_question_send(struct dns_resolver* const resolver, struct dns_question* const q) {
+  const struct sockaddr_in6* const server = dns_question_server(resolver, q);
+  q->deadline = dns_now() + resolver->timeout;
+  safe_execute(q->udp = socket(server->sin6_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), q->udp == -1, errno);
+  if(q->udp == -1) {
+    return;
+  }
+  int err;
+  safe_execute(err = connect(q->udp, (const struct sockaddr*) server,
+    server->sin6_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)), err == -1, errno);
+  if(err == -1 || epoll_ctl(resolver->core.core.fd, EPOLL_CTL_ADD, q->udp, &((struct epoll_event) {
+    .events = EPOLLIN,
+    .data.ptr = q
+  })) == -1) {
+    (void) close(q->udp);
+    q->udp = -1;
+    return;
+  }
+  (void) send(q->udp, q->msg + 2, q->len, MSG_NOSIGNAL);
+}
+
+static void dns_question_retry(struct dns_resolver* const resolver, struct dns_question* const q) {
+  dns_question_close(resolver, q);
+  if(++q->tries >= resolver->attempts * resolver->servers_len) {
+    dns_question_finish(resolver, q, EAI_AGAIN);
+  } else {
+    dns_question_send(resolver, q);
+  }
+}
+
+static void dns_question_tcp(struct dns_resolver* const resolver, struct dns_question* const q) {
+  const struct sockaddr_in6* const server = dns_question_server(resolver, q);
+  q->deadline = dns_now() + resolver->timeout;
+  safe_execute(q->tcp = socket(server->sin6_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), q->tcp == -1, errno);
+  if(q->tcp == -1) {
+    dns_question_retry(resolver, q);
+    return;
+  }
+  int err;
+  safe_execute(err = connect(q->tcp, (const struct sockaddr*) server,
+    server->sin6_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)), err == -1, errno);
+  if((err == -1 && errno != EINPROGRESS) || epoll_ctl(resolver->core.core.fd, EPOLL_CTL_ADD, q->tcp, &((struct epoll_event) {
+    .events = EPOLLOUT,
+    .data.ptr = q
+  })) == -1) {
+    dns_question_retry(resolver, q);
+  }
+}
+
+/*
+ * Returns 0 if the question was answered, -1 if the message is not an answer
+ * to the question, and -2 if the question was retried.
+ */
+
+static int dns_question_answer(struct dns_resolver* const resolver, struct dns_question* const q, const uint8_t* const msg, const uint32_t len, const int tcp) {
+  if(len < dns_header_size || dns_read_u16(msg) != q->id) {
+    return -1;
+  }
+  const uint16_t flags = dns_read_u16(msg + 2);
+  const uint16_t qdcount = dns_read_u16(msg + 4);
+  const uint16_t ancount = dns_read_u16(msg + 6);
+  if(!(flags & dns_flag_qr) || qdcount != 1) {
+    return -1;
+  }
+  char name[dns_max_name + 1];
+  uint32_t off;
+  if(dns_read_name(msg, len, dns_header_size, name, &off) == -1 || off + 4 > len ||
+    strcmp(name, q->query->name) != 0 || dns_read_u16(msg + off) != q->type) {
+    return -1;
+  }
+  off += 4;
+  if((flags & dns_flag_tc) && !tcp) {
+    dns_question_close(resolver, q);
+    dns_question_tcp(resolver, q);
+    return -2;
+  }
+  switch(flags & 0xf) {
+    case dns_rcode_ok: break;
+    case dns_rcode_nxdomain: {
+      dns_question_finish(resolver, q, EAI_NONAME);
+      return 0;
+    }
+    default: {
+      dns_question_retry(resolver, q);
+      return -2;
+    }
+  }
+  /* Follow the chain of CNAMEs, which is in order */
+  char current[dns_max_name + 1];
+  (void) strcpy(current, name);
+  struct dns_query* const query = q->query;
+  for(uint16_t i = 0; i < ancount; ++i) {
+    if(dns_read_name(msg, len, off, name, &off) == -1 || off + 10 > len) {
+      break;
+    }
+    const uint16_t type = dns_read_u16(msg + off);
+    const uint16_t class = dns_read_u16(msg + off + 2);
+    const uint32_t ttl = dns_read_u32(msg + off + 4);
+    const uint16_t rdlen = dns_read_u16(msg + off + 8);
+    off += 10;
+    if(off + rdlen > len) {
+      break;
+    }
+    if(class == dns_class_in && strcmp(name, current) == 0) {
+      if(type == dns_type_cname) {
+        uint32_t unused;
+        if(dns_read_name(msg, len, off, current, &unused) == -1) {
+          break;
+        }
+      } else if(type == q->type && rdlen == (type == dns_type_a ? 4 : 16)) {
+        if(dns_query_add(query, type == dns_type_a ? net_family_ipv4 : net_family_ipv6, msg + off) == -1) {
+          break;
+        }
+        if(query->ttl == 0 || ttl < query->ttl) {
+          query->ttl = ttl;
+        }
+      }
+    }
+    off += rdlen;
+  }
+  dns_question_finish(resolver, q, 0);
+  return 0;
+}
+
+static struct dns_question* dns_resolver_find(const struct dns_resolver* const resolver, const void* const ptr) {
+  for(uint32_t i = 0; i < resolver->questions_used; ++i) {
+    if(resolver->questions[i] == ptr) {
+      return resolver->questions[i];
+    }
+  }
+  return NULL;
+}
+
+static void dns_resolver_receive(struct dns_resolver* const resolver, struct dns_question* const q) {
+  uint8_t msg[dns_udp_size];
+  while(1) {
+    ssize_t bytes;
+    safe_execute(bytes = recv(q->udp, msg, sizeof(msg), MSG_TRUNC), bytes == -1, errno);
+    if(bytes == -1) {
+      if(errno == EINTR) {
+        continue;
+      }
+      /* Refused by the server, no use waiting for it */
+      if(errno != EAGAIN) {
+        dns_question_retry(resolver, q);
+      }
+      return;
+    }
+    /* Anything else finished or retried the question */
+    if(bytes <= (ssize_t) sizeof(msg) && dns_question_answer(resolver, q, msg, bytes, 0) != -1) {
+      return;
+    }
+  }
+}
+
+static void dns_resolver_stream(struct dns_resolver* const resolver, struct dns_question* const q, const uint32_t events) {
+  if(events & EPOLLERR) {
+    dns_question_retry(resolver, q);
+    return;
+  }
+  if(q->sent < (uint32_t) q->len + 2) {
+    if(!(events & EPOLLOUT)) {
+      return;
+    }
+    ssize_t bytes;
+    safe_execute(bytes = send(q->tcp, q->msg + q->sent, q->len + 2 - q->sent, MSG_NOSIGNAL), bytes == -1, errno);
+    if(bytes == -1) {
+      if(errno != EAGAIN && errno != EINTR) {
+        dns_question_retry(resolver, q);
+      }
+      return;
+    }
+    q->sent += bytes;
+    if(q->sent == (uint32_t) q->len + 2) {
+      (void) epoll_ctl(resolver->core.core.fd, EPOLL_CTL_MOD, q->tcp, &((struct epoll_event) {
+        .events = EPOLLIN | EPOLLRDHUP,
+        .data.ptr = q
+      }));
+    }
+    return;
+  }
+  if(q->buf == NULL) {
+    q->buf = shnet_malloc(2 + 65535);
+    if(q->buf == NULL) {
+      dns_question_retry(resolver, q);
+      return;
+    }
+  }
+  while(1) {
+    const uint32_t need = q->buf_len < 2 ? 2 : (2 + dns_read_u16(q->buf));
+    if(q->buf_len == need && need > 2) {
+      if(dns_question_answer(resolver, q, q->buf + 2, need - 2, 1) == -1) {
+        dns_question_retry(resolver, q);
+      }
+      return;
+    }
+    ssize_t bytes;
+    safe_execute(bytes = recv(q->tcp, q->buf + q->buf_len, need - q->buf_len, 0), bytes == -1, errno);
+    if(bytes == -1 && (errno == EINTR)) {
+      continue;
+    }
+    if(bytes == -1 && errno == EAGAIN) {
+      return;
+    }
+    if(bytes <= 0) {
+      dns_question_retry(resolver, q);
+      return;
+    }
+    q->buf_len += bytes;
+  }
+}
+
+static void dns_resolver_expire(struct dns_resolver* const resolver) {
+  const uint64_t now = dns_now();
+  for(uint32_t i = resolver->questions_used; i != 0; --i) {
+    struct dns_question* const q = resolver->questions[i - 1];
+    if(q->deadline <= now) {
+      dns_question_retry(resolver, q);
+    }
+  }
+}
+
+static void dns_resolver_arm(const struct dns_resolver* const resolver) {
+  uint64_t deadline = UINT64_MAX;
+  for(uint32_t i = 0; i < resolver->questions_used; ++i) {
+    if(resolver->questions[i]->deadline < deadline) {
+      deadline = resolver->questions[i]->deadline;
+    }
+  }
+  struct itimerspec spec = {0};
+  if(deadline != UINT64_MAX) {
+    const uint64_t now = dns_now();
+    const uint64_t ms = deadline > now ? deadline - now : 1;
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+  }
+  (void) timerfd_settime(resolver->timer, 0, &spec, NULL);
+}
+
+static void dns_resolver_flush(struct dns_resolver* const resolver) {
+  struct dns_query* query = resolver->done;
+  resolver->done = NULL;
+  (void) pthread_mutex_unlock(&resolver->lock);
+  while(query != NULL) {
+    struct dns_query* const next = query->next;
+    dns_query_complete(query);
+    query = next;
+  }
+}
+
+static void dns_resolver_onevent(struct async_loop* loop, uint32_t events, struct async_callback* callback) {
+  (void) loop;
+  (void) events;
+  struct dns_resolver* const resolver = (struct dns_resolver*) callback;
+  struct epoll_event evs[dns_batch];
+  (void) pthread_mutex_lock(&resolver->lock);
+  while(1) {
+    const int count = epoll_wait(resolver->core.core.fd, evs, dns_batch, 0);
+    if(count <= 0) {
+      break;
+    }
+    for(int i = 0; i < count; ++i) {
+      void* const ptr = evs[i].data.ptr;
+      if(ptr == &resolver->wake) {
+        eventfd_t value;
+        (void) eventfd_read(resolver->wake, &value);
+      } else if(ptr == &resolver->timer) {
+        uint64_t value;
+        (void) read(resolver->timer, &value, sizeof(value));
+        dns_resolver_expire(resolver);
+      } else {
+        /* The question might have been finished by a preceding event */
+        struct dns_question* const q = dns_resolver_find(resolver, ptr);
+        if(q == NULL) {
+          continue;
+        }
+        if(q->tcp != -1) {
+          dns_resolver_stream(resolver, q, evs[i].events);
+        } else if(q->udp != -1) {
+          dns_resolver_receive(resolver, q);
+        }
+      }
+    }
+  }
+  dns_resolver_arm(resolver);
+  dns_resolver_flush(resolver);
+}
+
+
+
+static void dns_resolver_read_hosts(struct dns_resolver* const resolver, const char* const path) {
+  FILE* const file = fopen(path, "re");
+  if(file == NULL) {
+    return;
+  }
+  char* line = NULL;
+  size_t line_size = 0;
+  while(getline(&line, &line_size, file) != -1) {
+    char* const comment = strchr(line, '#');
+    if(comment != NULL) {
+      *comment = 0;
+    }
+    char* save;
+    const char* const ip = strtok_r(line, " \t\r\n", &save);
+    if(ip == NULL) {
+      continue;
+    }
+    struct sockaddr_in6 addr = {0};
+    if(inet_pton(AF_INET, ip, &((struct sockaddr_in*) &addr)->sin_addr) == 1) {
+      addr.sin6_family = AF_INET;
+    } else if(inet_pton(AF_INET6, ip, &addr.sin6_addr) == 1) {
+      addr.sin6_family = AF_INET6;
+    } else {
+      continue;
+    }
+    const char* name;
+    while((name = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+      void* const ptr = shnet_realloc(resolver->hosts, sizeof(*resolver->hosts) * (resolver->hosts_len + 1));
+      if(ptr == NULL) {
+        break;
+      }
+      resolver->hosts = ptr;
+      const size_t len = strlen(name) + 1;
+      char* const copy = shnet_malloc(len);
+      if(copy == NULL) {
+        break;
+      }
+      (void) memcpy(copy, name, len);
+      dns_lowercase(copy);
+      resolver->hosts[resolver->hosts_len++] = (struct dns_host) {
+        .name = copy,
+        .addr = addr
+      };
+    }
+  }
+  free(line);
+  (void) fclose(file);
+}
+
+static void dns_resolver_read_conf(struct dns_resolver* const resolver, const char* const path, const uint16_t port) {
+  FILE* const file = fopen(path, "re");
+  if(file == NULL) {
+    return;
+  }
+  char* line = NULL;
+  size_t line_size = 0;
+  while(getline(&line, &line_size, file) != -1) {
+    char* save;
+    const char* const key = strtok_r(line, " \t\r\n", &save);
+    if(key == NULL || key[0] == '#' || key[0] == ';') {
+      continue;
+    }
+    if(strcmp(key, "nameserver") == 0) {
+      const char* const ip = strtok_r(NULL, " \t\r\n", &save);
+      if(ip == NULL || resolver->servers_len == dns_max_servers) {
+        continue;
+      }
+      struct sockaddr_in6* const addr = resolver->servers + resolver->servers_len;
+      (void) memset(addr, 0, sizeof(*addr));
+      if(inet_pton(AF_INET, ip, &((struct sockaddr_in*) addr)->sin_addr) == 1) {
+        ((struct sockaddr_in*) addr)->sin_family = AF_INET;
+        ((struct sockaddr_in*) addr)->sin_port = htons(port);
+      } else if(inet_pton(AF_INET6, ip, &addr->sin6_addr) == 1) {
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port = htons(port);
+      } else {
+        continue;
+      }
+      ++resolver->servers_len;
+    } else if(strcmp(key, "options") == 0) {
+      const char* option;
+      while((option = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        if(strncmp(option, "timeout:", 8) == 0) {
+          resolver->timeout = atoi(option + 8) * 1000;
+        } else if(strncmp(option, "attempts:", 9) == 0) {
+          resolver->attempts = atoi(option + 9);
+        }
+      }
+    }
+  }
+  free(line);
+  (void) fclose(file);
+}
+
+static int dns_resolver_fd(struct dns_resolver* const resolver, int* const fd, const uint32_t events) {
+  return epoll_ctl(resolver->core.core.fd, EPOLL_CTL_ADD, *fd, &((struct epoll_event) {
+    .events = events,
+    .data.ptr = fd
+  }));
+}
+
+void dns_resolver_free(struct dns_resolver* const resolver) {
+  if(resolver->alloc_loop) {
+    async_loop_stop(resolver->loop);
+    async_loop_free(resolver->loop);
+    free(resolver->loop);
+    resolver->loop = NULL;
+    resolver->alloc_loop = 0;
+  } else if(resolver->loop != NULL) {
+    (void) async_loop_remove(resolver->loop, &resolver->core.core);
+  }
+  (void) pthread_mutex_lock(&resolver->lock);
+  while(resolver->questions_used != 0) {
+    dns_question_finish(resolver, resolver->questions[resolver->questions_used - 1], ECANCELED);
+  }
+  free(resolver->questions);
+  resolver->questions = NULL;
+  resolver->questions_size = 0;
+  dns_resolver_flush(resolver);
+  (void) pthread_mutex_destroy(&resolver->lock);
+  for(uint32_t i = 0; i < resolver->hosts_len; ++i) {
+    free(resolver->hosts[i].name);
+  }
+  free(resolver->hosts);
+  resolver->hosts = NULL;
+  resolver->hosts_len = 0;
+  resolver->servers_len = 0;
+  (void) close(resolver->wake);
+  (void) close(resolver->timer);
+  (void) close(resolver->core.core.fd);
+}
+
+int dns_resolver(struct dns_resolver* const resolver, const struct dns_resolver_options* const options) {
+  const struct dns_resolver_options opt = options == NULL ? (struct dns_resolver_options){0} : *options;
+  const uint16_t port = opt.port == 0 ? 53 : opt.port;
+  resolver->servers_len = 0;
+  resolver->timeout = dns_default_timeout;
+  resolver->attempts = dns_default_attempts;
+  dns_resolver_read_conf(resolver, opt.resolv_conf == NULL ? "/etc/resolv.conf" : opt.resolv_conf, port);
+  if(resolver->servers_len == 0) {
+    struct sockaddr_in* const addr = (struct sockaddr_in*) resolver->servers;
+    (void) memset(resolver->servers, 0, sizeof(*resolver->servers));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    resolver->servers_len = 1;
+  }
+  if(opt.timeout != 0) {
+    resolver->timeout = opt.timeout;
+  }
+  if(opt.attempts != 0) {
+    resolver->attempts = opt.attempts;
+  }
+  if(resolver->timeout == 0) {
+    resolver->timeout = dns_default_timeout;
+  }
+  if(resolver->attempts == 0) {
+    resolver->attempts = 1;
+  } else if(resolver->attempts > dns_max_attempts) {
+    resolver->attempts = dns_max_attempts;
+  }
+  {
+    int err;
+    safe_execute(err = pthread_mutex_init(&resolver->lock, NULL), err != 0, err);
+    if(err != 0) {
+      errno = err;
+      return -1;
+    }
+  }
+  resolver->core.core.callback = 1;
+  resolver->core.on_event = dns_resolver_onevent;
+  safe_execute(resolver->core.core.fd = epoll_create1(EPOLL_CLOEXEC), resolver->core.core.fd == -1, errno);
+  if(resolver->core.core.fd == -1) {
+    goto err_mutex;
+  }
+  safe_execute(resolver->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), resolver->timer == -1, errno);
+  if(resolver->timer == -1) {
+    goto err_epoll;
+  }
+  safe_execute(resolver->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), resolver->wake == -1, errno);
+  if(resolver->wake == -1) {
+    goto err_timer;
+  }
+  if(dns_resolver_fd(resolver, &resolver->timer, EPOLLIN) == -1 || dns_resolver_fd(resolver, &resolver->wake, EPOLLIN) == -1) {
+    goto err_wake;
+  }
+  dns_resolver_read_hosts(resolver, opt.hosts == NULL ? "/etc/hosts" : opt.hosts);
+  if(resolver->loop == NULL) {
+    resolver->loop = shnet_calloc(1, sizeof(*resolver->loop));
+    if(resolver->loop == NULL) {
+      goto err_hosts;
+    }
+    if(async_loop(resolver->loop) == -1) {
+      free(resolver->loop);
+      resolver->loop = NULL;
+      goto err_hosts;
+    }
+    if(async_loop_start(resolver->loop) == -1) {
+      async_loop_free(resolver->loop);
+      free(resolver->loop);
+      resolver->loop = NULL;
+      goto err_hosts;
+    }
+    resolver->alloc_loop = 1;
+  }
+  if(async_loop_add(resolver->loop, &resolver->core.core, EPOLLIN) == -1) {
+    goto err_loop;
+  }
+  return 0;
+
+  err_loop:
+  if(resolver->alloc_loop) {
+    async_loop_stop(resolver->loop);
+    async_loop_free(resolver->loop);
+    free(resolver->loop);
+    resolver->loop = NULL;
+    resolver->alloc_loop = 0;
+  }
+  err_hosts:
+  for(uint32_t i = 0; i < resolver->hosts_len; ++i) {
+    free(resolver->hosts[i].name);
+  }
+  free(resolver->hosts);
+  resolver->hosts = NULL;
+  resolver->hosts_len = 0;
+  err_wake:
+  (void) close(resolver->wake);
+  err_timer:
+  (void) close(resolver->timer);
+  err_epoll:
+  (void) close(resolver->core.core.fd);
+  err_mutex:
+  (void) pthread_mutex_destroy(&resolver->lock);
+  return -1;
+}
+
+static int dns_resolve_port(const char* const port, uint16_t* const out) {
+  if(port == NULL) {
+    *out = 0;
+    return 0;
+  }
+  uint32_t value = 0;
+  const char* ptr = port;
+  do {
+    if(*ptr < '0' || *ptr > '9') {
+      return -1;
+    }
+    value = value * 10 + (*ptr - '0');
+    if(value > 65535) {
+      return -1;
+    }
+  } while(*++ptr);
+  *out = value;
+  return 0;
+}
+
+static int dns_resolve_local(const struct dns_resolver* const resolver, struct dns_query* const query, const int family, const int flags) {
+  uint8_t ip[16];
+  if(inet_pton(AF_INET, query->name, ip) == 1) {
+    if(family != net_family_ipv6) {
+      return dns_query_add(query, net_family_ipv4, ip) == -1 ? -1 : 1;
+    }
+    query->code = EAI_ADDRFAMILY;
+    return 1;
+  }
+  if(inet_pton(AF_INET6, query->name, ip) == 1) {
+    if(family != net_family_ipv4) {
+      return dns_query_add(query, net_family_ipv6, ip) == -1 ? -1 : 1;
+    }
+    query->code = EAI_ADDRFAMILY;
+    return 1;
+  }
+  if(flags & net_flag_numeric_hostname) {
+    query->code = EAI_NONAME;
+    return 1;
+  }
+  int found = 0;
+  for(uint32_t i = 0; i < resolver->hosts_len; ++i) {
+    const struct dns_host* const host = resolver->hosts + i;
+    if((family == net_family_any || family == host->addr.sin6_family) && strcmp(host->name, query->name) == 0) {
+      const void* const addr = host->addr.sin6_family == AF_INET ? (const void*) &((const struct sockaddr_in*) &host->addr)->sin_addr : (const void*) &host->addr.sin6_addr;
+      if(dns_query_add(query, host->addr.sin6_family, addr) == -1) {
+        return -1;
+      }
+      found = 1;
+    }
+  }
+  return found;
+}
+
+static int dns_resolve_id(const struct dns_resolver* const resolver, uint16_t* const id) {
+  while(1) {
+    if(getrandom(id, sizeof(*id), 0) != sizeof(*id)) {
+      return -1;
+    }
+    uint32_t i = 0;
+    for(; i < resolver->questions_used; ++i) {
+      if(resolver->questions[i]->id == *id) {
+        break;
+      }
+    }
+    if(i == resolver->questions_used) {
+      return 0;
+    }
+  }
+}
+
+int dns_resolve(struct dns_resolver* const resolver, struct net_async_address* const addr) {
+  const int family = addr->hints == NULL ? net_family_any : addr->hints->ai_family;
+  const int flags = addr->hints == NULL ? 0 : addr->hints->ai_flags;
+  uint16_t port;
+  if(addr->hostname == NULL || (family != net_family_any && family != net_family_ipv4 && family != net_family_ipv6) ||
+    (flags & (net_flag_wants_canonical_name | net_flag_wants_all_addresses | net_flag_wants_mapped_ipv4)) ||
+    dns_resolve_port(addr->port, &port) == -1) {
+    /* Not supported, leave it up to getaddrinfo() */
+    return net_get_address_async(addr);
+  }
+  size_t name_len = strlen(addr->hostname);
+  if(name_len != 0 && addr->hostname[name_len - 1] == '.') {
+    --name_len;
+  }
+  if(name_len == 0 || name_len > dns_max_name) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct dns_query* const query = shnet_calloc(1, sizeof(*query));
+  if(query == NULL) {
+    return -1;
+  }
+  query->addr = addr;
+  query->port = port;
+  query->socktype = addr->hints == NULL ? 0 : addr->hints->ai_socktype;
+  query->protocol = addr->hints == NULL ? 0 : addr->hints->ai_protocol;
+  (void) memcpy(query->name, addr->hostname, name_len);
+  dns_lowercase(query->name);
+  struct dns_question* questions[2] = {0};
+  (void) pthread_mutex_lock(&resolver->lock);
+  const int local = dns_resolve_local(resolver, query, family, flags);
+  if(local == -1) {
+    goto err;
+  }
+  if(local == 1) {
+    dns_query_push(resolver, query);
+    (void) pthread_mutex_unlock(&resolver->lock);
+    return 0;
+  }
+  const uint8_t count = family == net_family_any ? 2 : 1;
+  if(resolver->questions_used + count > resolver->questions_size) {
+    const uint32_t size = (resolver->questions_size == 0 ? 8 : resolver->questions_size << 1) + count;
+    void* const ptr = shnet_realloc(resolver->questions, sizeof(*resolver->questions) * size);
+    if(ptr == NULL) {
+      goto err;
+    }
+    resolver->questions = ptr;
+    resolver->questions_size = size;
+  }
+  for(uint8_t i = 0; i < count; ++i) {
+    questions[i] = shnet_calloc(1, sizeof(*questions[i]));
+    if(questions[i] == NULL) {
+      goto err;
+    }
+    questions[i]->query = query;
+    questions[i]->udp = -1;
+    questions[i]->tcp = -1;
+    questions[i]->type = (family == net_family_ipv4 || i == 1) ? dns_type_a : dns_type_aaaa;
+    if(dns_resolve_id(resolver, &questions[i]->id) == -1) {
+      goto err;
+    }
+    if(dns_build_query(questions[i]) == -1) {
+      errno = EINVAL;
+      goto err;
+    }
+  }
+  query->pending = count;
+  for(uint8_t i = 0; i < count; ++i) {
+    resolver->questions[resolver->questions_used++] = questions[i];
+    dns_question_send(resolver, questions[i]);
+  }
+  dns_resolver_arm(resolver);
+  (void) pthread_mutex_unlock(&resolver->lock);
+  return 0;
+
+  err:
+  (void) pthread_mutex_unlock(&resolver->lock);
+  free(questions[0]);
+  free(questions[1]);
+  net_free_address(query->heads[0]);
+  net_free_address(query->heads[1]);
+  free(query);
+  return -1;
+}
@@ -1,4 +1,7 @@
+#include <time.h>
 #include <errno.h>
+#include <stddef.h>
+#include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <endian.h>
@@ -6,7 +9,9 @@
 #include <arpa/inet.h>
 #include <linux/in.h>
 #include <linux/ip.h>
+#include <linux/filter.h>
 
+#include <shnet/dns.h>
 #include <shnet/net.h>
 #include <shnet/error.h>
 #include <shnet/threads.h>
@@ -36,6 +41,7 @@ struct addrinfo* net_get_address(const char* const hostname, const char* const p
 #define addr ((struct net_async_address*) net_get_address_thread_data)
 
 static void* net_get_address_thread(void* net_get_address_thread_data) {
+  addr->ttl = 0;
   addr->callback(addr, net_get_address(addr->hostname, addr->port, addr->hints));
   (void) pthread_detach(pthread_self());
   return NULL;
@@ -51,6 +57,377 @@ void net_free_address(struct addrinfo* const info) {
   freeaddrinfo(info);
 }
 
+struct addrinfo* net_copy_address(const struct addrinfo* info) {
+  struct addrinfo* head = NULL;
+  struct addrinfo** tail = &head;
+  for(; info != NULL; info = info->ai_next) {
+    /* The same layout glibc uses, so that freeaddrinfo() works on copies */
+    struct addrinfo* const copy = shnet_malloc(sizeof(*copy) + info->ai_addrlen);
+    if(copy == NULL) {
+      goto err;
+    }
+    *copy = *info;
+    copy->ai_addr = (struct sockaddr*)(copy + 1);
+    copy->ai_canonname = NULL;
+    copy->ai_next = NULL;
+    (void) memcpy(copy->ai_addr, info->ai_addr, info->ai_addrlen);
+    *tail = copy;
+    tail = &copy->ai_next;
+    if(info->ai_canonname != NULL) {
+      const size_t len = strlen(info->ai_canonname) + 1;
+      copy->ai_canonname = shnet_malloc(len);
+      if(copy->ai_canonname == NULL) {
+        goto err;
+      }
+      (void) memcpy(copy->ai_canonname, info->ai_canonname, len);
+    }
+  }
+  return head;
+
+  err:
+  if(head != NULL) {
+    net_free_address(head);
+  }
+  return NULL;
+}
+
+struct addrinfo* net_get_unix_address(const char* const path, const int socktype) {
+  const size_t len = strlen(path);
+  struct sockaddr_un addr;
+  if(len == 0 || len >= sizeof(addr.sun_path)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  struct addrinfo* const info = shnet_calloc(1, sizeof(*info) + sizeof(addr));
+  if(info == NULL) {
+    return NULL;
+  }
+  struct sockaddr_un* const un = (struct sockaddr_un*)(info + 1);
+  un->sun_family = net_family_unix;
+  (void) memcpy(un->sun_path, path, len);
+  /* "@name" is "name" in the abstract namespace, which needs no file */
+  if(path[0] == '@') {
+    un->sun_path[0] = 0;
+  }
+  info->ai_family = net_family_unix;
+  info->ai_socktype = socktype;
+  info->ai_addr = (struct sockaddr*) un;
+  info->ai_addrlen = path[0] == '@' ? offsetof(struct sockaddr_un, sun_path) + len : sizeof(*un);
+  return info;
+}
+
+
+struct net_dns_cache_waiter {
+  struct net_async_address* addr;
+  struct addrinfo* info;
+  int err;
+};
+
+struct net_dns_cache_entry {
+  struct net_async_address async;
+  struct addrinfo hints;
+  struct net_dns_cache* cache;
+
+  struct addrinfo* info;
+  uint64_t expires;
+
+  struct net_dns_cache_waiter* waiters;
+  uint32_t waiters_used;
+  uint32_t waiters_size;
+
+  uint8_t pending:1;
+};
+
+static uint64_t net_dns_cache_now(void) {
+  struct timespec tp;
+  (void) clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t) tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+int net_dns_cache(struct net_dns_cache* const cache) {
+  if(cache->size == 0) {
+    cache->size = 256;
+  }
+  if(cache->default_ttl == 0) {
+    cache->default_ttl = 60;
+  }
+  if(cache->stale_ttl == 0) {
+    cache->stale_ttl = 30;
+  }
+  cache->entries = shnet_calloc(cache->size, sizeof(*cache->entries));
+  if(cache->entries == NULL) {
+    return -1;
+  }
+  int err;
+  safe_execute(err = pthread_mutex_init(&cache->lock, NULL), err != 0, err);
+  if(err != 0) {
+    goto err_entries;
+  }
+  safe_execute(err = pthread_cond_init(&cache->idle, NULL), err != 0, err);
+  if(err != 0) {
+    goto err_mutex;
+  }
+  cache->used = 0;
+  cache->pending = 0;
+  cache->hits = 0;
+  cache->stale_hits = 0;
+  cache->misses = 0;
+  cache->lookups = 0;
+  return 0;
+
+  err_mutex:
+  (void) pthread_mutex_destroy(&cache->lock);
+  err_entries:
+  free(cache->entries);
+  cache->entries = NULL;
+  errno = err;
+  return -1;
+}
+
+static void net_dns_cache_entry_free(struct net_dns_cache_entry* const entry) {
+  if(entry->info != NULL) {
+    net_free_address(entry->info);
+  }
+  free(entry->waiters);
+  free(entry);
+}
+
+void net_dns_cache_free(struct net_dns_cache* const cache) {
+  (void) pthread_mutex_lock(&cache->lock);
+  while(cache->pending != 0) {
+    (void) pthread_cond_wait(&cache->idle, &cache->lock);
+  }
+  (void) pthread_mutex_unlock(&cache->lock);
+  for(uint32_t i = 0; i < cache->used; ++i) {
+    net_dns_cache_entry_free(cache->entries[i]);
+  }
+  free(cache->entries);
+  cache->entries = NULL;
+  cache->used = 0;
+  (void) pthread_cond_destroy(&cache->idle);
+  (void) pthread_mutex_destroy(&cache->lock);
+}
+
+void net_dns_cache_get_stats(struct net_dns_cache* const cache, struct net_dns_cache_stats* const stats) {
+  (void) pthread_mutex_lock(&cache->lock);
+  *stats = (struct net_dns_cache_stats) {
+    .hits = cache->hits,
+    .stale_hits = cache->stale_hits,
+    .misses = cache->misses,
+    .lookups = cache->lookups,
+    .entries = cache->used
+  };
+  (void) pthread_mutex_unlock(&cache->lock);
+}
+
+static int net_dns_cache_lookup(struct net_dns_cache_entry* const entry) {
+  struct net_dns_cache* const cache = entry->cache;
+  entry->pending = 1;
+  ++cache->pending;
+  ++cache->lookups;
+  /* Completion locks the cache, so it can't run before this returns */
+  if((cache->resolver == NULL ? net_get_address_async(&entry->async) : dns_resolve(cache->resolver, &entry->async)) == -1) {
+    entry->pending = 0;
+    --cache->pending;
+    return -1;
+  }
+  return 0;
+}
+
+static int net_dns_cache_matches(const struct net_dns_cache_entry* const entry, const struct net_async_address* const addr) {
+  if(strcmp(entry->async.hostname, addr->hostname) != 0) {
+    return 0;
+  }
+  if(entry->async.port == NULL || addr->port == NULL) {
+    if(entry->async.port != addr->port) {
+      return 0;
+    }
+  } else if(strcmp(entry->async.port, addr->port) != 0) {
+    return 0;
+  }
+  if(entry->async.hints == NULL || addr->hints == NULL) {
+    return entry->async.hints == addr->hints;
+  }
+  return entry->hints.ai_family == addr->hints->ai_family && entry->hints.ai_socktype == addr->hints->ai_socktype &&
+    entry->hints.ai_protocol == addr->hints->ai_protocol && entry->hints.ai_flags == addr->hints->ai_flags;
+}
+
+static void net_dns_cache_remove(struct net_dns_cache* const cache, const struct net_dns_cache_entry* const entry) {
+  for(uint32_t i = 0; i < cache->used; ++i) {
+    if(cache->entries[i] == entry) {
+      cache->entries[i] = cache->entries[--cache->used];
+      break;
+    }
+  }
+}
+
+static void net_dns_cache_done(struct net_async_address* async, struct addrinfo* info) {
+  const int err = errno;
+  struct net_dns_cache_entry* const entry = async->data;
+  struct net_dns_cache* const cache = entry->cache;
+  (void) pthread_mutex_lock(&cache->lock);
+  entry->pending = 0;
+  uint32_t ttl = 0;
+  if(info != NULL) {
+    if(entry->info != NULL) {
+      net_free_address(entry->info);
+    }
+    entry->info = info;
+    ttl = async->ttl == 0 ? cache->default_ttl : async->ttl;
+    entry->expires = net_dns_cache_now() + (uint64_t) ttl * 1000;
+  }
+  struct net_dns_cache_waiter* const waiters = entry->waiters;
+  const uint32_t waiters_used = entry->waiters_used;
+  entry->waiters = NULL;
+  entry->waiters_used = 0;
+  entry->waiters_size = 0;
+  for(uint32_t i = 0; i < waiters_used; ++i) {
+    waiters[i].addr->ttl = ttl;
+    if(info == NULL) {
+      waiters[i].err = err;
+    } else {
+      waiters[i].info = net_copy_address(info);
+      waiters[i].err = waiters[i].info == NULL ? errno : 0;
+    }
+  }
+  if(entry->info == NULL) {
+    /* Failed and nothing stale to fall back to, don't cache the failure */
+    net_dns_cache_remove(cache, entry);
+    net_dns_cache_entry_free(entry);
+  }
+  if(--cache->pending == 0) {
+    (void) pthread_cond_broadcast(&cache->idle);
+  }
+  (void) pthread_mutex_unlock(&cache->lock);
+  for(uint32_t i = 0; i < waiters_used; ++i) {
+    errno = waiters[i].err;
+    waiters[i].addr->callback(waiters[i].addr, waiters[i].info);
+  }
+  free(waiters);
+}
+
+static struct net_dns_cache_entry* net_dns_cache_insert(struct net_dns_cache* const cache, const struct net_async_address* const addr) {
+  if(cache->used == cache->size) {
+    /* Evict whatever expires first and isn't being looked up */
+    struct net_dns_cache_entry* victim = NULL;
+    for(uint32_t i = 0; i < cache->used; ++i) {
+      if(!cache->entries[i]->pending && (victim == NULL || cache->entries[i]->expires < victim->expires)) {
+        victim = cache->entries[i];
+      }
+    }
+    if(victim == NULL) {
+      errno = ENOSPC;
+      return NULL;
+    }
+    net_dns_cache_remove(cache, victim);
+    net_dns_cache_entry_free(victim);
+  }
+  const size_t hostname_len = strlen(addr->hostname) + 1;
+  const size_t port_len = addr->port == NULL ? 0 : (strlen(addr->port) + 1);
+  struct net_dns_cache_entry* const entry = shnet_calloc(1, sizeof(*entry) + hostname_len + port_len);
+  if(entry == NULL) {
+    return NULL;
+  }
+  entry->cache = cache;
+  entry->async.hostname = (char*)(entry + 1);
+  (void) memcpy(entry->async.hostname, addr->hostname, hostname_len);
+  if(addr->port != NULL) {
+    entry->async.port = entry->async.hostname + hostname_len;
+    (void) memcpy(entry->async.port, addr->port, port_len);
+  }
+  if(addr->hints != NULL) {
+    entry->hints = net_get_addr_struct(addr->hints->ai_family, addr->hints->ai_socktype, addr->hints->ai_protocol, addr->hints->ai_flags);
+    entry->async.hints = &entry->hints;
+  }
+  entry->async.data = entry;
+  entry->async.callback = net_dns_cache_done;
+  cache->entries[cache->used++] = entry;
+  return entry;
+}
+
+static int net_dns_cache_resolve(struct net_dns_cache* const cache, struct net_async_address* const addr) {
+  return cache->resolver == NULL ? net_get_address_async(addr) : dns_resolve(cache->resolver, addr);
+}
+
+int net_dns_cache_get_async(struct net_dns_cache* const cache, struct net_async_address* const addr) {
+  if(addr->hostname == NULL) {
+    return net_dns_cache_resolve(cache, addr);
+  }
+  const uint64_t now = net_dns_cache_now();
+  (void) pthread_mutex_lock(&cache->lock);
+  struct net_dns_cache_entry* entry = NULL;
+  for(uint32_t i = 0; i < cache->used; ++i) {
+    if(net_dns_cache_matches(cache->entries[i], addr)) {
+      entry = cache->entries[i];
+      break;
+    }
+  }
+  if(entry != NULL && entry->info != NULL) {
+    if(now < entry->expires + (uint64_t) cache->stale_ttl * 1000) {
+      ++cache->hits;
+      if(now >= entry->expires) {
+        /* Serve the old result, but have a fresh one ready for the next call */
+        ++cache->stale_hits;
+        addr->ttl = 0;
+        if(!entry->pending) {
+          (void) net_dns_cache_lookup(entry);
+        }
+      } else {
+        addr->ttl = (entry->expires - now + 999) / 1000;
+      }
+      struct addrinfo* const info = net_copy_address(entry->info);
+      (void) pthread_mutex_unlock(&cache->lock);
+      if(info == NULL) {
+        return -1;
+      }
+      addr->callback(addr, info);
+      return 0;
+    }
+    net_free_address(entry->info);
+    entry->info = NULL;
+  }
+  ++cache->misses;
+  if(entry == NULL) {
+    entry = net_dns_cache_insert(cache, addr);
+    if(entry == NULL) {
+      if(errno != ENOSPC) {
+        goto err;
+      }
+      /* Every entry is being looked up, so this one can't be cached */
+      ++cache->lookups;
+      (void) pthread_mutex_unlock(&cache->lock);
+      return net_dns_cache_resolve(cache, addr);
+    }
+  }
+  if(entry->waiters_used == entry->waiters_size) {
+    const uint32_t size = entry->waiters_size == 0 ? 4 : entry->waiters_size << 1;
+    void* const ptr = shnet_realloc(entry->waiters, sizeof(*entry->waiters) * size);
+    if(ptr == NULL) {
+      goto err_entry;
+    }
+    entry->waiters = ptr;
+    entry->waiters_size = size;
+  }
+  entry->waiters[entry->waiters_used++] = (struct net_dns_cache_waiter) {
+    .addr = addr
+  };
+  if(!entry->pending && net_dns_cache_lookup(entry) == -1) {
+    --entry->waiters_used;
+    goto err_entry;
+  }
+  (void) pthread_mutex_unlock(&cache->lock);
+  return 0;
+
+  err_entry:
+  if(!entry->pending) {
+    net_dns_cache_remove(cache, entry);
+    net_dns_cache_entry_free(entry);
+  }
+  err:
+  (void) pthread_mutex_unlock(&cache->lock);
+  return -1;
+}
+
 
 
 void net_address_to_string(const void* const addr, char* const buffer) {
@@ -83,6 +460,14 @@ void* net_address_to_ip(const void* const addr) {
 
 
 
+static socklen_t net_address_size(const struct addrinfo* const info) {
+  switch(info->ai_family) {
+    case net_family_ipv4: return net_const_ipv4_size;
+    case net_family_ipv6: return net_const_ipv6_size;
+    default: return info->ai_addrlen;
+  }
+}
+
 int net_socket_get(const struct addrinfo* const info) {
   int err;
   safe_execute(err = socket(info->ai_family, info->ai_socktype, info->ai_protocol), err == -1, errno);
@@ -91,13 +476,13 @@ int net_socket_get(const struct addrinfo* const info) {
 
 int net_socket_bind(const int sfd, const struct addrinfo* const info) {
   int err;
-  safe_execute(err = bind(sfd, info->ai_addr, info->ai_family == net_family_ipv4 ? net_const_ipv4_size : net_const_ipv6_size), err == -1, errno);
+  safe_execute(err = bind(sfd, info->ai_addr, net_address_size(info)), err == -1, errno);
   return err;
 }
 
 int net_socket_connect(const int sfd, const struct addrinfo* const info) {
   int err;
-  safe_execute(err = connect(sfd, info->ai_addr, info->ai_family == net_family_ipv4 ? net_const_ipv4_size : net_const_ipv6_size), err == -1, errno);
+  safe_execute(err = connect(sfd, info->ai_addr, net_address_size(info)), err == -1, errno);
   return err;
 }
 
@@ -164,3 +549,35 @@ void net_socket_default_options(const int sfd) {
   net_socket_reuse_port(sfd);
   net_socket_dont_block(sfd);
 }
+
+int net_socket_get_incoming_cpu(const int sfd) {
+  int ret;
+  if(getsockopt(sfd, SOL_SOCKET, SO_INCOMING_CPU, &ret, &(socklen_t){sizeof(int)}) == -1) {
+    return -1;
+  }
+  return ret;
+}
+
+int net_socket_steer_by_cpu(const int sfd, const uint32_t groups) {
+  if(groups == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  /*
+   * The program runs on the CPU that received the SYN and returns the index
+   * of the listener, in the order they joined the SO_REUSEPORT group, that
+   * should get the connection. It applies to the whole group.
+   */
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU),
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, groups),
+    BPF_STMT(BPF_RET | BPF_A, 0)
+  };
+  const struct sock_fprog prog = {
+    .len = sizeof(code) / sizeof(code[0]),
+    .filter = code
+  };
+  int err;
+  safe_execute(err = setsockopt(sfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)), err == -1, errno);
+  return err;
+}
@@ -0,0 +1,838 @@
+#include <errno.h>
+#include <assert.h>
+#include <endian.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <shnet/rudp.h>
+#include <shnet/time.h>
+#include <shnet/error.h>
+
+/*
+ * Every packet carries the sender's packet sequence number, the newest one it
+ * received from the other side, and a bitfield of which of the 32 before that
+ * it received too. Messages ride in packets. Reliable ones are kept until a
+ * packet they were in is acknowledged, and sent again in a later packet if
+ * that takes longer than the retransmission timeout, which is derived from
+ * round-trip times like TCP does (RFC 6298). Packets themselves are never
+ * retransmitted.
+ *
+ * Messages are not sent right away. Once per tick, everything queued for a
+ * peer is packed into as few packets as possible, and the packets of all peers
+ * go out in batches of sendmmsg(). Everything runs on the host's loop.
+ *
+ * Layout, in network byte order:
+ *   packet:  flags (1), sequence (2), ack (2), ack bits (4), messages...
+ *   message: channel (1), sequence (2), length (2), payload
+ */
+
+enum rudp_const {
+  rudp_header = 9,
+  rudp_message_header = 5,
+  rudp_batch = 32,
+  rudp_window = 32,
+  rudp_times = 64,
+  rudp_rto_initial = 200,
+  rudp_rto_min = 20,
+  rudp_rto_max = 2000,
+  rudp_backoff_max = 5,
+  rudp_mtu_default = 1200,
+  rudp_tick_default = 10,
+  rudp_timeout_default = 5000,
+  rudp_ping_default = 250,
+  rudp_buckets_min = 16
+};
+
+enum rudp_flag {
+  rudp_flag_connect = 1,
+  rudp_flag_disconnect = 2,
+  rudp_flag_ack = 4
+};
+
+struct rudp_message {
+  struct rudp_message* next;
+  uint64_t sent_at;
+  uint16_t seq;
+  uint16_t packet;
+  uint16_t len;
+  uint8_t channel;
+  uint8_t retries:7;
+  uint8_t sent:1;
+  char data[];
+};
+
+struct rudp_held {
+  uint32_t len;
+  char data[];
+};
+
+struct rudp_channel_state {
+  struct rudp_message* head;
+  struct rudp_message* tail;
+  struct rudp_held* held[rudp_window];
+  uint16_t send_seq;
+  uint16_t recv_seq;
+  uint8_t received:1;
+};
+
+struct rudp_peer {
+  struct rudp_peer* next;
+  struct rudp_host* host;
+  void* data;
+  union {
+    struct sockaddr addr;
+    struct sockaddr_in addr4;
+    struct sockaddr_in6 addr6;
+  };
+  
+  struct rudp_channel_state* channels;
+  struct rudp_message* queue;
+  struct rudp_message* queue_tail;
+  
+  uint64_t last_recv;
+  uint64_t last_send;
+  uint64_t times[rudp_times];
+  uint32_t time_seqs[rudp_times];
+  
+  uint64_t packets_sent;
+  uint64_t packets_received;
+  uint64_t retransmits;
+  uint32_t unacked;
+  uint32_t srtt;
+  uint32_t rttvar;
+  uint32_t rto;
+  uint32_t recv_bits;
+  uint16_t send_seq;
+  uint16_t recv_seq;
+  
+  uint8_t connected:1;
+  uint8_t received:1;
+  uint8_t ack_pending:1;
+  uint8_t disconnecting:1;
+  uint8_t measured:1;
+};
+
+struct rudp_state {
+  struct rudp_peer** buckets;
+  uint32_t buckets_len;
+  uint32_t peers_len;
+  uint32_t out_len;
+  struct udp_datagram out[rudp_batch];
+  char bufs[];
+};
+
+struct rudp_packet {
+  char* buf;
+  uint32_t len;
+  uint16_t seq;
+};
+
+static uint64_t rudp_time(void) {
+  return time_ns_to_ms(time_get_time());
+}
+
+static void rudp_put16(char* const buf, const uint16_t num) {
+  const uint16_t be = htobe16(num);
+  (void) memcpy(buf, &be, sizeof(be));
+}
+
+static void rudp_put32(char* const buf, const uint32_t num) {
+  const uint32_t be = htobe32(num);
+  (void) memcpy(buf, &be, sizeof(be));
+}
+
+static uint16_t rudp_get16(const char* const buf) {
+  uint16_t be;
+  (void) memcpy(&be, buf, sizeof(be));
+  return be16toh(be);
+}
+
+static uint32_t rudp_get32(const char* const buf) {
+  uint32_t be;
+  (void) memcpy(&be, buf, sizeof(be));
+  return be32toh(be);
+}
+
+/* Peers, hashed by their address */
+
+static uint32_t rudp_hash(const struct sockaddr* const addr) {
+  const unsigned char* bytes;
+  uint32_t len;
+  uint32_t hash = 2166136261u;
+  if(addr->sa_family == AF_INET) {
+    const struct sockaddr_in* const in = (const struct sockaddr_in*) addr;
+    hash = (hash ^ in->sin_port) * 16777619u;
+    bytes = (const unsigned char*) &in->sin_addr;
+    len = sizeof(in->sin_addr);
+  } else {
+    const struct sockaddr_in6* const in6 = (const struct sockaddr_in6*) addr;
+    hash = (hash ^ in6->sin6_port) * 16777619u;
+    bytes = (const unsigned char*) &in6->sin6_addr;
+    len = sizeof(in6->sin6_addr);
+  }
+  for(uint32_t i = 0; i < len; ++i) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static int rudp_address_equal(const struct sockaddr* const a, const struct sockaddr* const b) {
+  if(a->sa_family != b->sa_family) {
+    return 0;
+  }
+  if(a->sa_family == AF_INET) {
+    const struct sockaddr_in* const x = (const struct sockaddr_in*) a;
+    const struct sockaddr_in* const y = (const struct sockaddr_in*) b;
+    return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+  }
+  const struct sockaddr_in6* const x = (const struct sockaddr_in6*) a;
+  const struct sockaddr_in6* const y = (const struct sockaddr_in6*) b;
+  return x->sin6_port == y->sin6_port && !memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr));
+}
+
+static struct rudp_peer* rudp_peer_find(const struct rudp_host* const host, const struct sockaddr* const addr) {
+  struct rudp_state* const state = host->state;
+  struct rudp_peer* peer = state->buckets[rudp_hash(addr) & (state->buckets_len - 1)];
+  while(peer != NULL && !rudp_address_equal(&peer->addr, addr)) {
+    peer = peer->next;
+  }
+  return peer;
+}
+
+static int rudp_buckets_grow(struct rudp_state* const state) {
+  const uint32_t len = state->buckets_len << 1;
+  struct rudp_peer** const buckets = shnet_calloc(len, sizeof(*buckets));
+  if(buckets == NULL) {
+    return -1;
+  }
+  for(uint32_t i = 0; i < state->buckets_len; ++i) {
+    struct rudp_peer* peer = state->buckets[i];
+    while(peer != NULL) {
+      struct rudp_peer* const next = peer->next;
+      struct rudp_peer** const bucket = buckets + (rudp_hash(&peer->addr) & (len - 1));
+      peer->next = *bucket;
+      *bucket = peer;
+      peer = next;
+    }
+  }
+  free(state->buckets);
+  state->buckets = buckets;
+  state->buckets_len = len;
+  return 0;
+}
+
+static struct rudp_peer* rudp_peer_new(struct rudp_host* const host, const struct sockaddr* const addr) {
+  struct rudp_state* const state = host->state;
+  if(state->peers_len >= state->buckets_len && rudp_buckets_grow(state) == -1) {
+    return NULL;
+  }
+  struct rudp_peer* const peer = shnet_calloc(1, sizeof(*peer));
+  if(peer == NULL) {
+    return NULL;
+  }
+  peer->channels = shnet_calloc(host->channels_len, sizeof(*peer->channels));
+  if(peer->channels == NULL) {
+    free(peer);
+    return NULL;
+  }
+  peer->host = host;
+  if(addr->sa_family == AF_INET) {
+    peer->addr4 = *(const struct sockaddr_in*) addr;
+  } else {
+    peer->addr6 = *(const struct sockaddr_in6*) addr;
+  }
+  peer->last_recv = rudp_time();
+  peer->rto = rudp_rto_initial;
+  for(uint32_t i = 0; i < rudp_times; ++i) {
+    peer->time_seqs[i] = UINT32_MAX;
+  }
+  struct rudp_peer** const bucket = state->buckets + (rudp_hash(addr) & (state->buckets_len - 1));
+  peer->next = *bucket;
+  *bucket = peer;
+  ++state->peers_len;
+  return peer;
+}
+
+static void rudp_messages_free(struct rudp_message* message) {
+  while(message != NULL) {
+    struct rudp_message* const next = message->next;
+    free(message);
+    message = next;
+  }
+}
+
+static void rudp_peer_free(struct rudp_host* const host, struct rudp_peer* const peer) {
+  struct rudp_state* const state = host->state;
+  struct rudp_peer** link = state->buckets + (rudp_hash(&peer->addr) & (state->buckets_len - 1));
+  while(*link != peer) {
+    link = &(*link)->next;
+  }
+  *link = peer->next;
+  --state->peers_len;
+  if(host->on_event != NULL) {
+    host->on_event(host, peer, rudp_close);
+  }
+  for(uint32_t i = 0; i < host->channels_len; ++i) {
+    struct rudp_channel_state* const channel = peer->channels + i;
+    rudp_messages_free(channel->head);
+    for(uint32_t j = 0; j < rudp_window; ++j) {
+      free(channel->held[j]);
+    }
+  }
+  rudp_messages_free(peer->queue);
+  free(peer->channels);
+  free(peer);
+}
+
+/* Sending */
+
+static void rudp_out_send(struct rudp_host* const host) {
+  struct rudp_state* const state = host->state;
+  if(state->out_len != 0) {
+    /* Whatever the kernel has no room for is as good as lost */
+    (void) udp_send(&host->udp, state->out, state->out_len);
+    state->out_len = 0;
+  }
+}
+
+static uint32_t rudp_random(struct rudp_host* const host) {
+  uint32_t x = host->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  host->rng = x;
+  return x;
+}
+
+static void rudp_packet_begin(struct rudp_host* const host, struct rudp_peer* const peer, struct rudp_packet* const packet) {
+  struct rudp_state* const state = host->state;
+  packet->buf = state->bufs + (uint64_t) state->out_len * host->mtu;
+  packet->len = rudp_header;
+  packet->seq = peer->send_seq++;
+}
+
+static void rudp_packet_finish(struct rudp_host* const host, struct rudp_peer* const peer, struct rudp_packet* const packet, const uint64_t now, uint8_t flags) {
+  struct rudp_state* const state = host->state;
+  if(!peer->connected) {
+    flags |= rudp_flag_connect;
+  }
+  if(peer->received) {
+    flags |= rudp_flag_ack;
+  }
+  packet->buf[0] = flags;
+  rudp_put16(packet->buf + 1, packet->seq);
+  rudp_put16(packet->buf + 3, peer->recv_seq);
+  rudp_put32(packet->buf + 5, peer->recv_bits);
+  peer->times[packet->seq % rudp_times] = now;
+  peer->time_seqs[packet->seq % rudp_times] = packet->seq;
+  peer->last_send = now;
+  peer->ack_pending = 0;
+  ++peer->packets_sent;
+  if(host->loss != 0 && rudp_random(host) % 100 < host->loss) {
+    return;
+  }
+  struct udp_datagram* const datagram = state->out + state->out_len;
+  datagram->data = packet->buf;
+  datagram->len = packet->len;
+  datagram->segment = 0;
+  if(peer->addr.sa_family == AF_INET) {
+    datagram->addr4 = peer->addr4;
+  } else {
+    datagram->addr6 = peer->addr6;
+  }
+  if(++state->out_len == rudp_batch) {
+    rudp_out_send(host);
+  }
+}
+
+static void rudp_packet_add(struct rudp_host* const host, struct rudp_peer* const peer, struct rudp_packet* const packet,
+  int* const open, const uint64_t now, const struct rudp_message* const message) {
+  const uint32_t size = rudp_message_header + message->len;
+  if(*open && packet->len + size > host->mtu) {
+    rudp_packet_finish(host, peer, packet, now, 0);
+    *open = 0;
+  }
+  if(!*open) {
+    rudp_packet_begin(host, peer, packet);
+    *open = 1;
+  }
+  char* const buf = packet->buf + packet->len;
+  buf[0] = message->channel;
+  rudp_put16(buf + 1, message->seq);
+  rudp_put16(buf + 3, message->len);
+  (void) memcpy(buf + rudp_message_header, message->data, message->len);
+  packet->len += size;
+}
+
+static void rudp_peer_flush(struct rudp_host* const host, struct rudp_peer* const peer, const uint64_t now) {
+  struct rudp_packet packet;
+  int open = 0;
+  if(peer->disconnecting) {
+    rudp_packet_begin(host, peer, &packet);
+    rudp_packet_finish(host, peer, &packet, now, rudp_flag_disconnect);
+    return;
+  }
+  for(uint32_t i = 0; i < host->channels_len; ++i) {
+    struct rudp_channel_state* const channel = peer->channels + i;
+    for(struct rudp_message* message = channel->head; message != NULL; message = message->next) {
+      /* The other side only holds on to so many messages that came early */
+      if((uint16_t)(message->seq - channel->head->seq) >= rudp_window) {
+        break;
+      }
+      if(message->sent) {
+        const uint32_t backoff = message->retries < rudp_backoff_max ? message->retries : rudp_backoff_max;
+        uint64_t rto = (uint64_t) peer->rto << backoff;
+        if(rto > rudp_rto_max) {
+          rto = rudp_rto_max;
+        }
+        if(now - message->sent_at < rto) {
+          continue;
+        }
+        if(message->retries != 127) {
+          ++message->retries;
+        }
+        ++peer->retransmits;
+      }
+      rudp_packet_add(host, peer, &packet, &open, now, message);
+      message->sent = 1;
+      message->sent_at = now;
+      message->packet = packet.seq;
+    }
+  }
+  struct rudp_message* message = peer->queue;
+  while(message != NULL) {
+    struct rudp_message* const next = message->next;
+    rudp_packet_add(host, peer, &packet, &open, now, message);
+    free(message);
+    message = next;
+  }
+  peer->queue = NULL;
+  peer->queue_tail = NULL;
+  if(!open && (peer->ack_pending || now - peer->last_send >= (peer->connected ? host->ping_interval : peer->rto))) {
+    rudp_packet_begin(host, peer, &packet);
+    open = 1;
+  }
+  if(open) {
+    rudp_packet_finish(host, peer, &packet, now, 0);
+  }
+}
+
+void rudp_host_flush(struct rudp_host* const host) {
+  struct rudp_state* const state = host->state;
+  const uint64_t now = rudp_time();
+  for(uint32_t i = 0; i < state->buckets_len; ++i) {
+    struct rudp_peer* peer = state->buckets[i];
+    while(peer != NULL) {
+      struct rudp_peer* const next = peer->next;
+      if(now - peer->last_recv >= host->timeout) {
+        errno = peer->connected ? ETIMEDOUT : ECONNREFUSED;
+        rudp_peer_free(host, peer);
+      } else {
+        rudp_peer_flush(host, peer, now);
+        if(peer->disconnecting) {
+          errno = 0;
+          rudp_peer_free(host, peer);
+        }
+      }
+      peer = next;
+    }
+  }
+  rudp_out_send(host);
+}
+
+static void rudp_ontick(struct async_loop* loop, struct async_timer* timer) {
+  struct rudp_host* const host = (struct rudp_host*)((char*) timer - offsetof(struct rudp_host, tick));
+  rudp_host_flush(host);
+  async_timer_set(loop, &host->tick, host->tick_interval);
+}
+
+int rudp_send(struct rudp_peer* const peer, const uint8_t channel, const void* const data, const uint32_t len) {
+  struct rudp_host* const host = peer->host;
+  if(channel >= host->channels_len || peer->disconnecting) {
+    errno = EINVAL;
+    return -1;
+  }
+  if(len > host->mtu - rudp_header - rudp_message_header) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  struct rudp_message* const message = shnet_malloc(sizeof(*message) + len);
+  if(message == NULL) {
+    return -1;
+  }
+  struct rudp_channel_state* const state = peer->channels + channel;
+  message->next = NULL;
+  message->seq = state->send_seq++;
+  message->len = len;
+  message->channel = channel;
+  message->retries = 0;
+  message->sent = 0;
+  (void) memcpy(message->data, data, len);
+  if(host->channels[channel] == rudp_reliable) {
+    if(state->tail != NULL) {
+      state->tail->next = message;
+    } else {
+      state->head = message;
+    }
+    state->tail = message;
+    ++peer->unacked;
+  } else {
+    if(peer->queue_tail != NULL) {
+      peer->queue_tail->next = message;
+    } else {
+      peer->queue = message;
+    }
+    peer->queue_tail = message;
+  }
+  return 0;
+}
+
+/* Receiving */
+
+static int rudp_track(struct rudp_peer* const peer, const uint16_t seq) {
+  if(!peer->received) {
+    peer->received = 1;
+    peer->recv_seq = seq;
+    peer->recv_bits = 0;
+    return 0;
+  }
+  const uint16_t ahead = seq - peer->recv_seq;
+  if(ahead == 0) {
+    return -1;
+  }
+  if(ahead < 0x8000) {
+    if(ahead > 32) {
+      peer->recv_bits = 0;
+    } else if(ahead == 32) {
+      peer->recv_bits = (uint32_t) 1 << 31;
+    } else {
+      peer->recv_bits = (peer->recv_bits << ahead) | ((uint32_t) 1 << (ahead - 1));
+    }
+    peer->recv_seq = seq;
+    return 0;
+  }
+  const uint16_t behind = peer->recv_seq - seq;
+  if(behind <= 32) {
+    const uint32_t bit = (uint32_t) 1 << (behind - 1);
+    if(peer->recv_bits & bit) {
+      return -1;
+    }
+    peer->recv_bits |= bit;
+  }
+  return 0;
+}
+
+static int rudp_acked(const uint16_t packet, const uint16_t ack, const uint32_t bits) {
+  const uint16_t behind = ack - packet;
+  return behind == 0 || (behind <= 32 && ((bits >> (behind - 1)) & 1));
+}
+
+static void rudp_rtt(struct rudp_peer* const peer, const uint32_t sample) {
+  if(!peer->measured) {
+    peer->srtt = sample;
+    peer->rttvar = sample >> 1;
+    peer->measured = 1;
+  } else {
+    const uint32_t delta = peer->srtt > sample ? peer->srtt - sample : sample - peer->srtt;
+    peer->rttvar = (peer->rttvar * 3 + delta) >> 2;
+    peer->srtt = (peer->srtt * 7 + sample) >> 3;
+  }
+  uint32_t rto = peer->srtt + (peer->rttvar << 2);
+  if(rto < rudp_rto_min) {
+    rto = rudp_rto_min;
+  } else if(rto > rudp_rto_max) {
+    rto = rudp_rto_max;
+  }
+  peer->rto = rto;
+}
+
+static void rudp_ack(struct rudp_host* const host, struct rudp_peer* const peer, const uint16_t ack, const uint32_t bits, const uint64_t now) {
+  const uint32_t idx = ack % rudp_times;
+  if(peer->time_seqs[idx] == ack) {
+    peer->time_seqs[idx] = UINT32_MAX;
+    rudp_rtt(peer, now - peer->times[idx]);
+  }
+  for(uint32_t i = 0; i < host->channels_len; ++i) {
+    struct rudp_channel_state* const channel = peer->channels + i;
+    struct rudp_message** link = &channel->head;
+    struct rudp_message* last = NULL;
+    while(*link != NULL) {
+      struct rudp_message* const message = *link;
+      if(!message->sent) {
+        break;
+      }
+      if(rudp_acked(message->packet, ack, bits)) {
+        *link = message->next;
+        free(message);
+        --peer->unacked;
+      } else {
+        last = message;
+        link = &message->next;
+      }
+    }
+    if(*link == NULL) {
+      channel->tail = last;
+    }
+  }
+}
+
+static void rudp_deliver(struct rudp_host* const host, struct rudp_peer* const peer, const uint8_t idx,
+  const uint16_t seq, const char* const data, const uint32_t len) {
+  struct rudp_channel_state* const channel = peer->channels + idx;
+  switch(host->channels[idx]) {
+    case rudp_unreliable: {
+      host->on_message(host, peer, idx, data, len);
+      break;
+    }
+    case rudp_sequenced: {
+      /* Anything not newer than what was already delivered is dropped, repeats included */
+      if(channel->received && (uint16_t)(seq - channel->recv_seq - 1) >= 0x7FFF) {
+        break;
+      }
+      channel->received = 1;
+      channel->recv_seq = seq;
+      host->on_message(host, peer, idx, data, len);
+      break;
+    }
+    case rudp_reliable: {
+      const uint16_t ahead = seq - channel->recv_seq;
+      if(ahead == 0) {
+        ++channel->recv_seq;
+        host->on_message(host, peer, idx, data, len);
+        struct rudp_held* held;
+        while((held = channel->held[channel->recv_seq % rudp_window]) != NULL) {
+          channel->held[channel->recv_seq % rudp_window] = NULL;
+          ++channel->recv_seq;
+          host->on_message(host, peer, idx, held->data, held->len);
+          free(held);
+        }
+      } else if(ahead < rudp_window && channel->held[seq % rudp_window] == NULL) {
+        /* Out of order, but within the sender's window */
+        struct rudp_held* const held = shnet_malloc(sizeof(*held) + len);
+        if(held != NULL) {
+          held->len = len;
+          (void) memcpy(held->data, data, len);
+          channel->held[seq % rudp_window] = held;
+        }
+      }
+      break;
+    }
+    default: assert(0);
+  }
+}
+
+static void rudp_receive(struct rudp_host* const host, const struct udp_datagram* const datagram) {
+  if(datagram->truncated || datagram->len < rudp_header) {
+    return;
+  }
+  const char* buf = datagram->data;
+  const uint8_t flags = buf[0];
+  struct rudp_peer* peer = rudp_peer_find(host, &datagram->addr);
+  if(peer == NULL) {
+    if(!(flags & rudp_flag_connect) || (flags & rudp_flag_disconnect) || host->state->peers_len >= host->max_peers) {
+      return;
+    }
+    peer = rudp_peer_new(host, &datagram->addr);
+    if(peer == NULL) {
+      return;
+    }
+  }
+  if(peer->disconnecting) {
+    return;
+  }
+  if(flags & rudp_flag_disconnect) {
+    errno = ECONNRESET;
+    rudp_peer_free(host, peer);
+    return;
+  }
+  if(rudp_track(peer, rudp_get16(buf + 1)) == -1) {
+    return;
+  }
+  const uint64_t now = rudp_time();
+  peer->last_recv = now;
+  peer->ack_pending = 1;
+  ++peer->packets_received;
+  if(!peer->connected) {
+    peer->connected = 1;
+    if(host->on_event != NULL) {
+      host->on_event(host, peer, rudp_open);
+    }
+  }
+  if(flags & rudp_flag_ack) {
+    rudp_ack(host, peer, rudp_get16(buf + 3), rudp_get32(buf + 5), now);
+  }
+  const char* const end = buf + datagram->len;
+  buf += rudp_header;
+  while(end - buf >= rudp_message_header) {
+    const uint8_t channel = buf[0];
+    const uint16_t seq = rudp_get16(buf + 1);
+    const uint16_t len = rudp_get16(buf + 3);
+    buf += rudp_message_header;
+    if(channel >= host->channels_len || len > end - buf) {
+      return;
+    }
+    if(host->on_message != NULL) {
+      rudp_deliver(host, peer, channel, seq, buf, len);
+    }
+    buf += len;
+  }
+}
+
+/* The host */
+
+static void rudp_onevent(struct udp_socket* socket, enum udp_event event) {
+  struct rudp_host* const host = (struct rudp_host*) socket;
+  switch(event) {
+    case udp_data: {
+      struct udp_datagram datagrams[rudp_batch];
+      uint32_t count;
+      do {
+        count = udp_read(socket, datagrams, rudp_batch);
+        for(uint32_t i = 0; i < count; ++i) {
+          rudp_receive(host, datagrams + i);
+          data_pool_free(datagrams[i].data);
+        }
+      } while(count == rudp_batch);
+      break;
+    }
+    case udp_can_send: {
+      /* The first one comes right after the socket is added to the loop */
+      if(!async_timer_armed(&host->tick)) {
+        async_timer_set(socket->loop, &host->tick, host->tick_interval);
+      }
+      break;
+    }
+    case udp_close: {
+      async_timer_cancel(socket->loop, &host->tick);
+      struct rudp_state* const state = host->state;
+      for(uint32_t i = 0; i < state->buckets_len; ++i) {
+        while(state->buckets[i] != NULL) {
+          errno = 0;
+          rudp_peer_free(host, state->buckets[i]);
+        }
+      }
+      udp_socket_free(socket);
+      break;
+    }
+    case udp_free: {
+      free(host->state->buckets);
+      free(host->state);
+      host->state = NULL;
+      free(host->channels);
+      host->channels = NULL;
+      if(host->on_event != NULL) {
+        host->on_event(host, NULL, rudp_free);
+      }
+      break;
+    }
+    default: assert(0);
+  }
+}
+
+int rudp_host(struct rudp_host* const host, const struct rudp_host_options* const opt) {
+  if(opt == NULL || opt->channels == NULL || opt->channels_len == 0 || opt->channels_len > 256 || opt->loss > 100 ||
+    (opt->mtu != 0 && (opt->mtu <= rudp_header + rudp_message_header || opt->mtu > 65507))) {
+    errno = EINVAL;
+    return -1;
+  }
+  host->channels_len = opt->channels_len;
+  host->max_peers = opt->max_peers == 0 ? UINT32_MAX : opt->max_peers;
+  host->mtu = opt->mtu == 0 ? rudp_mtu_default : opt->mtu;
+  host->tick_interval = opt->tick == 0 ? rudp_tick_default : opt->tick;
+  host->timeout = opt->timeout == 0 ? rudp_timeout_default : opt->timeout;
+  host->ping_interval = opt->ping_interval == 0 ? rudp_ping_default : opt->ping_interval;
+  host->loss = opt->loss;
+  host->rng = (uint32_t) time_get_time() | 1;
+  host->channels = shnet_malloc(opt->channels_len);
+  if(host->channels == NULL) {
+    return -1;
+  }
+  for(uint32_t i = 0; i < opt->channels_len; ++i) {
+    host->channels[i] = opt->channels[i];
+  }
+  host->state = shnet_calloc(1, sizeof(*host->state) + (uint64_t) rudp_batch * host->mtu);
+  if(host->state == NULL) {
+    goto err_channels;
+  }
+  host->state->buckets = shnet_calloc(rudp_buckets_min, sizeof(*host->state->buckets));
+  if(host->state->buckets == NULL) {
+    goto err_state;
+  }
+  host->state->buckets_len = rudp_buckets_min;
+  host->tick = (struct async_timer) { .on_timeout = rudp_ontick };
+  host->udp.on_event = rudp_onevent;
+  if(udp_socket(&host->udp, &((struct udp_socket_options) {
+    .info = opt->info,
+    .hostname = opt->hostname,
+    .port = opt->port,
+    .family = opt->family,
+    .flags = opt->flags,
+    .bind = 1,
+    .recv_size = host->mtu
+  })) == -1) {
+    goto err_buckets;
+  }
+  return 0;
+  
+  err_buckets:
+  free(host->state->buckets);
+  err_state:
+  free(host->state);
+  host->state = NULL;
+  err_channels:
+  free(host->channels);
+  host->channels = NULL;
+  return -1;
+}
+
+void rudp_host_close(struct rudp_host* const host) {
+  udp_socket_close(&host->udp);
+}
+
+/* Peers */
+
+struct rudp_peer* rudp_connect(struct rudp_host* const host, const void* const addr) {
+  const struct sockaddr* const address = addr;
+  if(address->sa_family != AF_INET && address->sa_family != AF_INET6) {
+    errno = EINVAL;
+    return NULL;
+  }
+  struct rudp_peer* const peer = rudp_peer_find(host, address);
+  if(peer != NULL) {
+    return peer;
+  }
+  return rudp_peer_new(host, address);
+}
+
+void rudp_disconnect(struct rudp_peer* const peer) {
+  peer->disconnecting = 1;
+}
+
+void rudp_peer_set_data(struct rudp_peer* const peer, void* const data) {
+  peer->data = data;
+}
+
+void* rudp_peer_get_data(const struct rudp_peer* const peer) {
+  return peer->data;
+}
+
+void rudp_peer_get_address(const struct rudp_peer* const peer, void* const addr) {
+  if(peer->addr.sa_family == AF_INET) {
+    (void) memcpy(addr, &peer->addr4, sizeof(peer->addr4));
+  } else {
+    (void) memcpy(addr, &peer->addr6, sizeof(peer->addr6));
+  }
+}
+
+void rudp_peer_get_stats(const struct rudp_peer* const peer, struct rudp_peer_stats* const stats) {
+  *stats = (struct rudp_peer_stats) {
+    .packets_sent = peer->packets_sent,
+    .packets_received = peer->packets_received,
+    .retransmits = peer->retransmits,
+    .unacked = peer->unacked,
+    .rtt = peer->srtt,
+    .rtt_var = peer->rttvar,
+    .rto = peer->rto
+  };
+}
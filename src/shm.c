@@ -0,0 +1,527 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include <shnet/shm.h>
+#include <shnet/error.h>
+
+/*
+ * A channel is a memfd holding a byte ring per direction. Each side only
+ * ever moves the head of the ring it writes to and the tail of the one it
+ * reads from, so neither needs a lock to touch the memory. Every ring is
+ * mapped twice in a row, which keeps whatever is between its tail and head
+ * contiguous, so copying in and out never wraps around.
+ *
+ * Each side has an eventfd its loop listens to, and the peer writes to it
+ * when there is something new to read, or room again to write. Consumers
+ * announce when they go to sleep, and producers only ring the doorbell of a
+ * sleeping consumer. That takes a store and a load on each side, both
+ * sequentially consistent, so that at least one of them sees the other's.
+ * While a consumer keeps up, sends don't make a single syscall.
+ */
+
+enum shm_limit {
+  shm_magic = 0x73686e74,
+  shm_size_default = 1048576
+};
+
+struct shm_ring {
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+  /* The consumer sleeps, and wants a doorbell once there is more to read */
+  _Alignas(64) _Atomic uint32_t waiting;
+  /* The producer ran out of room, and wants a doorbell once there is more */
+  _Atomic uint32_t blocked;
+};
+
+struct shm_header {
+  uint32_t magic;
+  _Atomic uint32_t closed[2];
+  uint64_t size;
+  /* rings[side] is the one that side writes to */
+  struct shm_ring rings[2];
+};
+
+static uint64_t shm_page(void) {
+  return sysconf(_SC_PAGESIZE);
+}
+
+static int shm_map(struct shm_channel* const channel, const int memfd, const uint64_t size) {
+  const uint64_t page = shm_page();
+  const uint64_t map_size = page + size * 4;
+  char* base;
+  safe_execute(base = mmap(NULL, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0), base == MAP_FAILED, errno);
+  if(base == MAP_FAILED) {
+    return -1;
+  }
+  const uint64_t offsets[] = { 0, page, page, page + size, page + size };
+  const uint64_t lengths[] = { page, size, size, size, size };
+  uint64_t at = 0;
+  for(uint32_t i = 0; i < 5; ++i) {
+    void* ptr;
+    safe_execute(ptr = mmap(base + at, lengths[i], PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd, offsets[i]), ptr == MAP_FAILED, errno);
+    if(ptr == MAP_FAILED) {
+      (void) munmap(base, map_size);
+      return -1;
+    }
+    at += lengths[i];
+  }
+  channel->header = (struct shm_header*) base;
+  channel->map_size = map_size;
+  channel->size = size;
+  return 0;
+}
+
+static void shm_onevent(struct async_loop*, uint32_t, struct async_callback*);
+
+static int shm_channel_start(struct shm_channel* const channel, const struct shm_channel_options* const opt) {
+  const uint64_t page = shm_page();
+  char* const data = (char*) channel->header + page;
+  channel->out = channel->header->rings + channel->side;
+  channel->in = channel->header->rings + !channel->side;
+  channel->out_data = data + channel->size * 2 * channel->side;
+  channel->in_data = data + channel->size * 2 * !channel->side;
+  channel->seen = atomic_load_explicit(&channel->in->tail, memory_order_relaxed);
+  channel->busy_poll = opt != NULL ? opt->busy_poll : 0;
+  channel->blocked = 0;
+  channel->queue = (struct data_storage) {0};
+  if(pthread_mutex_init(&channel->lock, NULL) != 0) {
+    return -1;
+  }
+  if(channel->loop == NULL) {
+    channel->loop = shnet_calloc(1, sizeof(*channel->loop));
+    if(channel->loop == NULL) {
+      goto err_lock;
+    }
+    if(async_loop(channel->loop) == -1) {
+      free(channel->loop);
+      channel->loop = NULL;
+      goto err_lock;
+    }
+    if(async_loop_start(channel->loop) == -1) {
+      async_loop_free(channel->loop);
+      free(channel->loop);
+      channel->loop = NULL;
+      goto err_lock;
+    }
+    channel->alloc_loop = 1;
+  }
+  channel->core.core.socket = 0;
+  channel->core.core.server = 0;
+  channel->core.core.callback = 1;
+  channel->core.on_event = shm_onevent;
+  /* Anything the peer sent before makes the loop pick it up right away */
+  if(async_loop_add(channel->loop, &channel->core.core, EPOLLET | EPOLLIN) == -1) {
+    goto err_loop;
+  }
+  return 0;
+  
+  err_loop:
+  if(channel->alloc_loop) {
+    async_loop_shutdown(channel->loop, async_free | async_ptr_free);
+    channel->loop = NULL;
+    channel->alloc_loop = 0;
+  }
+  err_lock:
+  (void) pthread_mutex_destroy(&channel->lock);
+  return -1;
+}
+
+int shm_channel(struct shm_channel* const channel, const struct shm_channel_options* const opt) {
+  const uint64_t page = shm_page();
+  uint64_t size = opt != NULL && opt->size != 0 ? opt->size : shm_size_default;
+  if(size < page) {
+    size = page;
+  }
+  /* A power of 2, so that positions wrap around with a mask */
+  size = (uint64_t) 1 << (64 - __builtin_clzll(size - 1));
+  safe_execute(channel->memfd = memfd_create("shnet-shm", MFD_CLOEXEC), channel->memfd == -1, errno);
+  if(channel->memfd == -1) {
+    return -1;
+  }
+  int err;
+  safe_execute(err = ftruncate(channel->memfd, page + size * 2), err == -1, errno);
+  if(err == -1) {
+    goto err_memfd;
+  }
+  if(shm_map(channel, channel->memfd, size) == -1) {
+    goto err_memfd;
+  }
+  struct shm_header* const header = channel->header;
+  header->magic = shm_magic;
+  header->size = size;
+  for(uint32_t i = 0; i < 2; ++i) {
+    atomic_init(&header->closed[i], 0);
+    atomic_init(&header->rings[i].head, 0);
+    atomic_init(&header->rings[i].tail, 0);
+    /* Nobody is reading yet */
+    atomic_init(&header->rings[i].waiting, 1);
+    atomic_init(&header->rings[i].blocked, 0);
+  }
+  safe_execute(channel->core.core.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), channel->core.core.fd == -1, errno);
+  if(channel->core.core.fd == -1) {
+    goto err_map;
+  }
+  safe_execute(channel->peer_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), channel->peer_fd == -1, errno);
+  if(channel->peer_fd == -1) {
+    goto err_fd;
+  }
+  channel->side = 0;
+  if(shm_channel_start(channel, opt) == -1) {
+    goto err_peer;
+  }
+  return 0;
+  
+  err_peer:
+  (void) close(channel->peer_fd);
+  channel->peer_fd = -1;
+  err_fd:
+  (void) close(channel->core.core.fd);
+  channel->core.core.fd = -1;
+  err_map:
+  (void) munmap(channel->header, channel->map_size);
+  channel->header = NULL;
+  err_memfd:
+  (void) close(channel->memfd);
+  channel->memfd = -1;
+  return -1;
+}
+
+void shm_channel_get_fds(const struct shm_channel* const channel, int* const fds) {
+  fds[0] = channel->memfd;
+  fds[1] = channel->side == 0 ? channel->core.core.fd : channel->peer_fd;
+  fds[2] = channel->side == 0 ? channel->peer_fd : channel->core.core.fd;
+}
+
+int shm_channel_attach(struct shm_channel* const channel, const int* const fds, const struct shm_channel_options* const opt) {
+  const uint64_t page = shm_page();
+  struct stat st;
+  if(fstat(fds[0], &st) == -1) {
+    return -1;
+  }
+  const uint64_t size = st.st_size > (off_t) page ? (st.st_size - page) / 2 : 0;
+  if(size < page || (size & (size - 1)) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if(shm_map(channel, fds[0], size) == -1) {
+    return -1;
+  }
+  if(channel->header->magic != shm_magic || channel->header->size != size) {
+    errno = EINVAL;
+    goto err_map;
+  }
+  channel->memfd = fds[0];
+  channel->peer_fd = fds[1];
+  channel->core.core.fd = fds[2];
+  channel->side = 1;
+  if(shm_channel_start(channel, opt) == -1) {
+    goto err_map;
+  }
+  return 0;
+  
+  err_map:
+  (void) munmap(channel->header, channel->map_size);
+  channel->header = NULL;
+  return -1;
+}
+
+/*
+ * Positions live in memory the peer can write to, so a broken peer could make
+ * the distance between them anything. Copies never go further than the size of
+ * a ring from where they start, which the double mapping covers. Anything more
+ * than that closes the channel.
+ */
+
+static void shm_shutdown(const struct shm_channel* const channel) {
+  atomic_store_explicit(&channel->header->closed[channel->side], 1, memory_order_release);
+  /* Both loops find out on their own threads */
+  (void) eventfd_write(channel->core.core.fd, 1);
+  (void) eventfd_write(channel->peer_fd, 1);
+}
+
+static int shm_check(const struct shm_channel* const channel, const uint64_t used) {
+  if(used > channel->size) {
+    shm_shutdown(channel);
+    errno = EPROTO;
+    return -1;
+  }
+  return 0;
+}
+
+/* Writing */
+
+static void shm_notify(const struct shm_channel* const channel) {
+  if(atomic_load(&channel->out->waiting) && atomic_exchange(&channel->out->waiting, 0)) {
+    (void) eventfd_write(channel->peer_fd, 1);
+  }
+}
+
+/* Must be called with the channel locked */
+static int64_t shm_write(struct shm_channel* const channel, const struct data_frame* const frame) {
+  const uint64_t head = atomic_load_explicit(&channel->out->head, memory_order_relaxed);
+  const uint64_t used = head - atomic_load_explicit(&channel->out->tail, memory_order_acquire);
+  if(shm_check(channel, used) == -1) {
+    return -1;
+  }
+  const uint64_t room = channel->size - used;
+  uint64_t len = frame->len - frame->offset;
+  if(len > room) {
+    len = room;
+  }
+  if(len == 0) {
+    return 0;
+  }
+  char* const dst = channel->out_data + (head & (channel->size - 1));
+  if(frame->file) {
+    ssize_t bytes;
+    safe_execute(bytes = pread(frame->fd, dst, len, frame->offset), bytes == -1, errno);
+    if(bytes <= 0) {
+      if(bytes == 0) {
+        errno = EIO;
+      }
+      return -1;
+    }
+    len = bytes;
+  } else {
+    (void) memcpy(dst, frame->data + frame->offset, len);
+  }
+  atomic_store(&channel->out->head, head + len);
+  return len;
+}
+
+/*
+ * Must be called with the channel locked. Returns -1 if the ring is full, in
+ * which case the consumer rings back once it makes room, and -2 on errors.
+ */
+static int shm_flush(struct shm_channel* const channel) {
+  while(!data_storage_is_empty(&channel->queue)) {
+    if(channel->queue.frames->generator) {
+      if(data_storage_generate(&channel->queue) == -1) {
+        return -1;
+      }
+      continue;
+    }
+    const int64_t bytes = shm_write(channel, channel->queue.frames);
+    if(bytes == -1) {
+      return -2;
+    }
+    if(bytes == 0) {
+      atomic_store(&channel->out->blocked, 1);
+      const uint64_t head = atomic_load_explicit(&channel->out->head, memory_order_relaxed);
+      if(head - atomic_load(&channel->out->tail) == channel->size) {
+        channel->blocked = 1;
+        return -1;
+      }
+      /* The consumer made room in the meantime */
+      atomic_store(&channel->out->blocked, 0);
+      continue;
+    }
+    data_storage_drain(&channel->queue, bytes);
+  }
+  channel->blocked = 0;
+  return 0;
+}
+
+static int shm_closed(const struct shm_channel* const channel) {
+  return atomic_load_explicit(&channel->header->closed[0], memory_order_acquire) ||
+    atomic_load_explicit(&channel->header->closed[1], memory_order_acquire);
+}
+
+int shm_send(struct shm_channel* const channel, const struct data_frame* const frame) {
+  (void) pthread_mutex_lock(&channel->lock);
+  if(shm_closed(channel)) {
+    errno = EPIPE;
+    goto err;
+  }
+  const uint64_t head = atomic_load_explicit(&channel->out->head, memory_order_relaxed);
+  int err = shm_flush(channel);
+  if(err == -2) {
+    goto err_close;
+  }
+  if(err == 0 && !frame->generator) {
+    struct data_frame data = *frame;
+    const int64_t bytes = shm_write(channel, &data);
+    if(bytes == -1) {
+      goto err_close;
+    }
+    data.offset += bytes;
+    if(data.offset == data.len) {
+      (void) pthread_mutex_unlock(&channel->lock);
+      shm_notify(channel);
+      data_storage_free_frame(frame);
+      errno = 0;
+      return 0;
+    }
+    err = data_storage_add(&channel->queue, &data);
+  } else if(frame->generator || frame->offset != frame->len) {
+    err = data_storage_add(&channel->queue, frame);
+  } else {
+    /* An empty frame, only there to push out what's queued */
+    data_storage_free_frame(frame);
+  }
+  if(err == 0) {
+    err = shm_flush(channel) == -2 ? -2 : 0;
+  }
+  const int wrote = atomic_load_explicit(&channel->out->head, memory_order_relaxed) != head;
+  (void) pthread_mutex_unlock(&channel->lock);
+  if(wrote) {
+    shm_notify(channel);
+  }
+  if(err == -2) {
+    const int error = errno;
+    shm_channel_close(channel);
+    errno = error;
+    return -1;
+  }
+  return err;
+  
+  err_close:
+  (void) pthread_mutex_unlock(&channel->lock);
+  const int error = errno;
+  shm_channel_close(channel);
+  data_storage_free_frame_err(frame);
+  errno = error;
+  return -1;
+  
+  err:
+  (void) pthread_mutex_unlock(&channel->lock);
+  data_storage_free_frame_err(frame);
+  return -1;
+}
+
+/* Reading */
+
+uint64_t shm_peek(const struct shm_channel* const channel, const char** const data) {
+  const uint64_t tail = atomic_load_explicit(&channel->in->tail, memory_order_relaxed);
+  *data = channel->in_data + (tail & (channel->size - 1));
+  const uint64_t used = atomic_load_explicit(&channel->in->head, memory_order_acquire) - tail;
+  if(shm_check(channel, used) == -1) {
+    return 0;
+  }
+  errno = 0;
+  return used;
+}
+
+void shm_consume(struct shm_channel* const channel, const uint64_t len) {
+  if(len == 0) {
+    return;
+  }
+  atomic_store(&channel->in->tail, atomic_load_explicit(&channel->in->tail, memory_order_relaxed) + len);
+  if(atomic_load(&channel->in->blocked) && atomic_exchange(&channel->in->blocked, 0)) {
+    (void) eventfd_write(channel->peer_fd, 1);
+  }
+}
+
+uint64_t shm_read(struct shm_channel* const channel, void* data, uint64_t size) {
+  const char* src;
+  uint64_t len = shm_peek(channel, &src);
+  if(errno != 0) {
+    return 0;
+  }
+  if(len >= size) {
+    len = size;
+    errno = 0;
+  } else {
+    errno = atomic_load_explicit(&channel->header->closed[!channel->side], memory_order_acquire) ? EPIPE : EAGAIN;
+  }
+  (void) memcpy(data, src, len);
+  shm_consume(channel, len);
+  return len;
+}
+
+static void shm_onevent(struct async_loop* loop, uint32_t events, struct async_callback* callback) {
+  (void) events;
+  struct shm_channel* const channel = (struct shm_channel*) callback;
+  eventfd_t count;
+  (void) eventfd_read(channel->core.core.fd, &count);
+  int can_send = 0;
+  int err = 0;
+  (void) pthread_mutex_lock(&channel->lock);
+  if(channel->blocked) {
+    const uint64_t head = atomic_load_explicit(&channel->out->head, memory_order_relaxed);
+    err = shm_flush(channel);
+    can_send = err == 0;
+    if(atomic_load_explicit(&channel->out->head, memory_order_relaxed) != head) {
+      shm_notify(channel);
+    }
+  }
+  (void) pthread_mutex_unlock(&channel->lock);
+  if(err == -2) {
+    shm_channel_close(channel);
+  }
+  if(can_send && channel->on_event != NULL) {
+    channel->on_event(channel, shm_can_send);
+  }
+  if(!atomic_load_explicit(&channel->header->closed[channel->side], memory_order_acquire)) {
+    uint32_t spins = 0;
+    while(1) {
+      const uint64_t head = atomic_load_explicit(&channel->in->head, memory_order_acquire);
+      if(head != channel->seen) {
+        channel->seen = head;
+        spins = 0;
+        if(channel->on_event != NULL) {
+          channel->on_event(channel, shm_data);
+        }
+        continue;
+      }
+      /* Going back to sleep is what makes the producer ring the doorbell */
+      if(spins != channel->busy_poll) {
+        ++spins;
+        continue;
+      }
+      atomic_store(&channel->in->waiting, 1);
+      if(atomic_load(&channel->in->head) == channel->seen) {
+        break;
+      }
+      atomic_store(&channel->in->waiting, 0);
+    }
+  }
+  if(shm_closed(channel)) {
+    (void) async_loop_remove(loop, &channel->core.core);
+    if(channel->on_event != NULL) {
+      channel->on_event(channel, shm_close);
+    }
+  }
+}
+
+void shm_channel_close(struct shm_channel* const channel) {
+  shm_shutdown(channel);
+}
+
+void shm_channel_free(struct shm_channel* const channel) {
+  if(channel->core.core.fd != -1) {
+    (void) close(channel->core.core.fd);
+    channel->core.core.fd = -1;
+  }
+  if(channel->peer_fd != -1) {
+    (void) close(channel->peer_fd);
+    channel->peer_fd = -1;
+  }
+  if(channel->memfd != -1) {
+    (void) close(channel->memfd);
+    channel->memfd = -1;
+  }
+  if(channel->header != NULL) {
+    (void) munmap(channel->header, channel->map_size);
+    channel->header = NULL;
+  }
+  data_storage_free(&channel->queue);
+  (void) pthread_mutex_destroy(&channel->lock);
+  if(channel->alloc_loop) {
+    async_loop_shutdown(channel->loop, async_free | async_ptr_free);
+    channel->loop = NULL;
+    channel->alloc_loop = 0;
+  }
+  if(channel->on_event != NULL) {
+    channel->on_event(channel, shm_free);
+  }
+}
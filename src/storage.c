@@ -3,17 +3,305 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <stdatomic.h>
 
 #include <shnet/error.h>
 #include <shnet/storage.h>
 
+/*
+ * Blocks of the pool are grouped in power-of-two size classes. Every block
+ * starts with a header holding its class, so that it can be freed without
+ * knowing its size. Each thread caches a few blocks of every class in its
+ * own magazine, so that most allocations and frees don't touch any lock.
+ * Magazines are refilled from and flushed to a global depot per class,
+ * which in turn is refilled by carving up freshly allocated arenas.
+ */
+
+enum data_pool_const {
+  data_pool_min_shift = 6,
+  data_pool_max_shift = 16,
+  data_pool_classes = data_pool_max_shift - data_pool_min_shift + 1,
+  data_pool_large = data_pool_classes,
+  data_pool_header = 16,
+  data_pool_magazine_size = 32,
+  data_pool_arena_size = 65536,
+  data_pool_huge_arena_size = 2097152
+};
+
+struct data_pool_depot {
+  pthread_mutex_t mutex;
+  void* head;
+};
+
+struct data_pool_magazine {
+  void* blocks[data_pool_classes][data_pool_magazine_size];
+  uint32_t counts[data_pool_classes];
+  uint64_t hits;
+  uint8_t registered;
+};
+
+static struct data_pool_depot data_pool_depots[data_pool_classes];
+static pthread_once_t data_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t data_pool_key;
+static _Thread_local struct data_pool_magazine data_pool_magazine;
+
+static _Atomic uint64_t data_pool_hits;
+static _Atomic uint64_t data_pool_misses;
+static _Atomic uint64_t data_pool_arenas;
+static _Atomic uint64_t data_pool_arena_bytes;
+static _Atomic int data_pool_use_hugepages;
+
+#define block_next(block) (*(void**)(block))
+#define block_class(block) (*(uint64_t*)(block))
+
+static void data_pool_flush(struct data_pool_magazine* const mag, const uint32_t cls, const uint32_t amount) {
+  void* head = NULL;
+  void* tail = NULL;
+  for(uint32_t i = 0; i < amount; ++i) {
+    void* const block = mag->blocks[cls][--mag->counts[cls]];
+    block_next(block) = head;
+    if(head == NULL) {
+      tail = block;
+    }
+    head = block;
+  }
+  if(head != NULL) {
+    struct data_pool_depot* const depot = data_pool_depots + cls;
+    (void) pthread_mutex_lock(&depot->mutex);
+    block_next(tail) = depot->head;
+    depot->head = head;
+    (void) pthread_mutex_unlock(&depot->mutex);
+  }
+}
+
+static void data_pool_thread_exit(void* data) {
+  struct data_pool_magazine* const mag = data;
+  for(uint32_t cls = 0; cls < data_pool_classes; ++cls) {
+    data_pool_flush(mag, cls, mag->counts[cls]);
+  }
+  atomic_fetch_add_explicit(&data_pool_hits, mag->hits, memory_order_relaxed);
+  mag->hits = 0;
+  mag->registered = 0;
+}
+
+static void data_pool_init(void) {
+  for(uint32_t cls = 0; cls < data_pool_classes; ++cls) {
+    (void) pthread_mutex_init(&data_pool_depots[cls].mutex, NULL);
+  }
+  (void) pthread_key_create(&data_pool_key, data_pool_thread_exit);
+}
+
+static void data_pool_register(struct data_pool_magazine* const mag) {
+  (void) pthread_once(&data_pool_once, data_pool_init);
+  (void) pthread_setspecific(data_pool_key, mag);
+  mag->registered = 1;
+}
+
+static uint32_t data_pool_class(const uint64_t size) {
+  const uint64_t total = size + data_pool_header;
+  if(total > ((uint64_t) 1 << data_pool_max_shift)) {
+    return data_pool_large;
+  }
+  if(total <= ((uint64_t) 1 << data_pool_min_shift)) {
+    return 0;
+  }
+  return 64 - __builtin_clzll(total - 1) - data_pool_min_shift;
+}
+
+static void* data_pool_arena(uint64_t* const size) {
+  if(atomic_load_explicit(&data_pool_use_hugepages, memory_order_relaxed)) {
+    void* const ptr = mmap(NULL, data_pool_huge_arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(ptr != MAP_FAILED) {
+      *size = data_pool_huge_arena_size;
+      return ptr;
+    }
+  }
+  return shnet_malloc(*size);
+}
+
+static void* data_pool_refill(struct data_pool_magazine* const mag, const uint32_t cls) {
+  if(!mag->registered) {
+    data_pool_register(mag);
+  }
+  atomic_fetch_add_explicit(&data_pool_hits, mag->hits, memory_order_relaxed);
+  mag->hits = 0;
+  atomic_fetch_add_explicit(&data_pool_misses, 1, memory_order_relaxed);
+  const uint64_t block_size = (uint64_t) 1 << (cls + data_pool_min_shift);
+  struct data_pool_depot* const depot = data_pool_depots + cls;
+  (void) pthread_mutex_lock(&depot->mutex);
+  if(depot->head == NULL) {
+    (void) pthread_mutex_unlock(&depot->mutex);
+    uint64_t size = block_size << 3;
+    if(size < data_pool_arena_size) {
+      size = data_pool_arena_size;
+    }
+    char* const arena = data_pool_arena(&size);
+    if(arena == NULL) {
+      return NULL;
+    }
+    atomic_fetch_add_explicit(&data_pool_arenas, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&data_pool_arena_bytes, size, memory_order_relaxed);
+    const uint64_t count = size / block_size;
+    for(uint64_t i = 1; i < count; ++i) {
+      block_next(arena + (i - 1) * block_size) = arena + i * block_size;
+    }
+    (void) pthread_mutex_lock(&depot->mutex);
+    block_next(arena + (count - 1) * block_size) = depot->head;
+    depot->head = arena;
+  }
+  void* const block = depot->head;
+  depot->head = block_next(block);
+  while(depot->head != NULL && mag->counts[cls] < (data_pool_magazine_size >> 1)) {
+    mag->blocks[cls][mag->counts[cls]++] = depot->head;
+    depot->head = block_next(depot->head);
+  }
+  (void) pthread_mutex_unlock(&depot->mutex);
+  return block;
+}
+
+void* data_pool_malloc(const uint64_t size) {
+  const uint32_t cls = data_pool_class(size);
+  void* block;
+  if(cls == data_pool_large) {
+    block = shnet_malloc(size + data_pool_header);
+    if(block == NULL) {
+      return NULL;
+    }
+  } else {
+    struct data_pool_magazine* const mag = &data_pool_magazine;
+    if(mag->counts[cls] != 0) {
+      block = mag->blocks[cls][--mag->counts[cls]];
+      ++mag->hits;
+    } else {
+      block = data_pool_refill(mag, cls);
+      if(block == NULL) {
+        return NULL;
+      }
+    }
+  }
+  block_class(block) = cls;
+  return (char*) block + data_pool_header;
+}
+
+void* data_pool_realloc(void* const ptr, const uint64_t size) {
+  if(ptr == NULL) {
+    return data_pool_malloc(size);
+  }
+  void* const block = (char*) ptr - data_pool_header;
+  const uint32_t old_cls = block_class(block);
+  const uint32_t cls = data_pool_class(size);
+  if(cls == old_cls) {
+    if(cls != data_pool_large) {
+      return ptr;
+    }
+    char* const new_block = shnet_realloc(block, size + data_pool_header);
+    if(new_block == NULL) {
+      return NULL;
+    }
+    return new_block + data_pool_header;
+  }
+  void* const new_ptr = data_pool_malloc(size);
+  if(new_ptr == NULL) {
+    return NULL;
+  }
+  const uint64_t old_size = old_cls == data_pool_large ? size : (((uint64_t) 1 << (old_cls + data_pool_min_shift)) - data_pool_header);
+  (void) memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+  data_pool_free(ptr);
+  return new_ptr;
+}
+
+void data_pool_free(void* const ptr) {
+  if(ptr == NULL) {
+    return;
+  }
+  void* const block = (char*) ptr - data_pool_header;
+  const uint32_t cls = block_class(block);
+  if(cls == data_pool_large) {
+    free(block);
+    return;
+  }
+  struct data_pool_magazine* const mag = &data_pool_magazine;
+  if(!mag->registered) {
+    data_pool_register(mag);
+  }
+  if(mag->counts[cls] == data_pool_magazine_size) {
+    data_pool_flush(mag, cls, data_pool_magazine_size >> 1);
+  }
+  mag->blocks[cls][mag->counts[cls]++] = block;
+}
+
+#undef block_class
+#undef block_next
+
+void data_pool_hugepages(const int on) {
+  atomic_store_explicit(&data_pool_use_hugepages, on, memory_order_relaxed);
+}
+
+void data_pool_get_stats(struct data_pool_stats* const stats) {
+  struct data_pool_magazine* const mag = &data_pool_magazine;
+  stats->hits = atomic_load_explicit(&data_pool_hits, memory_order_relaxed) + mag->hits;
+  stats->misses = atomic_load_explicit(&data_pool_misses, memory_order_relaxed);
+  stats->arenas = atomic_load_explicit(&data_pool_arenas, memory_order_relaxed);
+  stats->arena_bytes = atomic_load_explicit(&data_pool_arena_bytes, memory_order_relaxed);
+}
+
+
+
+/*
+ * Bytes held in storages are tracked process-wide. Only the slow path pays
+ * for it, since data only ends up in a storage when it couldn't be sent
+ * right away. Files and generators don't hold any memory and don't count.
+ */
+
+static _Atomic uint64_t data_budget_used = 0;
+static _Atomic uint64_t data_budget_peak = 0;
+static _Atomic uint64_t data_budget_limit = 0;
+static _Atomic uint64_t data_budget_queues = 0;
+
+void data_budget_set_limit(const uint64_t limit) {
+  atomic_store_explicit(&data_budget_limit, limit, memory_order_relaxed);
+}
+
+int data_budget_exceeded(void) {
+  const uint64_t limit = atomic_load_explicit(&data_budget_limit, memory_order_relaxed);
+  return limit != 0 && atomic_load_explicit(&data_budget_used, memory_order_relaxed) > limit;
+}
+
+void data_budget_get_stats(struct data_budget_stats* const stats) {
+  stats->used = atomic_load_explicit(&data_budget_used, memory_order_relaxed);
+  stats->peak = atomic_load_explicit(&data_budget_peak, memory_order_relaxed);
+  stats->limit = atomic_load_explicit(&data_budget_limit, memory_order_relaxed);
+  stats->queues = atomic_load_explicit(&data_budget_queues, memory_order_relaxed);
+}
+
+static uint64_t data_budget_frame(const struct data_frame* const frame) {
+  return frame->generator || frame->file ? 0 : frame->len - frame->offset;
+}
+
+static void data_budget_add(const uint64_t bytes) {
+  const uint64_t used = atomic_fetch_add_explicit(&data_budget_used, bytes, memory_order_relaxed) + bytes;
+  uint64_t peak = atomic_load_explicit(&data_budget_peak, memory_order_relaxed);
+  while(used > peak && !atomic_compare_exchange_weak_explicit(&data_budget_peak, &peak, used, memory_order_relaxed, memory_order_relaxed));
+}
+
+static void data_budget_sub(const uint64_t bytes) {
+  (void) atomic_fetch_sub_explicit(&data_budget_used, bytes, memory_order_relaxed);
+}
+
 void data_storage_free_frame(const struct data_frame* const frame) {
   if(!frame->dont_free) {
-    if(frame->mmaped) {
+    if(frame->generator) {
+      if(frame->gen->free != NULL) {
+        frame->gen->free(frame->gen);
+      }
+    } else if(frame->mmaped) {
       (void) munmap(frame->data, frame->len);
     } else if(frame->file) {
       (void) close(frame->fd);
+    } else if(frame->pooled) {
+      data_pool_free(frame->data);
     } else {
       free(frame->data);
     }
@@ -22,10 +310,16 @@ void data_storage_free_frame(const struct data_frame* const frame) {
 
 void data_storage_free_frame_err(const struct data_frame* const frame) {
   if(frame->free_onerr) {
-    if(frame->mmaped) {
+    if(frame->generator) {
+      if(frame->gen->free != NULL) {
+        frame->gen->free(frame->gen);
+      }
+    } else if(frame->mmaped) {
       (void) munmap(frame->data, frame->len);
     } else if(frame->file) {
       (void) close(frame->fd);
+    } else if(frame->pooled) {
+      data_pool_free(frame->data);
     } else {
       free(frame->data);
     }
@@ -34,9 +328,15 @@ void data_storage_free_frame_err(const struct data_frame* const frame) {
 
 void data_storage_free(struct data_storage* const storage) {
   if(storage->frames != NULL) {
+    uint64_t bytes = 0;
     for(uint32_t i = 0; i < storage->used; ++i) {
+      bytes += data_budget_frame(&storage->frames[i]);
       data_storage_free_frame(&storage->frames[i]);
     }
+    if(storage->used != 0) {
+      data_budget_sub(bytes);
+      (void) atomic_fetch_sub_explicit(&data_budget_queues, 1, memory_order_relaxed);
+    }
     free(storage->frames);
     storage->frames = NULL;
   }
@@ -49,6 +349,15 @@ int data_storage_resize(struct data_storage* const storage, const uint32_t new_l
     return 0;
   }
   if(new_len == 0) {
+    if(storage->used != 0) {
+      /* The frames are someone else's now, so is their memory */
+      uint64_t bytes = 0;
+      for(uint32_t i = 0; i < storage->used; ++i) {
+        bytes += data_budget_frame(&storage->frames[i]);
+      }
+      data_budget_sub(bytes);
+      (void) atomic_fetch_sub_explicit(&data_budget_queues, 1, memory_order_relaxed);
+    }
     if(storage->frames != NULL) {
       free(storage->frames);
       storage->frames = NULL;
@@ -66,32 +375,49 @@ int data_storage_resize(struct data_storage* const storage, const uint32_t new_l
   return 0;
 }
 
-int data_storage_add(struct data_storage* const storage, const struct data_frame* const frame) {
+static void data_storage_place(struct data_storage* const storage, const uint32_t idx, const struct data_frame* const frame) {
+  (void) memmove(storage->frames + idx + 1, storage->frames + idx, sizeof(*storage->frames) * (storage->used - idx));
+  storage->frames[idx] = *frame;
+  if(storage->used++ == 0) {
+    (void) atomic_fetch_add_explicit(&data_budget_queues, 1, memory_order_relaxed);
+  }
+  const uint64_t bytes = data_budget_frame(frame);
+  if(bytes != 0) {
+    data_budget_add(bytes);
+  }
+}
+
+static int data_storage_insert(struct data_storage* const storage, const uint32_t idx, const struct data_frame* const frame) {
   if(storage->used >= storage->size && data_storage_resize(storage, storage->used + 1)) {
     return -1;
   }
+  if(frame->generator) {
+    data_storage_place(storage, idx, frame);
+    return 0;
+  }
   if(frame->offset == frame->len) {
     return 0;
   }
   if(!frame->read_only) {
     if(!frame->file) {
       const uint64_t len = frame->len - frame->offset;
-      void* const data_ptr = shnet_malloc(len);
+      void* const data_ptr = data_pool_malloc(len);
       if(data_ptr == NULL) {
         goto err;
       }
       (void) memcpy(data_ptr, frame->data + frame->offset, len);
-      storage->frames[storage->used++] = (struct data_frame) {
+      data_storage_place(storage, idx, &((struct data_frame) {
         .data = data_ptr,
-        .len = len
-      };
+        .len = len,
+        .pooled = 1
+      }));
     } else {
       void* data_ptr;
       safe_execute(data_ptr = mmap(NULL, frame->len, PROT_READ, MAP_PRIVATE, frame->fd, 0), data_ptr == MAP_FAILED, errno);
       if(data_ptr == MAP_FAILED) {
         goto err;
       }
-      if(data_storage_add(storage, &((struct data_frame) {
+      if(data_storage_insert(storage, idx, &((struct data_frame) {
         .data = data_ptr,
         .len = frame->len,
         .offset = frame->offset,
@@ -103,7 +429,7 @@ int data_storage_add(struct data_storage* const storage, const struct data_frame
     }
     data_storage_free_frame(frame);
   } else {
-    storage->frames[storage->used++] = *frame;
+    data_storage_place(storage, idx, frame);
   }
   return 0;
   
@@ -112,6 +438,10 @@ int data_storage_add(struct data_storage* const storage, const struct data_frame
   return -1;
 }
 
+int data_storage_add(struct data_storage* const storage, const struct data_frame* const frame) {
+  return data_storage_insert(storage, storage->used, frame);
+}
+
 #define frame storage->frames
 
 void data_storage_drain(struct data_storage* const storage, const uint64_t amount) {
@@ -119,10 +449,15 @@ void data_storage_drain(struct data_storage* const storage, const uint64_t amoun
     assert(amount == 0);
     return;
   }
+  if(!frame->file) {
+    data_budget_sub(amount);
+  }
   frame->offset += amount;
   if(frame->offset == frame->len) {
     data_storage_free_frame(frame);
-    --storage->used;
+    if(--storage->used == 0) {
+      (void) atomic_fetch_sub_explicit(&data_budget_queues, 1, memory_order_relaxed);
+    }
     (void) memmove(frame, frame + 1, sizeof(*frame) * storage->used);
   }
 }
@@ -132,13 +467,49 @@ void data_storage_finish(const struct data_storage* const storage) {
     frame->len -= frame->offset;
     (void) memmove(frame->data, frame->data + frame->offset, frame->len);
     frame->offset = 0;
-    char* const ptr = shnet_realloc(frame->data, frame->len);
+    char* const ptr = frame->pooled ? data_pool_realloc(frame->data, frame->len) : shnet_realloc(frame->data, frame->len);
     if(ptr != NULL) {
       frame->data = ptr;
     }
   }
 }
 
+int data_storage_generate(struct data_storage* const storage) {
+  assert(storage->used != 0 && frame->generator);
+  struct data_generator* const gen = frame->gen;
+  uint64_t produced = 0;
+  uint32_t idx = 0;
+  do {
+    struct data_frame chunk = {0};
+    const int ret = gen->produce(gen, &chunk);
+    if(ret == 0) {
+      data_storage_free_frame(frame + idx);
+      if(--storage->used == 0) {
+        (void) atomic_fetch_sub_explicit(&data_budget_queues, 1, memory_order_relaxed);
+      }
+      (void) memmove(frame + idx, frame + idx + 1, sizeof(*frame) * (storage->used - idx));
+      return 0;
+    }
+    if(ret == -1) {
+      if(idx == 0) {
+        errno = EAGAIN;
+        return -1;
+      }
+      break;
+    }
+    assert(!chunk.generator);
+    const uint32_t used = storage->used;
+    if(data_storage_insert(storage, idx, &chunk) == -1) {
+      return -1;
+    }
+    if(storage->used != used) {
+      produced += chunk.len - chunk.offset;
+      ++idx;
+    }
+  } while(produced < gen->threshold);
+  return 0;
+}
+
 #undef frame
 
 int data_storage_is_empty(const struct data_storage* const storage) {
@@ -148,7 +519,9 @@ int data_storage_is_empty(const struct data_storage* const storage) {
 uint64_t data_storage_size(const struct data_storage* const storage) {
   uint64_t sum = 0;
   for(uint32_t i = 0; i < storage->used; ++i) {
-    sum += storage->frames[i].len - storage->frames[i].offset;
+    if(!storage->frames[i].generator) {
+      sum += storage->frames[i].len - storage->frames[i].offset;
+    }
   }
   return sum;
 }
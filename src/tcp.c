@@ -1,3 +1,7 @@
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <sched.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <assert.h>
@@ -5,20 +9,47 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <linux/tcp.h>
 #include <stdatomic.h>
 #include <sys/ioctl.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/sendfile.h>
+#include <linux/sock_diag.h>
 
 #include <shnet/tcp.h>
+#include <shnet/dns.h>
 #include <shnet/error.h>
 
+/*
+ * A socket's lock is a futex, 0 when unlocked, 1 when locked and 2 when there
+ * may be waiters, as described by Drepper in "Futexes Are Tricky". It takes 4
+ * bytes instead of a pthread_mutex_t's 40, needs no initialisation beyond
+ * zeroing and no destruction, and the uncontended path is a single atomic.
+ */
+
 void tcp_lock(struct tcp_socket* const socket) {
-  (void) pthread_mutex_lock(&socket->lock);
+  _Atomic uint32_t* const lock = (_Atomic uint32_t*) &socket->lock;
+  uint32_t state = 0;
+  if(atomic_compare_exchange_strong_explicit(lock, &state, 1, memory_order_acquire, memory_order_relaxed)) {
+    return;
+  }
+  if(state != 2) {
+    state = atomic_exchange_explicit(lock, 2, memory_order_acquire);
+  }
+  while(state != 0) {
+    (void) syscall(SYS_futex, lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    state = atomic_exchange_explicit(lock, 2, memory_order_acquire);
+  }
 }
 
 void tcp_unlock(struct tcp_socket* const socket) {
-  (void) pthread_mutex_unlock(&socket->lock);
+  _Atomic uint32_t* const lock = (_Atomic uint32_t*) &socket->lock;
+  if(atomic_exchange_explicit(lock, 0, memory_order_release) == 2) {
+    (void) syscall(SYS_futex, lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
 }
 
 void tcp_socket_cork_on(const struct tcp_socket* const socket) {
@@ -54,7 +85,238 @@ void tcp_socket_keepalive_off(const struct tcp_socket* const socket) {
   (void) net_socket_setopt_false(socket->core.fd, SOL_SOCKET, SO_KEEPALIVE);
 }
 
+static uint32_t tcp_socket_events(const struct tcp_socket* const socket) {
+  return EPOLLET | EPOLLRDHUP | EPOLLOUT | (socket->read_paused ? 0 : EPOLLIN);
+}
+
+void tcp_socket_pause_read(struct tcp_socket* const socket) {
+  tcp_lock(socket);
+  if(!socket->read_paused) {
+    socket->read_paused = 1;
+    if(socket->core.fd != -1) {
+      (void) async_loop_mod(socket->loop, &socket->core, tcp_socket_events(socket));
+    }
+  }
+  tcp_unlock(socket);
+}
+
+void tcp_socket_resume_read(struct tcp_socket* const socket) {
+  tcp_lock(socket);
+  if(socket->read_paused) {
+    socket->read_paused = 0;
+    /*
+     * Modifying the event re-evaluates its readiness, so in edge-triggered
+     * mode any data that arrived while reading was paused is reported again.
+     */
+    if(socket->core.fd != -1) {
+      (void) async_loop_mod(socket->loop, &socket->core, tcp_socket_events(socket));
+    }
+  }
+  tcp_unlock(socket);
+}
+
+int tcp_socket_get_incoming_cpu(const struct tcp_socket* const socket) {
+  return net_socket_get_incoming_cpu(socket->core.fd);
+}
+
+int tcp_socket_stats(struct tcp_socket* const socket, struct tcp_socket_stats* const stats) {
+  tcp_lock(socket);
+  stats->bytes_in = socket->bytes_in;
+  stats->bytes_out = socket->bytes_out;
+  stats->queued = data_storage_size(&socket->queue);
+  const int sfd = socket->core.fd;
+  tcp_unlock(socket);
+  struct tcp_info info = {0};
+  if(getsockopt(sfd, net_proto_tcp, TCP_INFO, &info, &(socklen_t){ sizeof(info) }) == -1) {
+    return -1;
+  }
+  stats->bytes_acked = info.tcpi_bytes_acked;
+  stats->bytes_received = info.tcpi_bytes_received;
+  stats->delivery_rate = info.tcpi_delivery_rate;
+  stats->rtt = info.tcpi_rtt;
+  stats->rtt_var = info.tcpi_rttvar;
+  stats->min_rtt = info.tcpi_min_rtt;
+  stats->cwnd = info.tcpi_snd_cwnd;
+  stats->ssthresh = info.tcpi_snd_ssthresh;
+  stats->mss = info.tcpi_snd_mss;
+  stats->unacked = info.tcpi_unacked;
+  stats->lost = info.tcpi_lost;
+  stats->retransmits = info.tcpi_total_retrans;
+  stats->state = info.tcpi_state;
+  int buf = 0;
+  (void) getsockopt(sfd, SOL_SOCKET, SO_SNDBUF, &buf, &(socklen_t){ sizeof(buf) });
+  stats->sndbuf = buf;
+  buf = 0;
+  (void) getsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &buf, &(socklen_t){ sizeof(buf) });
+  stats->rcvbuf = buf;
+  int queue = 0;
+  (void) ioctl(sfd, TIOCOUTQ, &queue);
+  stats->send_queue = queue;
+  queue = 0;
+  (void) ioctl(sfd, FIONREAD, &queue);
+  stats->recv_queue = queue;
+  return 0;
+}
+
+static uint64_t tcp_time(void) {
+  struct timespec tp;
+  (void) clock_gettime(CLOCK_MONOTONIC_COARSE, &tp);
+  return (uint64_t) tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+int tcp_socket_fastopen_used(const struct tcp_socket* const socket) {
+  struct tcp_info info;
+  if(getsockopt(socket->core.fd, net_proto_tcp, TCP_INFO, &info, &(socklen_t){ sizeof(info) }) == -1) {
+    return 0;
+  }
+  return !!(info.tcpi_options & TCPI_OPT_SYN_DATA);
+}
+
+/*
+ * Handles let other threads refer to sockets without keeping them alive. A
+ * handle is a slot's index in the lower 32 bits and the slot's generation in
+ * the upper 32. The generation is odd while the slot holds a socket and is
+ * bumped once when it's taken and once when it's given back, so handles of
+ * sockets that are gone never match again. A slot's state packs the generation
+ * with the number of threads that have the socket pinned, so that pinning is a
+ * single compare-and-swap that also checks the generation, with no locks.
+ *
+ * Slots live in pages that are never moved or freed, so resolving a handle
+ * never touches freed memory either. A socket gives its slot back when it's
+ * freed, after waiting for every pin to be released. Taking and giving back
+ * slots is rare compared to resolving handles, so the free list has a mutex.
+ */
+
+enum tcp_handle_const {
+  tcp_handle_page_bits = 12,
+  tcp_handle_page = 1 << tcp_handle_page_bits,
+  tcp_handle_pages = 4096
+};
+
+struct tcp_handle_slot {
+  _Atomic uint64_t state;
+  struct tcp_socket* _Atomic socket;
+  uint32_t next;
+};
+
+static struct tcp_handle_slot* _Atomic tcp_handle_table[tcp_handle_pages];
+static pthread_mutex_t tcp_handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t tcp_handle_free = UINT32_MAX;
+static uint32_t tcp_handle_used = 0;
+
+static struct tcp_handle_slot* tcp_handle_slot(const uint32_t idx) {
+  if((idx >> tcp_handle_page_bits) >= tcp_handle_pages) {
+    return NULL;
+  }
+  struct tcp_handle_slot* const page = atomic_load_explicit(&tcp_handle_table[idx >> tcp_handle_page_bits], memory_order_acquire);
+  return page == NULL ? NULL : page + (idx & (tcp_handle_page - 1));
+}
+
+uint64_t tcp_socket_handle(struct tcp_socket* const socket) {
+  (void) pthread_mutex_lock(&tcp_handle_lock);
+  if(socket->handle != 0) {
+    (void) pthread_mutex_unlock(&tcp_handle_lock);
+    return socket->handle;
+  }
+  uint32_t idx;
+  struct tcp_handle_slot* slot;
+  if(tcp_handle_free != UINT32_MAX) {
+    idx = tcp_handle_free;
+    slot = tcp_handle_slot(idx);
+    tcp_handle_free = slot->next;
+  } else {
+    idx = tcp_handle_used;
+    if((idx >> tcp_handle_page_bits) >= tcp_handle_pages) {
+      (void) pthread_mutex_unlock(&tcp_handle_lock);
+      errno = ENFILE;
+      return 0;
+    }
+    if((idx & (tcp_handle_page - 1)) == 0) {
+      struct tcp_handle_slot* const page = shnet_calloc(tcp_handle_page, sizeof(*page));
+      if(page == NULL) {
+        (void) pthread_mutex_unlock(&tcp_handle_lock);
+        return 0;
+      }
+      atomic_store_explicit(&tcp_handle_table[idx >> tcp_handle_page_bits], page, memory_order_release);
+    }
+    ++tcp_handle_used;
+    slot = tcp_handle_slot(idx);
+  }
+  atomic_store_explicit(&slot->socket, socket, memory_order_relaxed);
+  /* Nobody holds a pin on a free slot, so this only bumps the generation */
+  const uint64_t state = atomic_fetch_add_explicit(&slot->state, (uint64_t) 1 << 32, memory_order_release) + ((uint64_t) 1 << 32);
+  socket->handle = (state & ~(uint64_t) UINT32_MAX) | idx;
+  (void) pthread_mutex_unlock(&tcp_handle_lock);
+  return socket->handle;
+}
+
+struct tcp_socket* tcp_handle_acquire(const uint64_t handle) {
+  struct tcp_handle_slot* const slot = tcp_handle_slot((uint32_t) handle);
+  if(slot == NULL) {
+    errno = ESTALE;
+    return NULL;
+  }
+  uint64_t state = atomic_load_explicit(&slot->state, memory_order_relaxed);
+  do {
+    if((state >> 32) != (handle >> 32) || !((state >> 32) & 1)) {
+      errno = ESTALE;
+      return NULL;
+    }
+  } while(!atomic_compare_exchange_weak_explicit(&slot->state, &state, state + 1, memory_order_acquire, memory_order_relaxed));
+  return atomic_load_explicit(&slot->socket, memory_order_relaxed);
+}
+
+void tcp_handle_release(const uint64_t handle) {
+  (void) atomic_fetch_sub_explicit(&tcp_handle_slot((uint32_t) handle)->state, 1, memory_order_release);
+}
+
+int tcp_handle_send(const uint64_t handle, const struct data_frame* const frame) {
+  struct tcp_socket* const socket = tcp_handle_acquire(handle);
+  if(socket == NULL) {
+    data_storage_free_frame_err(frame);
+    errno = ESTALE;
+    return -1;
+  }
+  const int err = tcp_send(socket, frame);
+  tcp_handle_release(handle);
+  return err;
+}
+
+static void tcp_handle_retire(struct tcp_socket* const socket) {
+  const uint32_t idx = (uint32_t) socket->handle;
+  struct tcp_handle_slot* const slot = tcp_handle_slot(idx);
+  /* No new pins from here on, the ones already there are short-lived */
+  uint64_t state = atomic_fetch_add_explicit(&slot->state, (uint64_t) 1 << 32, memory_order_acq_rel);
+  while((state & UINT32_MAX) != 0) {
+    (void) sched_yield();
+    state = atomic_load_explicit(&slot->state, memory_order_acquire);
+  }
+  socket->handle = 0;
+  (void) pthread_mutex_lock(&tcp_handle_lock);
+  slot->next = tcp_handle_free;
+  tcp_handle_free = idx;
+  (void) pthread_mutex_unlock(&tcp_handle_lock);
+}
+
+static void tcp_stage_free(struct tcp_socket* const);
+
+static void tcp_fds_free(struct tcp_socket* const);
+
+static void tcp_budget_leave(struct tcp_socket* const);
+
 void tcp_socket_free_(struct tcp_socket* const socket) {
+  if(socket->budget != NULL) {
+    tcp_budget_leave(socket);
+  }
+  if(socket->handle != 0) {
+    tcp_handle_retire(socket);
+  }
+  if(socket->stage != NULL) {
+    tcp_stage_free(socket);
+  }
+  if(socket->fds != NULL) {
+    tcp_fds_free(socket);
+  }
   if(socket->on_event != NULL) {
     socket->on_event(socket, tcp_deinit);
   }
@@ -62,8 +324,11 @@ void tcp_socket_free_(struct tcp_socket* const socket) {
     (void) close(socket->core.fd);
     socket->core.fd = -1;
   }
-  (void) pthread_mutex_destroy(&socket->lock);
   data_storage_free(&socket->queue);
+  if(socket->deadline != NULL) {
+    free(socket->deadline);
+    socket->deadline = NULL;
+  }
   if(socket->alloc_loop) {
     async_loop_shutdown(socket->loop, async_free | async_ptr_free);
     socket->loop = NULL;
@@ -74,6 +339,14 @@ void tcp_socket_free_(struct tcp_socket* const socket) {
   socket->closing = 0;
   socket->close_guard = 0;
   socket->closing_fast = 0;
+  socket->read_paused = 0;
+  socket->fastopen = 0;
+  socket->timed_out = 0;
+  socket->migrating = 0;
+  socket->race = NULL;
+  socket->connect = NULL;
+  socket->bytes_in = 0;
+  socket->bytes_out = 0;
   uint8_t free_ = socket->free;
   socket->free = 0;
   if(socket->on_event != NULL) {
@@ -95,7 +368,44 @@ void tcp_socket_free(struct tcp_socket* const socket) {
   }
 }
 
+static void tcp_splice_detach(struct tcp_socket* const);
+
+static void tcp_worker_leave(struct tcp_socket* const);
+
+static void tcp_counters_leave(struct tcp_socket* const);
+
+static void tcp_tune_free(struct tcp_socket* const);
+
+static void tcp_deadline_cancel(struct tcp_socket* const);
+
+/*
+ * The socket whose events the loop of this thread is dispatching, if any, and
+ * the migration it asked for meanwhile (see tcp_socket_migrate() below).
+ */
+
+struct tcp_migrate;
+
+static _Thread_local struct tcp_socket* tcp_dispatched;
+
+static _Thread_local struct tcp_migrate* tcp_deferred;
+
 static void tcp_socket_free_internal(struct tcp_socket* const socket) {
+  if(tcp_dispatched == socket) {
+    tcp_dispatched = NULL;
+  }
+  tcp_deadline_cancel(socket);
+  if(socket->tune != NULL) {
+    tcp_tune_free(socket);
+  }
+  if(socket->worker != NULL) {
+    tcp_worker_leave(socket);
+  }
+  if(socket->counters != NULL) {
+    tcp_counters_leave(socket);
+  }
+  if(socket->splice != NULL) {
+    tcp_splice_detach(socket);
+  }
   if(socket->on_event != NULL) {
     socket->on_event(socket, tcp_close);
   }
@@ -144,7 +454,264 @@ void tcp_socket_force_close(struct tcp_socket* const socket) {
   tcp_unlock(socket);
 }
 
+/*
+ * When there is more than one address to connect to, connection attempts are
+ * raced as described in RFC 8305 ("Happy Eyeballs"). Address families are
+ * interleaved, a new attempt is started every tcp_race_delay milliseconds or
+ * as soon as one fails, and the first attempt to complete wins.
+ *
+ * The attempts and the timer live in a separate epoll instance, which is added
+ * to the socket's loop as a single callback event. Attempts that lost are thus
+ * closed without the socket's loop ever seeing any stale events of theirs.
+ */
+
+enum tcp_race_const {
+  tcp_race_delay = 250,
+  tcp_race_batch = 8
+};
+
+struct tcp_race {
+  struct async_callback core;
+  struct tcp_socket* socket;
+  struct addrinfo* addrs;
+  int* fds;
+  int timer;
+  int code;
+  uint32_t next;
+  uint32_t count;
+};
+
+static void tcp_race_free(struct tcp_race* const race) {
+  for(uint32_t i = 0; i < race->count; ++i) {
+    if(race->fds[i] != -1) {
+      (void) close(race->fds[i]);
+    }
+  }
+  (void) close(race->timer);
+  (void) close(race->core.core.fd);
+  free(race);
+}
+
+static int tcp_race_attempt(struct tcp_race* const race) {
+  while(race->next < race->count) {
+    const struct addrinfo* const info = race->addrs + race->next;
+    const int sfd = net_socket_get(info);
+    race->fds[race->next++] = sfd;
+    if(sfd == -1) {
+      /*
+       * Like in tcp_socket_connect(), not being able to create a socket is
+       * fatal. Attempts that are already in progress may still win though.
+       */
+      race->code = errno;
+      race->next = race->count;
+      break;
+    }
+    net_socket_default_options(sfd);
+    errno = 0;
+    (void) net_socket_connect(sfd, info);
+    switch(errno) {
+      case 0:
+      case EINTR:
+      case EINPROGRESS: break;
+      default: {
+        race->code = errno;
+        goto err_sock;
+      }
+    }
+    int err;
+    safe_execute(err = epoll_ctl(race->core.core.fd, EPOLL_CTL_ADD, sfd, &((struct epoll_event) {
+      .events = EPOLLOUT,
+      .data = (epoll_data_t) {
+        .fd = sfd
+      }
+    })), err == -1, errno);
+    if(err == -1) {
+      race->code = errno;
+      goto err_sock;
+    }
+    if(race->next < race->count) {
+      (void) timerfd_settime(race->timer, 0, &((struct itimerspec) {
+        .it_value = (struct timespec) {
+          .tv_sec = tcp_race_delay / 1000,
+          .tv_nsec = (tcp_race_delay % 1000) * 1000000
+        }
+      }), NULL);
+    }
+    return 0;
+    
+    err_sock:
+    (void) close(sfd);
+    race->fds[race->next - 1] = -1;
+  }
+  return -1;
+}
+
+static void tcp_race_onevent(struct async_loop* loop, uint32_t events, struct async_callback* event) {
+  (void) events;
+  struct tcp_race* const race = (struct tcp_race*) event;
+  struct tcp_socket* const socket = race->socket;
+  tcp_lock(socket);
+  const int closed = socket->closing_fast || (socket->closing && data_storage_is_empty(&socket->queue));
+  tcp_unlock(socket);
+  if(closed) {
+    race->code = 0;
+    goto err;
+  }
+  struct epoll_event evts[tcp_race_batch];
+  const int count = epoll_wait(race->core.core.fd, evts, tcp_race_batch, 0);
+  for(int i = 0; i < count; ++i) {
+    const int sfd = evts[i].data.fd;
+    if(sfd == race->timer) {
+      uint64_t expired;
+      (void) read(race->timer, &expired, sizeof(expired));
+    } else {
+      int code = 0;
+      (void) getsockopt(sfd, SOL_SOCKET, SO_ERROR, &code, &(socklen_t){ sizeof(int) });
+      if(code == 0 && !(evts[i].events & (EPOLLERR | EPOLLHUP))) {
+        for(uint32_t j = 0; j < race->count; ++j) {
+          if(race->fds[j] == sfd) {
+            race->fds[j] = -1;
+            break;
+          }
+        }
+        (void) async_loop_remove(loop, &race->core.core);
+        tcp_race_free(race);
+        tcp_lock(socket);
+        socket->race = NULL;
+        socket->core.fd = sfd;
+        const int err = async_loop_add(socket->loop, &socket->core, tcp_socket_events(socket));
+        tcp_unlock(socket);
+        if(err == -1) {
+          tcp_socket_free_internal(socket);
+        }
+        return;
+      }
+      race->code = code != 0 ? code : ECONNREFUSED;
+      (void) epoll_ctl(race->core.core.fd, EPOLL_CTL_DEL, sfd, NULL);
+      for(uint32_t j = 0; j < race->count; ++j) {
+        if(race->fds[j] == sfd) {
+          race->fds[j] = -1;
+          break;
+        }
+      }
+      (void) close(sfd);
+    }
+    if(tcp_race_attempt(race) == -1) {
+      uint32_t pending = 0;
+      for(uint32_t j = 0; j < race->count; ++j) {
+        pending += race->fds[j] != -1;
+      }
+      if(pending == 0) {
+        goto err;
+      }
+    }
+  }
+  return;
+  
+  err:
+  (void) async_loop_remove(loop, &race->core.core);
+  tcp_lock(socket);
+  socket->race = NULL;
+  const int code = socket->timed_out ? ETIMEDOUT : race->code;
+  tcp_unlock(socket);
+  tcp_race_free(race);
+  errno = code;
+  tcp_socket_free_internal(socket);
+}
+
+static int tcp_race(struct tcp_socket* const socket, const struct addrinfo* const info) {
+  uint32_t count = 0;
+  for(const struct addrinfo* i = info; i != NULL; i = i->ai_next) {
+    ++count;
+  }
+  struct tcp_race* const race = shnet_malloc(sizeof(*race) + (sizeof(*race->addrs) + sizeof(struct sockaddr_storage) + sizeof(*race->fds)) * count);
+  if(race == NULL) {
+    return -1;
+  }
+  race->core.core.callback = 1;
+  race->core.on_event = tcp_race_onevent;
+  race->socket = socket;
+  race->addrs = (struct addrinfo*)(race + 1);
+  struct sockaddr_storage* const storage = (struct sockaddr_storage*)(race->addrs + count);
+  race->fds = (int*)(storage + count);
+  race->code = 0;
+  race->next = 0;
+  race->count = count;
+  /*
+   * Interleave address families, starting with the first one returned, so
+   * that a broken family only ever delays the connection by one attempt.
+   */
+  const int family = info->ai_family;
+  const struct addrinfo* first = info;
+  const struct addrinfo* other = info;
+  for(uint32_t i = 0; i < count; ++i) {
+    const int want_first = (i & 1) == 0 || other == NULL;
+    while(first != NULL && first->ai_family != family) {
+      first = first->ai_next;
+    }
+    while(other != NULL && other->ai_family == family) {
+      other = other->ai_next;
+    }
+    const struct addrinfo** const pick = (want_first && first != NULL) || other == NULL ? &first : &other;
+    struct addrinfo* const addr = race->addrs + i;
+    *addr = **pick;
+    addr->ai_addr = (struct sockaddr*)(storage + i);
+    (void) memcpy(addr->ai_addr, (*pick)->ai_addr, (*pick)->ai_addrlen);
+    addr->ai_canonname = NULL;
+    addr->ai_next = NULL;
+    *pick = (*pick)->ai_next;
+    race->fds[i] = -1;
+  }
+  safe_execute(race->core.core.fd = epoll_create1(EPOLL_CLOEXEC), race->core.core.fd == -1, errno);
+  if(race->core.core.fd == -1) {
+    goto err_race;
+  }
+  safe_execute(race->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), race->timer == -1, errno);
+  if(race->timer == -1) {
+    goto err_epoll;
+  }
+  int err;
+  safe_execute(err = epoll_ctl(race->core.core.fd, EPOLL_CTL_ADD, race->timer, &((struct epoll_event) {
+    .events = EPOLLIN,
+    .data = (epoll_data_t) {
+      .fd = race->timer
+    }
+  })), err == -1, errno);
+  if(err == -1) {
+    goto err_timer;
+  }
+  if(tcp_race_attempt(race) == -1) {
+    errno = race->code;
+    goto err_fds;
+  }
+  tcp_lock(socket);
+  socket->race = race;
+  tcp_unlock(socket);
+  if(async_loop_add(socket->loop, &race->core.core, EPOLLIN) == -1) {
+    tcp_lock(socket);
+    socket->race = NULL;
+    tcp_unlock(socket);
+    goto err_fds;
+  }
+  return 0;
+  
+  err_fds:
+  tcp_race_free(race);
+  return -1;
+  
+  err_timer:
+  (void) close(race->timer);
+  err_epoll:
+  (void) close(race->core.core.fd);
+  err_race:
+  free(race);
+  return -1;
+}
+
 static int tcp_socket_connect(struct tcp_socket* const socket, const struct addrinfo* info) {
+  if(info != NULL && info->ai_next != NULL) {
+    return tcp_race(socket, info);
+  }
   unsigned int ers = 0;
   while(1) {
     tcp_lock(socket);
@@ -160,6 +727,13 @@ static int tcp_socket_connect(struct tcp_socket* const socket, const struct addr
       goto err;
     }
     net_socket_default_options(socket->core.fd);
+    if(socket->fastopen) {
+      /*
+       * connect() returns right away and the SYN is deferred
+       * until the first send(), so that it can carry data.
+       */
+      (void) net_socket_setopt_true(socket->core.fd, net_proto_tcp, TCP_FASTOPEN_CONNECT);
+    }
     tcp_unlock(socket);
     errno = 0;
     (void) net_socket_connect(socket->core.fd, info);
@@ -167,7 +741,10 @@ static int tcp_socket_connect(struct tcp_socket* const socket, const struct addr
       case 0:
       case EINTR:
       case EINPROGRESS: {
-        if(async_loop_add(socket->loop, &socket->core, EPOLLET | EPOLLRDHUP | EPOLLIN | EPOLLOUT) == -1) {
+        tcp_lock(socket);
+        const int err = async_loop_add(socket->loop, &socket->core, tcp_socket_events(socket));
+        tcp_unlock(socket);
+        if(err == -1) {
           info = NULL;
           continue;
         }
@@ -211,55 +788,334 @@ static void tcp_socket_connect_async(struct net_async_address* addr, struct addr
 
 #undef socket
 
-int tcp_socket(struct tcp_socket* const socket, const struct tcp_socket_options* const opt) {
-  if(opt == NULL || (opt->info == NULL && opt->hostname == NULL && opt->port == NULL)) {
-    errno = EINVAL;
+/*
+ * Deadlines share a single wheel timer per socket. Activity only stores a
+ * timestamp, and the timer, when it expires, checks whether the earliest
+ * deadline really passed or the timer should just be re-armed for the
+ * remaining time. That keeps the per-packet cost at a clock read and a store.
+ * Sockets without timeouts don't carry any of it.
+ */
+
+struct tcp_deadline {
+  struct async_timer timer;
+  struct tcp_socket* socket;
+  uint64_t last_read;
+  uint64_t last_write;
+};
+
+static int tcp_deadline_alloc(struct tcp_socket* const socket) {
+  struct tcp_deadline* const deadline = shnet_calloc(1, sizeof(*deadline));
+  if(deadline == NULL) {
     return -1;
   }
-  {
-    int err;
-    safe_execute(err = pthread_mutex_init(&socket->lock, NULL), err != 0, err);
-    if(err != 0) {
-      errno = err;
-      return -1;
+  deadline->socket = socket;
+  tcp_lock(socket);
+  socket->deadline = deadline;
+  tcp_unlock(socket);
+  return 0;
+}
+
+static void tcp_deadline_cancel(struct tcp_socket* const socket) {
+  if(socket->deadline != NULL) {
+    async_timer_cancel(socket->loop, &socket->deadline->timer);
+  }
+}
+
+static uint64_t tcp_socket_deadline(const struct tcp_socket* const socket, const uint64_t now) {
+  const struct tcp_deadline* const last = socket->deadline;
+  uint64_t deadline = UINT64_MAX;
+  if(socket->idle_timeout != 0) {
+    deadline = (last->last_read > last->last_write ? last->last_read : last->last_write) + socket->idle_timeout;
+  }
+  if(socket->read_timeout != 0 && last->last_read + socket->read_timeout < deadline) {
+    deadline = last->last_read + socket->read_timeout;
+  }
+  if(socket->write_timeout != 0) {
+    /*
+     * Writes can only stall when something is queued. Otherwise just check
+     * back later, since the queue may be filled from any thread.
+     */
+    const uint64_t last_write = data_storage_is_empty(&socket->queue) ? now : last->last_write;
+    if(last_write + socket->write_timeout < deadline) {
+      deadline = last_write + socket->write_timeout;
     }
   }
-  if(socket->loop == NULL) {
-    socket->loop = shnet_calloc(1, sizeof(*socket->loop));
-    if(socket->loop == NULL) {
-      goto err_mutex;
+  return deadline;
+}
+
+enum tcp_connect_state {
+  tcp_connect_pending,
+  tcp_connect_done,
+  tcp_connect_detached
+};
+
+struct tcp_connect {
+  struct async_task task;
+  struct net_async_address addr;
+  struct addrinfo hints;
+  struct async_loop* loop;
+  struct tcp_socket* socket;
+  struct addrinfo* info;
+  struct net_dns_cache* dns_cache;
+  struct dns_resolver* resolver;
+  int code;
+  _Atomic uint8_t state;
+  uint8_t resolving:1;
+};
+
+static void tcp_socket_ontimeout(struct async_loop* loop, struct async_timer* timer) {
+  struct tcp_socket* const socket = ((struct tcp_deadline*) timer)->socket;
+  tcp_lock(socket);
+  if(!socket->opened) {
+    socket->timed_out = 1;
+    socket->closing_fast = 1;
+    data_storage_free(&socket->queue);
+    struct tcp_connect* const connect = socket->connect;
+    if(connect != NULL) {
+      /*
+       * Still resolving. The lookup can't be cancelled, so it is detached
+       * and frees itself once it completes. If it already completed, the
+       * task is queued on this loop and frees itself when it runs.
+       */
+      connect->socket = NULL;
+      (void) atomic_exchange_explicit(&connect->state, tcp_connect_detached, memory_order_acq_rel);
+      socket->connect = NULL;
+      tcp_unlock(socket);
+      errno = ETIMEDOUT;
+      tcp_socket_free_internal(socket);
+      return;
     }
-    if(tcp_async_loop(socket->loop) == -1) {
-      free(socket->loop);
-      socket->loop = NULL;
-      goto err_mutex;
+    if(socket->race != NULL) {
+      /* Wake the race up, it will notice the socket is closing */
+      (void) timerfd_settime(socket->race->timer, 0, &((struct itimerspec) {
+        .it_value = (struct timespec) {
+          .tv_nsec = 1
+        }
+      }), NULL);
+    } else if(socket->core.fd != -1) {
+      (void) shutdown(socket->core.fd, SHUT_RDWR);
     }
-    if(async_loop_start(socket->loop) == -1) {
-      async_loop_free(socket->loop);
-      free(socket->loop);
-      socket->loop = NULL;
-      goto err_mutex;
+    tcp_unlock(socket);
+    return;
+  }
+  const uint64_t now = tcp_time();
+  const uint64_t deadline = tcp_socket_deadline(socket, now);
+  if(now < deadline) {
+    tcp_unlock(socket);
+    async_timer_set(loop, timer, deadline - now);
+    return;
+  }
+  socket->timed_out = 1;
+  tcp_unlock(socket);
+  tcp_socket_force_close(socket);
+}
+
+static void tcp_socket_arm(struct tcp_socket* const socket) {
+  if((socket->idle_timeout | socket->read_timeout | socket->write_timeout) == 0) {
+    tcp_deadline_cancel(socket);
+    return;
+  }
+  if(socket->deadline == NULL && tcp_deadline_alloc(socket) == -1) {
+    /* The timeouts can't be kept, so neither can the connection */
+    tcp_socket_force_close(socket);
+    return;
+  }
+  const uint64_t now = tcp_time();
+  tcp_lock(socket);
+  socket->deadline->last_read = now;
+  socket->deadline->last_write = now;
+  const uint64_t deadline = tcp_socket_deadline(socket, now);
+  tcp_unlock(socket);
+  socket->deadline->timer.on_timeout = tcp_socket_ontimeout;
+  async_timer_set(socket->loop, &socket->deadline->timer, deadline - now);
+}
+
+static void tcp_connect_run(struct async_loop*, struct async_task*);
+
+static void tcp_connect_resolved(struct net_async_address* addr, struct addrinfo* info) {
+  struct tcp_connect* const connect = (struct tcp_connect*)((char*) addr - offsetof(struct tcp_connect, addr));
+  connect->info = info;
+  connect->code = errno;
+  if(atomic_exchange_explicit(&connect->state, tcp_connect_done, memory_order_acq_rel) == tcp_connect_detached) {
+    /* The socket timed out, and its loop might be gone by now */
+    if(info != NULL) {
+      net_free_address(info);
     }
-    socket->alloc_loop = 1;
+    free(connect);
+    return;
   }
-  socket->core.fd = -1;
-  socket->core.socket = 1;
-  socket->core.server = 0;
-  if(opt->info != NULL) {
-    if(tcp_socket_connect(socket, opt->info) == -1) {
-      goto err_loop;
+  /* Might be on any thread, continue on the socket's loop */
+  async_loop_post(connect->loop, &connect->task);
+}
+
+static void tcp_connect_run(struct async_loop* loop, struct async_task* task) {
+  struct tcp_connect* const connect = (struct tcp_connect*) task;
+  struct tcp_socket* const socket = connect->socket;
+  if(socket == NULL) {
+    /* Timed out while resolving */
+    if(connect->info != NULL) {
+      net_free_address(connect->info);
     }
-  } else {
-    const size_t hostname_len = opt->hostname == NULL ? 0 : (strlen(opt->hostname) + 1);
-    const size_t port_len = opt->port == NULL ? 0 : (strlen(opt->port) + 1);
-    struct net_async_address* const async = shnet_malloc(sizeof(*async) + hostname_len + port_len + sizeof(struct addrinfo));
-    if(async == NULL) {
-      goto err_loop;
+    free(connect);
+    return;
+  }
+  if(!connect->resolving) {
+    socket->deadline->timer.on_timeout = tcp_socket_ontimeout;
+    async_timer_set(loop, &socket->deadline->timer, socket->connect_timeout);
+    if(connect->info == NULL) {
+      connect->resolving = 1;
+      tcp_lock(socket);
+      socket->connect = connect;
+      tcp_unlock(socket);
+      int err;
+      if(connect->dns_cache != NULL) {
+        err = net_dns_cache_get_async(connect->dns_cache, &connect->addr);
+      } else if(connect->resolver != NULL) {
+        err = dns_resolve(connect->resolver, &connect->addr);
+      } else {
+        err = net_get_address_async(&connect->addr);
+      }
+      if(err == -1) {
+        tcp_lock(socket);
+        socket->connect = NULL;
+        tcp_unlock(socket);
+        free(connect);
+        tcp_socket_free_internal(socket);
+      }
+      return;
     }
-    if(opt->hostname == NULL) {
-      async->hostname = NULL;
-      async->port = (char*)(async + 1);
-      (void) memcpy(async->port, opt->port, port_len);
+  } else {
+    tcp_lock(socket);
+    socket->connect = NULL;
+    tcp_unlock(socket);
+  }
+  struct addrinfo* const info = connect->info;
+  errno = connect->code;
+  free(connect);
+  if(info == NULL) {
+    tcp_socket_free_internal(socket);
+    return;
+  }
+  const int err = tcp_socket_connect(socket, info);
+  net_free_address(info);
+  if(err == -1) {
+    tcp_socket_free_internal(socket);
+  }
+}
+
+static int tcp_socket_connect_timed(struct tcp_socket* const socket, const struct tcp_socket_options* const opt) {
+  const size_t hostname_len = opt->hostname == NULL ? 0 : (strlen(opt->hostname) + 1);
+  const size_t port_len = opt->port == NULL ? 0 : (strlen(opt->port) + 1);
+  struct tcp_connect* const connect = shnet_calloc(1, sizeof(*connect) + hostname_len + port_len);
+  if(connect == NULL) {
+    return -1;
+  }
+  if(opt->info != NULL) {
+    connect->info = net_copy_address(opt->info);
+    if(connect->info == NULL) {
+      free(connect);
+      return -1;
+    }
+  } else {
+    char* const strings = (char*)(connect + 1);
+    if(opt->hostname != NULL) {
+      connect->addr.hostname = strings;
+      (void) memcpy(connect->addr.hostname, opt->hostname, hostname_len);
+    }
+    if(opt->port != NULL) {
+      connect->addr.port = strings + hostname_len;
+      (void) memcpy(connect->addr.port, opt->port, port_len);
+    }
+    connect->hints.ai_family = opt->family;
+    connect->hints.ai_socktype = net_sock_stream;
+    connect->hints.ai_protocol = net_proto_tcp;
+    connect->hints.ai_flags = opt->flags;
+    connect->addr.hints = &connect->hints;
+    connect->addr.callback = tcp_connect_resolved;
+    connect->dns_cache = opt->dns_cache;
+    connect->resolver = opt->resolver;
+  }
+  connect->loop = socket->loop;
+  connect->socket = socket;
+  connect->task.on_run = tcp_connect_run;
+  /*
+   * The deadline timer may only be touched by the loop's thread, so
+   * connecting starts there.
+   */
+  async_loop_post(socket->loop, &connect->task);
+  return 0;
+}
+
+int tcp_socket(struct tcp_socket* const socket, const struct tcp_socket_options* const opt) {
+  if(opt == NULL || (opt->info == NULL && opt->hostname == NULL && opt->port == NULL)) {
+    errno = EINVAL;
+    return -1;
+  }
+  socket->lock = 0;
+  socket->handle = 0;
+  socket->deadline = NULL;
+  if((opt->connect_timeout | opt->idle_timeout | opt->read_timeout | opt->write_timeout) != 0 && tcp_deadline_alloc(socket) == -1) {
+    return -1;
+  }
+  if(socket->loop == NULL) {
+    socket->loop = shnet_calloc(1, sizeof(*socket->loop));
+    if(socket->loop == NULL) {
+      goto err_deadline;
+    }
+    if(tcp_async_loop(socket->loop) == -1) {
+      free(socket->loop);
+      socket->loop = NULL;
+      goto err_deadline;
+    }
+    if(async_loop_start(socket->loop) == -1) {
+      async_loop_free(socket->loop);
+      free(socket->loop);
+      socket->loop = NULL;
+      goto err_deadline;
+    }
+    socket->alloc_loop = 1;
+  }
+  socket->core.fd = -1;
+  socket->core.socket = 1;
+  socket->core.server = 0;
+  socket->core.callback = 0;
+  socket->fastopen = opt->fastopen != 0;
+  socket->worker = NULL;
+  socket->counters = NULL;
+  socket->bytes_in = 0;
+  socket->bytes_out = 0;
+  socket->race = NULL;
+  socket->connect = NULL;
+  socket->tune = NULL;
+  socket->autotune = opt->autotune != 0;
+  socket->stage = NULL;
+  socket->stage_sends = opt->stage_sends != 0;
+  socket->fds = NULL;
+  socket->connect_timeout = opt->connect_timeout;
+  socket->idle_timeout = opt->idle_timeout;
+  socket->read_timeout = opt->read_timeout;
+  socket->write_timeout = opt->write_timeout;
+  socket->timed_out = 0;
+  socket->migrating = 0;
+  if(opt->connect_timeout != 0) {
+    if(tcp_socket_connect_timed(socket, opt) == -1) {
+      goto err_loop;
+    }
+  } else if(opt->info != NULL) {
+    if(tcp_socket_connect(socket, opt->info) == -1) {
+      goto err_loop;
+    }
+  } else {
+    const size_t hostname_len = opt->hostname == NULL ? 0 : (strlen(opt->hostname) + 1);
+    const size_t port_len = opt->port == NULL ? 0 : (strlen(opt->port) + 1);
+    struct net_async_address* const async = shnet_malloc(sizeof(*async) + hostname_len + port_len + sizeof(struct addrinfo));
+    if(async == NULL) {
+      goto err_loop;
+    }
+    if(opt->hostname == NULL) {
+      async->hostname = NULL;
+      async->port = (char*)(async + 1);
+      (void) memcpy(async->port, opt->port, port_len);
     } else {
       if(opt->port == NULL) {
         async->hostname = (char*)(async + 1);
@@ -280,7 +1136,15 @@ int tcp_socket(struct tcp_socket* const socket, const struct tcp_socket_options*
     info->ai_protocol = net_proto_tcp;
     info->ai_flags = opt->flags;
     async->hints = info;
-    if(net_get_address_async(async) == -1) {
+    int err;
+    if(opt->dns_cache != NULL) {
+      err = net_dns_cache_get_async(opt->dns_cache, async);
+    } else if(opt->resolver != NULL) {
+      err = dns_resolve(opt->resolver, async);
+    } else {
+      err = net_get_address_async(async);
+    }
+    if(err == -1) {
       free(async);
       goto err_loop;
     }
@@ -293,23 +1157,126 @@ int tcp_socket(struct tcp_socket* const socket, const struct tcp_socket_options*
     socket->loop = NULL;
     socket->alloc_loop = 0;
   }
-  err_mutex:
-  (void) pthread_mutex_destroy(&socket->lock);
+  err_deadline:
+  if(socket->deadline != NULL) {
+    free(socket->deadline);
+    socket->deadline = NULL;
+  }
   return -1;
 }
 
+enum tcp_send_const {
+  tcp_send_iov = 64,
+  /* SCM_MAX_FD */
+  tcp_fds_max = 253
+};
+
+/*
+ * File descriptors passed over UNIX sockets ride on the first byte of a frame.
+ * Until that byte is sent, they are kept, duplicated, in a list ordered by
+ * the byte's position in the stream. Sends stop short of the next position,
+ * so that the byte starts the sendmsg() that carries the descriptors.
+ */
+
+struct tcp_fds {
+  struct tcp_fds* next;
+  uint64_t position;
+  uint32_t count;
+  int fds[];
+};
+
+static void tcp_fds_close(struct tcp_fds* const fds) {
+  for(uint32_t i = 0; i < fds->count; ++i) {
+    (void) close(fds->fds[i]);
+  }
+  free(fds);
+}
+
+static void tcp_fds_free(struct tcp_socket* const socket) {
+  struct tcp_fds* fds = socket->fds;
+  socket->fds = NULL;
+  while(fds != NULL) {
+    struct tcp_fds* const next = fds->next;
+    tcp_fds_close(fds);
+    fds = next;
+  }
+}
+
+/* Must be called with the socket locked, and its fds due */
+static ssize_t tcp_send_fds_now(struct tcp_socket* const socket) {
+  struct tcp_fds* const fds = socket->fds;
+  const struct data_frame* const frame = socket->queue.frames;
+  struct iovec iov = {
+    .iov_base = frame->data + frame->offset,
+    .iov_len = frame->len - frame->offset
+  };
+  _Alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * tcp_fds_max)];
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = CMSG_SPACE(sizeof(int) * fds->count)
+  };
+  struct cmsghdr* const cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds->count);
+  (void) memcpy(CMSG_DATA(cmsg), fds->fds, sizeof(int) * fds->count);
+  ssize_t bytes;
+  safe_execute(bytes = sendmsg(socket->core.fd, &msg, MSG_NOSIGNAL), bytes == -1, errno);
+  if(bytes > 0) {
+    /* The peer has its own copies now */
+    socket->fds = fds->next;
+    tcp_fds_close(fds);
+  }
+  return bytes;
+}
+
+/* Consecutive frames in memory go out in one syscall */
+static ssize_t tcp_send_gather(const struct tcp_socket* const socket, uint64_t limit) {
+  struct iovec iov[tcp_send_iov];
+  size_t len = 0;
+  const struct data_frame* frame = socket->queue.frames;
+  const struct data_frame* const end = frame + socket->queue.used;
+  for(; frame != end && len != tcp_send_iov && limit != 0 && !frame->file && !frame->generator; ++frame) {
+    const uint64_t left = frame->len - frame->offset;
+    iov[len++] = (struct iovec) {
+      .iov_base = frame->data + frame->offset,
+      .iov_len = left < limit ? left : limit
+    };
+    limit -= iov[len - 1].iov_len;
+  }
+  ssize_t bytes;
+  safe_execute(bytes = sendmsg(socket->core.fd, &((struct msghdr) {
+    .msg_iov = iov,
+    .msg_iovlen = len
+  }), MSG_NOSIGNAL), bytes == -1, errno);
+  return bytes;
+}
+
 int tcp_send_buffered(struct tcp_socket* const socket) {
   while(!data_storage_is_empty(&socket->queue)) {
     ssize_t bytes;
     errno = 0;
 #define data_ socket->queue.frames
-    if(data_->file) {
+    if(data_->generator) {
+      if(data_storage_generate(&socket->queue) == -1) {
+        return -1;
+      }
+      continue;
+    }
+    const uint64_t until = socket->fds == NULL ? UINT64_MAX : socket->fds->position - socket->bytes_out;
+    const uint64_t left = data_->len - data_->offset < until ? data_->len - data_->offset : until;
+    if(until == 0) {
+      bytes = tcp_send_fds_now(socket);
+    } else if(data_->file) {
       off_t off = data_->offset;
-      safe_execute(bytes = sendfile(socket->core.fd, data_->fd, &off, data_->len - data_->offset), bytes == -1, errno);
+      safe_execute(bytes = sendfile(socket->core.fd, data_->fd, &off, left), bytes == -1, errno);
+    } else if(socket->queue.used > 1 && left == data_->len - data_->offset && !data_[1].file && !data_[1].generator) {
+      bytes = tcp_send_gather(socket, until);
     } else {
-      safe_execute(bytes = send(socket->core.fd, data_->data + data_->offset, data_->len - data_->offset, MSG_NOSIGNAL), bytes == -1, errno);
+      safe_execute(bytes = send(socket->core.fd, data_->data + data_->offset, left, MSG_NOSIGNAL), bytes == -1, errno);
     }
-#undef data_
     if(bytes == -1) {
       switch(errno) {
         case EINTR: continue;
@@ -327,7 +1294,17 @@ int tcp_send_buffered(struct tcp_socket* const socket) {
         default: return -1;
       }
     }
-    data_storage_drain(&socket->queue, bytes);
+    socket->bytes_out += bytes;
+    if(socket->deadline != NULL && (socket->write_timeout | socket->idle_timeout)) {
+      socket->deadline->last_write = tcp_time();
+    }
+    do {
+      const uint64_t left = data_->len - data_->offset;
+      const uint64_t drained = (uint64_t) bytes < left ? (uint64_t) bytes : left;
+      data_storage_drain(&socket->queue, drained);
+      bytes -= drained;
+    } while(bytes != 0);
+#undef data_
   }
   if(!socket->close_guard && socket->closing) {
     (void) shutdown(socket->core.fd, SHUT_WR);
@@ -337,12 +1314,184 @@ int tcp_send_buffered(struct tcp_socket* const socket) {
   return 0;
 }
 
+/*
+ * With stage_sends set, tcp_send() called from outside of the socket's loop
+ * doesn't take the socket's lock. The frame is pushed onto a lock-free stack
+ * instead, and the loop moves whatever piled up meanwhile to the queue and
+ * sends it all at once. Only the first frame of a batch posts the flush, and
+ * async_loop_post() only wakes the loop if it isn't awake already.
+ *
+ * The stage is freed by tcp_socket_free_(), unless a flush is still pending,
+ * in which case the flush frees it when it sees the socket is gone.
+ */
+
+struct tcp_staged {
+  struct tcp_staged* next;
+  struct data_frame frame;
+};
+
+enum tcp_stage_state {
+  tcp_stage_running = 1,
+  tcp_stage_detached = 2
+};
+
+struct tcp_stage {
+  struct async_task task;
+  struct tcp_socket* socket;
+  _Atomic(struct tcp_staged*) head;
+  _Atomic uint32_t state;
+  _Atomic uint8_t posted;
+};
+
+static int tcp_on_loop(const struct tcp_socket* const socket) {
+  return pthread_equal(pthread_self(), socket->loop->thread);
+}
+
+/* Must be called with the socket locked */
+static void tcp_stage_take(struct tcp_socket* const socket, struct tcp_stage* const stage) {
+  struct tcp_staged* node = atomic_exchange(&stage->head, NULL);
+  /* The frames were pushed in reverse order */
+  struct tcp_staged* list = NULL;
+  while(node != NULL) {
+    struct tcp_staged* const next = node->next;
+    node->next = list;
+    list = node;
+    node = next;
+  }
+  while(list != NULL) {
+    struct tcp_staged* const next = list->next;
+    if(socket->closing || socket->closing_fast || tcp_budget_check(socket, &socket->queue) == -1 ||
+      data_storage_add(&socket->queue, &list->frame) == -1) {
+      data_storage_free_frame_err(&list->frame);
+    }
+    free(list);
+    list = next;
+  }
+}
+
+static void tcp_stage_discard(struct tcp_stage* const stage) {
+  struct tcp_staged* node = atomic_exchange_explicit(&stage->head, NULL, memory_order_acquire);
+  while(node != NULL) {
+    struct tcp_staged* const next = node->next;
+    data_storage_free_frame_err(&node->frame);
+    free(node);
+    node = next;
+  }
+}
+
+static void tcp_stage_onrun(struct async_loop* loop, struct async_task* task) {
+  (void) loop;
+  struct tcp_stage* const stage = (struct tcp_stage*) task;
+  uint32_t state = 0;
+  if(!atomic_compare_exchange_strong_explicit(&stage->state, &state, tcp_stage_running, memory_order_acquire, memory_order_relaxed)) {
+    tcp_stage_discard(stage);
+    free(stage);
+    return;
+  }
+  /* Frames staged from now on post another flush */
+  atomic_store(&stage->posted, 0);
+  struct tcp_socket* const socket = stage->socket;
+  tcp_lock(socket);
+  tcp_stage_take(socket, stage);
+  if(socket->opened && !socket->closing_fast && tcp_send_buffered(socket) != -2 && !socket->dont_autoclean) {
+    (void) data_storage_resize(&socket->queue, socket->queue.used);
+  }
+  tcp_unlock(socket);
+  /* The socket may have been freed meanwhile, which the next flush must see */
+  (void) atomic_fetch_and_explicit(&stage->state, ~(uint32_t) tcp_stage_running, memory_order_release);
+}
+
+static struct tcp_stage* tcp_stage_get(struct tcp_socket* const socket) {
+  _Atomic(struct tcp_stage*)* const ptr = (_Atomic(struct tcp_stage*)*) &socket->stage;
+  struct tcp_stage* stage = atomic_load_explicit(ptr, memory_order_acquire);
+  if(stage != NULL) {
+    return stage;
+  }
+  struct tcp_stage* const fresh = shnet_calloc(1, sizeof(*fresh));
+  if(fresh == NULL) {
+    return NULL;
+  }
+  fresh->task.on_run = tcp_stage_onrun;
+  fresh->socket = socket;
+  if(!atomic_compare_exchange_strong_explicit(ptr, &stage, fresh, memory_order_acq_rel, memory_order_acquire)) {
+    free(fresh);
+    return stage;
+  }
+  return fresh;
+}
+
+static int tcp_stage_push(struct tcp_socket* const socket, const struct data_frame* const frame) {
+  struct tcp_stage* const stage = tcp_stage_get(socket);
+  if(stage == NULL) {
+    goto err;
+  }
+  struct tcp_staged* const node = shnet_malloc(sizeof(*node));
+  if(node == NULL) {
+    goto err;
+  }
+  node->frame = *frame;
+  if(!frame->read_only && frame->dont_free && !frame->file && !frame->generator) {
+    /* The caller may reuse the memory as soon as this returns */
+    const uint64_t len = frame->len - frame->offset;
+    char* const data = data_pool_malloc(len);
+    if(data == NULL) {
+      free(node);
+      goto err;
+    }
+    (void) memcpy(data, frame->data + frame->offset, len);
+    node->frame = (struct data_frame) {
+      .data = data,
+      .len = len,
+      .read_only = 1,
+      .free_onerr = 1,
+      .pooled = 1
+    };
+  }
+  node->next = atomic_load_explicit(&stage->head, memory_order_relaxed);
+  while(!atomic_compare_exchange_weak(&stage->head, &node->next, node));
+  if(!atomic_exchange(&stage->posted, 1)) {
+    async_loop_post(socket->loop, &stage->task);
+  }
+  errno = 0;
+  return 0;
+  
+  err:
+  data_storage_free_frame_err(frame);
+  return -1;
+}
+
+static void tcp_stage_free(struct tcp_socket* const socket) {
+  struct tcp_stage* const stage = socket->stage;
+  socket->stage = NULL;
+  uint32_t state = atomic_fetch_or_explicit(&stage->state, tcp_stage_detached, memory_order_acq_rel);
+  while(state & tcp_stage_running) {
+    (void) sched_yield();
+    state = atomic_load_explicit(&stage->state, memory_order_acquire);
+  }
+  /* Unless a flush is pending, which will see the socket is gone */
+  if(!atomic_exchange(&stage->posted, 1)) {
+    tcp_stage_discard(stage);
+    free(stage);
+  }
+}
+
 int tcp_send(struct tcp_socket* const socket, const struct data_frame* const frame) {
+  if(socket->stage_sends && !socket->alloc_loop && !tcp_on_loop(socket)) {
+    return tcp_stage_push(socket, frame);
+  }
   tcp_lock(socket);
+  struct tcp_stage* const stage = atomic_load_explicit((_Atomic(struct tcp_stage*)*) &socket->stage, memory_order_acquire);
+  if(stage != NULL) {
+    /* Whatever other threads staged goes first */
+    tcp_stage_take(socket, stage);
+  }
   if(socket->closing || socket->closing_fast) {
     errno = EPIPE;
     goto err;
   }
+  if(tcp_budget_check(socket, &socket->queue) == -1) {
+    goto err;
+  }
   const int err = tcp_send_buffered(socket);
   if(err == -2) {
     errno = EPIPE;
@@ -351,12 +1500,20 @@ int tcp_send(struct tcp_socket* const socket, const struct data_frame* const fra
   if(!socket->dont_autoclean) {
     (void) data_storage_resize(&socket->queue, socket->queue.used);
   }
-  if(err == -1 || !socket->opened) {
+  if(err == -1 || !socket->opened || frame->generator) {
+    if(socket->deadline != NULL && socket->write_timeout != 0 && data_storage_is_empty(&socket->queue)) {
+      /* Writes stall from the moment there is something to write */
+      socket->deadline->last_write = tcp_time();
+    }
     errno = 0;
     if(data_storage_add(&socket->queue, frame) == -1) {
       goto err;
     }
+    if(err == 0 && socket->opened) {
+      (void) tcp_send_buffered(socket);
+    }
     tcp_unlock(socket);
+    errno = 0;
     return 0;
   }
   struct data_frame data = *frame;
@@ -377,6 +1534,9 @@ int tcp_send(struct tcp_socket* const socket, const struct data_frame* const fra
           goto err;
         }
         default: {
+          if(socket->deadline != NULL && socket->write_timeout != 0 && data.offset == frame->offset) {
+            socket->deadline->last_write = tcp_time();
+          }
           const int ret = data_storage_add(&socket->queue, &data);
           tcp_unlock(socket);
           return ret;
@@ -385,6 +1545,10 @@ int tcp_send(struct tcp_socket* const socket, const struct data_frame* const fra
       break;
     }
     data.offset += bytes;
+    socket->bytes_out += bytes;
+    if(socket->deadline != NULL && (socket->write_timeout | socket->idle_timeout)) {
+      socket->deadline->last_write = tcp_time();
+    }
     if(data.offset == data.len) {
       tcp_unlock(socket);
       data_storage_free_frame(frame);
@@ -399,110 +1563,1337 @@ int tcp_send(struct tcp_socket* const socket, const struct data_frame* const fra
   return -1;
 }
 
-uint64_t tcp_read(struct tcp_socket* const socket, void* data, uint64_t size) {
-  if(size == 0) {
-    errno = 0;
-    return 0;
+int tcp_send_fds(struct tcp_socket* const socket, const int* const fds, const uint32_t count, const struct data_frame* const frame) {
+  if(count == 0 || count > tcp_fds_max || frame->file || frame->generator || frame->offset == frame->len) {
+    errno = EINVAL;
+    goto err;
+  }
+  struct tcp_fds* const entry = shnet_malloc(sizeof(*entry) + sizeof(int) * count);
+  if(entry == NULL) {
+    goto err;
+  }
+  /* The caller may close its own as soon as this returns */
+  entry->count = 0;
+  for(; entry->count < count; ++entry->count) {
+    entry->fds[entry->count] = fcntl(fds[entry->count], F_DUPFD_CLOEXEC, 0);
+    if(entry->fds[entry->count] == -1) {
+      goto err_entry;
+    }
+  }
+  entry->next = NULL;
+  tcp_lock(socket);
+  struct tcp_stage* const stage = atomic_load_explicit((_Atomic(struct tcp_stage*)*) &socket->stage, memory_order_acquire);
+  if(stage != NULL) {
+    tcp_stage_take(socket, stage);
+  }
+  if(socket->closing || socket->closing_fast) {
+    errno = EPIPE;
+    goto err_lock;
+  }
+  if(socket->core.fd == -1 || net_socket_get_family(socket->core.fd) != net_family_unix) {
+    errno = EINVAL;
+    goto err_lock;
+  }
+  if(tcp_budget_check(socket, &socket->queue) == -1) {
+    goto err_lock;
+  }
+  entry->position = socket->bytes_out;
+  for(uint32_t i = 0; i < socket->queue.used; ++i) {
+    const struct data_frame* const queued = socket->queue.frames + i;
+    if(queued->generator) {
+      /* There is no telling where its data ends */
+      errno = EBUSY;
+      goto err_lock;
+    }
+    entry->position += queued->len - queued->offset;
+  }
+  if(socket->deadline != NULL && socket->write_timeout != 0 && data_storage_is_empty(&socket->queue)) {
+    socket->deadline->last_write = tcp_time();
+  }
+  if(data_storage_add(&socket->queue, frame) == -1) {
+    tcp_unlock(socket);
+    tcp_fds_close(entry);
+    return -1;
+  }
+  struct tcp_fds** tail = &socket->fds;
+  while(*tail != NULL) {
+    tail = &(*tail)->next;
+  }
+  *tail = entry;
+  if(socket->opened) {
+    (void) tcp_send_buffered(socket);
+  }
+  tcp_unlock(socket);
+  errno = 0;
+  return 0;
+  
+  err_lock:
+  tcp_unlock(socket);
+  err_entry:
+  tcp_fds_close(entry);
+  err:
+  data_storage_free_frame_err(frame);
+  return -1;
+}
+
+uint64_t tcp_read(struct tcp_socket* const socket, void* data, uint64_t size) {
+  if(size == 0) {
+    errno = 0;
+    return 0;
+  }
+  const uint64_t all = size;
+  while(1) {
+    ssize_t bytes;
+    errno = 0;
+    safe_execute(bytes = recv(socket->core.fd, data, size, 0), bytes == -1, errno);
+    if(bytes == -1) {
+      if(errno == EINTR) {
+        continue;
+      }
+      break;
+    } else if(bytes == 0) {
+      errno = EPIPE;
+      break;
+    }
+    size -= bytes;
+    if(size == 0) {
+      errno = 0;
+      break;
+    }
+    data = (char*) data + bytes;
+  }
+  socket->bytes_in += all - size;
+  return all - size;
+}
+
+uint64_t tcp_read_fds(struct tcp_socket* const socket, void* data, uint64_t size, int* const fds, uint32_t* const count) {
+  const uint32_t room = *count < tcp_fds_max ? *count : tcp_fds_max;
+  *count = 0;
+  if(size == 0) {
+    errno = 0;
+    return 0;
+  }
+  const uint64_t all = size;
+  while(1) {
+    struct iovec iov = {
+      .iov_base = data,
+      .iov_len = size
+    };
+    _Alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * tcp_fds_max)];
+    struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = room != 0 ? control : NULL,
+      .msg_controllen = room != 0 ? CMSG_SPACE(sizeof(int) * room) : 0
+    };
+    ssize_t bytes;
+    errno = 0;
+    safe_execute(bytes = recvmsg(socket->core.fd, &msg, MSG_CMSG_CLOEXEC), bytes == -1, errno);
+    if(bytes == -1) {
+      if(errno == EINTR) {
+        continue;
+      }
+      break;
+    } else if(bytes == 0) {
+      errno = EPIPE;
+      break;
+    }
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        const uint32_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        (void) memcpy(fds + *count, CMSG_DATA(cmsg), sizeof(int) * received);
+        *count += received;
+      }
+    }
+    size -= bytes;
+    /* Not to run out of room for the next ones */
+    if(size == 0 || *count != 0) {
+      errno = 0;
+      break;
+    }
+    data = (char*) data + bytes;
+  }
+  socket->bytes_in += all - size;
+  return all - size;
+}
+
+/*
+ * A splice relays data between 2 sockets through a pipe per direction.
+ * Data is moved from the source socket to the pipe and from the pipe to
+ * the destination socket with splice(), never entering userspace. Both
+ * sockets live in the same event loop, so all of the state below is only
+ * ever touched by the loop's thread.
+ */
+
+struct tcp_splice {
+  struct tcp_socket* sockets[2];
+  int pipes[2][2];
+  uint32_t pending[2];
+  uint8_t eof[2];
+};
+
+enum tcp_splice_const {
+  tcp_splice_chunk = 65536
+};
+
+int tcp_splice(struct tcp_socket* const one, struct tcp_socket* const two) {
+  if(one == two || one->loop != two->loop || one->splice != NULL || two->splice != NULL || !one->opened || !two->opened) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct tcp_splice* const relay = shnet_calloc(1, sizeof(*relay));
+  if(relay == NULL) {
+    return -1;
+  }
+  for(int i = 0; i < 2; ++i) {
+    int err;
+    safe_execute(err = pipe2(relay->pipes[i], O_NONBLOCK | O_CLOEXEC), err == -1, errno);
+    if(err == -1) {
+      if(i == 1) {
+        (void) close(relay->pipes[0][0]);
+        (void) close(relay->pipes[0][1]);
+      }
+      free(relay);
+      return -1;
+    }
+  }
+  relay->sockets[0] = one;
+  relay->sockets[1] = two;
+  for(int i = 0; i < 2; ++i) {
+    struct tcp_socket* const socket = relay->sockets[i];
+    tcp_lock(socket);
+    socket->splice = relay;
+    /*
+     * Data might have arrived before the sockets were spliced. Since they are
+     * edge-triggered, re-evaluate their readiness to not miss any of it.
+     */
+    (void) async_loop_mod(socket->loop, &socket->core, tcp_socket_events(socket));
+    tcp_unlock(socket);
+  }
+  return 0;
+}
+
+static void tcp_splice_flow(struct tcp_splice* const relay, const int dir) {
+  struct tcp_socket* const src = relay->sockets[dir];
+  struct tcp_socket* const dst = relay->sockets[!dir];
+  const int* const fds = relay->pipes[dir];
+  while(1) {
+    ssize_t bytes;
+    if(relay->pending[dir] != 0) {
+      tcp_lock(dst);
+      /*
+       * Anything queued with tcp_send() must go out before spliced data.
+       */
+      if(dst->closing || dst->closing_fast || !data_storage_is_empty(&dst->queue)) {
+        tcp_unlock(dst);
+        return;
+      }
+      safe_execute(bytes = splice(fds[0], NULL, dst->core.fd, NULL, relay->pending[dir], SPLICE_F_MOVE | SPLICE_F_NONBLOCK), bytes == -1, errno);
+      if(bytes > 0) {
+        dst->bytes_out += bytes;
+      }
+      tcp_unlock(dst);
+      if(bytes == -1) {
+        if(errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      relay->pending[dir] -= bytes;
+      continue;
+    }
+    if(relay->eof[dir]) {
+      if(relay->eof[dir] == 1) {
+        relay->eof[dir] = 2;
+        tcp_socket_close(dst);
+      }
+      return;
+    }
+    if(src->read_paused) {
+      return;
+    }
+    safe_execute(bytes = splice(src->core.fd, NULL, fds[1], NULL, tcp_splice_chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK), bytes == -1, errno);
+    if(bytes == -1) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    if(bytes == 0) {
+      relay->eof[dir] = 1;
+      continue;
+    }
+    relay->pending[dir] += bytes;
+    src->bytes_in += bytes;
+  }
+}
+
+static void tcp_splice_detach(struct tcp_socket* const socket) {
+  struct tcp_splice* const relay = socket->splice;
+  const int dir = relay->sockets[1] == socket;
+  struct tcp_socket* const peer = relay->sockets[!dir];
+  tcp_lock(peer);
+  peer->splice = NULL;
+  tcp_unlock(peer);
+  tcp_lock(socket);
+  socket->splice = NULL;
+  tcp_unlock(socket);
+  /*
+   * Whatever the closed socket sent that is still in the pipe is handed over
+   * to the peer's queue, so that it isn't lost. The peer is then closed
+   * gracefully, since it has no one to talk to anymore.
+   */
+  const uint32_t pending = relay->pending[dir];
+  if(pending != 0) {
+    char* const data = data_pool_malloc(pending);
+    if(data != NULL) {
+      ssize_t bytes;
+      safe_execute(bytes = read(relay->pipes[dir][0], data, pending), bytes == -1, errno);
+      if(bytes > 0) {
+        (void) tcp_send(peer, &((struct data_frame) {
+          .data = data,
+          .len = bytes,
+          .read_only = 1,
+          .pooled = 1,
+          .free_onerr = 1
+        }));
+      } else {
+        data_pool_free(data);
+      }
+    }
+  }
+  tcp_socket_close(peer);
+  for(int i = 0; i < 2; ++i) {
+    (void) close(relay->pipes[i][0]);
+    (void) close(relay->pipes[i][1]);
+  }
+  free(relay);
+}
+
+/*
+ * Setting SO_SNDBUF or SO_RCVBUF turns off the kernel's own buffer autotuning
+ * for the socket, which grows buffers generously but never shrinks them. Here,
+ * buffers follow the bandwidth-delay product measured by the kernel instead,
+ * sampled periodically on the socket's loop:
+ *
+ * - Idle sockets shrink towards the minimum.
+ * - Otherwise, buffers are sized to the measured BDP with some headroom. The
+ *   measurement can't exceed what the current buffer allows, so a buffer that
+ *   was the bottleneck during the last period is doubled instead.
+ * - Buffers shrink by at most half per period, so that one slow period does
+ *   not throttle a fast link.
+ */
+
+static _Atomic uint32_t tcp_tune_min = 16384;
+static _Atomic uint32_t tcp_tune_max = 16777216;
+static _Atomic uint32_t tcp_tune_interval = 1000;
+
+struct tcp_tune {
+  struct async_timer timer;
+  struct tcp_socket* socket;
+  uint64_t acked;
+  uint64_t received;
+  uint64_t sndbuf_limited;
+  uint32_t sndbuf;
+  uint32_t rcvbuf;
+};
+
+void tcp_autotune(const struct tcp_autotune_options* const opt) {
+  atomic_store_explicit(&tcp_tune_min, opt->min == 0 ? 16384 : opt->min, memory_order_relaxed);
+  atomic_store_explicit(&tcp_tune_max, opt->max == 0 ? 16777216 : opt->max, memory_order_relaxed);
+  atomic_store_explicit(&tcp_tune_interval, opt->interval == 0 ? 1000 : opt->interval, memory_order_relaxed);
+}
+
+/*
+ * When the process-wide budget of buffered bytes (data_budget_set_limit()) is
+ * exceeded, sockets that are already behind may not queue any more, the ones
+ * holding more than their share of the budget may be closed, and servers may
+ * stop accepting until enough of it has been drained.
+ */
+
+static _Atomic uint32_t tcp_budget_flags = tcp_budget_refuse;
+
+enum tcp_budget_const {
+  tcp_budget_retry = 10
+};
+
+void tcp_budget_policy(const uint32_t flags) {
+  atomic_store_explicit(&tcp_budget_flags, flags, memory_order_relaxed);
+}
+
+/*
+ * Sockets join a list once they may queue data while a limit is set, so that
+ * the ones holding the most can be found and closed, not just whoever happens
+ * to be sending. Other sockets are only ever try-locked from here, since the
+ * caller already holds its own lock. A socket leaves the list first thing when
+ * it's freed, so anything on the list is safe to look at with the list locked.
+ */
+
+struct tcp_budget {
+  struct tcp_budget* next;
+  struct tcp_budget* prev;
+  struct tcp_socket* socket;
+  /* The TLS plaintext queue, if any */
+  struct data_storage* queue;
+};
+
+static struct tcp_budget* tcp_budget_list = NULL;
+static pthread_mutex_t tcp_budget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int tcp_trylock(struct tcp_socket* const socket) {
+  uint32_t state = 0;
+  return atomic_compare_exchange_strong_explicit((_Atomic uint32_t*) &socket->lock, &state, 1, memory_order_acquire, memory_order_relaxed);
+}
+
+static void tcp_budget_join(struct tcp_socket* const socket, struct data_storage* const queue) {
+  struct tcp_budget* const budget = shnet_malloc(sizeof(*budget));
+  if(budget == NULL) {
+    return;
+  }
+  budget->socket = socket;
+  budget->queue = queue != &socket->queue ? queue : NULL;
+  budget->prev = NULL;
+  (void) pthread_mutex_lock(&tcp_budget_lock);
+  budget->next = tcp_budget_list;
+  if(tcp_budget_list != NULL) {
+    tcp_budget_list->prev = budget;
+  }
+  tcp_budget_list = budget;
+  (void) pthread_mutex_unlock(&tcp_budget_lock);
+  socket->budget = budget;
+}
+
+static void tcp_budget_leave(struct tcp_socket* const socket) {
+  struct tcp_budget* const budget = socket->budget;
+  (void) pthread_mutex_lock(&tcp_budget_lock);
+  if(budget->prev != NULL) {
+    budget->prev->next = budget->next;
+  } else {
+    tcp_budget_list = budget->next;
+  }
+  if(budget->next != NULL) {
+    budget->next->prev = budget->prev;
+  }
+  (void) pthread_mutex_unlock(&tcp_budget_lock);
+  free(budget);
+  socket->budget = NULL;
+}
+
+static uint64_t tcp_budget_size(const struct tcp_budget* const budget) {
+  uint64_t size = data_storage_size(&budget->socket->queue);
+  if(budget->queue != NULL) {
+    size += data_storage_size(budget->queue);
+  }
+  return size;
+}
+
+/* Must be called with the socket locked */
+static void tcp_budget_drop(struct tcp_socket* const socket, struct data_storage* const queue) {
+  socket->closing_fast = 1;
+  data_storage_free(&socket->queue);
+  if(queue != NULL && queue != &socket->queue) {
+    data_storage_free(queue);
+  }
+  if(socket->opened) {
+    socket->close_guard = 1;
+    (void) shutdown(socket->core.fd, SHUT_RDWR);
+  }
+}
+
+/* Closes the sockets holding the most first. Returns 1 if the caller is one of them. */
+static int tcp_budget_shed(struct tcp_socket* const socket, struct data_storage* const queue) {
+  int dropped = 0;
+  (void) pthread_mutex_lock(&tcp_budget_lock);
+  while(!dropped && data_budget_exceeded()) {
+    struct tcp_budget* victim = NULL;
+    uint64_t largest = 0;
+    for(struct tcp_budget* budget = tcp_budget_list; budget != NULL; budget = budget->next) {
+      struct tcp_socket* const other = budget->socket;
+      /* Whoever holds the lock is busy with the socket, it can wait */
+      if(other != socket && !tcp_trylock(other)) {
+        continue;
+      }
+      if(!other->closing_fast) {
+        const uint64_t size = tcp_budget_size(budget);
+        if(size > largest) {
+          largest = size;
+          victim = budget;
+        }
+      }
+      if(other != socket) {
+        tcp_unlock(other);
+      }
+    }
+    if(victim == NULL) {
+      break;
+    }
+    if(victim->socket == socket) {
+      tcp_budget_drop(socket, queue);
+      dropped = 1;
+    } else if(tcp_trylock(victim->socket)) {
+      tcp_budget_drop(victim->socket, victim->queue);
+      tcp_unlock(victim->socket);
+    } else {
+      break;
+    }
+  }
+  (void) pthread_mutex_unlock(&tcp_budget_lock);
+  return dropped;
+}
+
+/* Must be called with the socket locked, before anything is sent */
+int tcp_budget_check(struct tcp_socket* const socket, struct data_storage* const queue) {
+  if(socket->budget == NULL) {
+    struct data_budget_stats stats;
+    data_budget_get_stats(&stats);
+    if(stats.limit != 0) {
+      tcp_budget_join(socket, queue);
+    }
+  }
+  if(!data_budget_exceeded()) {
+    return 0;
+  }
+  const uint32_t flags = atomic_load_explicit(&tcp_budget_flags, memory_order_relaxed);
+  if((flags & tcp_budget_close) && tcp_budget_shed(socket, queue)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  /* Sockets that keep up with their peers aren't refused */
+  if((flags & tcp_budget_refuse) && !data_storage_is_empty(queue) && data_budget_exceeded()) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  return 0;
+}
+
+static void tcp_tune_free(struct tcp_socket* const socket) {
+  async_timer_cancel(socket->loop, &socket->tune->timer);
+  free(socket->tune);
+  socket->tune = NULL;
+}
+
+static uint32_t tcp_tune_get(const int sfd, const int opt) {
+  int val = 0;
+  (void) getsockopt(sfd, SOL_SOCKET, opt, &val, &(socklen_t){ sizeof(val) });
+  /* The kernel doubles what it is given to account for its own overhead */
+  return val / 2;
+}
+
+static void tcp_tune_set(const int sfd, const int opt, const int force_opt, const uint32_t val) {
+  /* Only privileged processes may go over net.core.[wr]mem_max */
+  if(setsockopt(sfd, SOL_SOCKET, force_opt, &val, sizeof(val)) == -1) {
+    (void) setsockopt(sfd, SOL_SOCKET, opt, &val, sizeof(val));
+  }
+}
+
+static uint32_t tcp_tune_target(const uint32_t cur, uint64_t target, const int limited, const uint32_t min, const uint32_t max) {
+  if(limited && target < (uint64_t) cur * 2) {
+    target = (uint64_t) cur * 2;
+  }
+  if(target < cur / 2) {
+    target = cur / 2;
+  }
+  if(target < min) {
+    target = min;
+  }
+  if(target > max) {
+    target = max;
+  }
+  return target;
+}
+
+static void tcp_tune_ontimeout(struct async_loop* loop, struct async_timer* timer) {
+  struct tcp_tune* const tune = (struct tcp_tune*) timer;
+  struct tcp_socket* const socket = tune->socket;
+  const uint32_t interval = atomic_load_explicit(&tcp_tune_interval, memory_order_relaxed);
+  const uint32_t min = atomic_load_explicit(&tcp_tune_min, memory_order_relaxed);
+  const uint32_t max = atomic_load_explicit(&tcp_tune_max, memory_order_relaxed);
+  struct tcp_info info = {0};
+  if(getsockopt(socket->core.fd, net_proto_tcp, TCP_INFO, &info, &(socklen_t){ sizeof(info) }) == -1) {
+    return;
+  }
+  const uint64_t acked = info.tcpi_bytes_acked - tune->acked;
+  const uint64_t received = info.tcpi_bytes_received - tune->received;
+  const uint64_t sndbuf_limited = info.tcpi_sndbuf_limited - tune->sndbuf_limited;
+  tune->acked = info.tcpi_bytes_acked;
+  tune->received = info.tcpi_bytes_received;
+  tune->sndbuf_limited = info.tcpi_sndbuf_limited;
+  
+  uint32_t sndbuf = min;
+  if(acked != 0) {
+    const uint64_t bdp = info.tcpi_delivery_rate * info.tcpi_rtt / 1000000;
+    /* Limited by the send buffer for over a quarter of the period */
+    const int limited = sndbuf_limited * 4 > (uint64_t) interval * 1000;
+    sndbuf = tcp_tune_target(tune->sndbuf, bdp * 2, limited, min, max);
+  } else if(min < tune->sndbuf / 2) {
+    sndbuf = tune->sndbuf / 2;
+  }
+  if(sndbuf != tune->sndbuf) {
+    tcp_tune_set(socket->core.fd, SO_SNDBUF, SO_SNDBUFFORCE, sndbuf);
+    tune->sndbuf = sndbuf;
+  }
+  
+  uint32_t rcvbuf = min;
+  if(received != 0) {
+    const uint32_t rtt = info.tcpi_rcv_rtt != 0 ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+    const uint64_t bdp = received * rtt / ((uint64_t) interval * 1000);
+    /* The window is the receive buffer, more than half of it used per RTT means it's too small */
+    const int limited = bdp * 2 > tune->rcvbuf;
+    rcvbuf = tcp_tune_target(tune->rcvbuf, bdp * 2, limited, min, max);
+  } else if(min < tune->rcvbuf / 2) {
+    rcvbuf = tune->rcvbuf / 2;
+  }
+  if(rcvbuf != tune->rcvbuf) {
+    tcp_tune_set(socket->core.fd, SO_RCVBUF, SO_RCVBUFFORCE, rcvbuf);
+    tune->rcvbuf = rcvbuf;
+  }
+  async_timer_set(loop, timer, interval);
+}
+
+static void tcp_tune(struct tcp_socket* const socket) {
+  struct tcp_tune* const tune = shnet_calloc(1, sizeof(*tune));
+  if(tune == NULL) {
+    /* The kernel's defaults will do */
+    return;
+  }
+  tune->timer.on_timeout = tcp_tune_ontimeout;
+  tune->socket = socket;
+  tune->sndbuf = tcp_tune_get(socket->core.fd, SO_SNDBUF);
+  tune->rcvbuf = tcp_tune_get(socket->core.fd, SO_RCVBUF);
+  socket->tune = tune;
+  async_timer_set(socket->loop, &tune->timer, atomic_load_explicit(&tcp_tune_interval, memory_order_relaxed));
+}
+
+enum tcp_fastopen_const {
+  /* TCP_SYN_SENT, but <netinet/tcp.h> can't be included with <linux/tcp.h> */
+  tcp_fastopen_syn_sent = 2
+};
+
+/*
+ * With TCP_FASTOPEN_CONNECT and a cached cookie, connect() doesn't send the SYN
+ * and the socket is reported writable right away. The SYN then goes out with
+ * the first data sent. Send the first queued frame with it, or an empty SYN if
+ * there is nothing to send, and wait for the connection to really be opened.
+ */
+
+static int tcp_socket_fastopen_connect(struct tcp_socket* const socket) {
+  tcp_lock(socket);
+  socket->fastopen = 0;
+  struct tcp_info info;
+  if(getsockopt(socket->core.fd, net_proto_tcp, TCP_INFO, &info, &(socklen_t){ sizeof(info) }) == -1 ||
+    info.tcpi_state != tcp_fastopen_syn_sent) {
+    tcp_unlock(socket);
+    return 0;
+  }
+  ssize_t bytes = 0;
+  const struct data_frame* const frame = socket->queue.frames;
+  if(!socket->closing_fast && !data_storage_is_empty(&socket->queue) && !frame->file && !frame->generator) {
+    safe_execute(bytes = send(socket->core.fd, frame->data + frame->offset, frame->len - frame->offset, MSG_NOSIGNAL), bytes == -1, errno);
+    if(bytes > 0) {
+      data_storage_drain(&socket->queue, bytes);
+      socket->bytes_out += bytes;
+    }
+  }
+  if(bytes <= 0) {
+    (void) send(socket->core.fd, NULL, 0, MSG_NOSIGNAL);
+  }
+  tcp_unlock(socket);
+  return 1;
+}
+
+#define socket ((struct tcp_socket*) event)
+
+static void tcp_socket_onevent(uint32_t events, struct async_event* event) {
+  int code = 0;
+  if(!socket->opened && socket->timed_out) {
+    /* Even if the connection went through just now, it's too late */
+    errno = ETIMEDOUT;
+    tcp_socket_free_internal(socket);
+    return;
+  }
+  if(events & EPOLLERR) {
+    (void) getsockopt(socket->core.fd, SOL_SOCKET, SO_ERROR, &code, &(socklen_t){ sizeof(int) });
+  } else {
+    if(!socket->opened && (events & EPOLLOUT)) {
+      if(socket->fastopen && tcp_socket_fastopen_connect(socket)) {
+        return;
+      }
+      tcp_lock(socket);
+      socket->opened = 1;
+      tcp_unlock(socket);
+      if(socket->on_event != NULL) {
+        socket->on_event(socket, tcp_open);
+      }
+      if(socket->connect_timeout | socket->idle_timeout | socket->read_timeout | socket->write_timeout) {
+        tcp_socket_arm(socket);
+      }
+      if(socket->autotune) {
+        tcp_tune(socket);
+      }
+      tcp_lock(socket);
+      if(!socket->close_guard) {
+        if(socket->closing_fast) {
+          data_storage_free(&socket->queue);
+          socket->close_guard = 1;
+          tcp_unlock(socket);
+          (void) shutdown(socket->core.fd, SHUT_RDWR);
+        } else if(socket->closing && data_storage_is_empty(&socket->queue)) {
+          socket->close_guard = 1;
+          tcp_unlock(socket);
+          (void) shutdown(socket->core.fd, SHUT_WR);
+        } else {
+          tcp_unlock(socket);
+        }
+      } else {
+        tcp_unlock(socket);
+      }
+      (void) getsockopt(socket->core.fd, SOL_SOCKET, SO_ERROR, &code, &(socklen_t){ sizeof(int) });
+    }
+    if(events & EPOLLIN) {
+      if(socket->deadline != NULL && (socket->read_timeout | socket->idle_timeout)) {
+        socket->deadline->last_read = tcp_time();
+      }
+      if(socket->splice != NULL) {
+        tcp_splice_flow(socket->splice, socket->splice->sockets[1] == socket);
+      } else if(socket->on_event != NULL) {
+        socket->on_event(socket, tcp_data);
+      }
+    }
+  }
+  if((events & EPOLLHUP) || code != 0) {
+    if((events & EPOLLHUP) && socket->read_paused && socket->splice == NULL && socket->on_event != NULL) {
+      /* The last chance to read whatever came before the end of the stream */
+      int unread = 0;
+      if(ioctl(socket->core.fd, FIONREAD, &unread) == 0 && unread > 0) {
+        socket->on_event(socket, tcp_data);
+      }
+    }
+    errno = code == 0 && socket->timed_out ? ETIMEDOUT : code;
+    tcp_socket_free_internal(socket);
+    return;
+  }
+  if(events & EPOLLOUT) {
+    if(socket->on_event != NULL) {
+      socket->on_event(socket, tcp_can_send);
+    }
+    if(!socket->dont_send_buffered) {
+      tcp_lock(socket);
+      if(!socket->closing_fast && tcp_send_buffered(socket) != -2 && !socket->dont_autoclean) {
+        (void) data_storage_resize(&socket->queue, socket->queue.used);
+      }
+      tcp_unlock(socket);
+    }
+    if(socket->splice != NULL) {
+      tcp_splice_flow(socket->splice, socket->splice->sockets[0] == socket);
+    }
+  }
+  if(events & EPOLLRDHUP) {
+    /*
+     * Data that came before the end of the stream may still be unread. The
+     * kernel reports the end again when reading is resumed, after the data.
+     */
+    tcp_lock(socket);
+    const int paused = socket->read_paused;
+    tcp_unlock(socket);
+    if(paused) {
+      return;
+    }
+    if(socket->on_event != NULL) {
+      socket->on_event(socket, tcp_readclose);
+    }
+    if(socket->splice != NULL) {
+      tcp_splice_flow(socket->splice, socket->splice->sockets[1] == socket);
+    } else if(!socket->dont_close_onreadclose) {
+      tcp_socket_close(socket);
+    }
+  }
+}
+
+#undef socket
+
+
+
+/*
+ * A server may hand accepted sockets to a set of worker loops instead of its
+ * own. The server's loop is the only one picking workers, so the policy state
+ * needs no synchronisation. Connection counts and lag are written by other
+ * threads and only need to be roughly up to date, hence relaxed atomics.
+ *
+ * Accepted sockets outlive their server, so the workers are reference counted
+ * by the server, its sockets and the lag probes in flight.
+ */
+
+enum tcp_worker_const {
+  tcp_worker_probe_interval = 10,
+  tcp_rebalance_lag = 10,
+  tcp_rebalance_window = 16
+};
+
+struct tcp_worker {
+  struct async_task probe;
+  struct tcp_workers* workers;
+  struct async_loop* loop;
+  uint64_t probe_sent;
+  _Atomic(struct tcp_worker*) move_to;
+  uint64_t sample_cost;
+  uint32_t sample_count;
+  _Atomic uint32_t conns;
+  _Atomic uint32_t lag;
+  _Atomic uint32_t migrated;
+  _Atomic uint8_t probing;
+};
+
+struct tcp_workers {
+  struct async_timer rebalance;
+  _Atomic uint32_t refs;
+  uint32_t len;
+  uint32_t next;
+  uint32_t rebalance_interval;
+  uint32_t rebalance_lag;
+  enum tcp_balance balance;
+  struct tcp_worker worker[];
+};
+
+static uint64_t tcp_time_us(void) {
+  struct timespec tp;
+  (void) clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t) tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+static void tcp_workers_unref(struct tcp_workers* const workers) {
+  if(atomic_fetch_sub_explicit(&workers->refs, 1, memory_order_acq_rel) == 1) {
+    free(workers);
+  }
+}
+
+static void tcp_worker_leave(struct tcp_socket* const socket) {
+  struct tcp_worker* const worker = socket->worker;
+  socket->worker = NULL;
+  (void) atomic_fetch_sub_explicit(&worker->conns, 1, memory_order_relaxed);
+  tcp_workers_unref(worker->workers);
+}
+
+static void tcp_worker_onprobe(struct async_loop* loop, struct async_task* task) {
+  (void) loop;
+  struct tcp_worker* const worker = (struct tcp_worker*) task;
+  /* How long the loop took to get to the probe */
+  const uint64_t lag = tcp_time_us() - worker->probe_sent;
+  atomic_store_explicit(&worker->lag, lag > UINT32_MAX ? UINT32_MAX : lag, memory_order_relaxed);
+  atomic_store_explicit(&worker->probing, 0, memory_order_release);
+  tcp_workers_unref(worker->workers);
+}
+
+static uint64_t tcp_worker_lag(struct tcp_worker* const worker, const uint64_t now) {
+  uint64_t lag = atomic_load_explicit(&worker->lag, memory_order_relaxed);
+  if(atomic_load_explicit(&worker->probing, memory_order_acquire)) {
+    /* A loop that is stuck is at least as late as its pending probe */
+    const uint64_t pending = now - worker->probe_sent;
+    if(pending > lag) {
+      lag = pending;
+    }
+  } else if(now - worker->probe_sent >= tcp_worker_probe_interval * 1000) {
+    worker->probe_sent = now;
+    atomic_store_explicit(&worker->probing, 1, memory_order_relaxed);
+    (void) atomic_fetch_add_explicit(&worker->workers->refs, 1, memory_order_relaxed);
+    async_loop_post(worker->loop, &worker->probe);
+  }
+  return lag;
+}
+
+static struct tcp_worker* tcp_worker_pick(struct tcp_workers* const workers) {
+  const uint32_t start = workers->next;
+  workers->next = (start + 1) % workers->len;
+  struct tcp_worker* best = workers->worker + start;
+  switch(workers->balance) {
+    case tcp_balance_least_connections: {
+      uint32_t best_conns = atomic_load_explicit(&best->conns, memory_order_relaxed);
+      for(uint32_t i = 1; i < workers->len; ++i) {
+        struct tcp_worker* const worker = workers->worker + (start + i) % workers->len;
+        const uint32_t conns = atomic_load_explicit(&worker->conns, memory_order_relaxed);
+        if(conns < best_conns) {
+          best = worker;
+          best_conns = conns;
+        }
+      }
+      break;
+    }
+    case tcp_balance_least_lag: {
+      const uint64_t now = tcp_time_us();
+      uint64_t best_lag = tcp_worker_lag(best, now);
+      uint32_t best_conns = atomic_load_explicit(&best->conns, memory_order_relaxed);
+      for(uint32_t i = 1; i < workers->len; ++i) {
+        struct tcp_worker* const worker = workers->worker + (start + i) % workers->len;
+        const uint64_t lag = tcp_worker_lag(worker, now);
+        const uint32_t conns = atomic_load_explicit(&worker->conns, memory_order_relaxed);
+        if(lag < best_lag || (lag == best_lag && conns < best_conns)) {
+          best = worker;
+          best_lag = lag;
+          best_conns = conns;
+        }
+      }
+      break;
+    }
+    default: break;
+  }
+  return best;
+}
+
+static void tcp_rebalance_ontimeout(struct async_loop*, struct async_timer*);
+
+static struct tcp_workers* tcp_workers(const struct tcp_server_options* const opt) {
+  struct tcp_workers* const workers = shnet_calloc(1, sizeof(*workers) + sizeof(*workers->worker) * opt->workers_len);
+  if(workers == NULL) {
+    return NULL;
+  }
+  atomic_init(&workers->refs, 1);
+  workers->len = opt->workers_len;
+  workers->balance = opt->balance;
+  workers->rebalance.on_timeout = tcp_rebalance_ontimeout;
+  workers->rebalance_interval = opt->rebalance_interval;
+  workers->rebalance_lag = opt->rebalance_lag != 0 ? opt->rebalance_lag : tcp_rebalance_lag;
+  for(uint32_t i = 0; i < workers->len; ++i) {
+    struct tcp_worker* const worker = workers->worker + i;
+    worker->probe.on_run = tcp_worker_onprobe;
+    worker->workers = workers;
+    worker->loop = opt->workers[i];
+    /* Probe on the first pick */
+    worker->probe_sent = tcp_time_us() - tcp_worker_probe_interval * 1000;
+  }
+  return workers;
+}
+
+/*
+ * A socket migrates by leaving its loop's epoll set on that loop's thread and
+ * joining the target's on the target's thread, by a task posted there. In
+ * between, neither loop dispatches its events, but none are lost, since adding
+ * a file descriptor to an epoll set reports whatever it is ready for right
+ * away, edge-triggered or not. The send queue is part of the socket, so it
+ * moves along and is flushed once the target reports the socket writable.
+ * Timers may only be touched by their loop's thread, so they are cancelled
+ * here and re-armed there.
+ *
+ * The loop may have more events of the socket in the batch it's going through.
+ * tcp_onevent() drops events of sockets that belong to another loop by now. If
+ * the socket's own event handler migrates it, the migration waits until the
+ * event was handled in full.
+ */
+
+struct tcp_migrate {
+  struct async_task task;
+  struct tcp_socket* socket;
+  struct async_loop* loop;
+  uint8_t deadline:1;
+  uint8_t tune:1;
+};
+
+static void tcp_migrate_attach(struct async_loop* loop, struct async_task* task) {
+  struct tcp_migrate* const migrate = (struct tcp_migrate*) task;
+  struct tcp_socket* const socket = migrate->socket;
+  if(migrate->deadline) {
+    /* Checks what's left when it fires, as usual */
+    async_timer_set(loop, &socket->deadline->timer, 0);
+  }
+  if(migrate->tune) {
+    async_timer_set(loop, &socket->tune->timer, atomic_load_explicit(&tcp_tune_interval, memory_order_relaxed));
+  }
+  free(migrate);
+  tcp_lock(socket);
+  socket->migrating = 0;
+  const int err = async_loop_add(loop, &socket->core, tcp_socket_events(socket));
+  tcp_unlock(socket);
+  if(err == -1) {
+    tcp_socket_free_internal(socket);
+  }
+}
+
+static void tcp_worker_move(struct tcp_socket* const socket, const struct async_loop* const loop) {
+  struct tcp_worker* const worker = socket->worker;
+  (void) atomic_fetch_add_explicit(&worker->migrated, 1, memory_order_relaxed);
+  for(uint32_t i = 0; i < worker->workers->len; ++i) {
+    struct tcp_worker* const target = worker->workers->worker + i;
+    if(target->loop == loop) {
+      (void) atomic_fetch_sub_explicit(&worker->conns, 1, memory_order_relaxed);
+      (void) atomic_fetch_add_explicit(&target->conns, 1, memory_order_relaxed);
+      socket->worker = target;
+      return;
+    }
+  }
+  /* Not one of the server's workers, so no longer counted */
+  tcp_worker_leave(socket);
+}
+
+static void tcp_migrate_detach(struct tcp_migrate* const migrate) {
+  struct tcp_socket* const socket = migrate->socket;
+  if(socket->deadline != NULL && async_timer_armed(&socket->deadline->timer)) {
+    async_timer_cancel(socket->loop, &socket->deadline->timer);
+    migrate->deadline = 1;
+  }
+  if(socket->tune != NULL && async_timer_armed(&socket->tune->timer)) {
+    async_timer_cancel(socket->loop, &socket->tune->timer);
+    migrate->tune = 1;
+  }
+  if(socket->worker != NULL) {
+    tcp_worker_move(socket, migrate->loop);
+  }
+  tcp_lock(socket);
+  struct async_loop* const loop = socket->loop;
+  (void) async_loop_remove(loop, &socket->core);
+  socket->loop = migrate->loop;
+  const uint8_t alloc_loop = socket->alloc_loop;
+  socket->alloc_loop = 0;
+  tcp_unlock(socket);
+  if(alloc_loop) {
+    /* Nothing else uses the loop, it goes away once it's done with this batch */
+    async_loop_shutdown(loop, async_free | async_ptr_free);
+  }
+  async_loop_post(migrate->loop, &migrate->task);
+}
+
+int tcp_socket_migrate(struct tcp_socket* const socket, struct async_loop* const loop) {
+  if(loop == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  if(loop == socket->loop) {
+    return 0;
+  }
+  struct tcp_migrate* const migrate = shnet_calloc(1, sizeof(*migrate));
+  if(migrate == NULL) {
+    return -1;
+  }
+  tcp_lock(socket);
+  if(!socket->opened || socket->closing || socket->closing_fast || socket->splice != NULL) {
+    tcp_unlock(socket);
+    free(migrate);
+    errno = EINVAL;
+    return -1;
+  }
+  if(socket->migrating) {
+    tcp_unlock(socket);
+    free(migrate);
+    errno = EBUSY;
+    return -1;
+  }
+  socket->migrating = 1;
+  tcp_unlock(socket);
+  migrate->task.on_run = tcp_migrate_attach;
+  migrate->socket = socket;
+  migrate->loop = loop;
+  if(tcp_dispatched == socket) {
+    tcp_deferred = migrate;
+  } else {
+    tcp_migrate_detach(migrate);
+  }
+  return 0;
+}
+
+/*
+ * The rebalancer runs on the server's loop. Every interval, it compares the
+ * workers' lag, and if the worst of them is late enough and more than twice
+ * as late as the best one, asks it to give one of its connections to the best
+ * one. Which connection is up to the worker: it times its sockets' events,
+ * and after a window of them, the first socket whose event took at least as
+ * long as the average is moved. Busy sockets have more events, so they are
+ * more likely to be picked. Until asked, workers time nothing.
+ */
+
+static void tcp_rebalance_ontimeout(struct async_loop* loop, struct async_timer* timer) {
+  struct tcp_workers* const workers = (struct tcp_workers*) timer;
+  const uint64_t now = tcp_time_us();
+  struct tcp_worker* busiest = workers->worker;
+  struct tcp_worker* idlest = workers->worker;
+  uint64_t busiest_lag = 0;
+  uint64_t idlest_lag = UINT64_MAX;
+  uint32_t open = 0;
+  for(uint32_t i = 0; i < workers->len; ++i) {
+    struct tcp_worker* const worker = workers->worker + i;
+    const uint64_t lag = tcp_worker_lag(worker, now);
+    open += atomic_load_explicit(&worker->conns, memory_order_relaxed);
+    if(lag > busiest_lag) {
+      busiest = worker;
+      busiest_lag = lag;
+    }
+    if(lag < idlest_lag) {
+      idlest = worker;
+      idlest_lag = lag;
+    }
+  }
+  /* A worker with a single connection would just pass its problem on */
+  if(busiest != idlest && busiest_lag >= (uint64_t) workers->rebalance_lag * 1000 &&
+    busiest_lag > idlest_lag * 2 && atomic_load_explicit(&busiest->conns, memory_order_relaxed) > 1) {
+    struct tcp_worker* expected = NULL;
+    (void) atomic_compare_exchange_strong_explicit(&busiest->move_to, &expected, idlest, memory_order_relaxed, memory_order_relaxed);
+  }
+  /* Armed again by the next connection */
+  if(open != 0) {
+    async_timer_set(loop, timer, workers->rebalance_interval);
+  }
+}
+
+static void tcp_rebalance_sample(struct tcp_socket* const socket, struct tcp_worker* const worker, const uint64_t cost) {
+  worker->sample_cost += cost;
+  ++worker->sample_count;
+  if(worker->sample_count < tcp_rebalance_window || cost * worker->sample_count < worker->sample_cost) {
+    return;
+  }
+  struct tcp_worker* const target = atomic_load_explicit(&worker->move_to, memory_order_relaxed);
+  if(tcp_socket_migrate(socket, target->loop) == 0) {
+    worker->sample_cost = 0;
+    worker->sample_count = 0;
+    atomic_store_explicit(&worker->move_to, NULL, memory_order_relaxed);
+  }
+}
+
+/*
+ * Sockets only report to their server once, when they are closed, so that
+ * sending and receiving never touch memory shared with other connections.
+ * Like the workers above, the counters outlive the server if they need to.
+ */
+
+struct tcp_server_counters {
+  _Atomic uint32_t refs;
+  _Atomic uint64_t accepted;
+  _Atomic uint64_t closed;
+  _Atomic uint64_t bytes_in;
+  _Atomic uint64_t bytes_out;
+  _Atomic uint64_t retransmits;
+  _Atomic uint64_t shed;
+  _Atomic uint32_t lag;
+};
+
+static void tcp_counters_unref(struct tcp_server_counters* const counters) {
+  if(atomic_fetch_sub_explicit(&counters->refs, 1, memory_order_acq_rel) == 1) {
+    free(counters);
+  }
+}
+
+static void tcp_counters_join(struct tcp_server_counters* const counters, struct tcp_socket* const socket) {
+  (void) atomic_fetch_add_explicit(&counters->refs, 1, memory_order_relaxed);
+  (void) atomic_fetch_add_explicit(&counters->accepted, 1, memory_order_relaxed);
+  socket->counters = counters;
+}
+
+static void tcp_counters_leave(struct tcp_socket* const socket) {
+  struct tcp_server_counters* const counters = socket->counters;
+  socket->counters = NULL;
+  struct tcp_info info = {0};
+  (void) getsockopt(socket->core.fd, net_proto_tcp, TCP_INFO, &info, &(socklen_t){ sizeof(info) });
+  (void) atomic_fetch_add_explicit(&counters->bytes_in, socket->bytes_in, memory_order_relaxed);
+  (void) atomic_fetch_add_explicit(&counters->bytes_out, socket->bytes_out, memory_order_relaxed);
+  (void) atomic_fetch_add_explicit(&counters->retransmits, info.tcpi_total_retrans, memory_order_relaxed);
+  (void) atomic_fetch_add_explicit(&counters->closed, 1, memory_order_release);
+  tcp_counters_unref(counters);
+}
+
+int tcp_server_stats(const struct tcp_server* const server, struct tcp_server_stats* const stats) {
+  struct tcp_server_counters* const counters = server->counters;
+  if(counters == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  stats->closed = atomic_load_explicit(&counters->closed, memory_order_acquire);
+  stats->accepted = atomic_load_explicit(&counters->accepted, memory_order_relaxed);
+  stats->open = stats->accepted - stats->closed;
+  stats->bytes_in = atomic_load_explicit(&counters->bytes_in, memory_order_relaxed);
+  stats->bytes_out = atomic_load_explicit(&counters->bytes_out, memory_order_relaxed);
+  stats->retransmits = atomic_load_explicit(&counters->retransmits, memory_order_relaxed);
+  /* For listeners, these are the accept queue's length and limit */
+  struct tcp_info info = {0};
+  if(getsockopt(server->core.fd, net_proto_tcp, TCP_INFO, &info, &(socklen_t){ sizeof(info) }) == -1) {
+    return -1;
+  }
+  stats->listen_queue = info.tcpi_unacked;
+  stats->listen_backlog = info.tcpi_sacked;
+  /* Every SYN or connection the listener dropped, overflows included */
+  uint32_t meminfo[SK_MEMINFO_VARS] = {0};
+  (void) getsockopt(server->core.fd, SOL_SOCKET, SO_MEMINFO, meminfo, &(socklen_t){ sizeof(meminfo) });
+  stats->listen_drops = meminfo[SK_MEMINFO_DROPS];
+  stats->shed = atomic_load_explicit(&counters->shed, memory_order_relaxed);
+  stats->lag = atomic_load_explicit(&counters->lag, memory_order_relaxed);
+  return 0;
+}
+
+int tcp_server_get_worker_stats(const struct tcp_server* const server, const uint32_t idx, struct tcp_worker_stats* const stats) {
+  if(server->workers == NULL || idx >= server->workers->len) {
+    errno = EINVAL;
+    return -1;
   }
-  const uint64_t all = size;
-  while(1) {
-    ssize_t bytes;
-    errno = 0;
-    safe_execute(bytes = recv(socket->core.fd, data, size, 0), bytes == -1, errno);
-    if(bytes == -1) {
-      if(errno == EINTR) {
-        continue;
-      }
-      break;
-    } else if(bytes == 0) {
-      errno = EPIPE;
-      break;
-    }
-    size -= bytes;
-    if(size == 0) {
-      errno = 0;
-      break;
-    }
-    data = (char*) data + bytes;
+  struct tcp_worker* const worker = server->workers->worker + idx;
+  stats->loop = worker->loop;
+  stats->connections = atomic_load_explicit(&worker->conns, memory_order_relaxed);
+  stats->lag = atomic_load_explicit(&worker->lag, memory_order_relaxed);
+  stats->migrated = atomic_load_explicit(&worker->migrated, memory_order_relaxed);
+  return 0;
+}
+
+uint16_t tcp_server_get_port(const struct tcp_server* const server) {
+  struct sockaddr_in6 addr;
+  net_socket_get_local_address(server->core.fd, &addr);
+  return net_address_to_port(&addr);
+}
+
+/*
+ * Admission control keeps a server from taking on more than it can handle by
+ * leaving connections in the kernel's backlog. The server's loop measures its
+ * own lag by how late a timer fires on it, but only while connections keep
+ * coming in, so that an idle server costs nothing. With workers, the least
+ * lagging of them counts too, since that's where the next connection goes.
+ * Everything here only ever runs on the server's loop.
+ */
+
+enum tcp_admit_const {
+  tcp_admit_interval = 100,
+  tcp_admit_retry = 10
+};
+
+struct tcp_admit {
+  struct async_timer probe;
+  struct tcp_server* server;
+  uint64_t probe_due;
+  uint64_t probe_at;
+  uint64_t refill_at;
+  uint32_t max_lag;
+  uint32_t rate;
+  uint32_t burst;
+  uint32_t tokens;
+};
+
+static void tcp_server_onevent(uint32_t events, struct async_event* event);
+
+static void tcp_server_onretry(struct async_loop* loop, struct async_timer* timer) {
+  (void) loop;
+  struct tcp_server* const server = (struct tcp_server*)((char*) timer - offsetof(struct tcp_server, accept_retry));
+  (void) async_loop_mod(server->loop, &server->core, EPOLLIN);
+  tcp_server_onevent(EPOLLIN, &server->core);
+}
+
+static void tcp_server_retry(struct tcp_server* const server, const uint32_t ms) {
+  /*
+   * The listener is level-triggered, so it would keep reporting the backlog
+   * until it's drained. It's muted until the timer fires instead. Hangups are
+   * still reported, so the server can be closed in the meantime.
+   */
+  if(!async_timer_armed(&server->accept_retry)) {
+    (void) async_loop_mod(server->loop, &server->core, 0);
+    server->accept_retry.on_timeout = tcp_server_onretry;
+    async_timer_set(server->loop, &server->accept_retry, ms);
   }
-  return all - size;
 }
 
-#define socket ((struct tcp_socket*) event)
+static void tcp_admit_onprobe(struct async_loop* loop, struct async_timer* timer) {
+  (void) loop;
+  struct tcp_admit* const admit = (struct tcp_admit*)((char*) timer - offsetof(struct tcp_admit, probe));
+  const uint64_t now = tcp_time();
+  /* Timers may fire up to a tick late on their own */
+  const uint64_t late = now - admit->probe_due;
+  const uint64_t lag = late > async_timer_tick ? late - async_timer_tick : 0;
+  atomic_store_explicit(&admit->server->counters->lag, lag > UINT32_MAX ? UINT32_MAX : lag, memory_order_relaxed);
+  admit->probe_at = now;
+}
 
-static void tcp_socket_onevent(uint32_t events, struct async_event* event) {
-  int code = 0;
-  if(events & EPOLLERR) {
-    (void) getsockopt(socket->core.fd, SOL_SOCKET, SO_ERROR, &code, &(socklen_t){ sizeof(int) });
-  } else {
-    if(!socket->opened && (events & EPOLLOUT)) {
-      tcp_lock(socket);
-      socket->opened = 1;
-      tcp_unlock(socket);
-      if(socket->on_event != NULL) {
-        socket->on_event(socket, tcp_open);
-      }
-      tcp_lock(socket);
-      if(!socket->close_guard) {
-        if(socket->closing_fast) {
-          data_storage_free(&socket->queue);
-          socket->close_guard = 1;
-          tcp_unlock(socket);
-          (void) shutdown(socket->core.fd, SHUT_RDWR);
-        } else if(socket->closing && data_storage_is_empty(&socket->queue)) {
-          socket->close_guard = 1;
-          tcp_unlock(socket);
-          (void) shutdown(socket->core.fd, SHUT_WR);
-        } else {
-          tcp_unlock(socket);
-        }
-      } else {
-        tcp_unlock(socket);
+static uint64_t tcp_admit_lag(const struct tcp_server* const server) {
+  uint64_t lag = atomic_load_explicit(&server->counters->lag, memory_order_relaxed);
+  if(server->workers != NULL) {
+    const uint64_t now = tcp_time_us();
+    uint64_t least = UINT64_MAX;
+    for(uint32_t i = 0; i < server->workers->len; ++i) {
+      const uint64_t worker_lag = tcp_worker_lag(server->workers->worker + i, now);
+      if(worker_lag < least) {
+        least = worker_lag;
       }
-      (void) getsockopt(socket->core.fd, SOL_SOCKET, SO_ERROR, &code, &(socklen_t){ sizeof(int) });
     }
-    if((events & EPOLLIN) && socket->on_event != NULL) {
-      socket->on_event(socket, tcp_data);
+    if(least / 1000 > lag) {
+      lag = least / 1000;
     }
   }
-  if((events & EPOLLHUP) || code != 0) {
-    errno = code;
-    tcp_socket_free_internal(socket);
-    return;
+  return lag;
+}
+
+/* Returns 0 if a connection may be accepted, otherwise when to try again */
+static uint32_t tcp_server_admit(struct tcp_server* const server) {
+  if((atomic_load_explicit(&tcp_budget_flags, memory_order_relaxed) & tcp_budget_stop_accepting) && data_budget_exceeded()) {
+    return tcp_budget_retry;
   }
-  if(events & EPOLLOUT) {
-    if(socket->on_event != NULL) {
-      socket->on_event(socket, tcp_can_send);
+  struct tcp_admit* const admit = server->admit;
+  if(admit == NULL) {
+    return 0;
+  }
+  if(admit->max_lag != 0) {
+    const uint64_t now = tcp_time();
+    if(!async_timer_armed(&admit->probe) && now - admit->probe_at >= tcp_admit_interval) {
+      admit->probe_due = now;
+      async_timer_set(server->loop, &admit->probe, 0);
     }
-    if(!socket->dont_send_buffered) {
-      tcp_lock(socket);
-      if(!socket->closing_fast && tcp_send_buffered(socket) != -2 && !socket->dont_autoclean) {
-        (void) data_storage_resize(&socket->queue, socket->queue.used);
-      }
-      tcp_unlock(socket);
+    if(tcp_admit_lag(server) > admit->max_lag) {
+      return tcp_admit_retry;
     }
   }
-  if(events & EPOLLRDHUP) {
-    if(socket->on_event != NULL) {
-      socket->on_event(socket, tcp_readclose);
+  if(admit->rate != 0 && admit->tokens == 0) {
+    const uint64_t now = tcp_time_us();
+    const uint64_t refill = (now - admit->refill_at) * admit->rate / 1000000;
+    if(refill == 0) {
+      const uint64_t wait = 1000000 / admit->rate - (now - admit->refill_at);
+      return wait < 1000 ? 1 : (wait + 999) / 1000;
     }
-    if(!socket->dont_close_onreadclose) {
-      tcp_socket_close(socket);
+    if(refill >= admit->burst) {
+      admit->tokens = admit->burst;
+      admit->refill_at = now;
+    } else {
+      admit->tokens = refill;
+      /* Keep the fraction of a token that was already earned */
+      admit->refill_at += refill * 1000000 / admit->rate;
     }
   }
+  return 0;
 }
 
-#undef socket
-
+static void tcp_server_admitted(struct tcp_server* const server) {
+  struct tcp_admit* const admit = server->admit;
+  if(admit != NULL && admit->rate != 0) {
+    if(admit->tokens-- == admit->burst) {
+      /* A full bucket doesn't fill up any further */
+      admit->refill_at = tcp_time_us();
+    }
+  }
+}
 
+/*
+ * Once file descriptors run out, pending connections can't even be accepted
+ * to be closed. A descriptor is kept in reserve for that.
+ */
 
-uint16_t tcp_server_get_port(const struct tcp_server* const server) {
-  struct sockaddr_in6 addr;
-  net_socket_get_local_address(server->core.fd, &addr);
-  return net_address_to_port(&addr);
+static int tcp_server_shed(struct tcp_server* const server) {
+  if(server->reserve_fd == -1) {
+    server->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return -1;
+  }
+  (void) close(server->reserve_fd);
+  int sfd;
+  safe_execute(sfd = accept(server->core.fd, NULL, NULL), sfd == -1, errno);
+  if(sfd != -1) {
+    (void) close(sfd);
+    (void) atomic_fetch_add_explicit(&server->counters->shed, 1, memory_order_relaxed);
+  }
+  server->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  return sfd == -1 ? -1 : 0;
 }
 
 void tcp_server_free(struct tcp_server* const server) {
+  if(async_timer_armed(&server->accept_retry)) {
+    async_timer_cancel(server->loop, &server->accept_retry);
+  }
+  if(server->admit != NULL) {
+    async_timer_cancel(server->loop, &server->admit->probe);
+    free(server->admit);
+    server->admit = NULL;
+  }
+  if(server->reserve_fd != -1) {
+    (void) close(server->reserve_fd);
+    server->reserve_fd = -1;
+  }
+  if(server->workers != NULL) {
+    async_timer_cancel(server->loop, &server->workers->rebalance);
+  }
   (void) server->on_event(server, NULL, tcp_deinit);
   (void) close(server->core.fd);
   server->core.fd = -1;
@@ -511,6 +2902,12 @@ void tcp_server_free(struct tcp_server* const server) {
     server->loop = NULL;
     server->alloc_loop = 0;
   }
+  if(server->workers != NULL) {
+    tcp_workers_unref(server->workers);
+    server->workers = NULL;
+  }
+  tcp_counters_unref(server->counters);
+  server->counters = NULL;
   (void) server->on_event(server, NULL, tcp_free);
 }
 
@@ -519,7 +2916,8 @@ void tcp_server_close(struct tcp_server* const server) {
 }
 
 int tcp_server(struct tcp_server* const server, const struct tcp_server_options* const opt) {
-  if(server->on_event == NULL || opt == NULL || (opt->info == NULL && opt->hostname == NULL && opt->port == NULL)) {
+  if(server->on_event == NULL || opt == NULL || (opt->info == NULL && opt->hostname == NULL && opt->port == NULL) ||
+    (opt->workers_len != 0 && opt->workers == NULL)) {
     errno = EINVAL;
     return -1;
   }
@@ -563,7 +2961,11 @@ int tcp_server(struct tcp_server* const server, const struct tcp_server_options*
       goto err_loop;
     }
     net_socket_default_options(server->core.fd);
-    if(net_socket_bind(server->core.fd, cur_info) == -1 || listen(server->core.fd, opt->backlog == 0 ? 32 : opt->backlog) == -1) {
+    if(opt->fastopen != 0) {
+      (void) setsockopt(server->core.fd, net_proto_tcp, TCP_FASTOPEN, &opt->fastopen, sizeof(int));
+    }
+    if(net_socket_bind(server->core.fd, cur_info) == -1 || listen(server->core.fd, opt->backlog == 0 ? 32 : opt->backlog) == -1 ||
+      (opt->cpu_steering != 0 && net_socket_steer_by_cpu(server->core.fd, opt->cpu_steering) == -1)) {
       (void) close(server->core.fd);
       if(cur_info->ai_next == NULL) {
         goto err_loop;
@@ -575,14 +2977,65 @@ int tcp_server(struct tcp_server* const server, const struct tcp_server_options*
   }
   server->core.socket = 0;
   server->core.server = 1;
-  if(async_loop_add(server->loop, &server->core, EPOLLIN) == -1) {
+  server->core.callback = 0;
+  server->idle_timeout = opt->idle_timeout;
+  server->read_timeout = opt->read_timeout;
+  server->write_timeout = opt->write_timeout;
+  server->autotune = opt->autotune != 0;
+  server->stage_sends = opt->stage_sends != 0;
+  server->accept_retry = (struct async_timer) {0};
+  server->counters = shnet_calloc(1, sizeof(*server->counters));
+  if(server->counters == NULL) {
     goto err_sfd;
   }
+  atomic_init(&server->counters->refs, 1);
+  if(opt->workers_len != 0) {
+    server->workers = tcp_workers(opt);
+    if(server->workers == NULL) {
+      goto err_counters;
+    }
+  } else {
+    server->workers = NULL;
+  }
+  if(opt->max_lag != 0 || opt->accept_rate != 0) {
+    server->admit = shnet_calloc(1, sizeof(*server->admit));
+    if(server->admit == NULL) {
+      goto err_workers;
+    }
+    server->admit->probe.on_timeout = tcp_admit_onprobe;
+    server->admit->server = server;
+    server->admit->max_lag = opt->max_lag;
+    server->admit->rate = opt->accept_rate;
+    server->admit->burst = opt->accept_burst != 0 ? opt->accept_burst : opt->accept_rate;
+    server->admit->tokens = server->admit->burst;
+    server->admit->refill_at = tcp_time_us();
+  } else {
+    server->admit = NULL;
+  }
+  server->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if(async_loop_add(server->loop, &server->core, EPOLLIN) == -1) {
+    goto err_admit;
+  }
   if(alloc_info) {
     net_free_address(info);
   }
   return 0;
   
+  err_admit:
+  if(server->reserve_fd != -1) {
+    (void) close(server->reserve_fd);
+    server->reserve_fd = -1;
+  }
+  free(server->admit);
+  server->admit = NULL;
+  err_workers:
+  if(server->workers != NULL) {
+    free(server->workers);
+    server->workers = NULL;
+  }
+  err_counters:
+  free(server->counters);
+  server->counters = NULL;
   err_sfd:
   (void) close(server->core.fd);
   server->core.fd = -1;
@@ -608,6 +3061,11 @@ static void tcp_server_onevent(uint32_t events, struct async_event* event) {
   }
   assert(!(events & ~EPOLLIN));
   while(1) {
+    const uint32_t wait = tcp_server_admit(_server);
+    if(wait != 0) {
+      tcp_server_retry(_server, wait);
+      return;
+    }
     struct sockaddr_storage addr;
     int sfd;
     safe_execute(sfd = accept(_server->core.fd, (struct sockaddr*)&addr, (socklen_t[]){ sizeof(addr) }), sfd == -1, errno);
@@ -618,13 +3076,32 @@ static void tcp_server_onevent(uint32_t events, struct async_event* event) {
         case EPROTO:
         case ECONNRESET:
         case ECONNABORTED: continue;
+        case EMFILE:
+        case ENFILE: {
+          if(tcp_server_shed(_server) == 0) {
+            continue;
+          }
+          tcp_server_retry(_server, tcp_admit_retry);
+          return;
+        }
+        case ENOBUFS:
+        case ENOMEM: {
+          tcp_server_retry(_server, tcp_admit_retry);
+          return;
+        }
         default: return;
       }
     }
+    tcp_server_admitted(_server);
     struct tcp_socket sock = {0};
     sock.core.fd = sfd;
     sock.core.socket = 1;
     sock.core.server = 1;
+    sock.idle_timeout = _server->idle_timeout;
+    sock.read_timeout = _server->read_timeout;
+    sock.write_timeout = _server->write_timeout;
+    sock.autotune = _server->autotune;
+    sock.stage_sends = _server->stage_sends;
     net_socket_default_options(sfd);
     struct tcp_socket* socket = _server->on_event(_server, &sock, tcp_open);
     if(socket == NULL) {
@@ -640,22 +3117,32 @@ static void tcp_server_onevent(uint32_t events, struct async_event* event) {
     }
     *socket = sock;
     if(socket->loop == NULL) {
-      socket->loop = _server->loop;
+      if(_server->workers != NULL) {
+        struct tcp_worker* const worker = tcp_worker_pick(_server->workers);
+        (void) atomic_fetch_add_explicit(&worker->conns, 1, memory_order_relaxed);
+        (void) atomic_fetch_add_explicit(&_server->workers->refs, 1, memory_order_relaxed);
+        socket->worker = worker;
+        socket->loop = worker->loop;
+        if(_server->workers->rebalance_interval != 0 && !async_timer_armed(&_server->workers->rebalance)) {
+          async_timer_set(_server->loop, &_server->workers->rebalance, _server->workers->rebalance_interval);
+        }
+      } else {
+        socket->loop = _server->loop;
+      }
     }
-    int err;
-    safe_execute(err = pthread_mutex_init(&socket->lock, NULL), err != 0, err);
-    if(err != 0) {
-      errno = err;
+    tcp_counters_join(_server->counters, socket);
+    if(async_loop_add(socket->loop, &socket->core, tcp_socket_events(socket)) == -1) {
       goto err_open;
     }
-    if(async_loop_add(socket->loop, &socket->core, EPOLLET | EPOLLRDHUP | EPOLLIN | EPOLLOUT) == -1) {
-      goto err_mutex;
-    }
     continue;
     
-    err_mutex:
-    (void) pthread_mutex_destroy(&socket->lock);
     err_open:
+    if(socket->worker != NULL) {
+      tcp_worker_leave(socket);
+    }
+    if(socket->counters != NULL) {
+      tcp_counters_leave(socket);
+    }
     if(socket->free) {
       free(socket);
     }
@@ -669,10 +3156,450 @@ static void tcp_server_onevent(uint32_t events, struct async_event* event) {
 
 
 
-void tcp_onevent(struct async_loop* loop, uint32_t events, struct async_event* event) {
+/*
+ * A pool keeps connections to a number of upstreams (keys) open for reuse.
+ * Every connection has the pool's event handler installed for its whole
+ * lifetime. While a connection is checked out, events are forwarded to the
+ * handler given to tcp_pool_get(). While it's idle, the pool watches it on
+ * its own and closes it as soon as the peer closes it or sends anything.
+ *
+ * Idle connections of a key are kept in a list, most recently used first.
+ * Checkouts take the head, so that the tail holds the connections that have
+ * been idle the longest, which are the ones a periodic timer evicts.
+ */
+
+#define conn ((struct tcp_pool_conn*) socket)
+
+static uint64_t tcp_pool_now(void) {
+  struct timespec tp;
+  (void) clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t) tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+static void tcp_pool_unlink(struct tcp_pool_conn* const c) {
+  struct tcp_pool_key* const key = c->key;
+  if(c->prev == NULL) {
+    key->idle_head = c->next;
+  } else {
+    c->prev->next = c->next;
+  }
+  if(c->next == NULL) {
+    key->idle_tail = c->prev;
+  } else {
+    c->next->prev = c->prev;
+  }
+  c->prev = NULL;
+  c->next = NULL;
+  c->idle = 0;
+  --key->idle;
+}
+
+static void tcp_pool_link(struct tcp_pool_conn* const c) {
+  struct tcp_pool_key* const key = c->key;
+  c->prev = NULL;
+  c->next = key->idle_head;
+  if(key->idle_head == NULL) {
+    key->idle_tail = c;
+  } else {
+    key->idle_head->prev = c;
+  }
+  key->idle_head = c;
+  c->idle = 1;
+  c->idle_since = tcp_pool_now();
+  ++key->idle;
+}
+
+static void tcp_pool_onevent(struct tcp_socket* socket, enum tcp_event event) {
+  struct tcp_pool* const pool = conn->key->pool;
+  const int code = errno;
+  int close_ = 0;
+  int free_ = 0;
+  (void) pthread_mutex_lock(&pool->lock);
+  void (*const on_event)(struct tcp_socket*, enum tcp_event) = conn->busy ? conn->on_event : NULL;
+  switch(event) {
+    case tcp_data:
+    case tcp_readclose: {
+      if(conn->idle) {
+        /* Idle connections must stay silent, they can't be reused otherwise */
+        tcp_pool_unlink(conn);
+        close_ = 1;
+      }
+      break;
+    }
+    case tcp_close: {
+      if(conn->idle) {
+        tcp_pool_unlink(conn);
+      }
+      conn->dead = 1;
+      conn->err = code;
+      --conn->key->total;
+      /* If tcp_socket() didn't even return yet, it's freed by the caller */
+      free_ = !conn->creating;
+      break;
+    }
+    case tcp_free: {
+      if(--pool->conns == 0) {
+        (void) pthread_cond_broadcast(&pool->done);
+      }
+      break;
+    }
+    default: break;
+  }
+  if(close_) {
+    tcp_socket_force_close(socket);
+  }
+  (void) pthread_mutex_unlock(&pool->lock);
+  if(on_event != NULL) {
+    errno = code;
+    on_event(socket, event);
+  }
+  if(free_) {
+    tcp_socket_free(socket);
+  }
+}
+
+#undef conn
+
+/*
+ * The connection must have already been accounted for in key->total and
+ * pool->conns. Connections that aren't checked out are put in the idle list.
+ */
+
+static struct tcp_pool_conn* tcp_pool_connect(struct tcp_pool_key* const key, const int busy, void (*on_event)(struct tcp_socket*, enum tcp_event)) {
+  struct tcp_pool* const pool = key->pool;
+  struct tcp_pool_conn* const c = shnet_calloc(1, sizeof(*c));
+  if(c == NULL) {
+    goto err;
+  }
+  c->on_event = on_event;
+  c->key = key;
+  c->busy = busy;
+  c->creating = 1;
+  c->tcp.on_event = tcp_pool_onevent;
+  c->tcp.loop = pool->loop;
+  c->tcp.free = 1;
+  if(tcp_socket(&c->tcp, &key->opt) == -1) {
+    free(c);
+    goto err;
+  }
+  (void) pthread_mutex_lock(&pool->lock);
+  c->creating = 0;
+  if(c->dead) {
+    const int code = c->err;
+    (void) pthread_mutex_unlock(&pool->lock);
+    tcp_socket_free(&c->tcp);
+    errno = code != 0 ? code : ECONNREFUSED;
+    return NULL;
+  }
+  if(!c->busy) {
+    if(pool->closing) {
+      tcp_socket_force_close(&c->tcp);
+    } else {
+      tcp_pool_link(c);
+    }
+  }
+  (void) pthread_mutex_unlock(&pool->lock);
+  return c;
+
+  err:
+  (void) pthread_mutex_lock(&pool->lock);
+  --key->total;
+  if(--pool->conns == 0) {
+    (void) pthread_cond_broadcast(&pool->done);
+  }
+  (void) pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static void tcp_pool_warm(struct tcp_pool_key* const key, const uint32_t count) {
+  for(uint32_t i = 0; i < count; ++i) {
+    (void) tcp_pool_connect(key, 0, NULL);
+  }
+}
+
+static void tcp_pool_ontimer(struct async_loop* loop, uint32_t events, struct async_callback* event) {
   (void) loop;
+  (void) events;
+  struct tcp_pool* const pool = (struct tcp_pool*) event;
+  uint64_t expired;
+  (void) read(pool->core.core.fd, &expired, sizeof(expired));
+  const uint64_t now = tcp_pool_now();
+  (void) pthread_mutex_lock(&pool->lock);
+  for(uint32_t i = 0; i < pool->keys_used && !pool->closing; ++i) {
+    struct tcp_pool_key* const key = pool->keys[i];
+    /* Closed connections are only subtracted from the total once they close */
+    uint32_t total = key->total;
+    while(key->idle_tail != NULL && total > key->min && now - key->idle_tail->idle_since >= pool->idle_timeout) {
+      struct tcp_pool_conn* const c = key->idle_tail;
+      tcp_pool_unlink(c);
+      tcp_socket_force_close(&c->tcp);
+      --total;
+    }
+    if(key->total < key->min) {
+      const uint32_t count = key->min - key->total;
+      key->total += count;
+      pool->conns += count;
+      (void) pthread_mutex_unlock(&pool->lock);
+      tcp_pool_warm(key, count);
+      (void) pthread_mutex_lock(&pool->lock);
+    }
+  }
+  (void) pthread_mutex_unlock(&pool->lock);
+}
+
+int tcp_pool(struct tcp_pool* const pool) {
+  if(pool->idle_timeout == 0) {
+    pool->idle_timeout = 30000;
+  }
+  int err;
+  safe_execute(err = pthread_mutex_init(&pool->lock, NULL), err != 0, err);
+  if(err != 0) {
+    errno = err;
+    return -1;
+  }
+  safe_execute(err = pthread_cond_init(&pool->done, NULL), err != 0, err);
+  if(err != 0) {
+    errno = err;
+    goto err_mutex;
+  }
+  safe_execute(pool->core.core.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), pool->core.core.fd == -1, errno);
+  if(pool->core.core.fd == -1) {
+    goto err_cond;
+  }
+  /* Idle connections are thus evicted at most a quarter of the timeout late */
+  const uint32_t interval = pool->idle_timeout < 4 ? 1 : (pool->idle_timeout >> 2);
+  const struct timespec spec = (struct timespec) {
+    .tv_sec = interval / 1000,
+    .tv_nsec = (interval % 1000) * 1000000
+  };
+  (void) timerfd_settime(pool->core.core.fd, 0, &((struct itimerspec) {
+    .it_interval = spec,
+    .it_value = spec
+  }), NULL);
+  pool->core.core.callback = 1;
+  pool->core.on_event = tcp_pool_ontimer;
+  if(pool->loop == NULL) {
+    pool->loop = shnet_calloc(1, sizeof(*pool->loop));
+    if(pool->loop == NULL) {
+      goto err_timer;
+    }
+    if(tcp_async_loop(pool->loop) == -1) {
+      free(pool->loop);
+      pool->loop = NULL;
+      goto err_timer;
+    }
+    if(async_loop_start(pool->loop) == -1) {
+      async_loop_free(pool->loop);
+      free(pool->loop);
+      pool->loop = NULL;
+      goto err_timer;
+    }
+    pool->alloc_loop = 1;
+  }
+  if(async_loop_add(pool->loop, &pool->core.core, EPOLLIN) == -1) {
+    goto err_loop;
+  }
+  pool->keys = NULL;
+  pool->keys_used = 0;
+  pool->keys_size = 0;
+  pool->conns = 0;
+  pool->closing = 0;
+  return 0;
+
+  err_loop:
+  if(pool->alloc_loop) {
+    async_loop_stop(pool->loop);
+    async_loop_free(pool->loop);
+    free(pool->loop);
+    pool->loop = NULL;
+    pool->alloc_loop = 0;
+  }
+  err_timer:
+  (void) close(pool->core.core.fd);
+  err_cond:
+  (void) pthread_cond_destroy(&pool->done);
+  err_mutex:
+  (void) pthread_mutex_destroy(&pool->lock);
+  return -1;
+}
+
+void tcp_pool_free(struct tcp_pool* const pool) {
+  (void) pthread_mutex_lock(&pool->lock);
+  pool->closing = 1;
+  for(uint32_t i = 0; i < pool->keys_used; ++i) {
+    struct tcp_pool_key* const key = pool->keys[i];
+    while(key->idle_head != NULL) {
+      struct tcp_pool_conn* const c = key->idle_head;
+      tcp_pool_unlink(c);
+      tcp_socket_force_close(&c->tcp);
+    }
+  }
+  (void) async_loop_remove(pool->loop, &pool->core.core);
+  while(pool->conns != 0) {
+    (void) pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  (void) pthread_mutex_unlock(&pool->lock);
+  if(pool->alloc_loop) {
+    async_loop_stop(pool->loop);
+    async_loop_free(pool->loop);
+    free(pool->loop);
+    pool->loop = NULL;
+    pool->alloc_loop = 0;
+  }
+  for(uint32_t i = 0; i < pool->keys_used; ++i) {
+    if(pool->keys[i]->opt.info != NULL) {
+      net_free_address(pool->keys[i]->opt.info);
+    }
+    free(pool->keys[i]);
+  }
+  free(pool->keys);
+  pool->keys = NULL;
+  pool->keys_used = 0;
+  pool->keys_size = 0;
+  (void) close(pool->core.core.fd);
+  (void) pthread_cond_destroy(&pool->done);
+  (void) pthread_mutex_destroy(&pool->lock);
+}
+
+struct tcp_pool_key* tcp_pool_key(struct tcp_pool* const pool, const struct tcp_pool_key_options* const opt) {
+  if(opt == NULL || (opt->tcp.info == NULL && opt->tcp.hostname == NULL && opt->tcp.port == NULL) ||
+    (opt->max != 0 && opt->min > opt->max)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  const size_t hostname_len = opt->tcp.hostname == NULL ? 0 : (strlen(opt->tcp.hostname) + 1);
+  const size_t port_len = opt->tcp.port == NULL ? 0 : (strlen(opt->tcp.port) + 1);
+  struct tcp_pool_key* const key = shnet_calloc(1, sizeof(*key) + hostname_len + port_len);
+  if(key == NULL) {
+    return NULL;
+  }
+  key->pool = pool;
+  key->opt = opt->tcp;
+  if(opt->tcp.hostname != NULL) {
+    key->opt.hostname = (char*)(key + 1);
+    (void) memcpy((char*)(key + 1), opt->tcp.hostname, hostname_len);
+  }
+  if(opt->tcp.port != NULL) {
+    key->opt.port = (char*)(key + 1) + hostname_len;
+    (void) memcpy((char*)(key + 1) + hostname_len, opt->tcp.port, port_len);
+  }
+  if(opt->tcp.info != NULL) {
+    key->opt.info = net_copy_address(opt->tcp.info);
+    if(key->opt.info == NULL) {
+      goto err_key;
+    }
+  }
+  key->min = opt->min;
+  key->max = opt->max == 0 ? UINT32_MAX : opt->max;
+  (void) pthread_mutex_lock(&pool->lock);
+  if(pool->keys_used == pool->keys_size) {
+    const uint32_t size = pool->keys_size == 0 ? 4 : (pool->keys_size << 1);
+    void* const ptr = shnet_realloc(pool->keys, sizeof(*pool->keys) * size);
+    if(ptr == NULL) {
+      (void) pthread_mutex_unlock(&pool->lock);
+      goto err_info;
+    }
+    pool->keys = ptr;
+    pool->keys_size = size;
+  }
+  pool->keys[pool->keys_used++] = key;
+  key->total = key->min;
+  pool->conns += key->min;
+  (void) pthread_mutex_unlock(&pool->lock);
+  tcp_pool_warm(key, key->min);
+  return key;
+
+  err_info:
+  if(key->opt.info != NULL) {
+    net_free_address(key->opt.info);
+  }
+  err_key:
+  free(key);
+  return NULL;
+}
+
+struct tcp_socket* tcp_pool_get(struct tcp_pool_key* const key, void (*on_event)(struct tcp_socket*, enum tcp_event)) {
+  struct tcp_pool* const pool = key->pool;
+  (void) pthread_mutex_lock(&pool->lock);
+  if(pool->closing) {
+    (void) pthread_mutex_unlock(&pool->lock);
+    errno = EPIPE;
+    return NULL;
+  }
+  struct tcp_pool_conn* c = key->idle_head;
+  if(c != NULL) {
+    tcp_pool_unlink(c);
+    c->busy = 1;
+    c->on_event = on_event;
+    (void) pthread_mutex_unlock(&pool->lock);
+    return &c->tcp;
+  }
+  if(key->total >= key->max) {
+    (void) pthread_mutex_unlock(&pool->lock);
+    errno = EAGAIN;
+    return NULL;
+  }
+  ++key->total;
+  ++pool->conns;
+  (void) pthread_mutex_unlock(&pool->lock);
+  c = tcp_pool_connect(key, 1, on_event);
+  return c == NULL ? NULL : &c->tcp;
+}
+
+void tcp_pool_put(struct tcp_socket* const socket) {
+  struct tcp_pool_conn* const c = (struct tcp_pool_conn*) socket;
+  struct tcp_pool* const pool = c->key->pool;
+  (void) pthread_mutex_lock(&pool->lock);
+  c->busy = 0;
+  c->on_event = NULL;
+  c->data = NULL;
+  if(c->dead) {
+    (void) pthread_mutex_unlock(&pool->lock);
+    return;
+  }
+  tcp_lock(socket);
+  int healthy = !pool->closing && !socket->closing && !socket->closing_fast;
+  if(healthy && socket->core.fd != -1) {
+    /* Unread data would be mistaken for a response by the next user */
+    int unread = 0;
+    healthy = ioctl(socket->core.fd, FIONREAD, &unread) == 0 && unread == 0;
+  }
+  tcp_unlock(socket);
+  if(healthy) {
+    tcp_pool_link(c);
+  } else {
+    tcp_socket_force_close(socket);
+  }
+  (void) pthread_mutex_unlock(&pool->lock);
+}
+
+
+
+void tcp_onevent(struct async_loop* loop, uint32_t events, struct async_event* event) {
   if(event->socket) {
+    struct tcp_socket* const socket = (struct tcp_socket*) event;
+    if(socket->loop != loop) {
+      /* Migrated earlier in this batch, the target reports it anew */
+      return;
+    }
+    struct tcp_worker* const worker = socket->worker;
+    const uint64_t start = worker != NULL && atomic_load_explicit(&worker->move_to, memory_order_relaxed) != NULL ? tcp_time_us() : 0;
+    tcp_dispatched = socket;
     tcp_socket_onevent(events, event);
+    if(tcp_dispatched == NULL) {
+      /* Closed, there's nothing left to migrate */
+      free(tcp_deferred);
+      tcp_deferred = NULL;
+      return;
+    }
+    tcp_dispatched = NULL;
+    if(tcp_deferred != NULL) {
+      struct tcp_migrate* const migrate = tcp_deferred;
+      tcp_deferred = NULL;
+      tcp_migrate_detach(migrate);
+    } else if(start != 0) {
+      tcp_rebalance_sample(socket, worker, tcp_time_us() - start);
+    }
   } else {
     tcp_server_onevent(events, event);
   }
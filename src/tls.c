@@ -0,0 +1,801 @@
+#include <errno.h>
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <shnet/tls.h>
+#include <shnet/error.h>
+
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/x509v3.h>
+
+/*
+ * The session cache maps "servername:port" to the newest session received
+ * from that server. Sessions are evicted in least recently stored order.
+ */
+
+struct tls_session_entry {
+  char* key;
+  SSL_SESSION* session;
+};
+
+int tls_session_cache(struct tls_session_cache* const cache) {
+  if(cache->size == 0) {
+    cache->size = 64;
+  }
+  cache->entries = shnet_calloc(cache->size, sizeof(*cache->entries));
+  if(cache->entries == NULL) {
+    return -1;
+  }
+  int err;
+  safe_execute(err = pthread_mutex_init(&cache->lock, NULL), err != 0, err);
+  if(err != 0) {
+    free(cache->entries);
+    cache->entries = NULL;
+    errno = err;
+    return -1;
+  }
+  cache->used = 0;
+  return 0;
+}
+
+void tls_session_cache_free(struct tls_session_cache* const cache) {
+  for(uint32_t i = 0; i < cache->used; ++i) {
+    free(cache->entries[i].key);
+    SSL_SESSION_free(cache->entries[i].session);
+  }
+  free(cache->entries);
+  cache->entries = NULL;
+  cache->used = 0;
+  (void) pthread_mutex_destroy(&cache->lock);
+}
+
+static uint32_t tls_session_cache_find(const struct tls_session_cache* const cache, const char* const key) {
+  uint32_t i = 0;
+  for(; i < cache->used; ++i) {
+    if(strcmp(cache->entries[i].key, key) == 0) {
+      break;
+    }
+  }
+  return i;
+}
+
+static void tls_session_cache_remove(struct tls_session_cache* const cache, const uint32_t idx) {
+  free(cache->entries[idx].key);
+  SSL_SESSION_free(cache->entries[idx].session);
+  --cache->used;
+  (void) memmove(cache->entries + idx, cache->entries + idx + 1, sizeof(*cache->entries) * (cache->used - idx));
+}
+
+static int tls_session_cache_put(struct tls_session_cache* const cache, const char* const key, SSL_SESSION* const session) {
+  const size_t len = strlen(key) + 1;
+  char* const copy = shnet_malloc(len);
+  if(copy == NULL) {
+    return -1;
+  }
+  (void) memcpy(copy, key, len);
+  (void) pthread_mutex_lock(&cache->lock);
+  const uint32_t idx = tls_session_cache_find(cache, key);
+  if(idx != cache->used) {
+    tls_session_cache_remove(cache, idx);
+  } else if(cache->used == cache->size) {
+    tls_session_cache_remove(cache, 0);
+  }
+  cache->entries[cache->used++] = (struct tls_session_entry) {
+    .key = copy,
+    .session = session
+  };
+  (void) pthread_mutex_unlock(&cache->lock);
+  return 0;
+}
+
+static SSL_SESSION* tls_session_cache_get(struct tls_session_cache* const cache, const char* const key) {
+  SSL_SESSION* session = NULL;
+  (void) pthread_mutex_lock(&cache->lock);
+  const uint32_t idx = tls_session_cache_find(cache, key);
+  if(idx != cache->used) {
+    if(SSL_SESSION_is_resumable(cache->entries[idx].session)) {
+      session = cache->entries[idx].session;
+      (void) SSL_SESSION_up_ref(session);
+    } else {
+      tls_session_cache_remove(cache, idx);
+    }
+  }
+  (void) pthread_mutex_unlock(&cache->lock);
+  return session;
+}
+
+/*
+ * Sockets are found through an ex-data slot of their own rather than the app
+ * data, which belongs to whoever else makes SSL objects from the same context.
+ */
+
+static int tls_ex_index = -1;
+static pthread_once_t tls_ex_once = PTHREAD_ONCE_INIT;
+
+static void tls_ex_init(void) {
+  tls_ex_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
+
+static int tls_ex(void) {
+  (void) pthread_once(&tls_ex_once, tls_ex_init);
+  return tls_ex_index;
+}
+
+static int tls_session_new(SSL* ssl, SSL_SESSION* session) {
+  const int idx = tls_ex();
+  if(idx == -1) {
+    return 0;
+  }
+  struct tls_socket* const socket = SSL_get_ex_data(ssl, idx);
+  if(socket == NULL || socket->cache == NULL || socket->session_key == NULL) {
+    return 0;
+  }
+  /* Returning 1 means the cache took over the reference */
+  return tls_session_cache_put(socket->cache, socket->session_key, session) == 0;
+}
+
+void tls_ctx_session_cache(SSL_CTX* const ctx) {
+  (void) SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, tls_session_new);
+}
+
+static void tls_ctx_defaults(SSL_CTX* const ctx) {
+  (void) SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  (void) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+  (void) SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+}
+
+SSL_CTX* tls_client_ctx(void) {
+  SSL_CTX* const ctx = SSL_CTX_new(TLS_client_method());
+  if(ctx == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  tls_ctx_defaults(ctx);
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  (void) SSL_CTX_set_default_verify_paths(ctx);
+  tls_ctx_session_cache(ctx);
+  return ctx;
+}
+
+SSL_CTX* tls_server_ctx(void) {
+  SSL_CTX* const ctx = SSL_CTX_new(TLS_server_method());
+  if(ctx == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  tls_ctx_defaults(ctx);
+  return ctx;
+}
+
+static int tls_is_ip(const char* const name) {
+  unsigned char addr[16];
+  return inet_pton(AF_INET, name, addr) == 1 || inet_pton(AF_INET6, name, addr) == 1;
+}
+
+static int tls_cert_add_san(X509* const cert, const char* const name) {
+  char value[272];
+  const char* const type = tls_is_ip(name) ? "IP" : "DNS";
+  if(snprintf(value, sizeof(value), "%s:%s", type, name) >= (int) sizeof(value)) {
+    return -1;
+  }
+  X509_EXTENSION* const ext = X509V3_EXT_conf_nid(NULL, NULL, NID_subject_alt_name, value);
+  if(ext == NULL) {
+    return -1;
+  }
+  const int ok = X509_add_ext(cert, ext, -1);
+  X509_EXTENSION_free(ext);
+  return ok ? 0 : -1;
+}
+
+int tls_ctx_self_signed(SSL_CTX* const ctx, const char* const name) {
+  EVP_PKEY* const key = EVP_EC_gen("P-256");
+  if(key == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  X509* const cert = X509_new();
+  if(cert == NULL) {
+    EVP_PKEY_free(key);
+    errno = ENOMEM;
+    return -1;
+  }
+  uint32_t serial;
+  X509_NAME* subject;
+  const int ok =
+    RAND_bytes((unsigned char*) &serial, sizeof(serial)) == 1 &&
+    X509_set_version(cert, X509_VERSION_3) &&
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), serial >> 1) &&
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600) != NULL &&
+    X509_gmtime_adj(X509_getm_notAfter(cert), 86400L * 365) != NULL &&
+    X509_set_pubkey(cert, key) &&
+    (subject = X509_get_subject_name(cert)) != NULL &&
+    X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_ASC, (const unsigned char*) name, -1, -1, 0) &&
+    X509_set_issuer_name(cert, subject) &&
+    tls_cert_add_san(cert, name) == 0 &&
+    X509_sign(cert, key, EVP_sha256()) != 0 &&
+    SSL_CTX_use_certificate(ctx, cert) == 1 &&
+    SSL_CTX_use_PrivateKey(ctx, key) == 1;
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  if(!ok) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+
+
+static void tls_socket_onevent(struct tcp_socket*, enum tcp_event);
+
+static int tls_socket_ssl(struct tls_socket* const socket, SSL_CTX* const ctx) {
+  const int idx = tls_ex();
+  if(idx == -1) {
+    errno = ENOMEM;
+    return -1;
+  }
+  socket->ssl = SSL_new(ctx);
+  if(socket->ssl == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  socket->tcp.alloc_ssl = 1;
+  (void) SSL_set_ex_data(socket->ssl, idx, socket);
+  (void) SSL_set_options(socket->ssl, SSL_OP_ENABLE_KTLS);
+  (void) SSL_set_mode(socket->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  socket->tcp.on_event = tls_socket_onevent;
+  socket->tcp.dont_close_onreadclose = 1;
+  return 0;
+}
+
+static void tls_socket_deinit(struct tls_socket* const socket) {
+  if(socket->tcp.alloc_ssl) {
+    SSL_free(socket->ssl);
+    socket->ssl = NULL;
+    socket->tcp.alloc_ssl = 0;
+  }
+  if(socket->tcp.alloc_ctx) {
+    SSL_CTX_free(socket->ctx);
+    socket->ctx = NULL;
+    socket->tcp.alloc_ctx = 0;
+  }
+  if(socket->session_key != NULL) {
+    free(socket->session_key);
+    socket->session_key = NULL;
+  }
+  socket->cache = NULL;
+  data_storage_free(&socket->queue);
+  socket->tcp.tls_close_guard = 0;
+  socket->tcp.init_fin = 0;
+  socket->tcp.shutdown_once = 0;
+  socket->tcp.ktls = 0;
+}
+
+int tls_socket_resumed(struct tls_socket* const socket) {
+  tcp_lock(&socket->tcp);
+  const int reused = socket->tcp.init_fin && SSL_session_reused(socket->ssl);
+  tcp_unlock(&socket->tcp);
+  return reused;
+}
+
+int tls_socket_ktls(struct tls_socket* const socket) {
+  tcp_lock(&socket->tcp);
+  const int ktls = socket->tcp.ktls;
+  tcp_unlock(&socket->tcp);
+  return ktls;
+}
+
+void tls_socket_free(struct tls_socket* const socket) {
+  tcp_socket_free(&socket->tcp);
+}
+
+void tls_socket_force_close(struct tls_socket* const socket) {
+  tcp_socket_force_close(&socket->tcp);
+}
+
+/*
+ * With kernel TLS, close_notify must be sent after all of the data queued in
+ * the TCP layer, so it is queued there as a generator that sends the alert.
+ */
+
+static int tls_close_notify(struct data_generator* gen, struct data_frame* frame) {
+  (void) frame;
+  struct tls_socket* const socket = (struct tls_socket*)((char*) gen - offsetof(struct tls_socket, close_notify));
+  ERR_clear_error();
+  (void) SSL_shutdown(socket->ssl);
+  return 0;
+}
+
+static void tls_socket_shutdown(struct tls_socket* const socket) {
+  tcp_lock(&socket->tcp);
+  if(socket->tcp.shutdown_once) {
+    tcp_unlock(&socket->tcp);
+    return;
+  }
+  socket->tcp.shutdown_once = 1;
+  if(socket->tcp.ktls) {
+    socket->close_notify.produce = tls_close_notify;
+    if(data_storage_add(&socket->tcp.queue, &((struct data_frame) {
+      .gen = &socket->close_notify,
+      .dont_free = 1,
+      .generator = 1
+    })) == 0) {
+      (void) tcp_send_buffered(&socket->tcp);
+    }
+  } else {
+    ERR_clear_error();
+    (void) SSL_shutdown(socket->ssl);
+  }
+  tcp_unlock(&socket->tcp);
+  tcp_socket_close(&socket->tcp);
+}
+
+/*
+ * Without kernel TLS, plaintext is queued in the TLS layer and encrypted in
+ * userspace with SSL_write(). Files are read in chunks, since sendfile() can't
+ * be used. The return value is the same as for tcp_send_buffered().
+ */
+
+enum tls_const {
+  tls_file_chunk = 16384
+};
+
+static int tls_send_buffered(struct tls_socket* const socket) {
+  while(!data_storage_is_empty(&socket->queue)) {
+#define data_ socket->queue.frames
+    if(data_->generator) {
+      if(data_storage_generate(&socket->queue) == -1) {
+        return -1;
+      }
+      continue;
+    }
+    char buf[tls_file_chunk];
+    const void* data;
+    uint64_t len = data_->len - data_->offset;
+    if(data_->file) {
+      if(len > sizeof(buf)) {
+        len = sizeof(buf);
+      }
+      ssize_t bytes;
+      safe_execute(bytes = pread(data_->fd, buf, len, data_->offset), bytes == -1, errno);
+      if(bytes <= 0) {
+        if(bytes == -1 && errno == EINTR) {
+          continue;
+        }
+        goto err;
+      }
+      data = buf;
+      len = bytes;
+    } else {
+      data = data_->data + data_->offset;
+      if(len > INT_MAX) {
+        len = INT_MAX;
+      }
+    }
+#undef data_
+    ERR_clear_error();
+    const int bytes = SSL_write(socket->ssl, data, len);
+    if(bytes <= 0) {
+      switch(SSL_get_error(socket->ssl, bytes)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE: return -1;
+        default: goto err;
+      }
+    }
+    data_storage_drain(&socket->queue, bytes);
+    socket->tcp.bytes_out += bytes;
+  }
+  return 0;
+
+  err:
+  data_storage_free(&socket->queue);
+  errno = EPIPE;
+  return -2;
+}
+
+static void tls_socket_flush(struct tls_socket* const socket) {
+  tcp_lock(&socket->tcp);
+  if(!socket->tcp.init_fin || socket->tcp.shutdown_once) {
+    tcp_unlock(&socket->tcp);
+    return;
+  }
+  const int err = socket->tcp.ktls ? 0 : tls_send_buffered(socket);
+  const int shutdown = err == 0 && socket->tcp.tls_close_guard;
+  tcp_unlock(&socket->tcp);
+  if(err == -2) {
+    tcp_socket_force_close(&socket->tcp);
+  } else if(shutdown) {
+    tls_socket_shutdown(socket);
+  }
+}
+
+void tls_socket_close(struct tls_socket* const socket) {
+  tcp_lock(&socket->tcp);
+  socket->tcp.tls_close_guard = 1;
+  tcp_unlock(&socket->tcp);
+  tls_socket_flush(socket);
+}
+
+/*
+ * Once the handshake is done, the kernel might have taken over encryption of
+ * outgoing records. In that case, everything queued so far is moved to the TCP
+ * layer, which is then used directly, so that sendfile() stays zero-copy.
+ */
+
+static int tls_socket_offload(struct tls_socket* const socket) {
+#ifndef OPENSSL_NO_KTLS
+  if(!BIO_get_ktls_send(SSL_get_wbio(socket->ssl))) {
+    return 0;
+  }
+  socket->tcp.ktls = 1;
+  const uint32_t used = socket->queue.used;
+  uint32_t i = 0;
+  for(; i < used; ++i) {
+    struct data_frame frame = socket->queue.frames[i];
+    /* Already owned by the queue, so must not be copied again */
+    frame.read_only = 1;
+    if(data_storage_add(&socket->tcp.queue, &frame) == -1) {
+      for(uint32_t j = i; j < used; ++j) {
+        data_storage_free_frame(socket->queue.frames + j);
+      }
+      break;
+    }
+  }
+  /* Drops the frames without freeing them */
+  (void) data_storage_resize(&socket->queue, 0);
+  if(i != used) {
+    return -1;
+  }
+  if(!data_storage_is_empty(&socket->tcp.queue)) {
+    (void) tcp_send_buffered(&socket->tcp);
+  }
+#else
+  (void) socket;
+#endif
+  return 0;
+}
+
+static void tls_socket_handshake(struct tls_socket* const socket) {
+  tcp_lock(&socket->tcp);
+  ERR_clear_error();
+  const int ret = SSL_do_handshake(socket->ssl);
+  if(ret != 1) {
+    const int err = SSL_get_error(socket->ssl, ret);
+    tcp_unlock(&socket->tcp);
+    if(err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+      tcp_socket_force_close(&socket->tcp);
+    }
+    return;
+  }
+  socket->tcp.init_fin = 1;
+  const int err = tls_socket_offload(socket);
+  tcp_unlock(&socket->tcp);
+  if(err == -1) {
+    tcp_socket_force_close(&socket->tcp);
+    return;
+  }
+  if(socket->on_event != NULL) {
+    socket->on_event(socket, tcp_open);
+    /*
+     * Application data might have arrived together with the last handshake
+     * message, in which case there won't be another edge to report it.
+     */
+    socket->on_event(socket, tcp_data);
+  }
+  tls_socket_flush(socket);
+}
+
+static void tls_socket_onevent(struct tcp_socket* tcp, enum tcp_event event) {
+  struct tls_socket* const socket = (struct tls_socket*) tcp;
+  switch(event) {
+    case tcp_open: {
+      tcp_lock(tcp);
+      const int ok = SSL_set_fd(socket->ssl, tcp->core.fd);
+      tcp_unlock(tcp);
+      if(!ok) {
+        tcp_socket_force_close(tcp);
+        break;
+      }
+      tls_socket_handshake(socket);
+      break;
+    }
+    case tcp_data: {
+      if(!tcp->init_fin) {
+        tls_socket_handshake(socket);
+      } else if(socket->on_event != NULL) {
+        socket->on_event(socket, tcp_data);
+      }
+      break;
+    }
+    case tcp_can_send: {
+      if(!tcp->init_fin) {
+        tls_socket_handshake(socket);
+        break;
+      }
+      tls_socket_flush(socket);
+      if(socket->on_event != NULL) {
+        socket->on_event(socket, tcp_can_send);
+      }
+      break;
+    }
+    case tcp_readclose: {
+      if(!tcp->init_fin) {
+        tcp_socket_force_close(tcp);
+        break;
+      }
+      if(socket->on_event != NULL) {
+        socket->on_event(socket, tcp_readclose);
+      }
+      if(!socket->dont_close_onreadclose) {
+        tls_socket_close(socket);
+      }
+      break;
+    }
+    case tcp_deinit: {
+      if(socket->on_event != NULL) {
+        socket->on_event(socket, tcp_deinit);
+      }
+      tls_socket_deinit(socket);
+      break;
+    }
+    default: {
+      if(socket->on_event != NULL) {
+        socket->on_event(socket, event);
+      }
+      break;
+    }
+  }
+}
+
+static char* tls_socket_session_key(const char* const servername, const struct tcp_socket_options* const opt) {
+  char port[8] = {0};
+  if(opt->port != NULL) {
+    (void) snprintf(port, sizeof(port), "%s", opt->port);
+  } else if(opt->info != NULL) {
+    (void) snprintf(port, sizeof(port), "%hu", net_address_to_port(opt->info->ai_addr));
+  }
+  const size_t len = strlen(servername) + strlen(port) + 2;
+  char* const key = shnet_malloc(len);
+  if(key != NULL) {
+    (void) snprintf(key, len, "%s:%s", servername, port);
+  }
+  return key;
+}
+
+int tls_socket(struct tls_socket* const socket, const struct tls_socket_options* const opt) {
+  if(opt == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  if(opt->ctx != NULL) {
+    socket->ctx = opt->ctx;
+  } else {
+    socket->ctx = tls_client_ctx();
+    if(socket->ctx == NULL) {
+      return -1;
+    }
+    socket->tcp.alloc_ctx = 1;
+  }
+  if(tls_socket_ssl(socket, socket->ctx) == -1) {
+    goto err_ctx;
+  }
+  SSL_set_connect_state(socket->ssl);
+  const char* const servername = opt->servername != NULL ? opt->servername : opt->tcp.hostname;
+  if(servername != NULL) {
+    /* Server Name Indication must not be used for IP addresses */
+    if(tls_is_ip(servername) ? !X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(socket->ssl), servername) :
+      (!SSL_set_tlsext_host_name(socket->ssl, servername) || !SSL_set1_host(socket->ssl, servername))) {
+      errno = EINVAL;
+      goto err_ssl;
+    }
+    if(opt->cache != NULL) {
+      socket->session_key = tls_socket_session_key(servername, &opt->tcp);
+      if(socket->session_key == NULL) {
+        goto err_ssl;
+      }
+      socket->cache = opt->cache;
+      SSL_SESSION* const session = tls_session_cache_get(opt->cache, socket->session_key);
+      if(session != NULL) {
+        (void) SSL_set_session(socket->ssl, session);
+        SSL_SESSION_free(session);
+      }
+    }
+  }
+  if(tcp_socket(&socket->tcp, &opt->tcp) == -1) {
+    goto err_ssl;
+  }
+  return 0;
+
+  err_ssl:
+  tls_socket_deinit(socket);
+  return -1;
+
+  err_ctx:
+  if(socket->tcp.alloc_ctx) {
+    SSL_CTX_free(socket->ctx);
+    socket->ctx = NULL;
+    socket->tcp.alloc_ctx = 0;
+  }
+  return -1;
+}
+
+int tls_send(struct tls_socket* const socket, const struct data_frame* const frame) {
+  tcp_lock(&socket->tcp);
+  if(socket->tcp.tls_close_guard || socket->tcp.closing || socket->tcp.closing_fast) {
+    tcp_unlock(&socket->tcp);
+    data_storage_free_frame_err(frame);
+    errno = EPIPE;
+    return -1;
+  }
+  if(socket->tcp.ktls) {
+    tcp_unlock(&socket->tcp);
+    return tcp_send(&socket->tcp, frame);
+  }
+  if(tcp_budget_check(&socket->tcp, &socket->queue) == -1) {
+    tcp_unlock(&socket->tcp);
+    data_storage_free_frame_err(frame);
+    return -1;
+  }
+  if(data_storage_add(&socket->queue, frame) == -1) {
+    tcp_unlock(&socket->tcp);
+    return -1;
+  }
+  const int err = socket->tcp.init_fin ? tls_send_buffered(socket) : 0;
+  tcp_unlock(&socket->tcp);
+  if(err == -2) {
+    tcp_socket_force_close(&socket->tcp);
+    return -1;
+  }
+  errno = 0;
+  return 0;
+}
+
+int tls_handle_send(const uint64_t handle, const struct data_frame* const frame) {
+  struct tcp_socket* const socket = tcp_handle_acquire(handle);
+  if(socket == NULL) {
+    data_storage_free_frame_err(frame);
+    errno = ESTALE;
+    return -1;
+  }
+  const int err = tls_send((struct tls_socket*) socket, frame);
+  tcp_handle_release(handle);
+  return err;
+}
+
+uint64_t tls_read(struct tls_socket* const socket, void* data, uint64_t size) {
+  if(size == 0) {
+    errno = 0;
+    return 0;
+  }
+  const uint64_t all = size;
+  tcp_lock(&socket->tcp);
+  while(1) {
+    ERR_clear_error();
+    errno = 0;
+    const int bytes = SSL_read(socket->ssl, data, size > INT_MAX ? INT_MAX : size);
+    if(bytes <= 0) {
+      switch(SSL_get_error(socket->ssl, bytes)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE: {
+          errno = EAGAIN;
+          break;
+        }
+        case SSL_ERROR_SYSCALL: {
+          if(errno == 0) {
+            errno = EPIPE;
+          }
+          break;
+        }
+        case SSL_ERROR_ZERO_RETURN: {
+          errno = EPIPE;
+          break;
+        }
+        default: {
+          errno = EPROTO;
+          break;
+        }
+      }
+      break;
+    }
+    socket->tcp.bytes_in += bytes;
+    size -= bytes;
+    if(size == 0) {
+      errno = 0;
+      break;
+    }
+    data = (char*) data + bytes;
+  }
+  tcp_unlock(&socket->tcp);
+  return all - size;
+}
+
+
+
+void tls_server_free(struct tls_server* const server) {
+  tcp_server_free(&server->tcp);
+}
+
+void tls_server_close(struct tls_server* const server) {
+  tcp_server_close(&server->tcp);
+}
+
+static struct tcp_socket* tls_server_onevent(struct tcp_server* tcp, struct tcp_socket* tcp_sock, enum tcp_event event) {
+  struct tls_server* const server = (struct tls_server*) tcp;
+  if(event != tcp_open) {
+    (void) server->on_event(server, NULL, event);
+    if(event == tcp_deinit && tcp->alloc_ctx) {
+      SSL_CTX_free(server->ctx);
+      server->ctx = NULL;
+      tcp->alloc_ctx = 0;
+    }
+    return NULL;
+  }
+  struct tls_socket sock = {0};
+  sock.tcp = *tcp_sock;
+  struct tls_socket* socket = server->on_event(server, &sock, tcp_open);
+  if(socket == NULL) {
+    return NULL;
+  }
+  if(socket == &sock) {
+    socket = shnet_malloc(sizeof(*socket));
+    if(socket == NULL) {
+      return NULL;
+    }
+    sock.tcp.free = 1;
+  }
+  *socket = sock;
+  socket->ctx = server->ctx;
+  if(tls_socket_ssl(socket, server->ctx) == -1) {
+    if(socket->tcp.free) {
+      free(socket);
+    }
+    return NULL;
+  }
+  SSL_set_accept_state(socket->ssl);
+  /* The TCP layer copies the stack socket over its TCP part */
+  *tcp_sock = socket->tcp;
+  return &socket->tcp;
+}
+
+int tls_server(struct tls_server* const server, const struct tls_server_options* const opt) {
+  if(server->on_event == NULL || opt == NULL || (opt->ctx == NULL && (opt->cert_path == NULL || opt->key_path == NULL))) {
+    errno = EINVAL;
+    return -1;
+  }
+  if(opt->ctx != NULL) {
+    server->ctx = opt->ctx;
+  } else {
+    server->ctx = tls_server_ctx();
+    if(server->ctx == NULL) {
+      return -1;
+    }
+    server->tcp.alloc_ctx = 1;
+    if(SSL_CTX_use_certificate_chain_file(server->ctx, opt->cert_path) != 1 ||
+      SSL_CTX_use_PrivateKey_file(server->ctx, opt->key_path, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(server->ctx) != 1) {
+      errno = EINVAL;
+      goto err_ctx;
+    }
+  }
+  server->tcp.on_event = tls_server_onevent;
+  if(tcp_server(&server->tcp, &opt->tcp) == -1) {
+    goto err_ctx;
+  }
+  return 0;
+
+  err_ctx:
+  if(server->tcp.alloc_ctx) {
+    SSL_CTX_free(server->ctx);
+    server->ctx = NULL;
+    server->tcp.alloc_ctx = 0;
+  }
+  return -1;
+}
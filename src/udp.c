@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
+
+#include <shnet/udp.h>
+#include <shnet/error.h>
+
+/*
+ * Datagrams are moved in batches of up to udp_batch per syscall. Receive
+ * buffers come from the buffer pool and belong to the socket until a datagram
+ * lands in them, at which point they are handed over to the application. The
+ * ones that are left over wait for the next udp_read().
+ */
+
+enum udp_const {
+  udp_batch = 32,
+  udp_recv_default = 1500,
+  udp_gro_default = 65507
+};
+
+struct udp_recv {
+  char* bufs[udp_batch];
+};
+
+static void udp_onevent(struct async_loop* loop, uint32_t events, struct async_callback* callback) {
+  struct udp_socket* const socket = (struct udp_socket*) callback;
+  if(events & EPOLLHUP) {
+    (void) async_loop_remove(loop, &socket->core.core);
+    if(socket->on_event != NULL) {
+      socket->on_event(socket, udp_close);
+    }
+    return;
+  }
+  /* ICMP errors surface as EPOLLERR, udp_read() reports them */
+  if((events & (EPOLLIN | EPOLLERR)) && socket->on_event != NULL) {
+    socket->on_event(socket, udp_data);
+  }
+  if((events & EPOLLOUT) && socket->on_event != NULL) {
+    socket->on_event(socket, udp_can_send);
+  }
+}
+
+int udp_socket(struct udp_socket* const socket, const struct udp_socket_options* const opt) {
+  if(opt == NULL || (opt->info == NULL && opt->hostname == NULL && opt->port == NULL)) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct addrinfo* info;
+  struct addrinfo* cur_info;
+  if(opt->info == NULL) {
+    const struct addrinfo hints = net_get_addr_struct(opt->family, net_sock_datagram, net_proto_udp, opt->flags | (opt->bind ? net_flag_wants_server : 0));
+    cur_info = net_get_address(opt->hostname, opt->port, &hints);
+    if(cur_info == NULL) {
+      return -1;
+    }
+    info = cur_info;
+  } else {
+    info = NULL;
+    cur_info = opt->info;
+  }
+  if(socket->loop == NULL) {
+    socket->loop = shnet_calloc(1, sizeof(*socket->loop));
+    if(socket->loop == NULL) {
+      goto err_addr;
+    }
+    if(async_loop(socket->loop) == -1) {
+      free(socket->loop);
+      socket->loop = NULL;
+      goto err_addr;
+    }
+    if(async_loop_start(socket->loop) == -1) {
+      async_loop_free(socket->loop);
+      free(socket->loop);
+      socket->loop = NULL;
+      goto err_addr;
+    }
+    socket->alloc_loop = 1;
+  }
+  while(1) {
+    socket->core.core.fd = net_socket_get(cur_info);
+    if(socket->core.core.fd == -1) {
+      goto err_loop;
+    }
+    net_socket_default_options(socket->core.core.fd);
+    if((opt->bind ? net_socket_bind : net_socket_connect)(socket->core.core.fd, cur_info) == -1) {
+      (void) close(socket->core.core.fd);
+      if(cur_info->ai_next == NULL) {
+        goto err_loop;
+      }
+      cur_info = cur_info->ai_next;
+    } else {
+      break;
+    }
+  }
+  /* Without kernel support, datagrams simply arrive one by one */
+  socket->gro = opt->gro != 0 && net_socket_setopt_true(socket->core.core.fd, SOL_UDP, UDP_GRO) == 0;
+  if(opt->recv_size != 0) {
+    socket->recv_size = opt->recv_size;
+  } else {
+    socket->recv_size = socket->gro ? udp_gro_default : udp_recv_default;
+  }
+  socket->recv = NULL;
+  socket->core.core.socket = 0;
+  socket->core.core.server = 0;
+  socket->core.core.callback = 1;
+  socket->core.on_event = udp_onevent;
+  if(async_loop_add(socket->loop, &socket->core.core, EPOLLET | EPOLLIN | EPOLLOUT) == -1) {
+    goto err_fd;
+  }
+  if(info != NULL) {
+    net_free_address(info);
+  }
+  return 0;
+  
+  err_fd:
+  (void) close(socket->core.core.fd);
+  err_loop:
+  socket->core.core.fd = -1;
+  if(socket->alloc_loop) {
+    async_loop_shutdown(socket->loop, async_free | async_ptr_free);
+    socket->loop = NULL;
+    socket->alloc_loop = 0;
+  }
+  err_addr:
+  if(info != NULL) {
+    net_free_address(info);
+  }
+  return -1;
+}
+
+uint16_t udp_socket_get_port(const struct udp_socket* const socket) {
+  struct sockaddr_in6 addr;
+  net_socket_get_local_address(socket->core.core.fd, &addr);
+  return net_address_to_port(&addr);
+}
+
+static uint16_t udp_gro_segment(struct msghdr* const msg) {
+  for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int segment;
+      (void) memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+      return segment;
+    }
+  }
+  return 0;
+}
+
+uint32_t udp_read(struct udp_socket* const socket, struct udp_datagram* const datagrams, const uint32_t count) {
+  if(socket->recv == NULL) {
+    socket->recv = shnet_calloc(1, sizeof(*socket->recv));
+    if(socket->recv == NULL) {
+      return 0;
+    }
+  }
+  char** const bufs = socket->recv->bufs;
+  uint32_t done = 0;
+  while(done != count) {
+    uint32_t batch = count - done < udp_batch ? count - done : udp_batch;
+    struct mmsghdr msgs[udp_batch];
+    struct iovec iov[udp_batch];
+    _Alignas(struct cmsghdr) char control[udp_batch][CMSG_SPACE(sizeof(int))];
+    for(uint32_t i = 0; i < batch; ++i) {
+      if(bufs[i] == NULL) {
+        bufs[i] = data_pool_malloc(socket->recv_size);
+        if(bufs[i] == NULL) {
+          batch = i;
+          break;
+        }
+      }
+      iov[i] = (struct iovec) {
+        .iov_base = bufs[i],
+        .iov_len = socket->recv_size
+      };
+      msgs[i].msg_hdr = (struct msghdr) {
+        .msg_name = &datagrams[done + i].addr6,
+        .msg_namelen = sizeof(datagrams[done + i].addr6),
+        .msg_iov = iov + i,
+        .msg_iovlen = 1,
+        .msg_control = socket->gro ? control[i] : NULL,
+        .msg_controllen = socket->gro ? sizeof(control[i]) : 0
+      };
+    }
+    if(batch == 0) {
+      return done;
+    }
+    int received;
+    safe_execute(received = recvmmsg(socket->core.core.fd, msgs, batch, 0, NULL), received == -1, errno);
+    if(received == -1) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return done;
+    }
+    for(int i = 0; i < received; ++i) {
+      struct udp_datagram* const datagram = datagrams + done + i;
+      datagram->data = bufs[i];
+      datagram->len = msgs[i].msg_len;
+      datagram->segment = socket->gro ? udp_gro_segment(&msgs[i].msg_hdr) : 0;
+      datagram->truncated = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+      bufs[i] = NULL;
+    }
+    done += received;
+    if((uint32_t) received != batch) {
+      errno = EAGAIN;
+      return done;
+    }
+  }
+  errno = 0;
+  return done;
+}
+
+uint32_t udp_send(struct udp_socket* const socket, const struct udp_datagram* const datagrams, const uint32_t count) {
+  uint32_t done = 0;
+  while(done != count) {
+    const uint32_t batch = count - done < udp_batch ? count - done : udp_batch;
+    struct mmsghdr msgs[udp_batch];
+    struct iovec iov[udp_batch];
+    _Alignas(struct cmsghdr) char control[udp_batch][CMSG_SPACE(sizeof(uint16_t))];
+    for(uint32_t i = 0; i < batch; ++i) {
+      const struct udp_datagram* const datagram = datagrams + done + i;
+      iov[i] = (struct iovec) {
+        .iov_base = datagram->data,
+        .iov_len = datagram->len
+      };
+      msgs[i].msg_hdr = (struct msghdr) {
+        .msg_name = datagram->addr.sa_family == AF_UNSPEC ? NULL : (void*) &datagram->addr,
+        .msg_namelen = datagram->addr.sa_family == AF_UNSPEC ? 0 : datagram->addr.sa_family == AF_INET ? net_const_ipv4_size : net_const_ipv6_size,
+        .msg_iov = iov + i,
+        .msg_iovlen = 1
+      };
+      if(datagram->segment != 0 && datagram->segment < datagram->len) {
+        /* The kernel (or the NIC) cuts it into datagrams of this size */
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        struct cmsghdr* const cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        (void) memcpy(CMSG_DATA(cmsg), &datagram->segment, sizeof(uint16_t));
+      }
+    }
+    int sent;
+    safe_execute(sent = sendmmsg(socket->core.core.fd, msgs, batch, 0), sent == -1, errno);
+    if(sent == -1) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return done;
+    }
+    done += sent;
+  }
+  errno = 0;
+  return done;
+}
+
+void udp_socket_close(struct udp_socket* const socket) {
+  /*
+   * Even unconnected datagram sockets report EPOLLHUP once they are shut down
+   * both ways, which lets the loop drop the socket from its own thread.
+   */
+  (void) shutdown(socket->core.core.fd, SHUT_RDWR);
+}
+
+void udp_socket_free(struct udp_socket* const socket) {
+  if(socket->core.core.fd != -1) {
+    (void) close(socket->core.core.fd);
+    socket->core.core.fd = -1;
+  }
+  if(socket->recv != NULL) {
+    for(uint32_t i = 0; i < udp_batch; ++i) {
+      if(socket->recv->bufs[i] != NULL) {
+        data_pool_free(socket->recv->bufs[i]);
+      }
+    }
+    free(socket->recv);
+    socket->recv = NULL;
+  }
+  if(socket->alloc_loop) {
+    async_loop_shutdown(socket->loop, async_free | async_ptr_free);
+    socket->loop = NULL;
+    socket->alloc_loop = 0;
+  }
+  if(socket->on_event != NULL) {
+    socket->on_event(socket, udp_free);
+  }
+}
@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 
@@ -15,6 +16,50 @@ test_register(void*, shnet_malloc, (const size_t a), (a));
 test_register(void*, shnet_realloc, (void* const a, const size_t b), (a, b));
 test_register(void*, mmap, (void* a, size_t b, int c, int d, int e, off_t f), (a, b, c, d, e, f))
 
+struct test_generator {
+  struct data_generator gen;
+  int chunks;
+  int paused;
+  int freed;
+};
+
+static int test_produce(struct data_generator* gen, struct data_frame* frame) {
+  struct test_generator* const tgen = (struct test_generator*) gen;
+  if(tgen->paused) {
+    return -1;
+  }
+  if(tgen->chunks == 0) {
+    return 0;
+  }
+  --tgen->chunks;
+  char* const ptr = malloc(2);
+  assert(ptr);
+  ptr[0] = TEST_MAGIC;
+  ptr[1] = TEST_MAGIC;
+  *frame = (struct data_frame) {
+    .data = ptr,
+    .len = 2,
+    .read_only = 1
+  };
+  return 1;
+}
+
+static void test_generator_free(struct data_generator* gen) {
+  ++((struct test_generator*) gen)->freed;
+}
+
+static void* test_pool_thread(void* data) {
+  void** const ptrs = data;
+  for(int i = 0; i < 64; ++i) {
+    ptrs[i] = data_pool_malloc(100);
+    assert(ptrs[i]);
+  }
+  for(int i = 0; i < 64; ++i) {
+    data_pool_free(ptrs[i]);
+  }
+  return NULL;
+}
+
 int main() {
   test_begin("storage check");
   test_error_check(void*, shnet_malloc, (0xbad));
@@ -398,6 +443,174 @@ int main() {
   assert(storage.size == 3);
   test_end();
 
+  test_begin("storage generator");
+  struct test_generator tgen = {0};
+  tgen.gen.produce = test_produce;
+  tgen.gen.free = test_generator_free;
+  tgen.chunks = 3;
+  assert(!data_storage_add(&storage, &((struct data_frame) {
+    .gen = &tgen.gen,
+    .generator = 1
+  })));
+  assert(!data_storage_is_empty(&storage));
+  assert(data_storage_size(&storage) == 0);
+  assert(!data_storage_generate(&storage));
+  assert(storage.used == 2);
+  assert(!storage.frames->generator);
+  assert(storage.frames[1].generator);
+  assert(data_storage_size(&storage) == 2);
+  assert(storage.frames->data[1] == TEST_MAGIC);
+  data_storage_drain(&storage, 2);
+  tgen.gen.threshold = 3;
+  assert(!data_storage_generate(&storage));
+  assert(storage.used == 3);
+  assert(data_storage_size(&storage) == 4);
+  data_storage_drain(&storage, 2);
+  data_storage_drain(&storage, 2);
+  assert(storage.used == 1);
+  assert(!tgen.freed);
+  test_end();
+  
+  test_begin("storage generator pause");
+  tgen.paused = 1;
+  errno = 0;
+  assert(data_storage_generate(&storage) == -1);
+  assert(errno == EAGAIN);
+  assert(storage.used == 1);
+  tgen.paused = 0;
+  errno = 0;
+  test_end();
+  
+  test_begin("storage generator finish");
+  assert(!data_storage_generate(&storage));
+  assert(data_storage_is_empty(&storage));
+  assert(tgen.freed == 1);
+  tgen.chunks = 1;
+  assert(!data_storage_add(&storage, &((struct data_frame) {
+    .gen = &tgen.gen,
+    .generator = 1
+  })));
+  assert(!data_storage_generate(&storage));
+  assert(storage.used == 1);
+  assert(!storage.frames->generator);
+  assert(data_storage_size(&storage) == 2);
+  assert(tgen.freed == 2);
+  data_storage_drain(&storage, 2);
+  tgen.chunks = 1;
+  assert(!data_storage_add(&storage, &((struct data_frame) {
+    .gen = &tgen.gen,
+    .generator = 1,
+    .dont_free = 1
+  })));
+  assert(storage.used == 1);
+  data_storage_free(&storage);
+  assert(tgen.freed == 2);
+  test_end();
+  
+  test_begin("storage pool");
+  struct data_pool_stats stats;
+  data_pool_get_stats(&stats);
+  const uint64_t old_misses = stats.misses;
+  char* pool_ptr = data_pool_malloc(1);
+  assert(pool_ptr);
+  pool_ptr[0] = TEST_MAGIC;
+  data_pool_free(pool_ptr);
+  data_pool_get_stats(&stats);
+  const uint64_t old_hits = stats.hits;
+  char* pool_ptr2 = data_pool_malloc(1);
+  assert(pool_ptr2 == pool_ptr);
+  data_pool_get_stats(&stats);
+  assert(stats.hits == old_hits + 1);
+  assert(stats.misses >= old_misses);
+  assert(stats.arenas != 0);
+  assert(stats.arena_bytes != 0);
+  data_pool_free(NULL);
+  test_end();
+  
+  test_begin("storage pool realloc");
+  assert(data_pool_realloc(pool_ptr2, 2) == pool_ptr2);
+  pool_ptr = data_pool_realloc(pool_ptr2, 1000);
+  assert(pool_ptr);
+  assert(pool_ptr[0] == TEST_MAGIC);
+  pool_ptr[999] = TEST_MAGIC;
+  pool_ptr = data_pool_realloc(pool_ptr, 100000);
+  assert(pool_ptr);
+  assert(pool_ptr[0] == TEST_MAGIC);
+  assert(pool_ptr[999] == TEST_MAGIC);
+  pool_ptr[99999] = TEST_MAGIC;
+  pool_ptr = data_pool_realloc(pool_ptr, 200000);
+  assert(pool_ptr);
+  assert(pool_ptr[99999] == TEST_MAGIC);
+  pool_ptr = data_pool_realloc(pool_ptr, 1);
+  assert(pool_ptr);
+  assert(pool_ptr[0] == TEST_MAGIC);
+  data_pool_free(pool_ptr);
+  pool_ptr = data_pool_realloc(NULL, 1);
+  assert(pool_ptr);
+  data_pool_free(pool_ptr);
+  test_end();
+  
+  test_begin("storage pool err");
+  test_error(shnet_malloc);
+  assert(data_pool_malloc(30000) == NULL);
+  assert(errno == TEST_MAGIC);
+  test_error(shnet_malloc);
+  assert(data_pool_malloc(300000) == NULL);
+  assert(errno == TEST_MAGIC);
+  errno = 0;
+  test_end();
+  
+  test_begin("storage pool hugepages");
+  data_pool_hugepages(1);
+  data_pool_get_stats(&stats);
+  const uint64_t old_arenas = stats.arenas;
+  pool_ptr = data_pool_malloc(2000);
+  assert(pool_ptr);
+  pool_ptr[1999] = TEST_MAGIC;
+  data_pool_get_stats(&stats);
+  assert(stats.arenas == old_arenas + 1);
+  data_pool_free(pool_ptr);
+  data_pool_hugepages(0);
+  test_end();
+  
+  test_begin("storage pool threads");
+  void* thread_ptrs[64];
+  pthread_t thread;
+  assert(!pthread_create(&thread, NULL, test_pool_thread, thread_ptrs));
+  assert(!pthread_join(thread, NULL));
+  data_pool_get_stats(&stats);
+  const uint64_t arenas = stats.arenas;
+  for(int i = 0; i < 64; ++i) {
+    assert((pool_ptr = data_pool_malloc(100)));
+    data_pool_free(pool_ptr);
+  }
+  data_pool_get_stats(&stats);
+  assert(stats.arenas == arenas);
+  test_end();
+  
+  test_begin("storage pool frames");
+  ptr = malloc(1);
+  assert(ptr);
+  ptr[0] = TEST_MAGIC;
+  assert(!data_storage_add(&storage, &((struct data_frame) {
+    .data = ptr,
+    .len = 1
+  })));
+  assert(storage.frames->pooled);
+  assert(storage.frames->data[0] == TEST_MAGIC);
+  data_storage_drain(&storage, 1);
+  assert(data_storage_is_empty(&storage));
+  pool_ptr = data_pool_malloc(1);
+  assert(pool_ptr);
+  assert(!data_storage_add(&storage, &((struct data_frame) {
+    .data = pool_ptr,
+    .len = 1,
+    .read_only = 1,
+    .pooled = 1
+  })));
+  data_storage_free(&storage);
+  test_end();
+  
   test_begin("storage free");
   data_storage_free(&storage);
   assert(data_storage_is_empty(&storage));
@@ -1,5 +1,6 @@
 #include <shnet/test.h>
 
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdatomic.h>
@@ -15,6 +16,41 @@ void onevt(struct async_loop* loop, uint32_t events, struct async_event* event)
   test_wake();
 }
 
+struct async_timer timers[4];
+int fired[4];
+_Atomic int fired_len = 0;
+uint64_t fired_ms[4];
+
+uint64_t now_ms(void) {
+  struct timespec tp;
+  (void) clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t) tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+void ontimeout(struct async_loop* loop, struct async_timer* timer) {
+  assert(!async_timer_armed(timer));
+  const int idx = atomic_fetch_add(&fired_len, 1);
+  fired[idx] = timer - timers;
+  fired_ms[idx] = now_ms();
+  test_wake();
+}
+
+void onrun(struct async_loop* loop, struct async_task* task) {
+  for(int i = 0; i < 4; ++i) {
+    timers[i].on_timeout = ontimeout;
+  }
+  /* Long enough to be cascaded from an upper level of the wheel */
+  async_timer_set(loop, timers + 0, 900);
+  async_timer_set(loop, timers + 1, 20);
+  async_timer_set(loop, timers + 2, 50);
+  async_timer_set(loop, timers + 3, 30);
+  async_timer_cancel(loop, timers + 3);
+  assert(!async_timer_armed(timers + 3));
+  async_timer_set(loop, timers + 2, 60);
+  assert(async_timer_armed(timers + 2));
+  test_wake();
+}
+
 test_register(void*, shnet_malloc, (const size_t a), (a))
 test_register(int, eventfd, (unsigned int a, int b), (a, b))
 test_register(int, epoll_create1, (int a), (a))
@@ -130,6 +166,25 @@ int main() {
   test_wait();
   test_end();
   
+  test_begin("async timers");
+  struct async_task task = {0};
+  task.on_run = onrun;
+  const uint64_t start = now_ms();
+  async_loop_post(&l, &task);
+  test_wait();
+  for(int i = 0; i < 3; ++i) {
+    test_wait();
+  }
+  assert(fired[0] == 1);
+  assert(fired[1] == 2);
+  assert(fired[2] == 0);
+  assert(fired_ms[0] - start >= 20);
+  assert(fired_ms[1] - start >= 60);
+  assert(fired_ms[2] - start >= 900);
+  test_sleep(50);
+  assert(atomic_load(&fired_len) == 3);
+  test_end();
+  
   test_begin("async manual");
   async_loop_stop(&l);
   async_loop_shutdown(&loop, 0);
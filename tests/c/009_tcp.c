@@ -9,7 +9,6 @@
 
 test_register(void*, shnet_malloc, (const size_t a), (a))
 test_register(void*, shnet_calloc, (const size_t a, const size_t b), (a, b))
-test_register(int, pthread_mutex_init, (pthread_mutex_t* restrict a, const pthread_mutexattr_t* restrict b), (a, b))
 test_register(int, net_socket_get, (const struct addrinfo* const a), (a))
 test_register(int, net_socket_bind, (const int a, const struct addrinfo* const b), (a, b))
 test_register(int, net_socket_connect, (const int a, const struct addrinfo* const b), (a, b))
@@ -352,6 +351,111 @@ void read_something(struct tcp_socket* sock, enum tcp_event event) {
   }
 }
 
+struct send_buf_generator {
+  struct data_generator gen;
+  uint64_t offset;
+  int freed;
+};
+
+int send_buf_produce(struct data_generator* gen, struct data_frame* frame) {
+  struct send_buf_generator* const sgen = (struct send_buf_generator*) gen;
+  if(sgen->offset == sizeof(send_buf)) {
+    return 0;
+  }
+  sgen->offset += 8192;
+  *frame = (struct data_frame) {
+    .data = send_buf,
+    .offset = sgen->offset - 8192,
+    .len = sgen->offset,
+    .read_only = 1,
+    .dont_free = 1,
+    .free_onerr = 0
+  };
+  return 1;
+}
+
+void send_buf_generator_free(struct data_generator* gen) {
+  ((struct send_buf_generator*) gen)->freed = 1;
+}
+
+int paused_data = 0;
+
+void read_after_resume(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      test_wake();
+      break;
+    }
+    case tcp_data: {
+      assert(!sock->read_paused);
+      if(tcp_read(sock, recv_buf, 1) == 0) {
+        break;
+      }
+      assert(recv_buf[0] == 's');
+      paused_data = 1;
+      tcp_socket_close(sock);
+      tcp_socket_free(sock);
+      sock->on_event = free_only;
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+void send_and_close(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      assert(!tcp_send(sock, &((struct data_frame) {
+        .data = "hello",
+        .len = 5,
+        .dont_free = 1,
+        .read_only = 1,
+        .free_onerr = 0
+      })));
+      tcp_socket_close(sock);
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    default: break;
+  }
+}
+
+uint64_t half_closed_read = 0;
+int half_closed = 0;
+
+void read_after_half_close(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      test_wake();
+      break;
+    }
+    case tcp_data: {
+      const uint64_t read = tcp_read(sock, recv_buf + half_closed_read, sizeof(recv_buf) - half_closed_read);
+      /* The data comes before the end of the stream */
+      assert(!half_closed || read == 0);
+      half_closed_read += read;
+      break;
+    }
+    case tcp_readclose: {
+      half_closed = 1;
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_mutex_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
 struct tcp_socket* reject_only(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
   switch(event) {
     case tcp_close: {
@@ -386,6 +490,10 @@ struct tcp_socket* return_self_only(struct tcp_server* serv, struct tcp_socket*
           sock->on_event = send_a_msg;
           break;
         }
+        case 3: {
+          sock->on_event = send_and_close;
+          break;
+        }
         default: break;
       }
       switch(server_crash_stage) {
@@ -395,11 +503,6 @@ struct tcp_socket* return_self_only(struct tcp_server* serv, struct tcp_socket*
           break;
         }
         case 2: {
-          test_error(pthread_mutex_init);
-          ++server_crash_stage;
-          break;
-        }
-        case 3: {
           test_error(async_loop_add);
           ++server_crash_stage;
           break;
@@ -433,7 +536,6 @@ int main() {
   test_begin("tcp check");
   test_error_check(void*, shnet_malloc, (0xbad));
   test_error_check(void*, shnet_calloc, (0xbad, 0xbad));
-  test_error_check(int, pthread_mutex_init, ((void*) 0x1bad, (void*) 0x2bad));
   test_error_check(int, net_socket_get, ((void*) 0xbad));
   test_error_check(int, net_socket_bind, (0xbad, (void*) 0xbad));
   test_error_check(int, net_socket_connect, (0xbad, (void*) 0xbad));
@@ -449,7 +551,6 @@ int main() {
   
   test_error_set_retval(shnet_malloc, NULL);
   test_error_set_retval(shnet_calloc, NULL);
-  test_error_set_retval(pthread_mutex_init, ENOMEM);
   test_error_set_retval(net_get_address, NULL);
   test_error_set_errno(accept, EPIPE);
   test_error_set_errno(recv, EINTR);
@@ -471,42 +572,37 @@ int main() {
   
   test_begin("tcp socket err 3");
   options.hostname = "127.0.0.1";
-  test_error(pthread_mutex_init);
-  assert(tcp_socket(sockets, &options));
-  test_end();
-  
-  test_begin("tcp socket err 4");
   test_error(shnet_calloc);
   assert(tcp_socket(sockets, &options));
   test_end();
   
-  test_begin("tcp socket err 5");
+  test_begin("tcp socket err 4");
   test_error(async_loop);
   assert(tcp_socket(sockets, &options));
   test_end();
   
-  test_begin("tcp socket err 6");
+  test_begin("tcp socket err 5");
   test_error(async_loop_start);
   assert(tcp_socket(sockets, &options));
   test_end();
   
-  test_begin("tcp socket err 7");
+  test_begin("tcp socket err 6");
   test_error_set(shnet_malloc, 2);
   assert(tcp_socket(sockets, &options));
   test_end();
   
-  test_begin("tcp socket err 8");
+  test_begin("tcp socket err 7");
   test_error(net_get_address_async);
   assert(tcp_socket(sockets, &options));
   test_end();
   
-  test_begin("tcp socket err 9");
+  test_begin("tcp socket err 8");
   options.port = "80";
   test_error(net_get_address_async);
   assert(tcp_socket(sockets, &options));
   test_end();
   
-  test_begin("tcp socket err 10");
+  test_begin("tcp socket err 9");
   options.hostname = NULL;
   test_error(net_get_address_async);
   assert(tcp_socket(sockets, &options));
@@ -723,18 +819,6 @@ int main() {
   test_mutex_wait();
   test_end();
   
-  test_begin("tcp server open err 4");
-  assert(sockets->closing == 0);
-  assert(sockets->closing_fast == 0);
-  assert(sockets->close_guard == 0);
-  assert(sockets->confirmed_free == 0);
-  async_loop_stop(servers->loop);
-  assert(!tcp_socket(sockets, &options));
-  tcp_socket_free(sockets);
-  assert(!async_loop_start(servers->loop));
-  test_mutex_wait();
-  test_end();
-  
   test_begin("tcp server open 1");
   assert(sockets->closing == 0);
   assert(sockets->closing_fast == 0);
@@ -950,6 +1034,29 @@ int main() {
   assert(!memcmp(send_buf + 8192, recv_buf, 524288 - 8192));
   test_end();
   
+  test_begin("tcp send generator");
+  expected_read = 524288;
+  memset(recv_buf, 0, recv_buf_len);
+  recv_buf_len = 0;
+  struct send_buf_generator sgen = {0};
+  sgen.gen.produce = send_buf_produce;
+  sgen.gen.free = send_buf_generator_free;
+  sgen.gen.threshold = 16384;
+  assert(!tcp_socket(sockets, &options));
+  assert(!setsockopt(sockets->core.fd, SOL_SOCKET, SO_SNDBUF, (int[]){ 1024 }, sizeof(int)));
+  assert(!tcp_send(sockets, &((struct data_frame) {
+    .gen = &sgen.gen,
+    .generator = 1
+  })));
+  assert(errno == 0);
+  tcp_socket_close(sockets);
+  tcp_socket_free(sockets);
+  test_mutex_wait();
+  test_wait();
+  assert(sgen.freed);
+  assert(!memcmp(send_buf, recv_buf, 524288));
+  test_end();
+  
   test_begin("tcp graceful shutdown with buffered data");
   expected_read = 1;
   recv_buf_len = 0;
@@ -1052,6 +1159,41 @@ int main() {
   test_mutex_wait();
   test_end();
   
+  test_begin("tcp pause read");
+  sockets->on_event = read_after_resume;
+  server_onevt = 2;
+  sockets->read_paused = 1;
+  assert(!tcp_socket(sockets, &options));
+  test_wait();
+  tcp_socket_pause_read(sockets);
+  assert(sockets->read_paused);
+  test_sleep(100);
+  assert(!paused_data);
+  tcp_socket_resume_read(sockets);
+  tcp_socket_resume_read(sockets);
+  test_wait();
+  assert(paused_data);
+  test_mutex_wait();
+  assert(!sockets->read_paused);
+  test_end();
+  
+  test_begin("tcp pause read half close");
+  sockets->on_event = read_after_half_close;
+  server_onevt = 3;
+  sockets->read_paused = 1;
+  assert(!tcp_socket(sockets, &options));
+  test_wait();
+  /* The peer sends and is done sending long before reading is resumed */
+  test_sleep(100);
+  assert(half_closed_read == 0);
+  assert(!half_closed);
+  tcp_socket_resume_read(sockets);
+  test_mutex_wait();
+  assert(half_closed_read == 5);
+  assert(!memcmp(recv_buf, "hello", 5));
+  assert(half_closed);
+  test_end();
+  
   test_begin("tcp free");
   tcp_server_close(servers);
   test_mutex_wait();
@@ -0,0 +1,213 @@
+#include <shnet/test.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <shnet/tcp.h>
+
+struct tcp_server upstream = {0};
+struct tcp_server relay = {0};
+
+struct tcp_socket client = {0};
+struct tcp_socket relay_in = {0};
+struct tcp_socket relay_out = {0};
+
+struct addrinfo* upstream_info = NULL;
+
+char send_buf[262144];
+
+char recv_buf[262144];
+uint64_t recv_buf_len = 0;
+
+char echo_buf[65536];
+
+void echo_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_data: {
+      while(1) {
+        const uint64_t read = tcp_read(sock, echo_buf, sizeof(echo_buf));
+        if(read == 0) {
+          break;
+        }
+        assert(!tcp_send(sock, &((struct data_frame) {
+          .data = echo_buf,
+          .len = read,
+          .dont_free = 1
+        })));
+      }
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* upstream_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = echo_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void relay_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      if(relay_in.opened && relay_out.opened) {
+        assert(!tcp_splice(&relay_in, &relay_out));
+        errno = 0;
+        assert(tcp_splice(&relay_in, &relay_out));
+        assert(errno == EINVAL);
+        tcp_socket_resume_read(&relay_in);
+      }
+      break;
+    }
+    case tcp_data: {
+      /* Only possible after the relay is over */
+      assert(sock->splice == NULL);
+      char discard[256];
+      (void) tcp_read(sock, discard, sizeof(discard));
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* relay_evt_serv(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = relay_evt;
+      sock->read_paused = 1;
+      relay_out.on_event = relay_evt;
+      relay_out.loop = serv->loop;
+      assert(!tcp_socket(&relay_out, &((struct tcp_socket_options) {
+        .info = upstream_info
+      })));
+      return &relay_in;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      assert(!tcp_send(sock, &((struct data_frame) {
+        .data = send_buf,
+        .len = sizeof(send_buf),
+        .read_only = 1,
+        .dont_free = 1
+      })));
+      tcp_socket_close(sock);
+      break;
+    }
+    case tcp_data: {
+      recv_buf_len += tcp_read(sock, recv_buf + recv_buf_len, sizeof(recv_buf) - recv_buf_len);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+int main() {
+  test_seed_random();
+  for(unsigned i = 0; i < sizeof(send_buf) / sizeof(send_buf[0]); ++i) {
+    send_buf[i] = (char)(rand() & 0xff);
+  }
+
+  test_begin("tcp splice setup");
+  const struct addrinfo hints = net_get_addr_struct(net_family_ipv4, net_sock_stream, net_proto_tcp, 0);
+  struct addrinfo* info = net_get_address("127.0.0.1", NULL, &hints);
+  assert(info);
+  upstream.on_event = upstream_evt;
+  assert(!tcp_server(&upstream, &((struct tcp_server_options) {
+    .info = info
+  })));
+  relay.on_event = relay_evt_serv;
+  assert(!tcp_server(&relay, &((struct tcp_server_options) {
+    .info = info
+  })));
+  net_free_address(info);
+  char port[7] = {0};
+  assert(sprintf(port, "%hu", tcp_server_get_port(&upstream)) > 0);
+  upstream_info = net_get_address("127.0.0.1", port, &hints);
+  assert(upstream_info);
+  test_end();
+
+  test_begin("tcp splice err");
+  errno = 0;
+  assert(tcp_splice(&client, &client));
+  assert(errno == EINVAL);
+  errno = 0;
+  assert(tcp_splice(&relay_in, &relay_out));
+  assert(errno == EINVAL);
+  test_end();
+
+  test_begin("tcp splice");
+  assert(sprintf(port, "%hu", tcp_server_get_port(&relay)) > 0);
+  client.on_event = client_evt;
+  assert(!tcp_socket(&client, &((struct tcp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = port
+  })));
+  tcp_socket_free(&client);
+  /* client, relay_in, relay_out, the upstream's socket */
+  test_wait();
+  test_wait();
+  test_wait();
+  test_wait();
+  assert(recv_buf_len == sizeof(send_buf));
+  assert(!memcmp(recv_buf, send_buf, sizeof(send_buf)));
+  assert(relay_in.splice == NULL);
+  assert(relay_out.splice == NULL);
+  test_end();
+
+  test_begin("tcp splice free");
+  net_free_address(upstream_info);
+  tcp_server_close(&upstream);
+  tcp_server_close(&relay);
+  test_wait();
+  test_wait();
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,193 @@
+#include <shnet/test.h>
+
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <shnet/tcp.h>
+
+struct tcp_server server = {0};
+struct tcp_socket clients[3] = {0};
+
+uint64_t opened_at = 0;
+uint16_t opened_port = 0;
+int closed_errno = -1;
+
+uint64_t now(void) {
+  struct timespec tp;
+  assert(!clock_gettime(CLOCK_MONOTONIC, &tp));
+  return (uint64_t) tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      opened_at = now();
+      struct sockaddr_in addr;
+      net_socket_get_peer_address(sock->core.fd, &addr);
+      opened_port = ntohs(addr.sin_port);
+      tcp_socket_force_close(sock);
+      break;
+    }
+    case tcp_close: {
+      closed_errno = errno;
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+uint16_t get_port(const int sfd) {
+  struct sockaddr_in addr;
+  net_socket_get_local_address(sfd, &addr);
+  return ntohs(addr.sin_port);
+}
+
+int get_socket(void) {
+  const int sfd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(sfd != -1);
+  assert(!bind(sfd, (struct sockaddr*) &((struct sockaddr_in) {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  }), sizeof(struct sockaddr_in)));
+  return sfd;
+}
+
+struct sockaddr_in addrs[2];
+struct addrinfo infos[2];
+
+struct addrinfo* get_info(const uint16_t first, const uint16_t second) {
+  const uint16_t ports[2] = { first, second };
+  for(int i = 0; i < 2; ++i) {
+    addrs[i] = (struct sockaddr_in) {
+      .sin_family = AF_INET,
+      .sin_port = htons(ports[i]),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    infos[i] = (struct addrinfo) {
+      .ai_family = AF_INET,
+      .ai_socktype = SOCK_STREAM,
+      .ai_protocol = IPPROTO_TCP,
+      .ai_addrlen = sizeof(struct sockaddr_in),
+      .ai_addr = (struct sockaddr*)(addrs + i),
+      .ai_next = i == 0 ? infos + 1 : NULL
+    };
+  }
+  return infos;
+}
+
+int main() {
+  test_begin("tcp race setup");
+  const struct addrinfo hints = net_get_addr_struct(net_family_ipv4, net_sock_stream, net_proto_tcp, 0);
+  struct addrinfo* info = net_get_address("127.0.0.1", NULL, &hints);
+  assert(info);
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .info = info
+  })));
+  net_free_address(info);
+  const uint16_t good_port = tcp_server_get_port(&server);
+  /*
+   * A listener with a full accept queue drops SYNs,
+   * so connecting to it hangs instead of failing.
+   */
+  const int blackhole = get_socket();
+  assert(!listen(blackhole, 0));
+  const uint16_t blackhole_port = get_port(blackhole);
+  int fillers[4];
+  for(int i = 0; i < 4; ++i) {
+    fillers[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(fillers[i] != -1);
+    (void) connect(fillers[i], (struct sockaddr*) &((struct sockaddr_in) {
+      .sin_family = AF_INET,
+      .sin_port = htons(blackhole_port),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    }), sizeof(struct sockaddr_in));
+  }
+  test_sleep(100);
+  /* Bound, but not listening, so it refuses connections */
+  const int refused = get_socket();
+  const uint16_t refused_port = get_port(refused);
+  test_end();
+
+  test_begin("tcp race stalled first address");
+  clients[0].on_event = client_evt;
+  const uint64_t start = now();
+  assert(!tcp_socket(&clients[0], &((struct tcp_socket_options) {
+    .info = get_info(blackhole_port, good_port)
+  })));
+  tcp_socket_free(&clients[0]);
+  test_wait();
+  assert(opened_port == good_port);
+  assert(opened_at - start < 1000);
+  test_end();
+
+  test_begin("tcp race refused first address");
+  clients[1].on_event = client_evt;
+  opened_port = 0;
+  assert(!tcp_socket(&clients[1], &((struct tcp_socket_options) {
+    .info = get_info(refused_port, good_port)
+  })));
+  tcp_socket_free(&clients[1]);
+  test_wait();
+  assert(opened_port == good_port);
+  test_end();
+
+  test_begin("tcp race all refused");
+  clients[2].on_event = client_evt;
+  opened_port = 0;
+  closed_errno = -1;
+  assert(!tcp_socket(&clients[2], &((struct tcp_socket_options) {
+    .info = get_info(refused_port, refused_port)
+  })));
+  tcp_socket_free(&clients[2]);
+  test_wait();
+  assert(opened_port == 0);
+  assert(closed_errno == ECONNREFUSED);
+  test_end();
+
+  test_begin("tcp race free");
+  for(int i = 0; i < 4; ++i) {
+    assert(!close(fillers[i]));
+  }
+  assert(!close(blackhole));
+  assert(!close(refused));
+  tcp_server_close(&server);
+  test_wait();
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,157 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <shnet/tcp.h>
+
+struct tcp_server server = {0};
+struct tcp_socket clients[3] = {0};
+
+char recv_buf[16];
+uint64_t recv_buf_len = 0;
+
+int server_used = -1;
+int client_used = -1;
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      server_used = tcp_socket_fastopen_used(sock);
+      break;
+    }
+    case tcp_data: {
+      recv_buf_len += tcp_read(sock, recv_buf + recv_buf_len, sizeof(recv_buf) - recv_buf_len);
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_close: {
+      client_used = tcp_socket_fastopen_used(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+/*
+ * Server side TCP Fast Open is only available if enabled with sysctl.
+ * Without it, connections must still work, but without using TFO.
+ */
+int fastopen_enabled(void) {
+  FILE* const file = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+  if(file == NULL) {
+    return 0;
+  }
+  int value = 0;
+  if(fscanf(file, "%d", &value) != 1) {
+    value = 0;
+  }
+  (void) fclose(file);
+  return (value & 3) == 3;
+}
+
+void run_client(struct tcp_socket* const client, struct addrinfo* const info, const int send_data) {
+  client->on_event = client_evt;
+  recv_buf_len = 0;
+  server_used = -1;
+  client_used = -1;
+  assert(!tcp_socket(client, &((struct tcp_socket_options) {
+    .info = info,
+    .fastopen = 1
+  })));
+  if(send_data) {
+    assert(!tcp_send(client, &((struct data_frame) {
+      .data = "hello",
+      .len = 5,
+      .read_only = 1,
+      .dont_free = 1
+    })));
+  }
+  tcp_socket_close(client);
+  tcp_socket_free(client);
+  /* client and the accepted socket */
+  test_wait();
+  test_wait();
+  assert(recv_buf_len == (send_data ? 5 : 0));
+  if(send_data) {
+    assert(!memcmp(recv_buf, "hello", 5));
+  }
+}
+
+int main() {
+  test_begin("tcp fastopen setup");
+  const struct addrinfo hints = net_get_addr_struct(net_family_ipv4, net_sock_stream, net_proto_tcp, 0);
+  struct addrinfo* info = net_get_address("127.0.0.1", NULL, &hints);
+  assert(info);
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .info = info,
+    .fastopen = 16
+  })));
+  net_free_address(info);
+  char port[7] = {0};
+  assert(sprintf(port, "%hu", tcp_server_get_port(&server)) > 0);
+  info = net_get_address("127.0.0.1", port, &hints);
+  assert(info);
+  test_end();
+
+  test_begin("tcp fastopen cookie request");
+  /* Might already use TFO if a cookie is cached from before */
+  run_client(clients + 0, info, 1);
+  test_end();
+
+  test_begin("tcp fastopen");
+  run_client(clients + 1, info, 1);
+  assert(server_used == fastopen_enabled());
+  assert(client_used == fastopen_enabled());
+  test_end();
+
+  test_begin("tcp fastopen no data");
+  run_client(clients + 2, info, 0);
+  assert(!server_used);
+  test_end();
+
+  test_begin("tcp fastopen free");
+  net_free_address(info);
+  tcp_server_close(&server);
+  test_wait();
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,269 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <shnet/tls.h>
+
+struct tls_server server = {0};
+struct tls_socket clients[4] = {0};
+struct tls_session_cache cache = {0};
+
+SSL_CTX* server_ctx = NULL;
+SSL_CTX* client_ctx = NULL;
+
+char send_buf[131072];
+
+char recv_buf[131072];
+uint64_t recv_buf_len = 0;
+
+char echo_buf[16384];
+
+int client_opened = 0;
+int client_resumed = -1;
+int client_ktls = -1;
+
+void echo_evt(struct tls_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_data: {
+      while(1) {
+        const uint64_t read = tls_read(sock, echo_buf, sizeof(echo_buf));
+        if(read == 0) {
+          break;
+        }
+        assert(!tls_send(sock, &((struct data_frame) {
+          .data = echo_buf,
+          .len = read,
+          .dont_free = 1
+        })));
+      }
+      break;
+    }
+    case tcp_close: {
+      tls_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tls_socket* server_evt(struct tls_server* serv, struct tls_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = echo_evt;
+      break;
+    }
+    case tcp_close: {
+      tls_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tls_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      client_opened = 1;
+      client_resumed = tls_socket_resumed(sock);
+      client_ktls = tls_socket_ktls(sock);
+      break;
+    }
+    case tcp_data: {
+      recv_buf_len += tls_read(sock, recv_buf + recv_buf_len, sizeof(recv_buf) - recv_buf_len);
+      if(recv_buf_len == sizeof(recv_buf)) {
+        tls_socket_close(sock);
+      }
+      break;
+    }
+    case tcp_close: {
+      tls_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+void run_client(struct tls_socket* const client, const char* const port, const int file) {
+  client->on_event = client_evt;
+  client_opened = 0;
+  client_resumed = -1;
+  client_ktls = -1;
+  recv_buf_len = 0;
+  assert(!tls_socket(client, &((struct tls_socket_options) {
+    .tcp = (struct tcp_socket_options) {
+      .hostname = "127.0.0.1",
+      .port = port
+    },
+    .ctx = client_ctx,
+    .servername = "localhost",
+    .cache = &cache
+  })));
+  if(file) {
+    FILE* const tmp = tmpfile();
+    assert(tmp);
+    assert(fwrite(send_buf, 1, sizeof(send_buf), tmp) == sizeof(send_buf));
+    assert(!fflush(tmp));
+    const int fd = dup(fileno(tmp));
+    assert(fd != -1);
+    (void) fclose(tmp);
+    assert(!tls_send(client, &((struct data_frame) {
+      .fd = fd,
+      .len = sizeof(send_buf),
+      .read_only = 1,
+      .file = 1
+    })));
+  } else {
+    assert(!tls_send(client, &((struct data_frame) {
+      .data = send_buf,
+      .len = sizeof(send_buf),
+      .read_only = 1,
+      .dont_free = 1
+    })));
+  }
+  /* client and the accepted socket */
+  test_wait();
+  test_wait();
+  assert(client_opened);
+  assert(!client_ktls || client_ktls == 1);
+  assert(recv_buf_len == sizeof(recv_buf));
+  assert(!memcmp(recv_buf, send_buf, sizeof(send_buf)));
+}
+
+int main() {
+  test_seed_random();
+  for(unsigned i = 0; i < sizeof(send_buf) / sizeof(send_buf[0]); ++i) {
+    send_buf[i] = (char)(rand() & 0xff);
+  }
+
+  test_begin("tls setup");
+  server_ctx = tls_server_ctx();
+  assert(server_ctx);
+  assert(!tls_ctx_self_signed(server_ctx, "localhost"));
+  client_ctx = tls_client_ctx();
+  assert(client_ctx);
+  assert(X509_STORE_add_cert(SSL_CTX_get_cert_store(client_ctx), SSL_CTX_get0_certificate(server_ctx)) == 1);
+  assert(!tls_session_cache(&cache));
+  server.on_event = server_evt;
+  assert(!tls_server(&server, &((struct tls_server_options) {
+    .tcp = (struct tcp_server_options) {
+      .hostname = "127.0.0.1",
+      .port = "0"
+    },
+    .ctx = server_ctx
+  })));
+  char port[7] = {0};
+  assert(sprintf(port, "%hu", tcp_server_get_port(&server.tcp)) > 0);
+  test_end();
+
+  test_begin("tls server err");
+  struct tls_server bad = {0};
+  bad.on_event = server_evt;
+  errno = 0;
+  assert(tls_server(&bad, &((struct tls_server_options) {
+    .tcp = (struct tcp_server_options) {
+      .hostname = "127.0.0.1",
+      .port = "0"
+    }
+  })));
+  assert(errno == EINVAL);
+  test_end();
+
+  test_begin("tls full handshake");
+  run_client(clients + 0, port, 0);
+  assert(!client_resumed);
+  assert(cache.used == 1);
+  test_end();
+
+  test_begin("tls resumed handshake");
+  run_client(clients + 1, port, 0);
+  assert(client_resumed == 1);
+  test_end();
+
+  test_begin("tls file");
+  run_client(clients + 2, port, 1);
+  assert(client_resumed == 1);
+  test_end();
+
+  test_begin("tls untrusted");
+  /* A context of the application's own, which must be left as it is */
+  SSL_CTX* const own_ctx = SSL_CTX_new(TLS_client_method());
+  assert(own_ctx);
+  SSL_CTX_set_verify(own_ctx, SSL_VERIFY_PEER, NULL);
+  const long own_mode = SSL_CTX_get_session_cache_mode(own_ctx);
+  clients[3].on_event = client_evt;
+  client_opened = 0;
+  assert(!tls_socket(clients + 3, &((struct tls_socket_options) {
+    .tcp = (struct tcp_socket_options) {
+      .hostname = "127.0.0.1",
+      .port = port
+    },
+    .ctx = own_ctx,
+    /* The hostname then, which isn't what the session of "localhost" is stored under */
+    .cache = &cache
+  })));
+  assert(SSL_CTX_get_session_cache_mode(own_ctx) == own_mode);
+  assert(SSL_CTX_sess_get_new_cb(own_ctx) == NULL);
+  /* client and the accepted socket */
+  test_wait();
+  test_wait();
+  assert(!client_opened);
+  SSL_CTX_free(own_ctx);
+  test_end();
+
+  test_begin("tls foreign ssl");
+  /* Made by the application from a context it shares with this module */
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(fd != -1);
+  assert(!connect(fd, (struct sockaddr*) &((struct sockaddr_in) {
+    .sin_family = AF_INET,
+    .sin_port = htons(tcp_server_get_port(&server.tcp)),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  }), sizeof(struct sockaddr_in)));
+  SSL* const ssl = SSL_new(client_ctx);
+  assert(ssl);
+  char foreign[64];
+  (void) memset(foreign, 0xff, sizeof(foreign));
+  assert(SSL_set_app_data(ssl, foreign) == 1);
+  assert(SSL_set_fd(ssl, fd) == 1);
+  assert(SSL_set_tlsext_host_name(ssl, "localhost") == 1);
+  assert(SSL_connect(ssl) == 1);
+  /* The echo comes after the session tickets, which are left alone */
+  assert(SSL_write(ssl, "x", 1) == 1);
+  char echo;
+  assert(SSL_read(ssl, &echo, 1) == 1);
+  assert(echo == 'x');
+  assert(cache.used == 1);
+  (void) SSL_shutdown(ssl);
+  SSL_free(ssl);
+  assert(!close(fd));
+  /* The accepted socket */
+  test_wait();
+  test_end();
+
+  test_begin("tls free");
+  tls_server_close(&server);
+  test_wait();
+  tls_session_cache_free(&cache);
+  SSL_CTX_free(client_ctx);
+  SSL_CTX_free(server_ctx);
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,471 @@
+#include <shnet/test.h>
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include <shnet/dns.h>
+#include <shnet/tcp.h>
+
+/*
+ * A stand-in DNS server, answering over UDP and TCP on the same port.
+ */
+
+int dns_udp = -1;
+int dns_tcp = -1;
+int dns_stop[2];
+uint16_t dns_port = 0;
+_Atomic uint32_t dns_queries = 0;
+uint32_t slow_dropped = 0;
+/* Source ports of the queries over UDP */
+_Atomic uint16_t dns_ports[1024];
+_Atomic uint32_t dns_ports_len = 0;
+
+void put_u16(uint8_t* const ptr, const uint16_t value) {
+  ptr[0] = value >> 8;
+  ptr[1] = value;
+}
+
+uint32_t put_record(uint8_t* const ptr, const uint16_t type, const uint32_t ttl, const void* const data, const uint16_t len) {
+  /* Pointer to the question's name */
+  ptr[0] = 0xc0;
+  ptr[1] = 12;
+  put_u16(ptr + 2, type);
+  put_u16(ptr + 4, 1);
+  put_u16(ptr + 6, ttl >> 16);
+  put_u16(ptr + 8, ttl);
+  put_u16(ptr + 10, len);
+  (void) memcpy(ptr + 12, data, len);
+  return 12 + len;
+}
+
+uint32_t put_a(uint8_t* const ptr, const uint32_t ttl, const char* const ip) {
+  uint8_t addr[4];
+  assert(inet_pton(AF_INET, ip, addr) == 1);
+  return put_record(ptr, 1, ttl, addr, 4);
+}
+
+uint32_t put_aaaa(uint8_t* const ptr, const uint32_t ttl, const char* const ip) {
+  uint8_t addr[16];
+  assert(inet_pton(AF_INET6, ip, addr) == 1);
+  return put_record(ptr, 28, ttl, addr, 16);
+}
+
+/* Returns the length of the response, or 0 to not respond */
+uint32_t answer(const uint8_t* const query, const uint32_t len, uint8_t* const out, const int tcp) {
+  assert(len > 12);
+  ++dns_queries;
+  char name[256] = {0};
+  uint32_t off = 12;
+  uint32_t name_len = 0;
+  while(query[off] != 0) {
+    if(name_len != 0) {
+      name[name_len++] = '.';
+    }
+    (void) memcpy(name + name_len, query + off + 1, query[off]);
+    name_len += query[off];
+    off += 1 + query[off];
+  }
+  ++off;
+  const uint16_t type = (query[off] << 8) | query[off + 1];
+  off += 4;
+  /* Header and question, without the additional OPT record */
+  (void) memcpy(out, query, off);
+  out[2] = 0x81;
+  out[3] = 0x80;
+  put_u16(out + 6, 0);
+  put_u16(out + 10, 0);
+  uint16_t count = 0;
+  if(strcmp(name, "a.test") == 0) {
+    if(type == 1) {
+      off += put_a(out + off, 60, "127.0.0.1");
+      ++count;
+    }
+  } else if(strcmp(name, "six.test") == 0) {
+    if(type == 1) {
+      off += put_a(out + off, 60, "127.0.0.2");
+    } else {
+      off += put_aaaa(out + off, 60, "::1");
+    }
+    ++count;
+  } else if(strcmp(name, "cname.test") == 0) {
+    const uint8_t target[] = { 1, 'a', 4, 't', 'e', 's', 't', 0 };
+    const uint32_t target_off = off + 12;
+    off += put_record(out + off, 5, 60, target, sizeof(target));
+    ++count;
+    if(type == 1) {
+      off += put_a(out + off, 20, "127.0.0.1");
+      /* The owner is the CNAME's target */
+      out[off - 16] = 0xc0;
+      out[off - 15] = target_off;
+      ++count;
+    }
+  } else if(strcmp(name, "big.test") == 0) {
+    if(!tcp) {
+      out[2] |= 0x02;
+    } else if(type == 1) {
+      off += put_a(out + off, 30, "10.0.0.1");
+      off += put_a(out + off, 40, "10.0.0.2");
+      off += put_a(out + off, 50, "10.0.0.3");
+      count += 3;
+    }
+  } else if(strcmp(name, "slow.test") == 0) {
+    if(slow_dropped == 0) {
+      ++slow_dropped;
+      return 0;
+    }
+    if(type == 1) {
+      off += put_a(out + off, 60, "10.0.0.9");
+      ++count;
+    }
+  } else if(strcmp(name, "dead.test") == 0) {
+    return 0;
+  } else {
+    out[3] |= 3;
+  }
+  put_u16(out + 6, count);
+  return off;
+}
+
+void* dns_server(void* data) {
+  (void) data;
+  uint8_t query[2048];
+  uint8_t response[2048];
+  struct pollfd fds[3] = {
+    { .fd = dns_udp, .events = POLLIN },
+    { .fd = dns_tcp, .events = POLLIN },
+    { .fd = dns_stop[0], .events = POLLIN }
+  };
+  while(1) {
+    assert(poll(fds, 3, -1) > 0);
+    if(fds[2].revents) {
+      break;
+    }
+    if(fds[0].revents & POLLIN) {
+      struct sockaddr_in addr;
+      socklen_t addr_len = sizeof(addr);
+      const ssize_t len = recvfrom(dns_udp, query, sizeof(query), 0, (struct sockaddr*) &addr, &addr_len);
+      assert(len != -1);
+      const uint32_t idx = atomic_load(&dns_ports_len);
+      if(idx < 1024) {
+        atomic_store(&dns_ports[idx], ntohs(addr.sin_port));
+        atomic_store(&dns_ports_len, idx + 1);
+      }
+      const uint32_t res_len = answer(query, len, response, 0);
+      if(res_len != 0) {
+        assert(sendto(dns_udp, response, res_len, 0, (struct sockaddr*) &addr, addr_len) == res_len);
+      }
+    }
+    if(fds[1].revents & POLLIN) {
+      const int sfd = accept(dns_tcp, NULL, NULL);
+      assert(sfd != -1);
+      uint8_t prefix[2];
+      assert(recv(sfd, prefix, 2, MSG_WAITALL) == 2);
+      const uint16_t len = (prefix[0] << 8) | prefix[1];
+      assert(recv(sfd, query, len, MSG_WAITALL) == len);
+      const uint32_t res_len = answer(query, len, response + 2, 1);
+      put_u16(response, res_len);
+      assert(send(sfd, response, res_len + 2, MSG_NOSIGNAL) == res_len + 2);
+      assert(!close(sfd));
+    }
+  }
+  return NULL;
+}
+
+struct dns_resolver resolver = {0};
+
+struct result {
+  int code;
+  uint32_t count;
+  uint32_t ttl;
+  uint16_t port;
+  int families[4];
+  char ips[4][net_const_ip_max_strlen];
+};
+
+struct result result;
+_Atomic uint32_t many_left = 0;
+
+void resolved(struct net_async_address* addr, struct addrinfo* info) {
+  (void) memset(&result, 0, sizeof(result));
+  result.code = errno;
+  result.ttl = addr->ttl;
+  for(struct addrinfo* cur = info; cur != NULL; cur = cur->ai_next) {
+    if(result.count < 4) {
+      result.families[result.count] = cur->ai_family;
+      net_address_to_string(cur->ai_addr, result.ips[result.count]);
+      result.port = net_address_to_port(cur->ai_addr);
+    }
+    ++result.count;
+  }
+  if(info != NULL) {
+    net_free_address(info);
+  }
+  test_wake();
+}
+
+void resolve(const char* const hostname, const char* const port, const int family, const int flags) {
+  struct addrinfo hints = net_get_addr_struct(family, net_sock_stream, net_proto_tcp, flags);
+  struct net_async_address addr = {
+    .hostname = (char*) hostname,
+    .port = (char*) port,
+    .hints = &hints,
+    .callback = resolved
+  };
+  assert(!dns_resolve(&resolver, &addr));
+  test_wait();
+}
+
+void resolved_many(struct net_async_address* addr, struct addrinfo* info) {
+  assert(info != NULL);
+  assert(info->ai_next == NULL);
+  net_free_address(info);
+  free(addr);
+  if(--many_left == 0) {
+    test_wake();
+  }
+}
+
+struct tcp_server server = {0};
+struct tcp_socket client = {0};
+int client_opened = 0;
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      return NULL;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      client_opened = 1;
+      tcp_socket_force_close(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+int main() {
+  test_begin("dns setup");
+  dns_udp = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(dns_udp != -1);
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  };
+  assert(!bind(dns_udp, (struct sockaddr*) &addr, sizeof(addr)));
+  net_socket_get_local_address(dns_udp, &addr);
+  dns_port = ntohs(addr.sin_port);
+  dns_tcp = socket(AF_INET, SOCK_STREAM, 0);
+  assert(dns_tcp != -1);
+  assert(!bind(dns_tcp, (struct sockaddr*) &addr, sizeof(addr)));
+  assert(!listen(dns_tcp, 16));
+  assert(!pipe(dns_stop));
+  pthread_t thread;
+  assert(!pthread_create(&thread, NULL, dns_server, NULL));
+
+  char conf_path[] = "/tmp/shnet_resolv_XXXXXX";
+  const int conf_fd = mkstemp(conf_path);
+  assert(conf_fd != -1);
+  const char conf[] = "# test\nsearch example.com\nnameserver 127.0.0.1\noptions timeout:1 attempts:3\n";
+  assert(write(conf_fd, conf, sizeof(conf) - 1) == sizeof(conf) - 1);
+  assert(!close(conf_fd));
+  char hosts_path[] = "/tmp/shnet_hosts_XXXXXX";
+  const int hosts_fd = mkstemp(hosts_path);
+  assert(hosts_fd != -1);
+  const char hosts[] = "10.1.2.3 hosted.test Alias.Test # comment\n::2 hosted.test\n";
+  assert(write(hosts_fd, hosts, sizeof(hosts) - 1) == sizeof(hosts) - 1);
+  assert(!close(hosts_fd));
+
+  assert(!dns_resolver(&resolver, &((struct dns_resolver_options) {
+    .resolv_conf = conf_path,
+    .hosts = hosts_path,
+    .port = dns_port,
+    .timeout = 200
+  })));
+  assert(!unlink(conf_path));
+  assert(!unlink(hosts_path));
+  assert(resolver.servers_len == 1);
+  assert(resolver.attempts == 3);
+  assert(resolver.timeout == 200);
+  test_end();
+
+  test_begin("dns literal");
+  resolve("127.0.0.1", "80", net_family_any, 0);
+  assert(result.code == 0);
+  assert(result.count == 1);
+  assert(result.port == 80);
+  assert(!strcmp(result.ips[0], "127.0.0.1"));
+  resolve("::1", NULL, net_family_ipv4, 0);
+  assert(result.count == 0);
+  assert(result.code == EAI_ADDRFAMILY);
+  resolve("a.test", NULL, net_family_any, net_flag_numeric_hostname);
+  assert(result.count == 0);
+  assert(result.code == EAI_NONAME);
+  test_end();
+
+  test_begin("dns hosts");
+  const uint32_t queries = dns_queries;
+  resolve("alias.test", "1", net_family_any, 0);
+  assert(result.count == 1);
+  assert(!strcmp(result.ips[0], "10.1.2.3"));
+  resolve("hosted.test.", "1", net_family_any, 0);
+  assert(result.count == 2);
+  resolve("HOSTED.test", "1", net_family_ipv6, 0);
+  assert(result.count == 1);
+  assert(!strcmp(result.ips[0], "::2"));
+  assert(dns_queries == queries);
+  test_end();
+
+  test_begin("dns query");
+  resolve("a.test", "8080", net_family_ipv4, 0);
+  assert(result.code == 0);
+  assert(result.count == 1);
+  assert(result.ttl == 60);
+  assert(result.port == 8080);
+  assert(!strcmp(result.ips[0], "127.0.0.1"));
+  test_end();
+
+  test_begin("dns query both families");
+  resolve("six.test", NULL, net_family_any, 0);
+  assert(result.count == 2);
+  assert(result.families[0] == AF_INET6);
+  assert(!strcmp(result.ips[0], "::1"));
+  assert(result.families[1] == AF_INET);
+  assert(!strcmp(result.ips[1], "127.0.0.2"));
+  resolve("a.test", NULL, net_family_any, 0);
+  assert(result.count == 1);
+  assert(!strcmp(result.ips[0], "127.0.0.1"));
+  test_end();
+
+  test_begin("dns cname");
+  resolve("CNAME.test", NULL, net_family_ipv4, 0);
+  assert(result.count == 1);
+  assert(result.ttl == 20);
+  assert(!strcmp(result.ips[0], "127.0.0.1"));
+  test_end();
+
+  test_begin("dns tcp fallback");
+  resolve("big.test", NULL, net_family_ipv4, 0);
+  assert(result.count == 3);
+  assert(result.ttl == 30);
+  assert(!strcmp(result.ips[2], "10.0.0.3"));
+  test_end();
+
+  test_begin("dns nxdomain");
+  resolve("missing.test", NULL, net_family_any, 0);
+  assert(result.count == 0);
+  assert(result.code == EAI_NONAME);
+  test_end();
+
+  test_begin("dns retry");
+  resolve("slow.test", NULL, net_family_ipv4, 0);
+  assert(result.count == 1);
+  assert(slow_dropped == 1);
+  test_end();
+
+  test_begin("dns timeout");
+  const uint32_t dead_queries = dns_queries;
+  resolve("dead.test", NULL, net_family_ipv4, 0);
+  assert(result.count == 0);
+  assert(result.code == EAI_AGAIN);
+  assert(dns_queries - dead_queries == 3);
+  /* Each attempt comes from a port of its own */
+  const uint32_t dead_ports = atomic_load(&dns_ports_len);
+  assert(dead_ports >= 3);
+  assert(dns_ports[dead_ports - 1] != dns_ports[dead_ports - 2]);
+  assert(dns_ports[dead_ports - 2] != dns_ports[dead_ports - 3]);
+  test_end();
+
+  test_begin("dns many");
+  many_left = 64;
+  struct addrinfo hints = net_get_addr_struct(net_family_ipv4, net_sock_stream, net_proto_tcp, 0);
+  for(int i = 0; i < 64; ++i) {
+    struct net_async_address* const async = malloc(sizeof(*async));
+    assert(async);
+    *async = (struct net_async_address) {
+      .hostname = "a.test",
+      .hints = &hints,
+      .callback = resolved_many
+    };
+    assert(!dns_resolve(&resolver, async));
+  }
+  test_wait();
+  /* So does each question, hardly ever the same one twice */
+  const uint32_t many_ports = atomic_load(&dns_ports_len);
+  uint32_t repeated = 0;
+  for(uint32_t i = dead_ports; i < many_ports; ++i) {
+    for(uint32_t j = dead_ports; j < i; ++j) {
+      if(dns_ports[i] == dns_ports[j]) {
+        ++repeated;
+        break;
+      }
+    }
+  }
+  assert(many_ports - dead_ports == 64);
+  assert(repeated < 8);
+  test_end();
+
+  test_begin("dns getaddrinfo fallback");
+  resolve("127.0.0.1", "80", net_family_ipv4, net_flag_wants_canonical_name);
+  assert(result.count >= 1);
+  assert(result.ttl == 0);
+  assert(!strcmp(result.ips[0], "127.0.0.1"));
+  test_end();
+
+  test_begin("dns tcp socket");
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0"
+  })));
+  char port[7] = {0};
+  assert(sprintf(port, "%hu", tcp_server_get_port(&server)) > 0);
+  client.on_event = client_evt;
+  assert(!tcp_socket(&client, &((struct tcp_socket_options) {
+    .hostname = "a.test",
+    .port = port,
+    .family = net_family_ipv4,
+    .resolver = &resolver
+  })));
+  tcp_socket_free(&client);
+  test_wait();
+  assert(client_opened);
+  tcp_server_close(&server);
+  test_wait();
+  test_end();
+
+  test_begin("dns free");
+  dns_resolver_free(&resolver);
+  assert(write(dns_stop[1], "", 1) == 1);
+  assert(!pthread_join(thread, NULL));
+  assert(!close(dns_stop[0]));
+  assert(!close(dns_stop[1]));
+  assert(!close(dns_udp));
+  assert(!close(dns_tcp));
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,237 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <shnet/tcp.h>
+
+struct net_dns_cache cache = {0};
+
+struct lookup {
+  struct net_async_address async;
+  struct addrinfo hints;
+  _Atomic int done;
+  int err;
+  uint16_t port;
+};
+
+struct lookup lookups[16];
+
+void lookup_cb(struct net_async_address* async, struct addrinfo* info) {
+  struct lookup* const lookup = async->data;
+  if(info == NULL) {
+    lookup->err = errno;
+  } else {
+    assert(info->ai_family == net_family_ipv4);
+    lookup->port = net_address_to_port(info->ai_addr);
+    net_free_address(info);
+  }
+  atomic_store(&lookup->done, 1);
+  test_wake();
+}
+
+/*
+ * Returns 1 if the callback was called before net_dns_cache_get_async()
+ * returned. Only hits are sure to be, misses may race with getaddrinfo().
+ */
+int lookup(struct lookup* const lookup, const char* const hostname, const int flags) {
+  *lookup = (struct lookup) {0};
+  lookup->hints = net_get_addr_struct(net_family_ipv4, net_sock_stream, net_proto_tcp, flags);
+  lookup->async = (struct net_async_address) {
+    .hostname = (char*) hostname,
+    .port = "80",
+    .hints = &lookup->hints,
+    .data = lookup,
+    .callback = lookup_cb
+  };
+  assert(!net_dns_cache_get_async(&cache, &lookup->async));
+  return atomic_load(&lookup->done);
+}
+
+struct net_dns_cache_stats stats(void) {
+  struct net_dns_cache_stats stats;
+  net_dns_cache_get_stats(&cache, &stats);
+  return stats;
+}
+
+struct tcp_server server = {0};
+struct tcp_socket clients[2] = {0};
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      tcp_socket_close(sock);
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+int main() {
+  test_begin("dns cache setup");
+  cache.size = 3;
+  cache.default_ttl = 1;
+  cache.stale_ttl = 1;
+  assert(!net_dns_cache(&cache));
+  test_end();
+
+  test_begin("dns cache miss");
+  (void) lookup(lookups + 0, "127.0.0.1", 0);
+  test_wait();
+  assert(atomic_load(&lookups[0].done));
+  assert(lookups[0].err == 0);
+  assert(lookups[0].port == 80);
+  assert(lookups[0].async.ttl == 1);
+  assert(stats().misses == 1);
+  assert(stats().lookups == 1);
+  assert(stats().entries == 1);
+  test_end();
+
+  test_begin("dns cache hit");
+  assert(lookup(lookups + 0, "127.0.0.1", 0));
+  test_wait();
+  assert(lookups[0].port == 80);
+  assert(lookups[0].async.ttl == 1);
+  assert(stats().hits == 1);
+  assert(stats().lookups == 1);
+  test_end();
+
+  test_begin("dns cache coalesce");
+  for(int i = 0; i < 16; ++i) {
+    (void) lookup(lookups + i, "127.0.0.2", 0);
+  }
+  for(int i = 0; i < 16; ++i) {
+    test_wait();
+  }
+  for(int i = 0; i < 16; ++i) {
+    assert(lookups[i].port == 80);
+  }
+  /* Whichever weren't coalesced must have been hits */
+  assert(stats().misses + stats().hits == 18);
+  assert(stats().lookups == 2);
+  assert(stats().entries == 2);
+  test_end();
+
+  test_begin("dns cache failure");
+  (void) lookup(lookups + 0, "not an ip", net_flag_numeric_hostname);
+  test_wait();
+  assert(lookups[0].err == EAI_NONAME);
+  assert(stats().lookups == 3);
+  assert(stats().entries == 2);
+  test_end();
+
+  test_begin("dns cache stale");
+  test_sleep(1100);
+  assert(lookup(lookups + 0, "127.0.0.1", 0));
+  test_wait();
+  assert(lookups[0].port == 80);
+  assert(lookups[0].async.ttl == 0);
+  assert(stats().stale_hits == 1);
+  assert(stats().lookups == 4);
+  /* Wait for the refresh in the background */
+  int fresh = 0;
+  for(int i = 0; i < 100 && !fresh; ++i) {
+    assert(lookup(lookups + 0, "127.0.0.1", 0));
+    test_wait();
+    fresh = lookups[0].async.ttl != 0;
+    test_sleep(10);
+  }
+  assert(fresh);
+  assert(stats().lookups == 4);
+  test_end();
+
+  test_begin("dns cache expired");
+  test_sleep(2100);
+  (void) lookup(lookups + 0, "127.0.0.2", 0);
+  test_wait();
+  assert(lookups[0].port == 80);
+  assert(stats().lookups == 5);
+  test_end();
+
+  test_begin("dns cache eviction");
+  (void) lookup(lookups + 0, "127.0.0.3", 0);
+  test_wait();
+  assert(stats().entries == 3);
+  (void) lookup(lookups + 0, "127.0.0.4", 0);
+  test_wait();
+  assert(stats().entries == 3);
+  /* 127.0.0.1 expired the earliest */
+  (void) lookup(lookups + 0, "127.0.0.1", 0);
+  test_wait();
+  assert(stats().lookups == 8);
+  test_end();
+
+  test_begin("dns cache tcp");
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0"
+  })));
+  char port[7] = {0};
+  assert(sprintf(port, "%hu", tcp_server_get_port(&server)) > 0);
+  const uint64_t lookups_before = stats().lookups;
+  for(int i = 0; i < 2; ++i) {
+    clients[i].on_event = client_evt;
+    assert(!tcp_socket(clients + i, &((struct tcp_socket_options) {
+      .hostname = "127.0.0.1",
+      .port = port,
+      .family = net_family_ipv4,
+      .dns_cache = &cache
+    })));
+    /* client and the accepted socket */
+    test_wait();
+    test_wait();
+  }
+  assert(stats().lookups == lookups_before + 1);
+  test_end();
+
+  test_begin("dns cache free");
+  tcp_server_close(&server);
+  test_wait();
+  net_dns_cache_free(&cache);
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,266 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <shnet/tcp.h>
+
+struct tcp_server server = {0};
+struct tcp_pool pool = {0};
+struct tcp_pool_key* key = NULL;
+
+_Atomic uint32_t accepted = 0;
+_Atomic uint32_t accepted_alive = 0;
+
+struct tcp_socket* accepted_sockets[8];
+pthread_mutex_t accepted_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char echo_buf[256];
+
+void echo_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_data: {
+      const uint64_t read = tcp_read(sock, echo_buf, sizeof(echo_buf));
+      if(read != 0) {
+        assert(!tcp_send(sock, &((struct data_frame) {
+          .data = echo_buf,
+          .len = read,
+          .read_only = 1,
+          .dont_free = 1
+        })));
+      }
+      break;
+    }
+    case tcp_close: {
+      assert(!pthread_mutex_lock(&accepted_lock));
+      for(int i = 0; i < 8; ++i) {
+        if(accepted_sockets[i] == sock) {
+          accepted_sockets[i] = NULL;
+          break;
+        }
+      }
+      assert(!pthread_mutex_unlock(&accepted_lock));
+      atomic_fetch_sub(&accepted_alive, 1);
+      tcp_socket_free(sock);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = echo_evt;
+      atomic_fetch_add(&accepted, 1);
+      atomic_fetch_add(&accepted_alive, 1);
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void close_accepted(void) {
+  assert(!pthread_mutex_lock(&accepted_lock));
+  for(int i = 0; i < 8; ++i) {
+    if(accepted_sockets[i] != NULL) {
+      tcp_socket_close(accepted_sockets[i]);
+    }
+  }
+  assert(!pthread_mutex_unlock(&accepted_lock));
+}
+
+struct tcp_socket* remember_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  struct tcp_socket* const ret = server_evt(serv, sock, event);
+  if(event == tcp_open) {
+    /* Returning our own memory lets us know where the socket will live */
+    struct tcp_socket* const ptr = malloc(sizeof(*ptr));
+    assert(ptr);
+    sock->free = 1;
+    assert(!pthread_mutex_lock(&accepted_lock));
+    for(int i = 0; i < 8; ++i) {
+      if(accepted_sockets[i] == NULL) {
+        accepted_sockets[i] = ptr;
+        break;
+      }
+    }
+    assert(!pthread_mutex_unlock(&accepted_lock));
+    return ptr;
+  }
+  return ret;
+}
+
+char recv_buf[16];
+_Atomic uint64_t recv_buf_len = 0;
+_Atomic int opened = 0;
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      atomic_store(&opened, 1);
+      break;
+    }
+    case tcp_data: {
+      const uint64_t len = atomic_load(&recv_buf_len);
+      atomic_fetch_add(&recv_buf_len, tcp_read(sock, recv_buf + len, sizeof(recv_buf) - len));
+      if(atomic_load(&recv_buf_len) == 5) {
+        test_wake();
+      }
+      break;
+    }
+    default: break;
+  }
+}
+
+void exchange(struct tcp_socket* const sock) {
+  atomic_store(&recv_buf_len, 0);
+  assert(!tcp_send(sock, &((struct data_frame) {
+    .data = "hello",
+    .len = 5,
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  test_wait();
+  assert(!memcmp(recv_buf, "hello", 5));
+}
+
+uint32_t key_idle(void) {
+  assert(!pthread_mutex_lock(&pool.lock));
+  const uint32_t idle = key->idle;
+  assert(!pthread_mutex_unlock(&pool.lock));
+  return idle;
+}
+
+uint32_t key_total(void) {
+  assert(!pthread_mutex_lock(&pool.lock));
+  const uint32_t total = key->total;
+  assert(!pthread_mutex_unlock(&pool.lock));
+  return total;
+}
+
+int main() {
+  test_begin("tcp pool setup");
+  server.on_event = remember_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0"
+  })));
+  char port[7] = {0};
+  assert(sprintf(port, "%hu", tcp_server_get_port(&server)) > 0);
+  pool.idle_timeout = 200;
+  assert(!tcp_pool(&pool));
+  errno = 0;
+  assert(!tcp_pool_key(&pool, &((struct tcp_pool_key_options) {
+    .tcp = (struct tcp_socket_options) {
+      .hostname = "127.0.0.1",
+      .port = port
+    },
+    .min = 3,
+    .max = 2
+  })));
+  assert(errno == EINVAL);
+  key = tcp_pool_key(&pool, &((struct tcp_pool_key_options) {
+    .tcp = (struct tcp_socket_options) {
+      .hostname = "127.0.0.1",
+      .port = port
+    },
+    .min = 1,
+    .max = 2
+  }));
+  assert(key);
+  test_end();
+
+  test_begin("tcp pool warm");
+  test_wait_for(atomic_load(&accepted) == 1);
+  assert(key_idle() == 1);
+  assert(key_total() == 1);
+  test_end();
+
+  test_begin("tcp pool reuse");
+  struct tcp_socket* const first = tcp_pool_get(key, client_evt);
+  assert(first);
+  assert(key_idle() == 0);
+  test_wait_for(first->opened);
+  exchange(first);
+  tcp_pool_put(first);
+  assert(key_idle() == 1);
+  struct tcp_socket* const again = tcp_pool_get(key, client_evt);
+  assert(again == first);
+  exchange(again);
+  assert(atomic_load(&accepted) == 1);
+  test_end();
+
+  test_begin("tcp pool max");
+  atomic_store(&opened, 0);
+  struct tcp_socket* const second = tcp_pool_get(key, client_evt);
+  assert(second);
+  test_wait_for(atomic_load(&opened));
+  exchange(second);
+  errno = 0;
+  assert(!tcp_pool_get(key, client_evt));
+  assert(errno == EAGAIN);
+  assert(atomic_load(&accepted) == 2);
+  tcp_pool_put(again);
+  tcp_pool_put(second);
+  assert(key_idle() == 2);
+  test_end();
+
+  test_begin("tcp pool idle eviction");
+  /* Down to min, but not below it */
+  test_wait_for(key_total() == 1);
+  test_sleep(400);
+  assert(key_total() == 1);
+  assert(key_idle() == 1);
+  test_end();
+
+  test_begin("tcp pool health check");
+  test_wait_for(atomic_load(&accepted_alive) == 1);
+  const uint32_t accepted_before = atomic_load(&accepted);
+  close_accepted();
+  /* The pool notices and reconnects to keep min connections */
+  test_wait_for(atomic_load(&accepted) == accepted_before + 1);
+  test_wait_for(key_idle() == 1);
+  struct tcp_socket* const fresh = tcp_pool_get(key, client_evt);
+  assert(fresh);
+  test_wait_for(fresh->opened);
+  exchange(fresh);
+  test_end();
+
+  test_begin("tcp pool unread");
+  tcp_pool_put(fresh);
+  /* A connection with unread data must not be reused */
+  struct tcp_socket* const quiet = tcp_pool_get(key, NULL);
+  assert(quiet == fresh);
+  assert(!tcp_send(quiet, &((struct data_frame) {
+    .data = "hello",
+    .len = 5,
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  test_sleep(50);
+  tcp_pool_put(quiet);
+  assert(key_idle() == 0);
+  test_wait_for(atomic_load(&accepted) == accepted_before + 2);
+  test_wait_for(key_idle() == 1);
+  test_end();
+
+  test_begin("tcp pool free");
+  tcp_pool_free(&pool);
+  test_wait_for(atomic_load(&accepted_alive) == 0);
+  tcp_server_close(&server);
+  test_wait();
+  test_end();
+
+  return 0;
+}
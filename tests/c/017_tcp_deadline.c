@@ -0,0 +1,245 @@
+#include <shnet/test.h>
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include <shnet/dns.h>
+#include <shnet/tcp.h>
+#include <shnet/time.h>
+
+struct tcp_server server = {0};
+struct tcp_socket client = {0};
+
+_Atomic int server_err = -1;
+_Atomic int client_err = -1;
+_Atomic int client_opened = 0;
+_Atomic uint32_t server_reads = 0;
+
+char read_buf[64];
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_data: {
+      while(tcp_read(sock, read_buf, sizeof(read_buf)) != 0);
+      atomic_fetch_add(&server_reads, 1);
+      break;
+    }
+    case tcp_close: {
+      atomic_store(&server_err, errno);
+      tcp_socket_free(sock);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      atomic_store(&client_opened, 1);
+      break;
+    }
+    case tcp_close: {
+      atomic_store(&client_err, errno);
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+/* Returns how long it took for the client to be closed */
+uint64_t client_run(const struct tcp_socket_options* const opt) {
+  atomic_store(&client_err, -1);
+  atomic_store(&client_opened, 0);
+  client.on_event = client_evt;
+  const uint64_t start = time_ns_to_ms(time_get_time());
+  assert(!tcp_socket(&client, opt));
+  test_wait();
+  return time_ns_to_ms(time_get_time()) - start;
+}
+
+int main() {
+  test_begin("tcp deadline setup");
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .idle_timeout = 200
+  })));
+  char port[7] = {0};
+  assert(sprintf(port, "%hu", tcp_server_get_port(&server)) > 0);
+  test_end();
+
+  test_begin("tcp deadline resolve");
+  /* A DNS server that never answers */
+  const int dns = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(dns != -1);
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  };
+  assert(!bind(dns, (struct sockaddr*) &addr, sizeof(addr)));
+  net_socket_get_local_address(dns, &addr);
+  char conf_path[] = "/tmp/shnet_resolv_XXXXXX";
+  const int conf_fd = mkstemp(conf_path);
+  assert(conf_fd != -1);
+  const char conf[] = "nameserver 127.0.0.1\n";
+  assert(write(conf_fd, conf, sizeof(conf) - 1) == sizeof(conf) - 1);
+  assert(!close(conf_fd));
+  struct dns_resolver resolver = {0};
+  assert(!dns_resolver(&resolver, &((struct dns_resolver_options) {
+    .resolv_conf = conf_path,
+    .hosts = "/dev/null",
+    .port = ntohs(addr.sin_port),
+    .timeout = 5000,
+    .attempts = 1
+  })));
+  assert(!unlink(conf_path));
+  const uint64_t resolve_took = client_run(&((struct tcp_socket_options) {
+    .hostname = "silent.test",
+    .port = port,
+    .resolver = &resolver,
+    .connect_timeout = 100
+  }));
+  assert(atomic_load(&client_err) == ETIMEDOUT);
+  assert(!atomic_load(&client_opened));
+  assert(resolve_took < 1000);
+  /* The detached lookup is cancelled here and must clean up after itself */
+  dns_resolver_free(&resolver);
+  assert(!close(dns));
+  test_end();
+
+  test_begin("tcp deadline connect");
+  /* A listener that is never accepted from drops SYNs once its queue is full */
+  const int listener = socket(AF_INET, SOCK_STREAM, 0);
+  assert(listener != -1);
+  addr.sin_port = 0;
+  assert(!bind(listener, (struct sockaddr*) &addr, sizeof(addr)));
+  assert(!listen(listener, 0));
+  net_socket_get_local_address(listener, &addr);
+  int fillers[8];
+  int filled = 0;
+  for(; filled < 8; ++filled) {
+    fillers[filled] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(fillers[filled] != -1);
+    (void) connect(fillers[filled], (struct sockaddr*) &addr, sizeof(addr));
+    struct pollfd pfd = { .fd = fillers[filled], .events = POLLOUT };
+    if(poll(&pfd, 1, 100) == 0) {
+      ++filled;
+      break;
+    }
+  }
+  assert(filled < 8);
+  char listener_port[7] = {0};
+  assert(sprintf(listener_port, "%hu", ntohs(addr.sin_port)) > 0);
+  const uint64_t connect_took = client_run(&((struct tcp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = listener_port,
+    .connect_timeout = 100
+  }));
+  assert(atomic_load(&client_err) == ETIMEDOUT);
+  assert(!atomic_load(&client_opened));
+  assert(connect_took < 1000);
+  for(int i = 0; i < filled; ++i) {
+    assert(!close(fillers[i]));
+  }
+  assert(!close(listener));
+  test_end();
+
+  test_begin("tcp deadline connected");
+  /* The connect deadline no longer applies once the connection is open */
+  atomic_store(&client_err, -1);
+  client.on_event = client_evt;
+  assert(!tcp_socket(&client, &((struct tcp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = port,
+    .connect_timeout = 50,
+    .write_timeout = 50
+  })));
+  test_sleep(150);
+  assert(atomic_load(&client_opened));
+  assert(atomic_load(&client_err) == -1);
+  test_end();
+
+  test_begin("tcp deadline idle");
+  /* Then the server gives up on the silent client */
+  test_wait();
+  for(int i = 0; i < 100 && atomic_load(&server_err) == -1; ++i) {
+    test_sleep(10);
+  }
+  assert(atomic_load(&server_err) == ETIMEDOUT);
+  assert(atomic_load(&client_err) == 0);
+  test_end();
+
+  test_begin("tcp deadline activity");
+  atomic_store(&server_err, -1);
+  atomic_store(&server_reads, 0);
+  atomic_store(&client_err, -1);
+  client.on_event = client_evt;
+  assert(!tcp_socket(&client, &((struct tcp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = port
+  })));
+  for(int i = 0; i < 10; ++i) {
+    test_sleep(50);
+    assert(!tcp_send(&client, &((struct data_frame) {
+      .data = "ping",
+      .len = 4,
+      .read_only = 1,
+      .dont_free = 1
+    })));
+  }
+  /* 500ms in, well past the idle timeout, but never idle for long */
+  assert(atomic_load(&server_err) == -1);
+  assert(atomic_load(&server_reads) != 0);
+  tcp_socket_close(&client);
+  test_wait();
+  test_end();
+
+  test_begin("tcp deadline read");
+  atomic_store(&server_err, -1);
+  const uint64_t read_took = client_run(&((struct tcp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = port,
+    .read_timeout = 100
+  }));
+  assert(atomic_load(&client_err) == ETIMEDOUT);
+  assert(read_took >= 90);
+  assert(read_took < 200);
+  test_end();
+
+  test_begin("tcp deadline free");
+  tcp_server_close(&server);
+  test_wait();
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,226 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include <shnet/tcp.h>
+
+#define WORKERS 3
+
+struct async_loop loops[WORKERS];
+struct async_loop* workers[WORKERS];
+
+struct tcp_server server = {0};
+struct tcp_socket clients[8];
+char port[7];
+
+_Atomic uint32_t accepted_open = 0;
+_Atomic int wrong_loop = 0;
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      /* Events are dispatched by the loop the socket was handed to */
+      if(!pthread_equal(pthread_self(), sock->loop->thread)) {
+        atomic_store(&wrong_loop, 1);
+      }
+      atomic_fetch_add(&accepted_open, 1);
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+uint32_t connections(const uint32_t idx) {
+  struct tcp_worker_stats stats;
+  assert(!tcp_server_get_worker_stats(&server, idx, &stats));
+  assert(stats.loop == workers[idx]);
+  return stats.connections;
+}
+
+void connect_client(const int idx) {
+  clients[idx] = (struct tcp_socket) {0};
+  clients[idx].on_event = client_evt;
+  assert(!tcp_socket(clients + idx, &((struct tcp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = port
+  })));
+}
+
+void close_client(const int idx) {
+  tcp_socket_close(clients + idx);
+  test_wait();
+}
+
+void start_server(const enum tcp_balance balance) {
+  server = (struct tcp_server) {0};
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .workers = workers,
+    .workers_len = WORKERS,
+    .balance = balance
+  })));
+  assert(sprintf(port, "%hu", tcp_server_get_port(&server)) > 0);
+}
+
+void stop_server(void) {
+  tcp_server_close(&server);
+  test_wait();
+}
+
+void block_evt(struct async_loop* loop, struct async_task* task) {
+  (void) loop;
+  (void) task;
+  test_sleep(300);
+}
+
+struct async_task block = { .on_run = block_evt };
+
+int main() {
+  test_begin("tcp workers setup");
+  for(int i = 0; i < WORKERS; ++i) {
+    assert(!tcp_async_loop(loops + i));
+    assert(!async_loop_start(loops + i));
+    workers[i] = loops + i;
+  }
+  server.on_event = server_evt;
+  errno = 0;
+  assert(tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .workers_len = WORKERS
+  })) == -1);
+  assert(errno == EINVAL);
+  test_end();
+
+  test_begin("tcp workers round robin");
+  start_server(tcp_balance_round_robin);
+  for(int i = 0; i < 6; ++i) {
+    connect_client(i);
+    test_wait_for(atomic_load(&accepted_open) == (uint32_t) i + 1);
+  }
+  for(int i = 0; i < WORKERS; ++i) {
+    assert(connections(i) == 2);
+  }
+  assert(!atomic_load(&wrong_loop));
+  struct tcp_worker_stats stats;
+  errno = 0;
+  assert(tcp_server_get_worker_stats(&server, WORKERS, &stats) == -1);
+  assert(errno == EINVAL);
+  for(int i = 0; i < 6; ++i) {
+    close_client(i);
+  }
+  for(int i = 0; i < WORKERS; ++i) {
+    test_wait_for(connections(i) == 0);
+  }
+  test_end();
+
+  test_begin("tcp workers least connections");
+  stop_server();
+  start_server(tcp_balance_least_connections);
+  atomic_store(&accepted_open, 0);
+  for(int i = 0; i < WORKERS; ++i) {
+    connect_client(i);
+    test_wait_for(atomic_load(&accepted_open) == (uint32_t) i + 1);
+  }
+  /* Free up one of the workers, the next connection must go there */
+  uint32_t freed = WORKERS;
+  close_client(1);
+  for(int j = 0; j < 500 && freed == WORKERS; ++j) {
+    for(uint32_t i = 0; i < WORKERS; ++i) {
+      if(connections(i) == 0) {
+        freed = i;
+      }
+    }
+    test_sleep(10);
+  }
+  assert(freed != WORKERS);
+  connect_client(1);
+  test_wait_for(atomic_load(&accepted_open) == WORKERS + 1);
+  for(int i = 0; i < WORKERS; ++i) {
+    assert(connections(i) == 1);
+  }
+  for(int i = 0; i < WORKERS; ++i) {
+    close_client(i);
+  }
+  for(int i = 0; i < WORKERS; ++i) {
+    test_wait_for(connections(i) == 0);
+  }
+  test_end();
+
+  test_begin("tcp workers least lag");
+  stop_server();
+  start_server(tcp_balance_least_lag);
+  atomic_store(&accepted_open, 0);
+  /* The first accept sends out the probes, the stuck loop answers late */
+  async_loop_post(workers[0], &block);
+  test_sleep(20);
+  connect_client(0);
+  test_wait_for(connections(0) + connections(1) + connections(2) == 1);
+  test_sleep(50);
+  const uint32_t stuck = connections(0);
+  for(int i = 1; i < 5; ++i) {
+    connect_client(i);
+    test_wait_for(connections(0) + connections(1) + connections(2) == (uint32_t) i + 1);
+  }
+  assert(connections(0) == stuck);
+  test_wait_for(atomic_load(&accepted_open) == 5);
+  test_wait_for(!tcp_server_get_worker_stats(&server, 0, &stats) && stats.lag >= 100000);
+  for(int i = 0; i < 5; ++i) {
+    close_client(i);
+  }
+  for(int i = 0; i < WORKERS; ++i) {
+    test_wait_for(connections(i) == 0);
+  }
+  test_end();
+
+  test_begin("tcp workers free");
+  stop_server();
+  for(int i = 0; i < WORKERS; ++i) {
+    async_loop_stop(loops + i);
+    async_loop_free(loops + i);
+  }
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+
+#include <shnet/test.h>
+
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include <shnet/tcp.h>
+
+#define GROUPS 2
+
+struct tcp_server servers[GROUPS];
+_Atomic uint32_t accepted[GROUPS];
+_Atomic int accepted_cpu = -1;
+
+struct async_loop client_loop = {0};
+struct tcp_socket client = {0};
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      atomic_store(&accepted_cpu, tcp_socket_get_incoming_cpu(sock));
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      atomic_fetch_add(accepted + (serv - servers), 1);
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      tcp_socket_close(sock);
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+void pin_self(const int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  assert(!pthread_setaffinity_np(pthread_self(), sizeof(set), &set));
+}
+
+int main() {
+  test_begin("tcp cpu setup");
+  errno = 0;
+  assert(net_socket_steer_by_cpu(0, 0) == -1);
+  assert(errno == EINVAL);
+  char port[7] = "0";
+  for(int i = 0; i < GROUPS; ++i) {
+    servers[i].on_event = server_evt;
+    assert(!tcp_server(servers + i, &((struct tcp_server_options) {
+      .hostname = "127.0.0.1",
+      .port = port,
+      .cpu_steering = GROUPS
+    })));
+    assert(sprintf(port, "%hu", tcp_server_get_port(servers + i)) > 0);
+  }
+  assert(!tcp_async_loop(&client_loop));
+  assert(!async_loop_start(&client_loop));
+  test_end();
+
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  const struct addrinfo hints = net_get_addr_struct(net_family_ipv4, net_sock_stream, net_proto_tcp, 0);
+  struct addrinfo* const info = net_get_address("127.0.0.1", port, &hints);
+  assert(info);
+  for(int cpu = 0; cpu < GROUPS && cpu < cpus; ++cpu) {
+    test_begin("tcp cpu steering");
+    /* The SYN is sent and, over loopback, received on this CPU */
+    pin_self(cpu);
+    assert(!async_loop_pin(&client_loop, cpu));
+    uint32_t before[GROUPS];
+    for(int i = 0; i < GROUPS; ++i) {
+      before[i] = atomic_load(accepted + i);
+    }
+    for(int i = 0; i < 4; ++i) {
+      client.loop = &client_loop;
+      client.on_event = client_evt;
+      assert(!tcp_socket(&client, &((struct tcp_socket_options) {
+        .info = info
+      })));
+      test_wait();
+    }
+    for(int i = 0; i < 100 && atomic_load(accepted + cpu % GROUPS) != before[cpu % GROUPS] + 4; ++i) {
+      test_sleep(10);
+    }
+    for(int i = 0; i < GROUPS; ++i) {
+      assert(atomic_load(accepted + i) == before[i] + (i == cpu % GROUPS ? 4 : 0));
+    }
+    assert(atomic_load(&accepted_cpu) == cpu);
+    test_end();
+  }
+  net_free_address(info);
+
+  test_begin("tcp cpu free");
+  for(int i = 0; i < GROUPS; ++i) {
+    tcp_server_close(servers + i);
+    test_wait();
+  }
+  async_loop_stop(&client_loop);
+  async_loop_free(&client_loop);
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,165 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <shnet/tcp.h>
+
+struct tcp_server server = {0};
+struct tcp_socket client = {0};
+
+char echo_buf[4096];
+char payload[1000];
+_Atomic uint64_t received = 0;
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_data: {
+      while(1) {
+        const uint64_t read = tcp_read(sock, echo_buf, sizeof(echo_buf));
+        if(read == 0) {
+          break;
+        }
+        assert(!tcp_send(sock, &((struct data_frame) {
+          .data = echo_buf,
+          .len = read,
+          .read_only = 1,
+          .dont_free = 1
+        })));
+      }
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      test_wake();
+      break;
+    }
+    case tcp_data: {
+      char buf[256];
+      uint64_t read;
+      while((read = tcp_read(sock, buf, sizeof(buf))) != 0) {
+        if(atomic_fetch_add(&received, read) + read == sizeof(payload)) {
+          test_wake();
+        }
+      }
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_server_stats server_stats(void) {
+  struct tcp_server_stats stats;
+  assert(!tcp_server_stats(&server, &stats));
+  return stats;
+}
+
+int main() {
+  test_begin("tcp stats setup");
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .backlog = 8
+  })));
+  char port[7] = {0};
+  assert(sprintf(port, "%hu", tcp_server_get_port(&server)) > 0);
+  struct tcp_server_stats sstats = server_stats();
+  assert(sstats.accepted == 0);
+  assert(sstats.listen_backlog == 8);
+  assert(sstats.listen_queue == 0);
+  client.on_event = client_evt;
+  assert(!tcp_socket(&client, &((struct tcp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = port
+  })));
+  test_wait();
+  test_end();
+
+  test_begin("tcp stats socket");
+  (void) memset(payload, 'a', sizeof(payload));
+  assert(!tcp_send(&client, &((struct data_frame) {
+    .data = payload,
+    .len = sizeof(payload),
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  test_wait();
+  struct tcp_socket_stats stats;
+  assert(!tcp_socket_stats(&client, &stats));
+  assert(stats.bytes_out == sizeof(payload));
+  assert(stats.bytes_in == sizeof(payload));
+  assert(stats.queued == 0);
+  assert(stats.bytes_acked >= sizeof(payload));
+  assert(stats.bytes_received == sizeof(payload));
+  /* TCP_ESTABLISHED */
+  assert(stats.state == 1);
+  assert(stats.rtt != 0);
+  assert(stats.cwnd != 0);
+  assert(stats.mss != 0);
+  assert(stats.recv_queue == 0);
+  test_end();
+
+  test_begin("tcp stats server");
+  sstats = server_stats();
+  assert(sstats.accepted == 1);
+  assert(sstats.open == 1);
+  assert(sstats.closed == 0);
+  /* Connections are only rolled up once they close */
+  assert(sstats.bytes_in == 0);
+  tcp_socket_close(&client);
+  test_wait();
+  test_wait_for(server_stats().closed == 1);
+  sstats = server_stats();
+  assert(sstats.open == 0);
+  assert(sstats.bytes_in == sizeof(payload));
+  assert(sstats.bytes_out == sizeof(payload));
+  test_end();
+
+  test_begin("tcp stats free");
+  tcp_server_close(&server);
+  test_wait();
+  errno = 0;
+  assert(tcp_server_stats(&server, &sstats) == -1);
+  assert(errno == EINVAL);
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,159 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <shnet/tcp.h>
+
+struct tcp_server server = {0};
+struct tcp_socket client = {0};
+struct tcp_socket* _Atomic accepted = NULL;
+
+char sink[65536];
+_Atomic uint64_t received = 0;
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      atomic_store(&accepted, sock);
+      break;
+    }
+    case tcp_data: {
+      uint64_t read;
+      while((read = tcp_read(sock, sink, sizeof(sink))) != 0) {
+        atomic_fetch_add(&received, read);
+      }
+      break;
+    }
+    case tcp_close: {
+      atomic_store(&accepted, NULL);
+      tcp_socket_free(sock);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      test_wake();
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket_stats stats(struct tcp_socket* const sock) {
+  struct tcp_socket_stats stats;
+  assert(!tcp_socket_stats(sock, &stats));
+  return stats;
+}
+
+#define MIN 16384
+#define MAX 1048576
+#define CHUNK 262144
+
+int main() {
+  test_begin("tcp autotune setup");
+  tcp_autotune(&((struct tcp_autotune_options) {
+    .min = MIN,
+    .max = MAX,
+    .interval = 50
+  }));
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .autotune = 1
+  })));
+  char port[7] = {0};
+  assert(sprintf(port, "%hu", tcp_server_get_port(&server)) > 0);
+  client.on_event = client_evt;
+  assert(!tcp_socket(&client, &((struct tcp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = port,
+    .autotune = 1
+  })));
+  test_wait();
+  test_wait_for(atomic_load(&accepted) != NULL);
+  test_end();
+
+  test_begin("tcp autotune idle");
+  /* Nothing is going on, so both ends shrink to the minimum */
+  test_wait_for(stats(&client).sndbuf == MIN * 2 && stats(&client).rcvbuf == MIN * 2);
+  test_wait_for(stats(atomic_load(&accepted)).rcvbuf == MIN * 2);
+  test_end();
+
+  test_begin("tcp autotune bulk");
+  char* const chunk = malloc(CHUNK);
+  assert(chunk);
+  (void) memset(chunk, 'a', CHUNK);
+  uint64_t sent = 0;
+  uint32_t peak = 0;
+  for(int i = 0; i < 200; ++i) {
+    /* Keep the pipe full, but don't queue up too much */
+    if(stats(&client).queued < CHUNK) {
+      assert(!tcp_send(&client, &((struct data_frame) {
+        .data = chunk,
+        .len = CHUNK,
+        .read_only = 1,
+        .dont_free = 1
+      })));
+      sent += CHUNK;
+    }
+    const uint32_t sndbuf = stats(&client).sndbuf;
+    if(sndbuf > peak) {
+      peak = sndbuf;
+    }
+    test_sleep(5);
+  }
+  /* Throughput went up, so did the buffer, but not over the maximum */
+  assert(peak > MIN * 2);
+  assert(peak <= MAX * 2);
+  test_wait_for(atomic_load(&received) == sent);
+  test_end();
+
+  test_begin("tcp autotune shrink");
+  test_wait_for(stats(&client).sndbuf == MIN * 2);
+  test_end();
+
+  test_begin("tcp autotune free");
+  tcp_socket_close(&client);
+  test_wait();
+  free(chunk);
+  tcp_server_close(&server);
+  test_wait();
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,182 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <shnet/tcp.h>
+
+struct tcp_server server = {0};
+struct tcp_socket hog = {0};
+struct tcp_socket late = {0};
+
+_Atomic uint32_t accepted = 0;
+_Atomic uint32_t accepted_closed = 0;
+struct tcp_socket* _Atomic hog_peer = NULL;
+_Atomic int hog_err = -1;
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      struct tcp_socket* expected = NULL;
+      (void) atomic_compare_exchange_strong(&hog_peer, &expected, sock);
+      break;
+    }
+    case tcp_close: {
+      atomic_fetch_add(&accepted_closed, 1);
+      tcp_socket_free(sock);
+      break;
+    }
+    /* Never reads, so whatever is sent to it piles up */
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      atomic_fetch_add(&accepted, 1);
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      test_wake();
+      break;
+    }
+    case tcp_close: {
+      if(sock == &hog) {
+        atomic_store(&hog_err, errno);
+      }
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+struct data_budget_stats budget(void) {
+  struct data_budget_stats stats;
+  data_budget_get_stats(&stats);
+  return stats;
+}
+
+#define LIMIT 1048576
+#define CHUNK 262144
+
+int main() {
+  test_begin("tcp budget setup");
+  assert(budget().used == 0);
+  assert(budget().limit == 0);
+  assert(!data_budget_exceeded());
+  data_budget_set_limit(LIMIT);
+  assert(budget().limit == LIMIT);
+  tcp_budget_policy(tcp_budget_refuse | tcp_budget_stop_accepting);
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0"
+  })));
+  char port[7] = {0};
+  assert(sprintf(port, "%hu", tcp_server_get_port(&server)) > 0);
+  hog.on_event = client_evt;
+  assert(!tcp_socket(&hog, &((struct tcp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = port
+  })));
+  test_wait();
+  test_wait_for(atomic_load(&accepted) == 1);
+  test_end();
+
+  test_begin("tcp budget refuse");
+  char* const chunk = malloc(CHUNK);
+  assert(chunk);
+  (void) memset(chunk, 'a', CHUNK);
+  int refused = 0;
+  for(int i = 0; i < 1000; ++i) {
+    errno = 0;
+    if(tcp_send(&hog, &((struct data_frame) {
+      .data = chunk,
+      .len = CHUNK,
+      .read_only = 1,
+      .dont_free = 1
+    })) == -1) {
+      assert(errno == ENOBUFS);
+      refused = 1;
+      break;
+    }
+  }
+  assert(refused);
+  assert(data_budget_exceeded());
+  struct data_budget_stats stats = budget();
+  assert(stats.used > LIMIT);
+  assert(stats.used <= LIMIT + CHUNK);
+  assert(stats.peak >= stats.used);
+  assert(stats.queues == 1);
+  test_end();
+
+  test_begin("tcp budget stop accepting");
+  late.on_event = client_evt;
+  assert(!tcp_socket(&late, &((struct tcp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = port
+  })));
+  /* The kernel completes the handshake, the server leaves it in the backlog */
+  test_wait();
+  test_sleep(100);
+  assert(atomic_load(&accepted) == 1);
+  test_end();
+
+  test_begin("tcp budget close");
+  tcp_budget_policy(tcp_budget_close | tcp_budget_stop_accepting);
+  /* The idle hog holds the most, so it goes, not the socket that is sending */
+  assert(!tcp_send(&late, &((struct data_frame) {
+    .data = "x",
+    .len = 1,
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  test_wait();
+  assert(atomic_load(&hog_err) == 0);
+  assert(budget().used == 0);
+  assert(budget().queues == 0);
+  assert(!data_budget_exceeded());
+  /* With the budget drained, the server picks up where it left off */
+  test_wait_for(atomic_load(&accepted) == 2);
+  test_end();
+
+  test_begin("tcp budget free");
+  tcp_socket_close(&late);
+  test_wait();
+  /* The hog's peer sits on unread data, so it never sees the end of the stream */
+  tcp_socket_force_close(atomic_load(&hog_peer));
+  test_wait_for(atomic_load(&accepted_closed) == 2);
+  free(chunk);
+  tcp_server_close(&server);
+  test_wait();
+  data_budget_set_limit(0);
+  tcp_budget_policy(tcp_budget_refuse);
+  assert(budget().peak > LIMIT);
+  test_end();
+
+  return 0;
+}
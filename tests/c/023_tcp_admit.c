@@ -0,0 +1,203 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+
+#include <shnet/tcp.h>
+#include <shnet/time.h>
+
+#define CLIENTS 6
+
+struct tcp_server server = {0};
+struct sockaddr_in addr;
+int clients[CLIENTS];
+
+_Atomic uint32_t accepted = 0;
+_Atomic uint32_t accepted_closed = 0;
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_close: {
+      atomic_fetch_add(&accepted_closed, 1);
+      tcp_socket_free(sock);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      atomic_fetch_add(&accepted, 1);
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+struct tcp_server_stats server_stats(void) {
+  struct tcp_server_stats stats;
+  assert(!tcp_server_stats(&server, &stats));
+  return stats;
+}
+
+void start_server(const struct tcp_server_options* const opt) {
+  atomic_store(&accepted, 0);
+  atomic_store(&accepted_closed, 0);
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, opt));
+  addr = (struct sockaddr_in) {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    .sin_port = htons(tcp_server_get_port(&server))
+  };
+}
+
+void stop_server(const uint32_t open) {
+  for(uint32_t i = 0; i < open; ++i) {
+    assert(!close(clients[i]));
+  }
+  test_wait_for(atomic_load(&accepted_closed) == atomic_load(&accepted));
+  tcp_server_close(&server);
+  test_wait();
+}
+
+/* The handshake completes in the kernel, whether the server accepts or not */
+int connect_client(void) {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(fd != -1);
+  assert(!connect(fd, (struct sockaddr*) &addr, sizeof(addr)));
+  return fd;
+}
+
+/* Of the whole process, in milliseconds */
+uint64_t cpu_time(void) {
+  struct rusage usage;
+  assert(!getrusage(RUSAGE_SELF, &usage));
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 +
+    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+}
+
+_Atomic int hogging = 0;
+
+void hog_evt(struct async_loop* loop, struct async_task* task) {
+  if(atomic_load(&hogging)) {
+    test_sleep(100);
+    async_loop_post(loop, task);
+  }
+}
+
+struct async_task hog = { .on_run = hog_evt };
+
+int main() {
+  test_begin("tcp admit rate");
+  start_server(&((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .accept_rate = 10,
+    .accept_burst = 2
+  }));
+  const uint64_t start = time_ns_to_ms(time_get_time());
+  for(int i = 0; i < CLIENTS; ++i) {
+    clients[i] = connect_client();
+  }
+  const uint64_t cpu_start = cpu_time();
+  test_sleep(50);
+  /* The burst goes through right away, the rest at 10 per second */
+  assert(atomic_load(&accepted) == 2);
+  test_wait_for(atomic_load(&accepted) == CLIENTS);
+  assert(time_ns_to_ms(time_get_time()) - start >= 300);
+  /* Waiting for the bucket to refill doesn't keep the loop busy */
+  assert(cpu_time() - cpu_start < 100);
+  stop_server(CLIENTS);
+  test_end();
+
+  test_begin("tcp admit lag");
+  struct async_loop loop = {0};
+  assert(!tcp_async_loop(&loop));
+  assert(!async_loop_start(&loop));
+  server = (struct tcp_server) { .loop = &loop };
+  start_server(&((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .max_lag = 40
+  }));
+  atomic_store(&hogging, 1);
+  async_loop_post(&loop, &hog);
+  /* The loop only measures itself while connections come in */
+  uint32_t connected = 0;
+  while(connected < CLIENTS - 1 && server_stats().lag <= 40) {
+    clients[connected++] = connect_client();
+    test_sleep(250);
+  }
+  assert(server_stats().lag > 40);
+  const uint32_t admitted = atomic_load(&accepted);
+  clients[connected++] = connect_client();
+  test_sleep(300);
+  assert(atomic_load(&accepted) == admitted);
+  assert(admitted < connected);
+  atomic_store(&hogging, 0);
+  test_wait_for(atomic_load(&accepted) == connected);
+  assert(server_stats().lag <= 40);
+  stop_server(connected);
+  async_loop_stop(&loop);
+  async_loop_free(&loop);
+  server.loop = NULL;
+  test_end();
+
+  test_begin("tcp admit emfile");
+  start_server(&((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0"
+  }));
+  struct rlimit old_limit;
+  assert(!getrlimit(RLIMIT_NOFILE, &old_limit));
+  assert(!setrlimit(RLIMIT_NOFILE, &((struct rlimit) {
+    .rlim_cur = 256,
+    .rlim_max = old_limit.rlim_max
+  })));
+  int fillers[256];
+  int filled = 0;
+  while(filled < 256) {
+    const int fd = dup(0);
+    if(fd == -1) {
+      assert(errno == EMFILE);
+      break;
+    }
+    fillers[filled++] = fd;
+  }
+  assert(filled != 0);
+  /* Exactly one descriptor left, for the client */
+  assert(!close(fillers[--filled]));
+  const int rejected = connect_client();
+  test_wait_for(server_stats().shed == 1);
+  char byte;
+  assert(read(rejected, &byte, 1) == 0);
+  assert(atomic_load(&accepted) == 0);
+  assert(!close(rejected));
+  for(int i = 0; i < filled; ++i) {
+    assert(!close(fillers[i]));
+  }
+  assert(!setrlimit(RLIMIT_NOFILE, &old_limit));
+  /* With descriptors to spare, connections are accepted again */
+  clients[0] = connect_client();
+  test_wait_for(atomic_load(&accepted) == 1);
+  stop_server(1);
+  test_end();
+
+  return 0;
+}
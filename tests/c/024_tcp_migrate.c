@@ -0,0 +1,352 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include <shnet/tcp.h>
+
+#define LOOPS 3
+#define CLIENTS 4
+#define PAYLOAD 1000
+#define BULK 16777216
+
+struct async_loop loops[LOOPS];
+
+struct tcp_server server = {0};
+struct tcp_socket client = {0};
+struct tcp_socket* _Atomic accepted = NULL;
+
+_Atomic int wrong_loop = 0;
+_Atomic int migrated_once = 0;
+_Atomic uint64_t received = 0;
+_Atomic uint64_t client_received = 0;
+
+void check_loop(struct tcp_socket* sock) {
+  /* Events are dispatched by the loop the socket belongs to */
+  if(!pthread_equal(pthread_self(), sock->loop->thread)) {
+    atomic_store(&wrong_loop, 1);
+  }
+}
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      atomic_store(&accepted, sock);
+      break;
+    }
+    case tcp_data: {
+      check_loop(sock);
+      char buf[256];
+      if(!atomic_load(&migrated_once)) {
+        /* Leave the rest unread, the target loop must still report it */
+        assert(tcp_read(sock, buf, 1) == 1);
+        assert(buf[0] == 'm');
+        assert(!tcp_socket_migrate(sock, loops + 1));
+        /* Only once the event was handled */
+        assert(sock->loop == loops);
+        errno = 0;
+        assert(tcp_socket_migrate(sock, loops + 2) == -1);
+        assert(errno == EBUSY);
+        atomic_store(&migrated_once, 1);
+        break;
+      }
+      uint64_t read;
+      while((read = tcp_read(sock, buf, sizeof(buf))) != 0) {
+        atomic_fetch_add(&received, read);
+      }
+      break;
+    }
+    case tcp_can_send: {
+      check_loop(sock);
+      break;
+    }
+    case tcp_close: {
+      atomic_store(&accepted, NULL);
+      tcp_socket_free(sock);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      test_wake();
+      break;
+    }
+    case tcp_data: {
+      char buf[65536];
+      uint64_t read;
+      while((read = tcp_read(sock, buf, sizeof(buf))) != 0) {
+        atomic_fetch_add(&client_received, read);
+      }
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+char* bulk;
+
+void bulk_evt(struct async_loop* loop, struct async_task* task) {
+  /* On the socket's loop, like its event handler */
+  struct tcp_socket* const sock = atomic_load(&accepted);
+  assert(sock->loop == loop);
+  assert(!tcp_send(sock, &((struct data_frame) {
+    .data = bulk,
+    .len = BULK,
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  struct tcp_socket_stats stats;
+  assert(!tcp_socket_stats(sock, &stats));
+  assert(stats.queued != 0);
+  assert(!tcp_socket_migrate(sock, loops + 2));
+  assert(sock->loop == loops + 2);
+  test_wake();
+}
+
+struct async_task bulk_task = { .on_run = bulk_evt };
+
+/* Rebalancing, with plain sockets on the other end */
+
+struct tcp_server rebalanced = {0};
+struct async_loop* workers[2];
+int clients[CLIENTS];
+
+char echo_buf[64];
+
+void echo_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_data: {
+      check_loop(sock);
+      uint64_t read;
+      while((read = tcp_read(sock, echo_buf, sizeof(echo_buf))) != 0) {
+        assert(!tcp_send(sock, &((struct data_frame) {
+          .data = echo_buf,
+          .len = read,
+          .read_only = 1,
+          .dont_free = 1
+        })));
+      }
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* rebalanced_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = echo_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+struct tcp_worker_stats worker_stats(const uint32_t idx) {
+  struct tcp_worker_stats stats;
+  assert(!tcp_server_get_worker_stats(&rebalanced, idx, &stats));
+  return stats;
+}
+
+void echo_round(void) {
+  for(int i = 0; i < CLIENTS; ++i) {
+    char byte = 'a' + i;
+    assert(write(clients[i], &byte, 1) == 1);
+    assert(read(clients[i], &byte, 1) == 1);
+    assert(byte == 'a' + i);
+  }
+}
+
+_Atomic int hogging = 0;
+
+void hog_evt(struct async_loop* loop, struct async_task* task) {
+  if(atomic_load(&hogging)) {
+    test_sleep(100);
+    async_loop_post(loop, task);
+  }
+}
+
+struct async_task hog = { .on_run = hog_evt };
+
+int main() {
+  test_begin("tcp migrate setup");
+  for(int i = 0; i < LOOPS; ++i) {
+    assert(!tcp_async_loop(loops + i));
+    assert(!async_loop_start(loops + i));
+  }
+  server.loop = loops;
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0"
+  })));
+  char port[7] = {0};
+  assert(sprintf(port, "%hu", tcp_server_get_port(&server)) > 0);
+  errno = 0;
+  assert(tcp_socket_migrate(&client, loops) == -1);
+  assert(errno == EINVAL);
+  client.on_event = client_evt;
+  assert(!tcp_socket(&client, &((struct tcp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = port
+  })));
+  test_wait();
+  errno = 0;
+  assert(tcp_socket_migrate(&client, NULL) == -1);
+  assert(errno == EINVAL);
+  test_end();
+
+  test_begin("tcp migrate readiness");
+  char payload[PAYLOAD + 1];
+  (void) memset(payload, 'a', sizeof(payload));
+  payload[0] = 'm';
+  assert(!tcp_send(&client, &((struct data_frame) {
+    .data = payload,
+    .len = sizeof(payload),
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  test_wait_for(atomic_load(&received) == PAYLOAD);
+  struct tcp_socket* const sock = atomic_load(&accepted);
+  assert(sock != NULL);
+  assert(sock->loop == loops + 1);
+  /* Data sent after the migration arrives too */
+  assert(!tcp_send(&client, &((struct data_frame) {
+    .data = payload + 1,
+    .len = PAYLOAD,
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  test_wait_for(atomic_load(&received) == PAYLOAD * 2);
+  /* Already there */
+  assert(!tcp_socket_migrate(sock, loops + 1));
+  test_end();
+
+  test_begin("tcp migrate queue");
+  bulk = malloc(BULK);
+  assert(bulk);
+  (void) memset(bulk, 'b', BULK);
+  tcp_socket_pause_read(&client);
+  async_loop_post(loops + 1, &bulk_task);
+  test_wait();
+  test_sleep(50);
+  /* The frames that didn't fit in the kernel moved along with the socket */
+  assert(atomic_load(&client_received) < BULK);
+  tcp_socket_resume_read(&client);
+  test_wait_for(atomic_load(&client_received) == BULK);
+  assert(!atomic_load(&wrong_loop));
+  test_end();
+
+  test_begin("tcp migrate rebalance");
+  workers[0] = loops + 1;
+  workers[1] = loops + 2;
+  rebalanced.loop = loops;
+  rebalanced.on_event = rebalanced_evt;
+  assert(!tcp_server(&rebalanced, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .workers = workers,
+    .workers_len = 2,
+    .rebalance_interval = 50,
+    .rebalance_lag = 20
+  })));
+  const struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    .sin_port = htons(tcp_server_get_port(&rebalanced))
+  };
+  for(int i = 0; i < CLIENTS; ++i) {
+    clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+    assert(clients[i] != -1);
+    assert(!connect(clients[i], (struct sockaddr*) &addr, sizeof(addr)));
+  }
+  test_wait_for(worker_stats(0).connections == 2 && worker_stats(1).connections == 2);
+  echo_round();
+  /* The first worker falls behind, its connections keep it busy */
+  atomic_store(&hogging, 1);
+  async_loop_post(workers[0], &hog);
+  for(int i = 0; i < 100 && worker_stats(0).migrated == 0; ++i) {
+    echo_round();
+  }
+  assert(worker_stats(0).migrated == 1);
+  assert(worker_stats(0).connections == 1);
+  assert(worker_stats(1).connections == 3);
+  /* Down to a single connection, nothing is moved anymore */
+  for(int i = 0; i < 10; ++i) {
+    echo_round();
+  }
+  assert(worker_stats(0).migrated == 1);
+  atomic_store(&hogging, 0);
+  echo_round();
+  assert(!atomic_load(&wrong_loop));
+  test_end();
+
+  test_begin("tcp migrate free");
+  for(int i = 0; i < CLIENTS; ++i) {
+    assert(!close(clients[i]));
+  }
+  test_wait_for(worker_stats(0).connections == 0 && worker_stats(1).connections == 0);
+  tcp_server_close(&rebalanced);
+  test_wait();
+  tcp_socket_close(&client);
+  test_wait();
+  test_wait_for(atomic_load(&accepted) == NULL);
+  free(bulk);
+  tcp_server_close(&server);
+  test_wait();
+  for(int i = 0; i < LOOPS; ++i) {
+    async_loop_stop(loops + i);
+    async_loop_free(loops + i);
+  }
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,180 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include <shnet/tcp.h>
+#include <shnet/threads.h>
+
+#define CLIENTS 16
+#define BROADCASTERS 4
+
+struct tcp_server server = {0};
+struct sockaddr_in addr;
+int clients[CLIENTS];
+
+_Atomic uint64_t handles[CLIENTS];
+_Atomic uint32_t accepted = 0;
+_Atomic uint32_t freed = 0;
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      const uint64_t handle = tcp_socket_handle(sock);
+      assert(handle != 0);
+      assert(tcp_socket_handle(sock) == handle);
+      atomic_store(&handles[atomic_fetch_add(&accepted, 1)], handle);
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      atomic_fetch_add(&freed, 1);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+int connect_client(void) {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(fd != -1);
+  assert(!connect(fd, (struct sockaddr*) &addr, sizeof(addr)));
+  return fd;
+}
+
+int send_byte(const uint64_t handle, const char* const byte) {
+  return tcp_handle_send(handle, &((struct data_frame) {
+    .data = (char*) byte,
+    .len = 1,
+    .read_only = 1,
+    .dont_free = 1
+  }));
+}
+
+_Atomic uint64_t sent = 0;
+
+void* broadcast(void* data) {
+  (void) data;
+  while(1) {
+    uint32_t stale = 0;
+    for(int i = 0; i < CLIENTS; ++i) {
+      if(send_byte(atomic_load(&handles[i]), "b") == 0) {
+        atomic_fetch_add(&sent, 1);
+      } else if(errno == ESTALE) {
+        ++stale;
+      }
+    }
+    if(stale == CLIENTS) {
+      return NULL;
+    }
+  }
+}
+
+int main() {
+  test_begin("tcp handle send");
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0"
+  })));
+  addr = (struct sockaddr_in) {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    .sin_port = htons(tcp_server_get_port(&server))
+  };
+  clients[0] = connect_client();
+  test_wait_for(atomic_load(&accepted) == 1);
+  const uint64_t first = atomic_load(&handles[0]);
+  assert(!send_byte(first, "a"));
+  char byte;
+  assert(read(clients[0], &byte, 1) == 1);
+  assert(byte == 'a');
+  struct tcp_socket* const sock = tcp_handle_acquire(first);
+  assert(sock != NULL);
+  assert(sock->handle == first);
+  tcp_handle_release(first);
+  test_end();
+
+  test_begin("tcp handle stale");
+  assert(!close(clients[0]));
+  test_wait_for(atomic_load(&freed) == 1);
+  errno = 0;
+  assert(send_byte(first, "a") == -1);
+  assert(errno == ESTALE);
+  errno = 0;
+  assert(tcp_handle_acquire(first) == NULL);
+  assert(errno == ESTALE);
+  assert(tcp_handle_acquire(0) == NULL);
+  assert(tcp_handle_acquire(UINT64_MAX) == NULL);
+  test_end();
+
+  test_begin("tcp handle reuse");
+  /* The slot is taken again, but the old handle stays stale */
+  clients[0] = connect_client();
+  test_wait_for(atomic_load(&accepted) == 2);
+  const uint64_t second = atomic_load(&handles[1]);
+  assert((uint32_t) second == (uint32_t) first);
+  assert(second != first);
+  assert(send_byte(first, "a") == -1);
+  assert(!send_byte(second, "c"));
+  assert(read(clients[0], &byte, 1) == 1);
+  assert(byte == 'c');
+  assert(!close(clients[0]));
+  test_wait_for(atomic_load(&freed) == 2);
+  test_end();
+
+  test_begin("tcp handle race");
+  atomic_store(&accepted, 0);
+  for(int i = 0; i < CLIENTS; ++i) {
+    clients[i] = connect_client();
+  }
+  test_wait_for(atomic_load(&accepted) == CLIENTS);
+  pthread_t threads[BROADCASTERS];
+  for(int i = 0; i < BROADCASTERS; ++i) {
+    assert(!pthread_start(threads + i, broadcast, NULL));
+  }
+  test_sleep(20);
+  /* Sockets are freed while the broadcasters keep sending to them */
+  for(int i = 0; i < CLIENTS; ++i) {
+    assert(!close(clients[i]));
+    test_sleep(5);
+  }
+  for(int i = 0; i < BROADCASTERS; ++i) {
+    assert(!pthread_join(threads[i], NULL));
+  }
+  test_wait_for(atomic_load(&freed) == CLIENTS + 2);
+  assert(atomic_load(&sent) != 0);
+  test_end();
+
+  test_begin("tcp handle free");
+  tcp_server_close(&server);
+  test_wait();
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,265 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include <shnet/tcp.h>
+#include <shnet/threads.h>
+
+#define SENDERS 4
+#define FRAMES 4000
+#define FRAME 64
+#define DROPPED 8
+
+struct tcp_server server = {0};
+struct sockaddr_in addr;
+
+struct tcp_socket* _Atomic accepted = NULL;
+_Atomic uint32_t freed = 0;
+_Atomic int keep_closed = 0;
+_Atomic int closed = 0;
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      atomic_store(&accepted, sock);
+      break;
+    }
+    case tcp_close: {
+      if(atomic_load(&keep_closed)) {
+        atomic_store(&closed, 1);
+      } else {
+        tcp_socket_free(sock);
+      }
+      break;
+    }
+    case tcp_free: {
+      atomic_fetch_add(&freed, 1);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+struct tcp_socket* connect_client(int* const fd) {
+  atomic_store(&accepted, NULL);
+  *fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(*fd != -1);
+  assert(!connect(*fd, (struct sockaddr*) &addr, sizeof(addr)));
+  test_wait_for(atomic_load(&accepted) != NULL);
+  return atomic_load(&accepted);
+}
+
+void read_all(const int fd, char* buf, uint64_t len) {
+  while(len != 0) {
+    const ssize_t bytes = read(fd, buf, len);
+    assert(bytes > 0);
+    buf += bytes;
+    len -= bytes;
+  }
+}
+
+void* sender(void* data) {
+  struct tcp_socket* const sock = atomic_load(&accepted);
+  const uint32_t id = (uintptr_t) data;
+  for(uint32_t i = 0; i < FRAMES; ++i) {
+    /* Reused right away, so it has to be copied */
+    char frame[FRAME];
+    (void) memset(frame, 'f', sizeof(frame));
+    (void) memcpy(frame, &id, sizeof(id));
+    (void) memcpy(frame + sizeof(id), &i, sizeof(i));
+    assert(!tcp_send(sock, &((struct data_frame) {
+      .data = frame,
+      .len = sizeof(frame),
+      .dont_free = 1
+    })));
+  }
+  return NULL;
+}
+
+_Atomic int staged = 0;
+
+void send_after_staged(struct async_loop* loop, struct async_task* task) {
+  /* Runs on the socket's loop, ahead of the flush */
+  while(!atomic_load(&staged)) {
+    test_sleep(1);
+  }
+  assert(!tcp_send(atomic_load(&accepted), &((struct data_frame) {
+    .data = "b",
+    .len = 1,
+    .read_only = 1,
+    .dont_free = 1
+  })));
+}
+
+struct async_task after_staged = { .on_run = send_after_staged };
+
+_Atomic int blocked = 0;
+
+void block_loop(struct async_loop* loop, struct async_task* task) {
+  while(atomic_load(&blocked)) {
+    test_sleep(1);
+  }
+}
+
+struct async_task blocker = { .on_run = block_loop };
+
+void* free_socket(void* data) {
+  tcp_socket_free(data);
+  return NULL;
+}
+
+int main() {
+  test_begin("tcp stage setup");
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .stage_sends = 1
+  })));
+  addr = (struct sockaddr_in) {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    .sin_port = htons(tcp_server_get_port(&server))
+  };
+  int fd;
+  struct tcp_socket* sock = connect_client(&fd);
+  assert(sock->stage_sends);
+  test_end();
+
+  test_begin("tcp stage order");
+  pthread_t threads[SENDERS];
+  for(uintptr_t i = 0; i < SENDERS; ++i) {
+    assert(!pthread_start(threads + i, sender, (void*) i));
+  }
+  for(int i = 0; i < SENDERS; ++i) {
+    assert(!pthread_join(threads[i], NULL));
+  }
+  /* More than the kernel takes, so the queue is written out in batches */
+  char* const buf = malloc(SENDERS * FRAMES * FRAME);
+  assert(buf);
+  read_all(fd, buf, SENDERS * FRAMES * FRAME);
+  uint32_t next[SENDERS] = {0};
+  for(uint32_t i = 0; i < SENDERS * FRAMES; ++i) {
+    uint32_t id;
+    uint32_t seq;
+    (void) memcpy(&id, buf + i * FRAME, sizeof(id));
+    (void) memcpy(&seq, buf + i * FRAME + sizeof(id), sizeof(seq));
+    assert(id < SENDERS);
+    assert(seq == next[id]);
+    ++next[id];
+    assert(buf[i * FRAME + FRAME - 1] == 'f');
+  }
+  free(buf);
+  test_wait_for(sock->bytes_out == SENDERS * FRAMES * FRAME);
+  test_end();
+
+  test_begin("tcp stage loop send");
+  /* A send from the loop takes what was staged before it */
+  async_loop_post(server.loop, &after_staged);
+  assert(!tcp_send(sock, &((struct data_frame) {
+    .data = "a",
+    .len = 1,
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  atomic_store(&staged, 1);
+  char two[2];
+  read_all(fd, two, sizeof(two));
+  assert(two[0] == 'a');
+  assert(two[1] == 'b');
+  assert(!close(fd));
+  test_wait_for(atomic_load(&freed) == 1);
+  test_end();
+
+  test_begin("tcp stage close");
+  sock = connect_client(&fd);
+  atomic_store(&blocked, 1);
+  async_loop_post(server.loop, &blocker);
+  /* Owned by the socket from here on, freed whether they are sent or not */
+  for(int i = 0; i < DROPPED; ++i) {
+    char* const data = malloc(FRAME);
+    assert(data);
+    (void) memset(data, 'd', FRAME);
+    assert(!tcp_send(sock, &((struct data_frame) {
+      .data = data,
+      .len = FRAME,
+      .free_onerr = 1
+    })));
+  }
+  tcp_socket_force_close(sock);
+  atomic_store(&blocked, 0);
+  test_wait_for(atomic_load(&freed) == 2);
+  assert(!close(fd));
+  test_end();
+
+  test_begin("tcp stage free while flushing");
+  atomic_store(&keep_closed, 1);
+  sock = connect_client(&fd);
+  assert(!close(fd));
+  test_wait_for(atomic_load(&closed));
+  /* A pin holds the freeing thread back, right before it gets to the stage */
+  const uint64_t handle = tcp_socket_handle(sock);
+  assert(handle != 0);
+  assert(tcp_handle_acquire(handle) == sock);
+  pthread_t thread;
+  assert(!pthread_start(&thread, free_socket, sock));
+  test_sleep(50);
+  tcp_lock(sock);
+  assert(!tcp_send(sock, &((struct data_frame) {
+    .data = "a",
+    .len = 1,
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  /* The flush is running now, stuck on the lock */
+  test_sleep(50);
+  atomic_store(&blocked, 1);
+  async_loop_post(server.loop, &blocker);
+  /* So this posts another one, which only runs once the socket is gone */
+  assert(!tcp_send(sock, &((struct data_frame) {
+    .data = "b",
+    .len = 1,
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  tcp_handle_release(handle);
+  test_sleep(50);
+  tcp_unlock(sock);
+  assert(!pthread_join(thread, NULL));
+  assert(atomic_load(&freed) == 3);
+  atomic_store(&blocked, 0);
+  /* The second flush must see the socket is gone */
+  test_sleep(50);
+  test_end();
+
+  test_begin("tcp stage free");
+  tcp_server_close(&server);
+  test_wait();
+  test_end();
+
+  return 0;
+}
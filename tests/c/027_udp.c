@@ -0,0 +1,156 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <shnet/udp.h>
+
+#define BATCH 100
+#define SMALL 100
+#define SEGMENTS 10
+#define SEGMENT 1000
+
+struct udp_socket server = {0};
+struct udp_socket client = {0};
+
+_Atomic uint32_t server_datagrams = 0;
+_Atomic uint32_t server_bytes = 0;
+_Atomic uint32_t client_bytes = 0;
+_Atomic uint32_t coalesced = 0;
+_Atomic int echo = 0;
+
+void server_evt(struct udp_socket* sock, enum udp_event event) {
+  switch(event) {
+    case udp_data: {
+      struct udp_datagram datagrams[64];
+      uint32_t count;
+      while((count = udp_read(sock, datagrams, 64)) != 0) {
+        for(uint32_t i = 0; i < count; ++i) {
+          struct udp_datagram* const datagram = datagrams + i;
+          assert(!datagram->truncated);
+          assert(datagram->addr.sa_family == AF_INET);
+          assert(datagram->data[0] == 'u');
+          if(datagram->segment != 0) {
+            /* Several datagrams of the same size, the last one may be shorter */
+            atomic_fetch_add(&server_datagrams, (datagram->len + datagram->segment - 1) / datagram->segment);
+            atomic_fetch_add(&coalesced, 1);
+          } else {
+            atomic_fetch_add(&server_datagrams, 1);
+          }
+          atomic_fetch_add(&server_bytes, datagram->len);
+          if(atomic_load(&echo)) {
+            /* Back to where it came from */
+            datagram->segment = 0;
+            assert(udp_send(sock, datagram, 1) == 1);
+          }
+          data_pool_free(datagram->data);
+        }
+      }
+      break;
+    }
+    case udp_close: {
+      udp_socket_free(sock);
+      break;
+    }
+    case udp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+void client_evt(struct udp_socket* sock, enum udp_event event) {
+  switch(event) {
+    case udp_data: {
+      struct udp_datagram datagrams[8];
+      uint32_t count;
+      while((count = udp_read(sock, datagrams, 8)) != 0) {
+        for(uint32_t i = 0; i < count; ++i) {
+          atomic_fetch_add(&client_bytes, datagrams[i].len);
+          data_pool_free(datagrams[i].data);
+        }
+      }
+      break;
+    }
+    case udp_close: {
+      udp_socket_free(sock);
+      break;
+    }
+    case udp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+char payload[SEGMENTS * SEGMENT];
+
+int main() {
+  test_begin("udp setup");
+  (void) memset(payload, 'u', sizeof(payload));
+  errno = 0;
+  assert(udp_socket(&server, NULL) == -1);
+  assert(errno == EINVAL);
+  server.on_event = server_evt;
+  assert(!udp_socket(&server, &((struct udp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .family = net_family_ipv4,
+    .bind = 1,
+    .gro = 1
+  })));
+  assert(server.gro);
+  char port[7] = {0};
+  assert(sprintf(port, "%hu", udp_socket_get_port(&server)) > 0);
+  client.on_event = client_evt;
+  assert(!udp_socket(&client, &((struct udp_socket_options) {
+    .hostname = "127.0.0.1",
+    .port = port,
+    .family = net_family_ipv4
+  })));
+  test_end();
+
+  test_begin("udp batch");
+  struct udp_datagram datagrams[BATCH];
+  for(int i = 0; i < BATCH; ++i) {
+    datagrams[i] = (struct udp_datagram) {
+      .data = payload,
+      .len = SMALL
+    };
+  }
+  assert(udp_send(&client, datagrams, BATCH) == BATCH);
+  test_wait_for(atomic_load(&server_datagrams) == BATCH);
+  assert(atomic_load(&server_bytes) == BATCH * SMALL);
+  test_end();
+
+  test_begin("udp gso");
+  atomic_store(&server_datagrams, 0);
+  atomic_store(&server_bytes, 0);
+  /* One send, cut into SEGMENTS datagrams */
+  assert(udp_send(&client, &((struct udp_datagram) {
+    .data = payload,
+    .len = sizeof(payload),
+    .segment = SEGMENT
+  }), 1) == 1);
+  test_wait_for(atomic_load(&server_bytes) == sizeof(payload));
+  assert(atomic_load(&server_datagrams) == SEGMENTS);
+  test_end();
+
+  test_begin("udp reply");
+  atomic_store(&echo, 1);
+  assert(udp_send(&client, datagrams, 10) == 10);
+  test_wait_for(atomic_load(&client_bytes) == 10 * SMALL);
+  test_end();
+
+  test_begin("udp free");
+  udp_socket_close(&client);
+  test_wait();
+  udp_socket_close(&server);
+  test_wait();
+  test_end();
+
+  return 0;
+}
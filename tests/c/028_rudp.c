@@ -0,0 +1,268 @@
+#include <shnet/test.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include <shnet/rudp.h>
+
+#define MESSAGES 1000
+#define LOSS 25
+
+enum channel {
+  channel_unreliable,
+  channel_sequenced,
+  channel_reliable
+};
+
+const enum rudp_channel channels[] = {
+  [channel_unreliable] = rudp_unreliable,
+  [channel_sequenced] = rudp_sequenced,
+  [channel_reliable] = rudp_reliable
+};
+
+struct rudp_host server = {0};
+struct rudp_host client = {0};
+
+struct sockaddr_in server_addr = {0};
+struct rudp_peer* server_peer = NULL;
+
+_Atomic int server_open = 0;
+_Atomic int server_closed = 0;
+_Atomic int client_open = 0;
+_Atomic int client_closed = 0;
+_Atomic int done = 0;
+_Atomic int retransmitted = 0;
+
+_Atomic uint32_t unreliable = 0;
+_Atomic uint32_t sequenced = 0;
+_Atomic uint32_t reliable = 0;
+int64_t last_sequenced = -1;
+
+void server_evt(struct rudp_host* host, struct rudp_peer* peer, enum rudp_event event) {
+  switch(event) {
+    case rudp_open: {
+      struct sockaddr_in addr;
+      rudp_peer_get_address(peer, &addr);
+      assert(addr.sin_family == AF_INET);
+      assert(addr.sin_port == htons(udp_socket_get_port(&client.udp)));
+      atomic_store(&server_open, 1);
+      break;
+    }
+    case rudp_close: {
+      /* Either the disconnect made it, or the peer timed out */
+      assert(errno == ECONNRESET || errno == ETIMEDOUT);
+      atomic_store(&server_closed, 1);
+      break;
+    }
+    case rudp_free: {
+      assert(peer == NULL);
+      test_wake();
+      break;
+    }
+    default: assert(0);
+  }
+}
+
+void server_msg(struct rudp_host* host, struct rudp_peer* peer, uint8_t channel, const char* data, uint32_t len) {
+  assert(len == sizeof(uint32_t));
+  uint32_t num;
+  (void) memcpy(&num, data, sizeof(num));
+  switch(channel) {
+    case channel_unreliable: {
+      atomic_fetch_add(&unreliable, 1);
+      break;
+    }
+    case channel_sequenced: {
+      /* Some may go missing, but never backwards */
+      assert((int64_t) num > last_sequenced);
+      last_sequenced = num;
+      atomic_fetch_add(&sequenced, 1);
+      break;
+    }
+    case channel_reliable: {
+      assert(num == atomic_load(&reliable));
+      if(atomic_fetch_add(&reliable, 1) + 1 == MESSAGES) {
+        assert(!rudp_send(peer, channel_reliable, &num, sizeof(num)));
+      }
+      break;
+    }
+    default: assert(0);
+  }
+}
+
+void client_evt(struct rudp_host* host, struct rudp_peer* peer, enum rudp_event event) {
+  switch(event) {
+    case rudp_open: {
+      assert(peer == server_peer);
+      atomic_store(&client_open, 1);
+      break;
+    }
+    case rudp_close: {
+      assert(peer == server_peer);
+      assert(errno == 0);
+      atomic_store(&client_closed, 1);
+      break;
+    }
+    case rudp_free: {
+      assert(peer == NULL);
+      test_wake();
+      break;
+    }
+    default: assert(0);
+  }
+}
+
+void client_msg(struct rudp_host* host, struct rudp_peer* peer, uint8_t channel, const char* data, uint32_t len) {
+  assert(channel == channel_reliable);
+  assert(len == sizeof(uint32_t));
+  struct rudp_peer_stats stats;
+  rudp_peer_get_stats(peer, &stats);
+  assert(stats.packets_sent != 0);
+  assert(stats.packets_received != 0);
+  assert(stats.rto >= 20);
+  atomic_store(&retransmitted, stats.retransmits != 0);
+  atomic_store(&done, 1);
+}
+
+void connect_task(struct async_loop* loop, struct async_task* task) {
+  server_peer = rudp_connect(&client, &server_addr);
+  assert(server_peer != NULL);
+  assert(rudp_connect(&client, &server_addr) == server_peer);
+  char big[1200] = {0};
+  errno = 0;
+  assert(rudp_send(server_peer, channel_reliable, big, sizeof(big)) == -1);
+  assert(errno == EMSGSIZE);
+  errno = 0;
+  assert(rudp_send(server_peer, 3, big, 1) == -1);
+  assert(errno == EINVAL);
+  for(uint32_t i = 0; i < MESSAGES; ++i) {
+    assert(!rudp_send(server_peer, channel_reliable, &i, sizeof(i)));
+    assert(!rudp_send(server_peer, channel_sequenced, &i, sizeof(i)));
+    assert(!rudp_send(server_peer, channel_unreliable, &i, sizeof(i)));
+  }
+}
+
+struct async_task connect_t = { .on_run = connect_task };
+
+void disconnect_task(struct async_loop* loop, struct async_task* task) {
+  rudp_disconnect(server_peer);
+}
+
+struct async_task disconnect_t = { .on_run = disconnect_task };
+
+/* Takes packets from a plain UDP socket, to see what it makes of replays */
+struct rudp_host replay = {0};
+
+_Atomic uint32_t replayed = 0;
+
+void replay_evt(struct rudp_host* host, struct rudp_peer* peer, enum rudp_event event) {
+  if(event == rudp_free) {
+    test_wake();
+  }
+}
+
+void replay_msg(struct rudp_host* host, struct rudp_peer* peer, uint8_t channel, const char* data, uint32_t len) {
+  assert(channel == channel_sequenced);
+  atomic_fetch_add(&replayed, 1);
+}
+
+int main() {
+  test_begin("rudp setup");
+  errno = 0;
+  assert(rudp_host(&server, NULL) == -1);
+  assert(errno == EINVAL);
+  server.on_event = server_evt;
+  server.on_message = server_msg;
+  assert(!rudp_host(&server, &((struct rudp_host_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .family = net_family_ipv4,
+    .channels = channels,
+    .channels_len = 3,
+    .timeout = 2000,
+    .loss = LOSS
+  })));
+  client.on_event = client_evt;
+  client.on_message = client_msg;
+  assert(!rudp_host(&client, &((struct rudp_host_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .family = net_family_ipv4,
+    .channels = channels,
+    .channels_len = 3,
+    .timeout = 2000,
+    .loss = LOSS
+  })));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(udp_socket_get_port(&server.udp));
+  server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  test_end();
+
+  test_begin("rudp connect");
+  async_loop_post(client.udp.loop, &connect_t);
+  test_wait_for(atomic_load(&server_open) && atomic_load(&client_open));
+  test_end();
+
+  test_begin("rudp reliable");
+  test_wait_for(atomic_load(&reliable) == MESSAGES);
+  test_wait_for(atomic_load(&done));
+  /* With this much loss, something had to be sent twice */
+  assert(atomic_load(&retransmitted));
+  test_end();
+
+  test_begin("rudp sequenced");
+  assert(atomic_load(&sequenced) != 0);
+  assert(atomic_load(&sequenced) <= MESSAGES);
+  assert(atomic_load(&unreliable) != 0);
+  assert(atomic_load(&unreliable) <= MESSAGES);
+  test_end();
+
+  test_begin("rudp disconnect");
+  async_loop_post(client.udp.loop, &disconnect_t);
+  test_wait_for(atomic_load(&client_closed));
+  test_wait_for(atomic_load(&server_closed));
+  test_end();
+
+  test_begin("rudp free");
+  rudp_host_close(&client);
+  test_wait();
+  rudp_host_close(&server);
+  test_wait();
+  test_end();
+
+  test_begin("rudp sequenced replay");
+  replay.on_event = replay_evt;
+  replay.on_message = replay_msg;
+  assert(!rudp_host(&replay, &((struct rudp_host_options) {
+    .hostname = "127.0.0.1",
+    .port = "0",
+    .family = net_family_ipv4,
+    .channels = channels,
+    .channels_len = 3
+  })));
+  struct sockaddr_in replay_addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(udp_socket_get_port(&replay.udp)),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  };
+  const int raw = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(raw != -1);
+  /* Two packets carrying the same sequenced message */
+  for(uint8_t i = 0; i < 2; ++i) {
+    const char packet[] = {
+      1, 0, i, 0, 0, 0, 0, 0, 0,
+      channel_sequenced, 0, 7, 0, 4, 'm', 's', 'g', '!'
+    };
+    assert(sendto(raw, packet, sizeof(packet), 0, (struct sockaddr*) &replay_addr, sizeof(replay_addr)) == sizeof(packet));
+  }
+  test_wait_for(atomic_load(&replayed) != 0);
+  test_sleep(50);
+  assert(atomic_load(&replayed) == 1);
+  assert(!close(raw));
+  rudp_host_close(&replay);
+  test_wait();
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,171 @@
+#include <shnet/test.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include <shnet/tcp.h>
+
+/* More than the kernel takes at once, so the rest is queued */
+#define BIG (4 * 1024 * 1024)
+
+struct tcp_server server = {0};
+struct tcp_socket client = {0};
+
+_Atomic int client_open = 0;
+_Atomic uint64_t received = 0;
+_Atomic int passed_fd = -1;
+uint64_t passed_from = 0;
+uint64_t passed_to = 0;
+char marker = 0;
+
+void accepted_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_data: {
+      char buf[65536];
+      while(1) {
+        int fds[4];
+        uint32_t count = 4;
+        const uint64_t from = atomic_load(&received);
+        const uint64_t read = tcp_read_fds(sock, buf, sizeof(buf), fds, &count);
+        if(from <= BIG && BIG < from + read) {
+          marker = buf[BIG - from];
+        }
+        atomic_store(&received, from + read);
+        if(count != 0) {
+          assert(count == 1);
+          passed_from = from;
+          passed_to = from + read;
+          atomic_store(&passed_fd, fds[0]);
+        }
+        /* errno is 0 as long as there may be more */
+        if(errno != 0) {
+          break;
+        }
+      }
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    default: break;
+  }
+}
+
+struct tcp_socket* server_evt(struct tcp_server* serv, struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      sock->on_event = accepted_evt;
+      break;
+    }
+    case tcp_close: {
+      tcp_server_free(serv);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+  return sock;
+}
+
+void client_evt(struct tcp_socket* sock, enum tcp_event event) {
+  switch(event) {
+    case tcp_open: {
+      atomic_store(&client_open, 1);
+      break;
+    }
+    case tcp_close: {
+      tcp_socket_free(sock);
+      break;
+    }
+    case tcp_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+int main() {
+  test_begin("tcp unix setup");
+  char path[64];
+  assert(sprintf(path, "@shnet-test-%d", getpid()) > 0);
+  struct addrinfo* const info = net_get_unix_address(path, net_sock_stream);
+  assert(info);
+  assert(info->ai_family == net_family_unix);
+  server.on_event = server_evt;
+  assert(!tcp_server(&server, &((struct tcp_server_options) {
+    .info = info
+  })));
+  client.on_event = client_evt;
+  assert(!tcp_socket(&client, &((struct tcp_socket_options) {
+    .info = info
+  })));
+  net_free_address(info);
+  test_wait_for(atomic_load(&client_open));
+  test_end();
+
+  test_begin("tcp unix send");
+  char* const big = malloc(BIG);
+  assert(big);
+  (void) memset(big, 'b', BIG);
+  assert(!tcp_send(&client, &((struct data_frame) {
+    .data = big,
+    .len = BIG
+  })));
+  test_end();
+
+  test_begin("tcp unix fds");
+  int pipes[2];
+  assert(!pipe(pipes));
+  errno = 0;
+  assert(tcp_send_fds(&client, pipes, 0, &((struct data_frame) {
+    .data = "x",
+    .len = 1,
+    .read_only = 1,
+    .dont_free = 1
+  })) == -1);
+  assert(errno == EINVAL);
+  /* Queued behind the big frame, so it has to wait for its turn */
+  assert(!tcp_send_fds(&client, pipes, 1, &((struct data_frame) {
+    .data = "X",
+    .len = 1,
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  /* The socket has its own copy */
+  assert(!close(pipes[0]));
+  assert(!tcp_send(&client, &((struct data_frame) {
+    .data = "tail",
+    .len = 4,
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  test_wait_for(atomic_load(&received) == BIG + 5);
+  assert(atomic_load(&passed_fd) != -1);
+  /* The descriptor came along with the byte it was attached to */
+  assert(passed_from <= BIG && BIG < passed_to);
+  assert(marker == 'X');
+  assert(write(pipes[1], "hello", 5) == 5);
+  char buf[5];
+  assert(read(atomic_load(&passed_fd), buf, 5) == 5);
+  assert(!memcmp(buf, "hello", 5));
+  assert(!close(pipes[1]));
+  assert(!close(atomic_load(&passed_fd)));
+  test_end();
+
+  test_begin("tcp unix free");
+  tcp_socket_close(&client);
+  test_wait();
+  tcp_server_close(&server);
+  test_wait();
+  test_end();
+
+  return 0;
+}
@@ -0,0 +1,206 @@
+#include <shnet/test.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include <shnet/shm.h>
+
+/* Many times the ring, so that the sender has to wait for room */
+#define BIG (1024 * 1024)
+#define RING 4096
+
+struct shm_channel sender = {0};
+struct shm_channel receiver = {0};
+
+_Atomic uint64_t received = 0;
+_Atomic int can_send = 0;
+_Atomic int sender_closed = 0;
+_Atomic int receiver_closed = 0;
+_Atomic int mismatch = 0;
+_Atomic int read_err = 0;
+int peeking = 0;
+
+void sender_evt(struct shm_channel* channel, enum shm_event event) {
+  switch(event) {
+    case shm_can_send: {
+      atomic_store(&can_send, 1);
+      break;
+    }
+    case shm_close: {
+      atomic_store(&sender_closed, 1);
+      break;
+    }
+    case shm_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+void receiver_evt(struct shm_channel* channel, enum shm_event event) {
+  switch(event) {
+    case shm_data: {
+      if(peeking) {
+        const char* data;
+        const uint64_t len = shm_peek(channel, &data);
+        for(uint64_t i = 0; i < len; ++i) {
+          if(data[i] != (char) ((atomic_load(&received) + i) % 251)) {
+            atomic_store(&mismatch, 1);
+          }
+        }
+        shm_consume(channel, len);
+        atomic_fetch_add(&received, len);
+        break;
+      }
+      char buf[1000];
+      while(1) {
+        const uint64_t read = shm_read(channel, buf, sizeof(buf));
+        for(uint64_t i = 0; i < read; ++i) {
+          if(buf[i] != (char) ((atomic_load(&received) + i) % 251)) {
+            atomic_store(&mismatch, 1);
+          }
+        }
+        atomic_fetch_add(&received, read);
+        /* errno is 0 as long as there may be more */
+        if(errno != 0) {
+          atomic_store(&read_err, errno);
+          break;
+        }
+      }
+      break;
+    }
+    case shm_close: {
+      atomic_store(&receiver_closed, 1);
+      break;
+    }
+    case shm_free: {
+      test_wake();
+      break;
+    }
+    default: break;
+  }
+}
+
+int main() {
+  test_begin("shm setup");
+  sender.on_event = sender_evt;
+  assert(!shm_channel(&sender, &((struct shm_channel_options) {
+    .size = RING - 1
+  })));
+  /* Rounded up to a power of 2 */
+  assert(sender.size == RING);
+  int fds[shm_fds];
+  shm_channel_get_fds(&sender, fds);
+  /* As if they were passed to another process */
+  for(int i = 0; i < shm_fds; ++i) {
+    fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+    assert(fds[i] != -1);
+  }
+  int bad[shm_fds] = { fds[1], fds[1], fds[2] };
+  errno = 0;
+  assert(shm_channel_attach(&receiver, bad, NULL) == -1);
+  assert(errno == EINVAL);
+  receiver.on_event = receiver_evt;
+  assert(!shm_channel_attach(&receiver, fds, &((struct shm_channel_options) {
+    .busy_poll = 100
+  })));
+  assert(receiver.size == RING);
+  test_end();
+
+  test_begin("shm send");
+  char* const big = malloc(BIG);
+  assert(big);
+  for(uint64_t i = 0; i < BIG; ++i) {
+    big[i] = i % 251;
+  }
+  assert(!shm_send(&sender, &((struct data_frame) {
+    .data = big,
+    .len = BIG,
+    .read_only = 1,
+    .dont_free = 1
+  })));
+  test_wait_for(atomic_load(&received) == BIG);
+  assert(!atomic_load(&mismatch));
+  assert(atomic_load(&can_send));
+  test_end();
+
+  test_begin("shm peek");
+  peeking = 1;
+  char* const copy = malloc(BIG);
+  assert(copy);
+  for(uint64_t i = 0; i < BIG; ++i) {
+    copy[i] = (BIG + i) % 251;
+  }
+  /* Freed by the channel once it's all in the ring */
+  assert(!shm_send(&sender, &((struct data_frame) {
+    .data = copy,
+    .len = BIG
+  })));
+  test_wait_for(atomic_load(&received) == BIG * 2);
+  assert(!atomic_load(&mismatch));
+  free(big);
+  test_end();
+
+  test_begin("shm close");
+  shm_channel_close(&sender);
+  test_wait_for(atomic_load(&sender_closed));
+  test_wait_for(atomic_load(&receiver_closed));
+  errno = 0;
+  assert(shm_send(&sender, &((struct data_frame) {
+    .data = "x",
+    .len = 1,
+    .read_only = 1,
+    .dont_free = 1
+  })) == -1);
+  assert(errno == EPIPE);
+  char buf[1];
+  assert(shm_read(&receiver, buf, 1) == 0);
+  assert(errno == EPIPE);
+  test_end();
+
+  test_begin("shm free");
+  shm_channel_free(&sender);
+  test_wait();
+  shm_channel_free(&receiver);
+  test_wait();
+  test_end();
+
+  test_begin("shm corrupt");
+  peeking = 0;
+  atomic_store(&read_err, 0);
+  atomic_store(&sender_closed, 0);
+  atomic_store(&receiver_closed, 0);
+  assert(!shm_channel(&sender, NULL));
+  shm_channel_get_fds(&sender, fds);
+  for(int i = 0; i < shm_fds; ++i) {
+    fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+    assert(fds[i] != -1);
+  }
+  assert(!shm_channel_attach(&receiver, fds, NULL));
+  /* The head is the first member of a ring, and the peer could write anything there */
+  *(_Atomic uint64_t*) sender.out = sender.size * 3;
+  errno = 0;
+  assert(shm_send(&sender, &((struct data_frame) {
+    .data = "x",
+    .len = 1,
+    .read_only = 1,
+    .dont_free = 1
+  })) == -1);
+  assert(errno == EPROTO);
+  test_wait_for(atomic_load(&sender_closed));
+  test_wait_for(atomic_load(&receiver_closed));
+  /* The other side doesn't copy from past the ring either */
+  assert(atomic_load(&read_err) == EPROTO);
+  assert(!atomic_load(&mismatch));
+  shm_channel_free(&sender);
+  test_wait();
+  shm_channel_free(&receiver);
+  test_wait();
+  test_end();
+
+  return 0;
+}
@@ -5,6 +5,9 @@
 #include <shnet/async.h>
 #include <shnet/net.h>
 #include <shnet/tcp.h>
+#include <shnet/udp.h>
+#include <shnet/rudp.h>
+#include <shnet/shm.h>
 //#include <shnet/tls.h>
 
 int main() {